@@ -1,4 +1,6 @@
 #include <emmintrin.h>
+#include <stddef.h>
+#include <new>
 #include <vector>
 #include <queue>
 #include "adaptive_radix_tree.h"
@@ -14,11 +16,77 @@ int AdaptiveRadixTree::checkPrefix(Node* node, const unsigned char* key, int dep
     for (i = 0; i < 6 && i < node->prefix_length; i++)
     {
         if (key[depth + i] != node->prefix[i])
+        {
+            ART_STAT_INC(prefix_mismatches);
             return i;
+        }
     }
     return i;
 }
 
+// 复制节点头时不能把锁的状态也带过去，dirty和leaf保留
+static inline void copyHeader(Node* dst, const Node* src)
+{
+    memcpy(dst, src, sizeof(Node));
+    dst->version = src->version & (kDirtyBit | kLeafBit);
+}
+
+// 下降路径上的节点都是被修改节点的祖先，先判断再写，没有变化的cache line不会被弄脏
+static inline void markDirty(Node* node)
+{
+    if ((node->version & kDirtyBit) == 0)
+    {
+        node->version |= kDirtyBit;
+    }
+}
+
+// 并发模式下读线程不加锁读取子节点指针，新节点必须初始化完成之后再发布
+// Ref节点只在非并发模式下出现，句柄直接写
+void AdaptiveRadixTree::storeChild(Node** ref, Node* child)
+{
+    uintptr_t ptr = reinterpret_cast<uintptr_t>(ref);
+    if (ptr & 1)
+    {
+        *reinterpret_cast<uint32_t*>(ptr & ~(uintptr_t)1) = encodeRef(TagNode(child));
+        return;
+    }
+    __atomic_store_n(ref, TagNode(child), __ATOMIC_RELEASE);
+}
+
+StatsCollector* AdaptiveRadixTree::newStatsCollector()
+{
+#ifdef ART_ENABLE_STATS
+    return new StatsCollector;
+#else
+    return NULL;
+#endif
+}
+
+ArtStats AdaptiveRadixTree::GetStats()
+{
+    ArtStats stats;
+    memset(&stats, 0, sizeof(stats));
+    if (_stats != NULL)
+    {
+        _stats->Snapshot(&stats);
+    }
+    return stats;
+}
+
+void AdaptiveRadixTree::EnableLatency(uint32_t sample_every)
+{
+    delete _latency;
+    _latency = sample_every == 0 ? NULL : new LatencyRecorder(sample_every);
+}
+
+void AdaptiveRadixTree::GetLatency(LatencyOp op, LatencyHistogram* out)
+{
+    if (_latency != NULL)
+    {
+        _latency->Merge(op, out);
+    }
+}
+
 uint32_t AdaptiveRadixTree::maxCapacitySize(NodeType type)
 {
     switch (type)
@@ -28,35 +96,108 @@ uint32_t AdaptiveRadixTree::maxCapacitySize(NodeType type)
         case NODE16:
             return 16;
         case NODE48:
+        case NODE48_REF:
             return 48;
         case NODE256:
+        case NODE256_REF:
             return 256;
+        case NODE_EXTENT:
+        case NODE_DICT:
+        case NODE_DELTA16:
+        case NODE_DELTA32:
+        case NODE_SINGLE:
+            break;
     }
     assert(0);
+    return 0;
 }
 
 Node4* AdaptiveRadixTree::makeNode4()
 {
-    _used_memory += sizeof(Node4);
-    return new Node4;
+    // 新节点不在上一个checkpoint里
+    Node4* node = new (allocNode(NODE4)) Node4;
+    node->header.version |= kDirtyBit;
+    return node;
 }
 
 Node16* AdaptiveRadixTree::makeNode16()
 {
-    _used_memory += sizeof(Node16);
-    return new Node16;
+    // 新节点不在上一个checkpoint里
+    Node16* node = new (allocNode(NODE16)) Node16;
+    node->header.version |= kDirtyBit;
+    return node;
 }
 
 Node48* AdaptiveRadixTree::makeNode48()
 {
-    _used_memory += sizeof(Node48);
-    return new Node48;
+    // 新节点不在上一个checkpoint里
+    Node48* node = new (allocNode(NODE48)) Node48;
+    node->header.version |= kDirtyBit;
+    return node;
 }
 
 Node256* AdaptiveRadixTree::makeNode256()
 {
-    _used_memory += sizeof(Node256);
-    return new Node256;
+    // 新节点不在上一个checkpoint里
+    Node256* node = new (allocNode(NODE256)) Node256;
+    node->header.version |= kDirtyBit;
+    return node;
+}
+
+Node48Ref* AdaptiveRadixTree::makeNode48Ref()
+{
+    // 新节点不在上一个checkpoint里
+    Node48Ref* node = new (allocNode(NODE48_REF)) Node48Ref;
+    node->header.version |= kDirtyBit;
+    return node;
+}
+
+Node256Ref* AdaptiveRadixTree::makeNode256Ref()
+{
+    // 新节点不在上一个checkpoint里
+    Node256Ref* node = new (allocNode(NODE256_REF)) Node256Ref;
+    node->header.version |= kDirtyBit;
+    return node;
+}
+
+NodeExtent* AdaptiveRadixTree::makeNodeExtent()
+{
+    // 新节点不在上一个checkpoint里
+    NodeExtent* node = new (allocNode(NODE_EXTENT)) NodeExtent;
+    node->header.version |= kDirtyBit;
+    return node;
+}
+
+NodeDict* AdaptiveRadixTree::makeNodeDict()
+{
+    // 新节点不在上一个checkpoint里
+    NodeDict* node = new (allocNode(NODE_DICT)) NodeDict;
+    node->header.version |= kDirtyBit;
+    return node;
+}
+
+NodeDelta16* AdaptiveRadixTree::makeNodeDelta16()
+{
+    // 新节点不在上一个checkpoint里
+    NodeDelta16* node = new (allocNode(NODE_DELTA16)) NodeDelta16;
+    node->header.version |= kDirtyBit;
+    return node;
+}
+
+NodeDelta32* AdaptiveRadixTree::makeNodeDelta32()
+{
+    // 新节点不在上一个checkpoint里
+    NodeDelta32* node = new (allocNode(NODE_DELTA32)) NodeDelta32;
+    node->header.version |= kDirtyBit;
+    return node;
+}
+
+NodeSingle* AdaptiveRadixTree::makeNodeSingle()
+{
+    // 新节点不在上一个checkpoint里
+    NodeSingle* node = new (allocNode(NODE_SINGLE)) NodeSingle;
+    node->header.version |= kDirtyBit;
+    return node;
 }
 
 Node* AdaptiveRadixTree::makeNode(NodeType type)
@@ -71,39 +212,127 @@ Node* AdaptiveRadixTree::makeNode(NodeType type)
             return reinterpret_cast<Node*>(makeNode48());
         case NODE256:
             return reinterpret_cast<Node*>(makeNode256());
+        case NODE48_REF:
+            return reinterpret_cast<Node*>(makeNode48Ref());
+        case NODE256_REF:
+            return reinterpret_cast<Node*>(makeNode256Ref());
+        case NODE_EXTENT:
+            return reinterpret_cast<Node*>(makeNodeExtent());
+        case NODE_DICT:
+            return reinterpret_cast<Node*>(makeNodeDict());
+        case NODE_DELTA16:
+            return reinterpret_cast<Node*>(makeNodeDelta16());
+        case NODE_DELTA32:
+            return reinterpret_cast<Node*>(makeNodeDelta32());
+        case NODE_SINGLE:
+            return reinterpret_cast<Node*>(makeNodeSingle());
     }
+    assert(0);
+    return NULL;
 }
 
-void AdaptiveRadixTree::freeNode(Node* node)
+uint32_t AdaptiveRadixTree::nodeSize(NodeType type)
 {
-    switch (node->type)
+    switch (type)
     {
         case NODE4:
-            _used_memory -= sizeof(Node4);
-            break;
+            return sizeof(Node4);
         case NODE16:
-            _used_memory -= sizeof(Node16);
-            break;
+            return sizeof(Node16);
         case NODE48:
-            _used_memory -= sizeof(Node48);
-            break;
+            return sizeof(Node48);
         case NODE256:
-            _used_memory -= sizeof(Node256);
-            break;
-        default:
-            assert(0);
+            return sizeof(Node256);
+        case NODE48_REF:
+            return sizeof(Node48Ref);
+        case NODE256_REF:
+            return sizeof(Node256Ref);
+        case NODE_EXTENT:
+            return sizeof(NodeExtent);
+        case NODE_DICT:
+            return sizeof(NodeDict);
+        case NODE_DELTA16:
+            return sizeof(NodeDelta16);
+        case NODE_DELTA32:
+            return sizeof(NodeDelta32);
+        case NODE_SINGLE:
+            return sizeof(NodeSingle);
+    }
+    assert(0);
+    return 0;
+}
+
+void* AdaptiveRadixTree::allocNode(NodeType type)
+{
+    std::unique_lock<std::mutex> lock(_alloc_mutex, std::defer_lock);
+    if (_concurrent || _parallel_build)
+    {
+        lock.lock();
+    }
+    void* ptr = _compacting ? _slabs[type].AllocFresh() : _slabs[type].Alloc();
+    // 和原来用new分配节点时一样，内存用完时抛出bad_alloc
+    if (ptr == NULL)
+    {
+        throw std::bad_alloc();
+    }
+    _used_memory += nodeSize(type);
+    return ptr;
+}
+
+void AdaptiveRadixTree::freeNode(Node* node)
+{
+    if (_concurrent)
+    {
+        retireNode(node);
+        return;
+    }
+    std::unique_lock<std::mutex> lock(_alloc_mutex, std::defer_lock);
+    if (_parallel_build)
+    {
+        lock.lock();
     }
-    delete node;
+    _used_memory -= nodeSize(node->type);
+    _slabs[node->type].Free(node);
 }
 
+// 一次写入这么多key之后检查叶节点能不能换成压缩格式
+static const uint32_t kCompactLength = 16;
+
 // 忽略重复的key，直接伸展到可以容纳的nodetype
 void AdaptiveRadixTree::addLeafChild(Node* node, Node** ref, unsigned char start, uint32_t length, void* val)
 {
-    assert(node->is_leaf);
+    assert(node->IsLeaf());
+    if (node->type == NODE_EXTENT)
+    {
+        setExtentRange(node, ref, start, length, val);
+        return;
+    }
+    if (node->type == NODE_SINGLE)
+    {
+        setSingleRange(node, ref, start, length, val);
+        return;
+    }
+    if (node->type >= NODE_DICT)
+    {
+        setPackedRange(node, ref, start, length, val);
+        return;
+    }
+    // Node48/Node256用NULL表示空槽位，写入NULL等同于删除这些key
+    if (val == NULL)
+    {
+        removeChild(node, start, length);
+        return;
+    }
     uint32_t total = node->child_count + length;
     if (total <= maxCapacitySize(node->type) || node->type == NODE256)
     {
         addLeafChildSafe(node, ref, start, length, val);
+        ART_STAT_INC(leaf_fill[LeafFillBucket(node->child_count)]);
+        // 大段的覆盖写之后叶节点可能变得连续，单个key的写入不检查
+        if ((_extent_leaf || _packed_leaf) && length >= kCompactLength)
+        {
+            compactLeaf(node, ref);
+        }
     }
     else
     {
@@ -111,7 +340,13 @@ void AdaptiveRadixTree::addLeafChild(Node* node, Node** ref, unsigned char start
         // 扩容路径不可能有NODE4
         assert(newNode->type != NODE4);
         addLeafChildSafe(newNode, ref, start, length, val);
-        *ref = newNode;
+        ART_STAT_INC(leaf_fill[LeafFillBucket(newNode->child_count)]);
+        storeChild(ref, newNode);
+        // 每次扩容时检查一次，连续写入的叶节点不会一直长成Node256
+        if (_extent_leaf || _packed_leaf)
+        {
+            compactLeaf(newNode, ref);
+        }
     }
 }
 
@@ -120,10 +355,11 @@ void AdaptiveRadixTree::addLeafChild(Node* node, Node** ref, unsigned char start
 // 48 -> 256
 Node* AdaptiveRadixTree::expandLeafChild(Node* node, uint32_t expected_size)
 {
+    ART_STAT_INC(grows[node->type]);
     if (expected_size > 48)
     {
         Node256* newNode = makeNode256();
-        memcpy(&newNode->header, node, sizeof(Node));
+        copyHeader(&newNode->header, node);
         newNode->header.type = NODE256;
         newNode->header.child_count = 0;
         switch (node->type)
@@ -158,6 +394,9 @@ Node* AdaptiveRadixTree::expandLeafChild(Node* node, uint32_t expected_size)
                 }
                 break;
             }
+            default:
+                assert(0);
+                break;
         }
         freeNode(node);
         return reinterpret_cast<Node*>(newNode);
@@ -165,7 +404,7 @@ Node* AdaptiveRadixTree::expandLeafChild(Node* node, uint32_t expected_size)
     else if (expected_size > 16)
     {
         Node48* newNode = makeNode48();
-        memcpy(&newNode->header, node, sizeof(Node));
+        copyHeader(&newNode->header, node);
         newNode->header.type = NODE48;
         newNode->header.child_count = 0;
         switch (node->type)
@@ -188,6 +427,9 @@ Node* AdaptiveRadixTree::expandLeafChild(Node* node, uint32_t expected_size)
                 }
                 break;
             }
+            default:
+                assert(0);
+                break;
         }
         freeNode(node);
         return reinterpret_cast<Node*>(newNode);
@@ -197,7 +439,7 @@ Node* AdaptiveRadixTree::expandLeafChild(Node* node, uint32_t expected_size)
         Node16* newNode = makeNode16();
         assert(node->type == NODE4);
         Node4* node4 = reinterpret_cast<Node4*>(node);
-        memcpy(&newNode->header, node, sizeof(Node));
+        copyHeader(&newNode->header, node);
         newNode->header.type = NODE16;
         newNode->header.child_count = 0;
         for (int i = 0; i < node->child_count; i++)
@@ -229,6 +471,8 @@ void AdaptiveRadixTree::addLeafChildSafe(Node* node, Node** ref, unsigned char s
         {
             return addLeafChild256(node, ref, start, length, val);
         }
+        default:
+            assert(0);
     }
 }
 
@@ -431,25 +675,25 @@ void AdaptiveRadixTree::addChild(Node* node, Node** ref, unsigned char byte, voi
         {
             return addChild256(reinterpret_cast<Node256*>(node), ref, byte, child);
         }
-        assert(0);
+        case NODE48_REF:
+        {
+            return addChild48Ref(reinterpret_cast<Node48Ref*>(node), ref, byte, child);
+        }
+        case NODE256_REF:
+        {
+            return addChild256Ref(reinterpret_cast<Node256Ref*>(node), ref, byte, child);
+        }
+        default:
+            assert(0);
+            break;
     }
 }
 
 void AdaptiveRadixTree::addChild4(Node4* node4, Node** ref, unsigned char byte, void* child)
 {
     Node* node = reinterpret_cast<Node*>(node4);
-    bool found = false;
-    int i;
-    for (i = 0; i < node->child_count; i++)
-    {
-        if (byte == node4->child_keys[i])
-        {
-            found = true;
-            break;
-        }
-    }
-
-    if (found)
+    int i = _search_kernel->findKey4(node4->child_keys, node->child_count, byte);
+    if (i >= 0)
     {
         assert(node4->child_ptrs[i]);
         node4->child_ptrs[i] = reinterpret_cast<Node*>(child);
@@ -466,15 +710,7 @@ void AdaptiveRadixTree::addChild4(Node4* node4, Node** ref, unsigned char byte,
             return;
         }
 
-        int slot;
-        for (slot = 0; slot < node->child_count; slot++)
-        {
-            if (byte < node4->child_keys[slot])
-            {
-                break;
-            }
-        }
-
+        int slot = _search_kernel->insertPos4(node4->child_keys, node->child_count, byte);
         if (node->child_count > slot)
         {
             memmove(&node4->child_keys[slot+1], &node4->child_keys[slot], node->child_count - slot);
@@ -487,33 +723,24 @@ void AdaptiveRadixTree::addChild4(Node4* node4, Node** ref, unsigned char byte,
     else
     {
         assert(node->child_count == 4);
+        ART_STAT_INC(grows[NODE4]);
         Node16* newNode = makeNode16();
         memcpy(&newNode->child_keys[0], &node4->child_keys[0], node->child_count);
         memcpy(&newNode->child_ptrs[0], &node4->child_ptrs[0], node->child_count * sizeof(void*));
-        memcpy(&newNode->header, &node4->header, sizeof(Node));
+        copyHeader(&newNode->header, &node4->header);
         newNode->header.type = NODE16;
-        assert(*ref == node);
-        *ref = reinterpret_cast<Node*>(newNode);
-        freeNode(node);
         addChild16(newNode, NULL, byte, child);
+        assert(UntagNode(childAt(ref)) == node);
+        storeChild(ref, reinterpret_cast<Node*>(newNode));
+        freeNode(node);
     }
 }
 
 void AdaptiveRadixTree::addChild16(Node16* node16, Node** ref, unsigned char byte, void* child)
 {
     Node* node = reinterpret_cast<Node*>(node16);
-    bool found = false;
-    int i;
-    for (i = 0; i < node->child_count; i++)
-    {
-        if (byte == node16->child_keys[i])
-        {
-            found = true;
-            break;
-        }
-    }
-
-    if (found)
+    int i = _search_kernel->findKey16(node16->child_keys, node->child_count, byte);
+    if (i >= 0)
     {
         assert(node16->child_ptrs[i]);
         node16->child_ptrs[i] = reinterpret_cast<Node*>(child);
@@ -529,52 +756,48 @@ void AdaptiveRadixTree::addChild16(Node16* node16, Node** ref, unsigned char byt
             return;
         }
 
-        int slot;
-        for (slot = 0; slot < node->child_count; slot++)
-        {
-            if (byte < node16->child_keys[slot])
-            {
-                break;
-            }
-        }
-
-        // int mask = (1 << node->child_count) - 1;
-        // __m128i cmp = _mm_cmplt_epi8(_mm_set1_epi8(byte),
-        //         _mm_loadu_si128(reinterpret_cast<const __m128i*>(node16->child_keys)));
-        // int bitfield = _mm_movemask_epi8(cmp);
-        // uint32_t idx;
-        // if (bitfield)
-        // {
-            // idx = __builtin_ctz(bitfield);
+        int slot = _search_kernel->insertPos16(node16->child_keys, node->child_count, byte);
         if (node->child_count > slot)
         {
             memmove(&node16->child_keys[slot + 1], &node16->child_keys[slot], node->child_count - slot);
             memmove(&node16->child_ptrs[slot + 1], &node16->child_ptrs[slot], (node->child_count - slot) * sizeof(void*));
         }
-        // }
-        // else
-        // {
-        //     idx = node->child_count;
-        // }
 
         node16->child_keys[slot] = byte;
         node16->child_ptrs[slot] = reinterpret_cast<Node*>(child);
         node->child_count++;
     }
+    else if (_compressed_refs && !node->IsLeaf())
+    {
+        assert(node->child_count == 16);
+        ART_STAT_INC(grows[NODE16]);
+        Node48Ref* newNode = makeNode48Ref();
+        for (int i = 0; i < node->child_count; i++)
+        {
+            newNode->child_refs[i] = encodeRef(node16->child_ptrs[i]);
+            newNode->child_ptr_indexs[node16->child_keys[i]] = i + 1;
+        }
+        copyHeader(&newNode->header, &node16->header);
+        newNode->header.type = NODE48_REF;
+        addChild48Ref(newNode, NULL, byte, child);
+        storeChild(ref, reinterpret_cast<Node*>(newNode));
+        freeNode(node);
+    }
     else
     {
         assert(node->child_count == 16);
+        ART_STAT_INC(grows[NODE16]);
         Node48* newNode = makeNode48();
         memcpy(&newNode->child_ptrs[0], &node16->child_ptrs[0], node->child_count * sizeof(void*));
         for (int i = 0; i < node->child_count; i++)
         {
             newNode->child_ptr_indexs[node16->child_keys[i]] = i + 1;
         }
-        memcpy(&newNode->header, &node16->header, sizeof(Node));
+        copyHeader(&newNode->header, &node16->header);
         newNode->header.type = NODE48;
-        *ref = reinterpret_cast<Node*>(newNode);
+        addChild48(newNode, NULL, byte, child);
+        storeChild(ref, reinterpret_cast<Node*>(newNode));
         freeNode(node);
-        addChild48(newNode, ref, byte, child);
     }
 }
 
@@ -607,6 +830,7 @@ void AdaptiveRadixTree::addChild48(Node48* node48, Node** ref, unsigned char byt
     else
     {
         assert(node->child_count == 48);
+        ART_STAT_INC(grows[NODE48]);
         Node256* newNode = makeNode256();
         for (int i = 0; i < 256; i++)
         {
@@ -615,11 +839,11 @@ void AdaptiveRadixTree::addChild48(Node48* node48, Node** ref, unsigned char byt
                 newNode->child_ptrs[i] = node48->child_ptrs[node48->child_ptr_indexs[i] - 1];
             }
         }
-        memcpy(&newNode->header, &node48->header, sizeof(Node));
+        copyHeader(&newNode->header, &node48->header);
         newNode->header.type = NODE256;
-        *ref = reinterpret_cast<Node*>(newNode);
-        freeNode(node);
         addChild256(newNode, NULL, byte, child);
+        storeChild(ref, reinterpret_cast<Node*>(newNode));
+        freeNode(node);
     }
 }
 
@@ -634,40 +858,77 @@ void AdaptiveRadixTree::addChild256(Node256* node256, Node** ref, unsigned char
     node256->child_ptrs[byte] = reinterpret_cast<Node*>(child);
 }
 
+// child带着tag，和addChild48一样先用空槽位，满了换成Node256Ref
+void AdaptiveRadixTree::addChild48Ref(Node48Ref* node48, Node** ref, unsigned char byte, void* child)
+{
+    Node* node = reinterpret_cast<Node*>(node48);
+    uint32_t handle = encodeRef(reinterpret_cast<Node*>(child));
+    if (node48->child_ptr_indexs[byte] > 0)
+    {
+        assert(node48->child_refs[node48->child_ptr_indexs[byte] - 1]);
+        node48->child_refs[node48->child_ptr_indexs[byte] - 1] = handle;
+        return;
+    }
+
+    if (node->child_count < 48)
+    {
+        int pos = 0;
+        while (node48->child_refs[pos]) pos++;
+        node48->child_refs[pos] = handle;
+        node48->child_ptr_indexs[byte] = pos + 1;
+        node->child_count++;
+    }
+    else
+    {
+        ART_STAT_INC(grows[NODE48_REF]);
+        Node256Ref* newNode = makeNode256Ref();
+        for (int i = 0; i < 256; i++)
+        {
+            if (node48->child_ptr_indexs[i])
+            {
+                newNode->child_refs[i] = node48->child_refs[node48->child_ptr_indexs[i] - 1];
+            }
+        }
+        copyHeader(&newNode->header, node);
+        newNode->header.type = NODE256_REF;
+        addChild256Ref(newNode, NULL, byte, child);
+        storeChild(ref, reinterpret_cast<Node*>(newNode));
+        freeNode(node);
+    }
+}
+
+void AdaptiveRadixTree::addChild256Ref(Node256Ref* node256, Node** ref, unsigned char byte, void* child)
+{
+    (void)ref;
+    assert(child);
+    if (node256->child_refs[byte] == 0)
+    {
+        node256->header.child_count++;
+    }
+    node256->child_refs[byte] = encodeRef(reinterpret_cast<Node*>(child));
+}
+
 Node** AdaptiveRadixTree::findChild(Node* node, unsigned char byte)
 {
-    switch (node->type)
+    return findChild(node, node->type, byte);
+}
+
+// type从指向node的指针的tag里取出来，不用等node的节点头
+Node** AdaptiveRadixTree::findChild(Node* node, NodeType type, unsigned char byte)
+{
+    switch (type)
     {
         case NODE4:
         {
             Node4* n = reinterpret_cast<Node4*>(node);
-            for (int i = 0; i < node->child_count; i++)
-            {
-                if (n->child_keys[i] == byte)
-                {
-                    return &n->child_ptrs[i];
-                }
-            }
-            return NULL;
+            int i = _search_kernel->findKey4(n->child_keys, node->child_count, byte);
+            return i < 0 ? NULL : &n->child_ptrs[i];
         }
         case NODE16:
         {
             Node16* n = reinterpret_cast<Node16*>(node);
-            for (int i = 0; i < node->child_count; i++)
-            {
-                if (n->child_keys[i] == byte)
-                {
-                    return &n->child_ptrs[i];
-                }
-            }
-            // __m128i results = _mm_cmpeq_epi8(_mm_set1_epi8(byte), _mm_loadu_si128((__m128i*)(&n->child_keys[0])));
-            // int mask = (1 << node->child_count) - 1;
-            // int bitfield = _mm_movemask_epi8(results) & mask;
-            // if (bitfield == 0)
-            // {
-            //     return NULL;
-            // }
-            return NULL;//&n->child_ptrs[__builtin_ctz(bitfield)];
+            int i = _search_kernel->findKey16(n->child_keys, node->child_count, byte);
+            return i < 0 ? NULL : &n->child_ptrs[i];
         }
         case NODE48:
         {
@@ -684,11 +945,54 @@ Node** AdaptiveRadixTree::findChild(Node* node, unsigned char byte)
             Node256* n = reinterpret_cast<Node256*>(node);
             return &n->child_ptrs[byte];
         }
-        assert(0);
+        case NODE48_REF:
+        {
+            Node48Ref* n = reinterpret_cast<Node48Ref*>(node);
+            int index = n->child_ptr_indexs[byte];
+            if (index == 0)
+            {
+                return NULL;
+            }
+            return handleRef(&n->child_refs[index - 1]);
+        }
+        case NODE256_REF:
+        {
+            Node256Ref* n = reinterpret_cast<Node256Ref*>(node);
+            return handleRef(&n->child_refs[byte]);
+        }
+        default:
+            assert(0);
+            break;
     }
     return NULL;
 }
 
+void AdaptiveRadixTree::expandRefNode(const Node* node, char* buf)
+{
+    if (node->type == NODE48_REF)
+    {
+        const Node48Ref* ref48 = reinterpret_cast<const Node48Ref*>(node);
+        Node48* node48 = new (buf) Node48;
+        copyHeader(&node48->header, node);
+        node48->header.type = NODE48;
+        memcpy(node48->child_ptr_indexs, ref48->child_ptr_indexs, 256);
+        for (int i = 0; i < 48; i++)
+        {
+            node48->child_ptrs[i] = decodeRef(ref48->child_refs[i]);
+        }
+        return;
+    }
+    assert(node->type == NODE256_REF);
+    const Node256Ref* ref256 = reinterpret_cast<const Node256Ref*>(node);
+    Node256* node256 = new (buf) Node256;
+    copyHeader(&node256->header, node);
+    node256->header.type = NODE256;
+    for (int i = 0; i < 256; i++)
+    {
+        node256->child_ptrs[i] = decodeRef(ref256->child_refs[i]);
+    }
+}
+
 void printkey(uint64_t key)
 {
     char* data = (char*)&key;
@@ -696,119 +1000,649 @@ void printkey(uint64_t key)
 }
 
 
-Node* AdaptiveRadixTree::makeProperNode(uint32_t length)
+NodeType AdaptiveRadixTree::properType(uint32_t length)
 {
-    Node* newNode;
     if (length < 5)
     {
-        newNode = reinterpret_cast<Node*>(makeNode4());
+        return NODE4;
     }
     else if (length < 17)
     {
-        newNode = reinterpret_cast<Node*>(makeNode16());
+        return NODE16;
     }
     else if (length < 49)
     {
-        newNode = reinterpret_cast<Node*>(makeNode48());
+        return NODE48;
     }
-    else
+    return NODE256;
+}
+
+NodeType AdaptiveRadixTree::innerType(uint32_t length)
+{
+    NodeType type = properType(length);
+    if (_compressed_refs && type == NODE48)
+    {
+        return NODE48_REF;
+    }
+    if (_compressed_refs && type == NODE256)
     {
-        newNode = reinterpret_cast<Node*>(makeNode256());
+        return NODE256_REF;
     }
-    return newNode;
+    return type;
 }
 
-void AdaptiveRadixTree::insert(Node* node, Node** ref, unsigned char* key, uint32_t length, void* val, int depth)
+Node* AdaptiveRadixTree::makeProperNode(uint32_t length)
 {
-    if (node == NULL)
+    return makeNode(properType(length));
+}
+
+// 创建从depth开始的叶节点，key[depth, 7)作为前缀
+Node* AdaptiveRadixTree::makeLeaf(unsigned char* key, uint32_t length, void* val, int depth)
+{
+    assert(depth > 0 && depth <= 7);
+    Node* newNode;
+    if (_single_leaf && length == 1)
     {
-        Node* newNode = makeProperNode(length);
-        if (depth < 7)
-        {
-            memcpy(&newNode->prefix[0], &key[depth], 8 - depth - 1);
-            newNode->prefix_length = 8 - depth - 1;
-            assert(newNode->prefix_length <= 8);
-        }
-        newNode->is_leaf = true;
-        addLeafChild(newNode, &newNode, key[7], length, val);
-        *ref = newNode;
-        return;
+        // 完整的key，上层节点负责的字节Search比较时会屏蔽掉
+        NodeSingle* single = makeNodeSingle();
+        memcpy(&single->key, key, sizeof(single->key));
+        newNode = &single->header;
     }
-
-    do
+    // 装得进Node4的叶节点不比extent叶节点大
+    else if (_extent_leaf && length > 4)
     {
-        if (node->prefix_length > 0 && depth < 7)
+        newNode = reinterpret_cast<Node*>(makeNodeExtent());
+    }
+    else if (_packed_leaf && length > 16)
+    {
+        // 只有一个value，字典一定放得下
+        newNode = reinterpret_cast<Node*>(makeNodeDict());
+    }
+    else
+    {
+        newNode = makeProperNode(length);
+    }
+    newNode->prefix_length = 7 - depth;
+    if (newNode->prefix_length > 0)
+    {
+        memcpy(&newNode->prefix[0], &key[depth], newNode->prefix_length);
+    }
+    newNode->SetLeaf(true);
+    // 换成更大的节点时newNode会带上tag
+    addLeafChild(newNode, &newNode, key[7], length, val);
+    return UntagNode(newNode);
+}
+
+// node的前缀只有前p个字节匹配，在中间插入一个Node4
+void AdaptiveRadixTree::splitPrefix(Node* node, Node** ref, unsigned char* key, int p, uint32_t length, void* val, int depth)
+{
+    ART_STAT_INC(splits);
+    Node* newNode = reinterpret_cast<Node*>(makeNode4());
+    newNode->prefix_length = p;
+    if (p > 0)
+    {
+        memcpy(&newNode->prefix[0], &node->prefix[0], p);
+    }
+
+    // 去掉第一个和最后一个，前缀6减去公共前缀长度就是分裂后的长度
+    Node* leafNode = makeLeaf(key, length, val, depth + p + 1);
+    addChild(newNode, NULL, key[depth + p], TagNode(leafNode));
+
+    unsigned char oldByte = node->prefix[p];
+    node->prefix_length -= (p + 1);
+    if (node->prefix_length > 0)
+    {
+        memmove(&node->prefix[0], &node->prefix[0] + p + 1, node->prefix_length);
+    }
+    assert(node->prefix_length < 7);
+    addChild(newNode, NULL, oldByte, TagNode(node));
+    storeChild(ref, newNode);
+}
+
+// 在node下面挂一个新的叶节点，slot不为空时是Node256的空槽位
+void AdaptiveRadixTree::addNewChild(Node* node, Node** ref, Node** slot, unsigned char* key, uint32_t length, void* val, int depth)
+{
+    Node* newNode = makeLeaf(key, length, val, depth + 1);
+    if (slot != NULL)
+    {
+        assert(node->type == NODE256 || node->type == NODE256_REF);
+        storeChild(slot, newNode);
+        node->child_count++;
+    }
+    else
+    {
+        addChild(node, ref, key[depth], TagNode(newNode));
+    }
+}
+
+void AdaptiveRadixTree::insert(Node* node, Node** ref, unsigned char* key, uint32_t length, void* val, int depth)
+{
+    if (node == NULL)
+    {
+        storeChild(ref, makeLeaf(key, length, val, depth));
+        return;
+    }
+    ART_STAT_INC(descents);
+    markDirty(node);
+
+    if (node->prefix_length > 0 && depth < 7)
+    {
+        int p = checkPrefix(node, key, depth);
+        assert(node->prefix_length <= 6);
+        // p不可能大于node->prefix_length
+        if (p != node->prefix_length)
+        {
+            splitPrefix(node, ref, key, p, length, val, depth);
+            return;
+        }
+        depth += node->prefix_length;
+    }
+
+    if (depth == 7)
+    {
+        addLeafChild(node, ref, key[depth], length, val);
+        return;
+    }
+
+    Node** next = findChild(node, key[depth]);
+    Node* child = next == NULL ? NULL : childAt(next);
+    if (child != NULL)
+    {
+        insert(UntagNode(child), next, key, length, val, depth + 1);
+    }
+    else
+    {
+        // 如果是Node256的空槽位，需要插入一个child
+        addNewChild(node, ref, next, key, length, val, depth);
+    }
+}
+
+
+// 删除[start, start + length)范围内的child，不缩小节点
+void AdaptiveRadixTree::removeChild(Node* node, unsigned char start, uint32_t length)
+{
+    uint32_t end = start + length;
+    assert(end <= 256);
+    switch (node->type)
+    {
+        case NODE4:
+        case NODE16:
         {
-            int p = checkPrefix(node, key, depth);
-            assert(node->prefix_length <= 7);
-            // p不可能大于node->prefix_length
-            if (p == node->prefix_length)
+            // Node4和Node16的key和指针数组位置不同，需要分开取
+            unsigned char* keys;
+            Node** ptrs;
+            if (node->type == NODE4)
             {
-                depth += node->prefix_length;
-                break;
+                keys = reinterpret_cast<Node4*>(node)->child_keys;
+                ptrs = reinterpret_cast<Node4*>(node)->child_ptrs;
+            }
+            else
+            {
+                keys = reinterpret_cast<Node16*>(node)->child_keys;
+                ptrs = reinterpret_cast<Node16*>(node)->child_ptrs;
+            }
+            int kept = 0;
+            for (int i = 0; i < node->child_count; i++)
+            {
+                if (keys[i] >= start && keys[i] < end)
+                {
+                    continue;
+                }
+                keys[kept] = keys[i];
+                ptrs[kept] = ptrs[i];
+                kept++;
+            }
+            node->child_count = kept;
+            break;
+        }
+        case NODE48:
+        {
+            Node48* node48 = reinterpret_cast<Node48*>(node);
+            for (uint32_t i = start; i < end; i++)
+            {
+                if (node48->child_ptr_indexs[i] > 0)
+                {
+                    node48->child_ptrs[node48->child_ptr_indexs[i] - 1] = NULL;
+                    node48->child_ptr_indexs[i] = 0;
+                    node->child_count--;
+                }
+            }
+            break;
+        }
+        case NODE256:
+        {
+            Node256* node256 = reinterpret_cast<Node256*>(node);
+            for (uint32_t i = start; i < end; i++)
+            {
+                if (node256->child_ptrs[i] != NULL)
+                {
+                    node256->child_ptrs[i] = NULL;
+                    node->child_count--;
+                }
+            }
+            break;
+        }
+        case NODE48_REF:
+        {
+            Node48Ref* node48 = reinterpret_cast<Node48Ref*>(node);
+            for (uint32_t i = start; i < end; i++)
+            {
+                if (node48->child_ptr_indexs[i] > 0)
+                {
+                    node48->child_refs[node48->child_ptr_indexs[i] - 1] = 0;
+                    node48->child_ptr_indexs[i] = 0;
+                    node->child_count--;
+                }
+            }
+            break;
+        }
+        case NODE256_REF:
+        {
+            Node256Ref* node256 = reinterpret_cast<Node256Ref*>(node);
+            for (uint32_t i = start; i < end; i++)
+            {
+                if (node256->child_refs[i] != 0)
+                {
+                    node256->child_refs[i] = 0;
+                    node->child_count--;
+                }
+            }
+            break;
+        }
+        default:
+            assert(0);
+            break;
+    }
+}
+
+// 缩容的阈值比扩容低，避免在边界上反复扩容缩容
+// 256 -> 48: <= 37, 48 -> 16: <= 12, 16 -> 4: <= 3
+void AdaptiveRadixTree::shrinkNode(Node* node, Node** ref)
+{
+    unsigned char keys[256];
+    Node* ptrs[256];
+    int count = 0;
+    switch (node->type)
+    {
+        case NODE4:
+        {
+            // 只剩一个key的叶节点换成单key叶节点
+            if (!_single_leaf || !node->IsLeaf() || node->child_count != 1)
+            {
+                return;
+            }
+            Node4* node4 = reinterpret_cast<Node4*>(node);
+            count = 1;
+            keys[0] = node4->child_keys[0];
+            ptrs[0] = node4->child_ptrs[0];
+            break;
+        }
+        case NODE_EXTENT:
+        case NODE_SINGLE:
+        {
+            return;
+        }
+        case NODE_DICT:
+        case NODE_DELTA16:
+        case NODE_DELTA32:
+        {
+            count = collectLeaf(node, keys, ptrs);
+            break;
+        }
+        case NODE16:
+        {
+            Node16* node16 = reinterpret_cast<Node16*>(node);
+            count = node->child_count;
+            memcpy(keys, node16->child_keys, count);
+            memcpy(ptrs, node16->child_ptrs, count * sizeof(void*));
+            break;
+        }
+        case NODE48:
+        {
+            Node48* node48 = reinterpret_cast<Node48*>(node);
+            for (int i = 0; i < 256; i++)
+            {
+                if (node48->child_ptr_indexs[i] > 0)
+                {
+                    keys[count] = i;
+                    ptrs[count] = node48->child_ptrs[node48->child_ptr_indexs[i] - 1];
+                    count++;
+                }
+            }
+            break;
+        }
+        case NODE256:
+        {
+            Node256* node256 = reinterpret_cast<Node256*>(node);
+            for (int i = 0; i < 256; i++)
+            {
+                if (node256->child_ptrs[i] != NULL)
+                {
+                    keys[count] = i;
+                    ptrs[count] = node256->child_ptrs[i];
+                    count++;
+                }
             }
+            break;
+        }
+        case NODE48_REF:
+        {
+            Node48Ref* node48 = reinterpret_cast<Node48Ref*>(node);
+            for (int i = 0; i < 256; i++)
+            {
+                if (node48->child_ptr_indexs[i] > 0)
+                {
+                    keys[count] = i;
+                    ptrs[count] = decodeRef(node48->child_refs[node48->child_ptr_indexs[i] - 1]);
+                    count++;
+                }
+            }
+            break;
+        }
+        case NODE256_REF:
+        {
+            Node256Ref* node256 = reinterpret_cast<Node256Ref*>(node);
+            for (int i = 0; i < 256; i++)
+            {
+                if (node256->child_refs[i] != 0)
+                {
+                    keys[count] = i;
+                    ptrs[count] = decodeRef(node256->child_refs[i]);
+                    count++;
+                }
+            }
+            break;
+        }
+    }
 
-            Node* newNode = reinterpret_cast<Node*>(makeNode4());
-            *ref = newNode;
-            newNode->prefix_length = p;
-            assert(newNode->prefix_length <= 8);
+    if (_single_leaf && node->IsLeaf() && count == 1)
+    {
+        Node* newNode = makeSingleLeaf(node, keys[0], ptrs[0]);
+        storeChild(ref, newNode);
+        freeNode(node);
+        return;
+    }
 
-            if (p > 0)
+    NodeType type = count <= 3 ? NODE4 : (count <= 12 ? NODE16 : (count <= 37 ? NODE48 : NODE256));
+    // 压缩格式的叶节点只有换成Node4/Node16才更小，Ref节点按容量比较
+    if (node->type >= NODE_DICT ? type > NODE16 : maxCapacitySize(type) >= maxCapacitySize(node->type))
+    {
+        return;
+    }
+    if (_compressed_refs && !node->IsLeaf() && type == NODE48)
+    {
+        type = NODE48_REF;
+    }
+
+    Node* newNode = makeNode(type);
+    copyHeader(newNode, node);
+    newNode->type = type;
+    newNode->child_count = count;
+    switch (type)
+    {
+        case NODE4:
+        {
+            Node4* node4 = reinterpret_cast<Node4*>(newNode);
+            memcpy(node4->child_keys, keys, count);
+            memcpy(node4->child_ptrs, ptrs, count * sizeof(void*));
+            break;
+        }
+        case NODE16:
+        {
+            Node16* node16 = reinterpret_cast<Node16*>(newNode);
+            memcpy(node16->child_keys, keys, count);
+            memcpy(node16->child_ptrs, ptrs, count * sizeof(void*));
+            break;
+        }
+        case NODE48:
+        {
+            Node48* node48 = reinterpret_cast<Node48*>(newNode);
+            for (int i = 0; i < count; i++)
             {
-                memcpy(&newNode->prefix[0], &node->prefix[0], p);
+                node48->child_ptr_indexs[keys[i]] = i + 1;
+                node48->child_ptrs[i] = ptrs[i];
             }
-            unsigned char oldByte = node->prefix[p];
-            node->prefix_length -= (p + 1);
-            if (node->prefix_length > 0)
+            break;
+        }
+        case NODE48_REF:
+        {
+            Node48Ref* node48 = reinterpret_cast<Node48Ref*>(newNode);
+            for (int i = 0; i < count; i++)
             {
-                memmove(&node->prefix[0], &node->prefix[0] + p + 1, node->prefix_length);
+                node48->child_ptr_indexs[keys[i]] = i + 1;
+                node48->child_refs[i] = encodeRef(ptrs[i]);
             }
-            assert(node->prefix_length < 7);
-
-            Node* leafNode = makeProperNode(length);
-            // 去掉第一个和最后一个，前缀6减去公共前缀长度就是分裂后的长度
-            leafNode->prefix_length = 8 - depth - p - 2;
-            memcpy(&leafNode->prefix[0], &key[depth + p + 1], leafNode->prefix_length);
-            assert(leafNode->prefix_length < 7);
-            leafNode->is_leaf = true;
-            addLeafChild(leafNode, &leafNode, key[7], length, val);
-            addChild(newNode, NULL, key[depth + p], leafNode);
-            addChild(newNode, NULL, oldByte, node);
-            return;
+            break;
+        }
+        default:
+            assert(0);
+    }
+    storeChild(ref, newNode);
+    freeNode(node);
+}
+
+// 只剩一个child的内部Node4，把自己的前缀和child的key拼到child的前缀前面，然后用child替换自己
+// 非根节点的深度至少是1，拼接之后的前缀不会超过6
+void AdaptiveRadixTree::mergeChild(Node4* node4, Node** ref)
+{
+    Node* node = &node4->header;
+    assert(node->child_count == 1 && !node->IsLeaf());
+    Node* child = UntagNode(node4->child_ptrs[0]);
+    int length = node->prefix_length + 1 + child->prefix_length;
+    assert(length <= 6);
+    if (child->prefix_length > 0)
+    {
+        memmove(&child->prefix[node->prefix_length + 1], &child->prefix[0], child->prefix_length);
+    }
+    child->prefix[node->prefix_length] = node4->child_keys[0];
+    if (node->prefix_length > 0)
+    {
+        memcpy(&child->prefix[0], &node->prefix[0], node->prefix_length);
+    }
+    child->prefix_length = length;
+    if (child->type == NODE_SINGLE)
+    {
+        reinterpret_cast<NodeSingle*>(child)->SyncKey();
+    }
+    markDirty(child);
+    storeChild(ref, child);
+    freeNode(node);
+}
+
+// node所在的槽位下面，前缀和key一致的key范围
+static void subtreeRange(const Node* node, uint64_t key, int depth, uint64_t* lo, uint64_t* hi)
+{
+    uint64_t base = depth == 0 ? 0 : key & (~0ULL << (64 - 8 * depth));
+    for (int i = 0; i < node->prefix_length; i++)
+    {
+        base |= (uint64_t)node->prefix[i] << (56 - 8 * (depth + i));
+    }
+    *lo = base;
+    *hi = base | (~0ULL >> (8 * (depth + node->prefix_length)));
+}
+
+// key在depth上的字节是byte时，[lo, hi]落在这个child下面的部分
+static void childRange(uint64_t lo, uint64_t hi, int depth, int byte, uint64_t* childLo, uint64_t* childHi)
+{
+    int shift = 56 - 8 * depth;
+    uint64_t base = (depth == 0 ? 0 : lo & (~0ULL << (64 - 8 * depth))) | ((uint64_t)byte << shift);
+    *childLo = std::max(lo, base);
+    *childHi = std::min<uint64_t>(hi, base | ((1ULL << shift) - 1));
+}
+
+// [lo, hi]都在*ref所在的槽位下面，depth是*ref前缀开始的位置
+// 一次下降到第一个叶节点，然后按key的顺序依次处理后面的叶节点
+void AdaptiveRadixTree::rangeInsert(Node** ref, uint64_t lo, uint64_t hi, void* val, int depth)
+{
+    uint64_t nodeLo, nodeHi;
+    subtreeRange(UntagNode(childAt(ref)), lo, depth, &nodeLo, &nodeHi);
+    // 前缀覆盖不了整个区间，前缀以内的部分直接处理，前缀以外的部分逐块插入，insert会分裂前缀
+    while (lo < nodeLo || hi > nodeHi)
+    {
+        if (lo >= nodeLo && lo <= nodeHi)
+        {
+            rangeInsert(ref, lo, nodeHi, val, depth);
+            lo = nodeHi + 1;
+        }
+        else
+        {
+            uint64_t last = std::min<uint64_t>(hi, lo | 0xFF);
+            uint64_t reverse = __builtin_bswap64(lo);
+            insert(UntagNode(childAt(ref)), ref, reinterpret_cast<unsigned char*>(&reverse), last - lo + 1, val, depth);
+            if (last == hi)
+            {
+                return;
+            }
+            lo = last + 1;
+        }
+        subtreeRange(UntagNode(childAt(ref)), lo, depth, &nodeLo, &nodeHi);
+    }
+
+    Node* node = UntagNode(childAt(ref));
+    ART_STAT_INC(descents);
+    markDirty(node);
+    depth += node->prefix_length;
+    if (depth == 7)
+    {
+        addLeafChild(node, ref, lo & 0xFF, hi - lo + 1, val);
+        return;
+    }
+
+    int shift = 56 - 8 * depth;
+    int firstByte = (lo >> shift) & 0xFF;
+    int lastByte = (hi >> shift) & 0xFF;
+    for (int byte = firstByte; byte <= lastByte; byte++)
+    {
+        uint64_t childLo, childHi;
+        childRange(lo, hi, depth, byte, &childLo, &childHi);
+        // 新增child的时候*ref可能被替换成更大的节点
+        Node** next = findChild(UntagNode(childAt(ref)), byte);
+        if (next != NULL && childAt(next) != NULL)
+        {
+            rangeInsert(next, childLo, childHi, val, depth + 1);
+            continue;
+        }
+
+        uint64_t last = std::min<uint64_t>(childHi, childLo | 0xFF);
+        uint64_t reverse = __builtin_bswap64(childLo);
+        addNewChild(UntagNode(childAt(ref)), ref, next, reinterpret_cast<unsigned char*>(&reverse), last - childLo + 1, val, depth);
+        if (last < childHi)
+        {
+            next = findChild(UntagNode(childAt(ref)), byte);
+            rangeInsert(next, last + 1, childHi, val, depth + 1);
+        }
+    }
+}
+
+// vals对应lo，调用前已经全部填成NULL
+void AdaptiveRadixTree::rangeQuery(Node* node, uint64_t lo, uint64_t hi, int depth, void** vals)
+{
+    ART_STAT_INC(descents);
+    uint64_t nodeLo, nodeHi;
+    subtreeRange(node, lo, depth, &nodeLo, &nodeHi);
+    if (hi < nodeLo || lo > nodeHi)
+    {
+        return;
+    }
+    if (lo < nodeLo)
+    {
+        vals += nodeLo - lo;
+        lo = nodeLo;
+    }
+    hi = std::min(hi, nodeHi);
+
+    depth += node->prefix_length;
+    if (depth == 7)
+    {
+        findLeafChild(node, lo & 0xFF, hi - lo + 1, vals);
+        return;
+    }
+
+    int shift = 56 - 8 * depth;
+    int firstByte = (lo >> shift) & 0xFF;
+    int lastByte = (hi >> shift) & 0xFF;
+    for (int byte = firstByte; byte <= lastByte; byte++)
+    {
+        Node** next = findChild(node, byte);
+        if (next != NULL && childAt(next) != NULL)
+        {
+            uint64_t childLo, childHi;
+            childRange(lo, hi, depth, byte, &childLo, &childHi);
+            rangeQuery(UntagNode(childAt(next)), childLo, childHi, depth + 1, vals + (childLo - lo));
+        }
+    }
+}
+
+// 返回之后*ref可能已经被替换，child_count为0时由父节点释放
+void AdaptiveRadixTree::deleteRange(Node** ref, uint64_t lo, uint64_t hi, int depth)
+{
+    Node* node = UntagNode(childAt(ref));
+    uint64_t nodeLo, nodeHi;
+    subtreeRange(node, lo, depth, &nodeLo, &nodeHi);
+    if (hi < nodeLo || lo > nodeHi)
+    {
+        return;
+    }
+    lo = std::max(lo, nodeLo);
+    hi = std::min(hi, nodeHi);
+    markDirty(node);
+
+    depth += node->prefix_length;
+    if (depth == 7)
+    {
+        if (node->type >= NODE_EXTENT)
+        {
+            // 删除run的中间可能多出一个run，放不下时换成普通节点
+            addLeafChild(node, ref, lo & 0xFF, hi - lo + 1, NULL);
+            node = UntagNode(childAt(ref));
+        }
+        else
+        {
+            removeChild(node, lo & 0xFF, hi - lo + 1);
+        }
+        if (node->child_count > 0)
+        {
+            shrinkNode(node, ref);
         }
-    } while (0);
-
-    if (depth == 7)
-    {
-        addLeafChild(node, ref, key[depth], length, val);
         return;
     }
 
-    Node** next = findChild(node, key[depth]);
-    if (next)
+    int shift = 56 - 8 * depth;
+    int firstByte = (lo >> shift) & 0xFF;
+    int lastByte = (hi >> shift) & 0xFF;
+    for (int byte = firstByte; byte <= lastByte; byte++)
     {
-        // 如果当前槽位是空的，需要插入一个child
-        if (*next == NULL)
+        Node** next = findChild(node, byte);
+        if (next == NULL || childAt(next) == NULL)
         {
-            node->child_count++;
+            continue;
+        }
+        uint64_t childLo, childHi;
+        childRange(lo, hi, depth, byte, &childLo, &childHi);
+        deleteRange(next, childLo, childHi, depth + 1);
+        Node* child = UntagNode(childAt(next));
+        if (child->child_count == 0)
+        {
+            freeNode(child);
+            removeChild(node, byte, 1);
         }
-        insert(*next, next, key, length, val, depth+1);
     }
-    else
+
+    // 根节点空了也保留，缩成Node4
+    if (node->child_count == 0 && ref != &_root)
+    {
+        return;
+    }
+    shrinkNode(node, ref);
+    node = UntagNode(childAt(ref));
+    if (ref != &_root && node->type == NODE4 && node->child_count == 1)
     {
-        Node* newNode = makeProperNode(length);
-        assert(8 > depth - 2);
-        memcpy(&newNode->prefix[0], &key[depth + 1], 8 - depth - 2);
-        newNode->prefix_length = 8 - depth - 2;
-        assert(newNode->prefix_length <= 8);
-        newNode->is_leaf = true;
-        addLeafChild(newNode, &newNode, key[7], length, val);
-        addChild(node, ref, key[depth], newNode);
+        mergeChild(reinterpret_cast<Node4*>(node), ref);
     }
 }
 
-
-void AdaptiveRadixTree::findLeafChild(Node* node, unsigned char start, uint32_t length, std::vector<void*>* vals)
+// 写入vals[0, length)，不存在的key填NULL
+void AdaptiveRadixTree::findLeafChild(Node* node, unsigned char start, uint32_t length, void** vals)
 {
     switch (node->type)
     {
@@ -828,79 +1662,128 @@ void AdaptiveRadixTree::findLeafChild(Node* node, unsigned char start, uint32_t
         {
             return findLeafChild256(reinterpret_cast<Node256*>(node), start, length, vals);
         }
+        case NODE_EXTENT:
+        {
+            return findExtentChildren(node, start, length, vals);
+        }
+        case NODE_DICT:
+        case NODE_DELTA16:
+        case NODE_DELTA32:
+        {
+            return findPackedChildren(node, start, length, vals);
+        }
+        case NODE_SINGLE:
+        {
+            return findSingleChildren(node, start, length, vals);
+        }
+        default:
+            assert(0);
+            break;
     }
 }
 
-void AdaptiveRadixTree::findLeafChild4(Node4* node, unsigned char start, uint32_t length, std::vector<void*>* vals)
+// 区间内缺少的key不能打断后面的查找，按key直接算出位置
+void AdaptiveRadixTree::findLeafChild4(Node4* node, unsigned char start, uint32_t length, void** vals)
 {
-    unsigned char target = start;
-    uint32_t last = length;
-    vals->resize(length);
-    for (int i = 0; i < node->header.child_count; i++)
+    memset(vals, 0, length * sizeof(void*));
+    // 并发模式下可能读到正在修改的节点，不能越界
+    int count = std::min<int>(node->header.child_count, 4);
+    for (int i = 0; i < count; i++)
     {
-        if (node->child_keys[i] == target)
-        {
-            (*vals)[length - last] = node->child_ptrs[i];
-            target++;
-            last--;
-        }
-        if (last == 0)
+        uint32_t offset = node->child_keys[i] - start;
+        if (node->child_keys[i] >= start && offset < length)
         {
-            break;
+            vals[offset] = node->child_ptrs[i];
         }
     }
 }
 
-void AdaptiveRadixTree::findLeafChild16(Node16* node, unsigned char start, uint32_t length, std::vector<void*>* vals)
+void AdaptiveRadixTree::findLeafChild16(Node16* node, unsigned char start, uint32_t length, void** vals)
 {
-    unsigned char target = start;
-    uint32_t last = length;
-    vals->resize(length);
-    for (int i = 0; i < node->header.child_count; i++)
+    memset(vals, 0, length * sizeof(void*));
+    int count = std::min<int>(node->header.child_count, 16);
+    for (int i = 0; i < count; i++)
     {
-        if (node->child_keys[i] == target)
-        {
-            (*vals)[length - last] = node->child_ptrs[i];
-            target++;
-            last--;
-        }
-        if (last == 0)
+        uint32_t offset = node->child_keys[i] - start;
+        if (node->child_keys[i] >= start && offset < length)
         {
-            break;
+            vals[offset] = node->child_ptrs[i];
         }
     }
 }
 
-void AdaptiveRadixTree::findLeafChild48(Node48* node, unsigned char start, uint32_t length, std::vector<void*>* vals)
+void AdaptiveRadixTree::findLeafChild48(Node48* node, unsigned char start, uint32_t length, void** vals)
 {
-    unsigned char target = start;
-    do
+    for (uint32_t i = 0; i < length; i++)
     {
-        if (node->child_ptr_indexs[target] > 0)
-        {
-            vals->push_back(node->child_ptrs[node->child_ptr_indexs[target] - 1]);
-        }
-        else
-        {
-            vals->push_back(0);
-        }
-        if (target == start + length - 1)
-        {
-            break;
-        }
-        target++;
-    } while (1);
+        int index = node->child_ptr_indexs[start + i];
+        vals[i] = index > 0 ? node->child_ptrs[index - 1] : NULL;
+    }
+}
+
+void AdaptiveRadixTree::findLeafChild256(Node256* node, unsigned char start, uint32_t length, void** vals)
+{
+    memcpy(vals, &node->child_ptrs[start], length * sizeof(void*));
 }
 
-void AdaptiveRadixTree::findLeafChild256(Node256* node, unsigned char start, uint32_t length, std::vector<void*>* vals)
+// 大页模式不压缩引用时预留的地址空间，MAP_NORESERVE只占虚拟地址
+static const uint64_t kHugeArenaCapacity = 1ULL << 40;
+
+void AdaptiveRadixTree::EnableHugePages(uint64_t prefault_bytes)
 {
-    vals->resize(length);
-    memcpy(&(*vals)[0], &node->child_ptrs[start], length * sizeof(void*));
+    assert(_root == NULL && _arena_base == NULL);
+    _huge_pages = true;
+    _prefault_bytes = prefault_bytes;
 }
 
-void AdaptiveRadixTree::Init()
+int AdaptiveRadixTree::Init(uint32_t flags)
 {
-    _root = reinterpret_cast<Node*>(makeNode4());
+    const uint32_t compact = ART_EXTENT_LEAF | ART_PACKED_LEAF | ART_SINGLE_LEAF | ART_COMPRESSED_REFS;
+    // 读线程不加锁，读到一半的run或者重新编码的节点没法校验
+    if ((flags & ~(compact | ART_CONCURRENT)) != 0 || ((flags & ART_CONCURRENT) && (flags & compact)))
+    {
+        return -1;
+    }
+    _concurrent = flags & ART_CONCURRENT;
+    _extent_leaf = flags & ART_EXTENT_LEAF;
+    _packed_leaf = flags & ART_PACKED_LEAF;
+    _single_leaf = flags & ART_SINGLE_LEAF;
+    _compressed_refs = flags & ART_COMPRESSED_REFS;
+    if ((_compressed_refs || _huge_pages) && _arena_base == NULL)
+    {
+        // 不压缩引用时偏移不用装进32位，按最大的树预留地址空间
+        int ret = _arena.Reserve(_compressed_refs ? SlabArena::kMaxCapacity : kHugeArenaCapacity, _huge_pages);
+        if (ret == 0)
+        {
+            _arena_base = _arena.Base();
+        }
+        else if (_compressed_refs)
+        {
+            _compressed_refs = false;
+            return -1;
+        }
+        else
+        {
+            _huge_pages = false;
+        }
+    }
+    // 句柄是相对arena起点的偏移，所有类型的节点都要从arena分配，arena用完时没有别的地方可以分配；
+    // 只用大页时arena用完之后退回普通的slab
+    for (int i = 0; i < 11; i++)
+    {
+        _slabs[i].SetArena(_compressed_refs || _huge_pages ? &_arena : NULL, !_compressed_refs);
+    }
+    if (_huge_pages)
+    {
+        // 预先提交只是为了少缺页，失败时分配slab的时候会再提交一次
+        _arena.Prefault(_prefault_bytes);
+    }
+    if (_concurrent && _epoch == NULL)
+    {
+        _epoch = new EpochManager(reclaimNode, this);
+    }
+    _root = TagNode(reinterpret_cast<Node*>(makeNode4()));
+    _search_kernel = SelectSearchKernel();
     _max_node_persistent_size = std::max(sizeof(Node4Persistent), sizeof(Node16Persistent));
     _max_node_persistent_size = std::max(_max_node_persistent_size, sizeof(Node48Persistent));
     _max_node_persistent_size = std::max(_max_node_persistent_size, sizeof(Node256Persistent));
@@ -908,16 +1791,32 @@ void AdaptiveRadixTree::Init()
     _max_node_persistent_size = std::max(_max_node_persistent_size, sizeof(Node16LeafPersistent));
     _max_node_persistent_size = std::max(_max_node_persistent_size, sizeof(Node48LeafPersistent));
     _max_node_persistent_size = std::max(_max_node_persistent_size, sizeof(Node256LeafPersistent));
+    return 0;
 }
 
 void* AdaptiveRadixTree::Search(uint64_t key)
 {
-    Node* node = _root;
+    Node* ptr = _root;
     uint64_t reverse = __builtin_bswap64(key);
     unsigned char* data = reinterpret_cast<unsigned char*>(&reverse);
+    ART_STAT_INC(search_ops);
+    LatencyScope scope(_latency, LATENCY_SEARCH);
+    if (_concurrent)
+    {
+        return searchOLC(data);
+    }
     int depth = 0;
-    while (node && depth < 8)
+    // 叶节点的槽位里是value，depth到8之后ptr就是结果
+    while (ptr && depth < 8)
     {
+        NodeType type = TagType(ptr);
+        Node* node = UntagNode(ptr);
+        ART_STAT_INC(descents);
+        // 前缀和最后一个字节一次比较
+        if (type == NODE_SINGLE)
+        {
+            return reinterpret_cast<NodeSingle*>(node)->Match(reverse, depth);
+        }
         if (node->prefix_length > 0)
         {
             int p = checkPrefix(node, data, depth);
@@ -927,71 +1826,111 @@ void* AdaptiveRadixTree::Search(uint64_t key)
             }
             depth += node->prefix_length;
         }
+        if (type >= NODE_EXTENT)
+        {
+            return findCompactChild(node, data[depth]);
+        }
 
-        Node** ref = findChild(node, data[depth]);
-        node = (ref == NULL) ? NULL : *ref;
+        Node** ref = findChild(node, type, data[depth]);
+        ptr = (ref == NULL) ? NULL : childAt(ref);
 
         depth++;
     }
-    return node;
+    return ptr;
 }
 
 void AdaptiveRadixTree::Insert(uint64_t key, void* val)
 {
+    ART_STAT_INC(insert_ops);
     uint64_t reverse = __builtin_bswap64(key);
+    if (_concurrent)
+    {
+        insertOLC(reinterpret_cast<unsigned char*>(&reverse), 1, val);
+        return;
+    }
+    // 写入NULL等同于删除，走deleteRange才会回收变空的节点
+    if (val == NULL)
+    {
+        deleteRange(&_root, key, key, 0);
+        return;
+    }
 
-    insert(_root, &_root, reinterpret_cast<unsigned char*>(&reverse), 1, val, 0);
+    insert(UntagNode(_root), &_root, reinterpret_cast<unsigned char*>(&reverse), 1, val, 0);
 }
 
 
-// 需要保证[start, start + length]在同一个叶节点
 void AdaptiveRadixTree::RangeInsert(uint64_t start, uint32_t length, void* val)
 {
-    assert(start % 256 + length <= 256);
-
-    uint64_t reverse = __builtin_bswap64(start);
+    ART_STAT_INC(insert_ops);
+    LatencyScope scope(_latency, LATENCY_RANGE_INSERT);
+    if (length == 0)
+    {
+        return;
+    }
+    assert(start + length - 1 >= start);
+    if (_concurrent)
+    {
+        // 并发模式下按叶节点拆开，每一块单独从根节点加锁下降
+        uint64_t last = start + length - 1;
+        while (1)
+        {
+            uint64_t chunkLast = std::min<uint64_t>(last, start | 0xFF);
+            uint64_t reverse = __builtin_bswap64(start);
+            insertOLC(reinterpret_cast<unsigned char*>(&reverse), chunkLast - start + 1, val);
+            if (chunkLast == last)
+            {
+                return;
+            }
+            start = chunkLast + 1;
+        }
+    }
+    if (val == NULL)
+    {
+        deleteRange(&_root, start, start + length - 1, 0);
+        return;
+    }
 
-    insert(_root, &_root, reinterpret_cast<unsigned char*>(&reverse), length, val, 0);
+    rangeInsert(&_root, start, start + length - 1, val, 0);
 }
 
 void AdaptiveRadixTree::RangeQuery(uint64_t start, uint32_t length, std::vector<void*>* vals)
 {
-    assert(start % 256 + length <= 256);
-    Node* node = _root;
-    uint64_t reverse = __builtin_bswap64(start);
-    unsigned char* data = reinterpret_cast<unsigned char*>(&reverse);
-    int depth = 0;
-    while (node && depth < 8)
+    vals->assign(length, NULL);
+    ART_STAT_INC(query_ops);
+    LatencyScope scope(_latency, LATENCY_RANGE_QUERY);
+    if (length == 0)
     {
-        if (node->prefix_length > 0)
-        {
-            int p = checkPrefix(node, data, depth);
-            if (p != node->prefix_length)
+        return;
+    }
+    assert(start + length - 1 >= start);
+    if (_concurrent)
+    {
+        uint64_t last = start + length - 1;
+        uint64_t cursor = start;
+        while (1)
+        {
+            uint64_t chunkLast = std::min<uint64_t>(last, cursor | 0xFF);
+            uint64_t reverse = __builtin_bswap64(cursor);
+            rangeQueryOLC(reinterpret_cast<unsigned char*>(&reverse), chunkLast - cursor + 1, &(*vals)[cursor - start]);
+            if (chunkLast == last)
             {
                 return;
             }
-            depth += node->prefix_length;
-        }
-
-        if (depth == 7)
-        {
-            findLeafChild(node, data[7], length, vals);
-            assert(vals->size() == length);
-            return;
+            cursor = chunkLast + 1;
         }
-
-        Node** ref = findChild(node, data[depth]);
-        node = (ref == NULL) ? NULL : *ref;
-
-        depth++;
     }
 
-    // 没有读到叶节点
-    if (depth != 7)
+    rangeQuery(UntagNode(_root), start, start + length - 1, 0, &(*vals)[0]);
+}
+
+void AdaptiveRadixTree::DeleteRange(uint64_t start, uint32_t length)
+{
+    if (length == 0)
     {
-        assert(vals->empty());
-        vals->resize(length);
+        return;
     }
+    assert(start + length - 1 >= start);
+    deleteRange(&_root, start, start + length - 1, 0);
 }
 
 void AdaptiveRadixTree::destroyNode(Node* node, int depth)
@@ -1009,7 +1948,7 @@ void AdaptiveRadixTree::destroyNode(Node* node, int depth)
             Node4* node4 = reinterpret_cast<Node4*>(node);
             for (int i = 0; i < node->child_count; i++)
             {
-                destroyNode(node4->child_ptrs[i], depth + node->prefix_length + 1);
+                destroyNode(UntagNode(node4->child_ptrs[i]), depth + node->prefix_length + 1);
             }
             break;
         }
@@ -1018,7 +1957,7 @@ void AdaptiveRadixTree::destroyNode(Node* node, int depth)
             Node16* node16 = reinterpret_cast<Node16*>(node);
             for (int i = 0; i < node->child_count; i++)
             {
-                destroyNode(node16->child_ptrs[i], depth + node->prefix_length + 1);
+                destroyNode(UntagNode(node16->child_ptrs[i]), depth + node->prefix_length + 1);
             }
             break;
         }
@@ -1029,7 +1968,7 @@ void AdaptiveRadixTree::destroyNode(Node* node, int depth)
             {
                 if (node48->child_ptrs[i])
                 {
-                    destroyNode(node48->child_ptrs[i], depth + node->prefix_length + 1);
+                    destroyNode(UntagNode(node48->child_ptrs[i]), depth + node->prefix_length + 1);
                 }
             }
             break;
@@ -1041,71 +1980,110 @@ void AdaptiveRadixTree::destroyNode(Node* node, int depth)
             {
                 if (node256->child_ptrs[i])
                 {
-                    destroyNode(node256->child_ptrs[i], depth + node->prefix_length + 1);
+                    destroyNode(UntagNode(node256->child_ptrs[i]), depth + node->prefix_length + 1);
+                }
+            }
+            break;
+        }
+        case NODE48_REF:
+        {
+            Node48Ref* node48 = reinterpret_cast<Node48Ref*>(node);
+            for (int i = 0; i < 48; i++)
+            {
+                if (node48->child_refs[i])
+                {
+                    destroyNode(UntagNode(decodeRef(node48->child_refs[i])), depth + node->prefix_length + 1);
+                }
+            }
+            break;
+        }
+        case NODE256_REF:
+        {
+            Node256Ref* node256 = reinterpret_cast<Node256Ref*>(node);
+            for (int i = 0; i < 256; i++)
+            {
+                if (node256->child_refs[i])
+                {
+                    destroyNode(UntagNode(decodeRef(node256->child_refs[i])), depth + node->prefix_length + 1);
                 }
             }
             break;
         }
+        default:
+            assert(0);
+            break;
     }
     freeNode(node);
 }
 
 void AdaptiveRadixTree::Destroy()
 {
-    if (!_root)
+    if (_epoch != NULL)
     {
-        return;
+        _epoch->DropAll();
     }
-
-    destroyNode(_root, 0);
+    for (int i = 0; i < 11; i++)
+    {
+        _slabs[i].Release();
+    }
+    _arena.Reset();
+    _root = NULL;
+    _used_memory = 0;
+    _compact_cursor = 0;
 }
 
 // 暂时不考虑buffer不够
+// 序列化的节点在缓冲里按字节紧挨着，不一定对齐，节点头和各个字段都按偏移memcpy
+static inline void storeHeader(char* buf, const Node* node)
+{
+    Node header;
+    copyHeader(&header, node);
+    memcpy(buf, &header, sizeof(Node));
+}
+
 bool AdaptiveRadixTree::serializationNode(const Node* node, char* buf, int& nodeSize)
 {
-    if (node->is_leaf)
+    if (node->IsLeaf())
     {
         switch (node->type)
         {
             case NODE4:
             {
-                Node4LeafPersistent* n = reinterpret_cast<Node4LeafPersistent*>(buf);
                 const Node4* node4 = reinterpret_cast<const Node4*>(node);
-                memcpy(n, node, sizeof(Node));
-                memcpy(&n->child_keys[0], &node4->child_keys[0], 4);
-                memcpy(&n->child_ptrs[0], &node4->child_ptrs[0], 4 * sizeof(void*));
+                storeHeader(buf, node);
+                memcpy(buf + offsetof(Node4LeafPersistent, child_keys), &node4->child_keys[0], 4);
+                memcpy(buf + offsetof(Node4LeafPersistent, child_ptrs), &node4->child_ptrs[0], 4 * sizeof(void*));
                 nodeSize = sizeof(Node4LeafPersistent);
                 return true;
             }
             case NODE16:
             {
-                Node16LeafPersistent* n = reinterpret_cast<Node16LeafPersistent*>(buf);
                 const Node16* node16 = reinterpret_cast<const Node16*>(node);
-                memcpy(n, node, sizeof(Node));
-                memcpy(&n->child_keys[0], &node16->child_keys[0], 16);
-                memcpy(&n->child_ptrs[0], &node16->child_ptrs[0], 16 * sizeof(void*));
+                storeHeader(buf, node);
+                memcpy(buf + offsetof(Node16LeafPersistent, child_keys), &node16->child_keys[0], 16);
+                memcpy(buf + offsetof(Node16LeafPersistent, child_ptrs), &node16->child_ptrs[0], 16 * sizeof(void*));
                 nodeSize = sizeof(Node16LeafPersistent);
                 return true;
             }
             case NODE48:
             {
-                Node48LeafPersistent* n = reinterpret_cast<Node48LeafPersistent*>(buf);
                 const Node48* node48 = reinterpret_cast<const Node48*>(node);
-                memcpy(n, node48, sizeof(Node));
-                memcpy(&n->child_ptr_indexs[0], &node48->child_ptr_indexs[0], 256);
-                memcpy(&n->child_ptrs[0], &node48->child_ptrs[0], 48 * sizeof(void*));
+                storeHeader(buf, &node48->header);
+                memcpy(buf + offsetof(Node48LeafPersistent, child_ptr_indexs), &node48->child_ptr_indexs[0], 256);
+                memcpy(buf + offsetof(Node48LeafPersistent, child_ptrs), &node48->child_ptrs[0], 48 * sizeof(void*));
                 nodeSize = sizeof(Node48LeafPersistent);
                 return true;
             }
             case NODE256:
             {
-                Node256LeafPersistent* n = reinterpret_cast<Node256LeafPersistent*>(buf);
                 const Node256* node256 = reinterpret_cast<const Node256*>(node);
-                memcpy(n, node256, sizeof(Node));
-                memcpy(&n->child_ptrs[0], &node256->child_ptrs[0], 256 * sizeof(void*));
+                storeHeader(buf, &node256->header);
+                memcpy(buf + offsetof(Node256LeafPersistent, child_ptrs), &node256->child_ptrs[0], 256 * sizeof(void*));
                 nodeSize = sizeof(Node256LeafPersistent);
                 return true;
             }
+            default:
+                return false;
         }
     }
     else 
@@ -1114,42 +2092,41 @@ bool AdaptiveRadixTree::serializationNode(const Node* node, char* buf, int& node
         {
             case NODE4:
             {
-                Node4Persistent* n = reinterpret_cast<Node4Persistent*>(buf);
                 const Node4* node4 = reinterpret_cast<const Node4*>(node);
-                memcpy(n, node, sizeof(Node));
-                memcpy(&n->child_keys[0], &node4->child_keys[0], 4);
+                storeHeader(buf, node);
+                memcpy(buf + offsetof(Node4Persistent, child_keys), &node4->child_keys[0], 4);
                 nodeSize = sizeof(Node4Persistent);
                 return true;
             }
             case NODE16:
             {
-                Node16Persistent* n = reinterpret_cast<Node16Persistent*>(buf);
                 const Node16* node16 = reinterpret_cast<const Node16*>(node);
-                memcpy(n, node, sizeof(Node));
-                memcpy(&n->child_keys[0], &node16->child_keys[0], 16);
+                storeHeader(buf, node);
+                memcpy(buf + offsetof(Node16Persistent, child_keys), &node16->child_keys[0], 16);
                 nodeSize = sizeof(Node16Persistent);
                 return true;
             }
             case NODE48:
             {
-                Node48Persistent* n = reinterpret_cast<Node48Persistent*>(buf);
                 const Node48* node48 = reinterpret_cast<const Node48*>(node);
-                memcpy(n, node48, sizeof(Node));
-                memcpy(&n->child_ptr_indexs[0], &node48->child_ptr_indexs[0], 256);
+                storeHeader(buf, &node48->header);
+                memcpy(buf + offsetof(Node48Persistent, child_ptr_indexs), &node48->child_ptr_indexs[0], 256);
                 nodeSize = sizeof(Node48Persistent);
                 return true;
             }
             case NODE256:
             {
-                Node256Persistent* n = reinterpret_cast<Node256Persistent*>(buf);
                 const Node256* node256 = reinterpret_cast<const Node256*>(node);
-                memcpy(n, node256, sizeof(Node));
+                storeHeader(buf, &node256->header);
+                unsigned char* bitmap = reinterpret_cast<unsigned char*>(buf + offsetof(Node256Persistent, child_bitmap));
                 for (int i = 0; i < 256; i++) {
-                    n->child_bitmap[i] = node256->child_ptrs[i] == NULL ? 0 : 1;
+                    bitmap[i] = node256->child_ptrs[i] == NULL ? 0 : 1;
                 }
                 nodeSize = sizeof(Node256Persistent);
                 return true;
             }
+            default:
+                return false;
         }
     }
     return false;
@@ -1157,18 +2134,20 @@ bool AdaptiveRadixTree::serializationNode(const Node* node, char* buf, int& node
 
 bool AdaptiveRadixTree::deserializationNode(Node** node, char** buf)
 {
-    Node* header = reinterpret_cast<Node*>(*buf);
-    if (header->is_leaf)
+    // 缓冲里的节点头不一定对齐，先拷到局部变量里再看类型
+    Node header;
+    memcpy(&header, *buf, sizeof(Node));
+    const char* p = *buf;
+    if (header.IsLeaf())
     {
-        switch (header->type)
+        switch (header.type)
         {
             case NODE4:
             {
                 Node4* n4 = makeNode4();
-                Node4LeafPersistent* n = reinterpret_cast<Node4LeafPersistent*>(*buf);
-                memcpy(n4, header, sizeof(Node));
-                memcpy(&n4->child_keys[0], &n->child_keys[0], 4);
-                memcpy(&n4->child_ptrs[0], &n->child_ptrs[0], 4 * sizeof(void*));
+                copyHeader(reinterpret_cast<Node*>(n4), &header);
+                memcpy(&n4->child_keys[0], p + offsetof(Node4LeafPersistent, child_keys), 4);
+                memcpy(&n4->child_ptrs[0], p + offsetof(Node4LeafPersistent, child_ptrs), 4 * sizeof(void*));
                 *node = reinterpret_cast<Node*>(n4);
                 *buf += sizeof(Node4LeafPersistent);
                 return true;
@@ -1176,10 +2155,9 @@ bool AdaptiveRadixTree::deserializationNode(Node** node, char** buf)
             case NODE16:
             {
                 Node16* n16 = makeNode16();
-                Node16LeafPersistent* n = reinterpret_cast<Node16LeafPersistent*>(*buf);
-                memcpy(n16, header, sizeof(Node));
-                memcpy(&n16->child_keys[0], &n->child_keys[0], 16);
-                memcpy(&n16->child_ptrs[0], &n->child_ptrs[0], 16 * sizeof(void*));
+                copyHeader(reinterpret_cast<Node*>(n16), &header);
+                memcpy(&n16->child_keys[0], p + offsetof(Node16LeafPersistent, child_keys), 16);
+                memcpy(&n16->child_ptrs[0], p + offsetof(Node16LeafPersistent, child_ptrs), 16 * sizeof(void*));
                 *node = reinterpret_cast<Node*>(n16);
                 *buf += sizeof(Node16LeafPersistent);
                 return true;
@@ -1187,10 +2165,9 @@ bool AdaptiveRadixTree::deserializationNode(Node** node, char** buf)
             case NODE48:
             {
                 Node48* n48 = makeNode48();
-                Node48LeafPersistent* n = reinterpret_cast<Node48LeafPersistent*>(*buf);
-                memcpy(n48, header, sizeof(Node));
-                memcpy(&n48->child_ptr_indexs[0], &n->child_ptr_indexs[0], 256);
-                memcpy(&n48->child_ptrs[0], &n->child_ptrs[0], 48 * sizeof(void*));
+                copyHeader(reinterpret_cast<Node*>(n48), &header);
+                memcpy(&n48->child_ptr_indexs[0], p + offsetof(Node48LeafPersistent, child_ptr_indexs), 256);
+                memcpy(&n48->child_ptrs[0], p + offsetof(Node48LeafPersistent, child_ptrs), 48 * sizeof(void*));
                 *node = reinterpret_cast<Node*>(n48);
                 *buf += sizeof(Node48LeafPersistent);
                 return true;
@@ -1198,25 +2175,25 @@ bool AdaptiveRadixTree::deserializationNode(Node** node, char** buf)
             case NODE256:
             {
                 Node256* n256 = makeNode256();
-                Node256LeafPersistent* n = reinterpret_cast<Node256LeafPersistent*>(*buf);
-                memcpy(n256, header, sizeof(Node));
-                memcpy(&n256->child_ptrs[0], &n->child_ptrs[0], 256 * sizeof(void*));
+                copyHeader(reinterpret_cast<Node*>(n256), &header);
+                memcpy(&n256->child_ptrs[0], p + offsetof(Node256LeafPersistent, child_ptrs), 256 * sizeof(void*));
                 *node = reinterpret_cast<Node*>(n256);
                 *buf += sizeof(Node256LeafPersistent);
                 return true;
             }
+            default:
+                return false;
         }
     }
     else
     {
-        switch (header->type)
+        switch (header.type)
         {
             case NODE4:
             {
                 Node4* n4 = makeNode4();
-                Node4Persistent* np = reinterpret_cast<Node4Persistent*>(*buf);
-                memcpy(n4, header, sizeof(Node));
-                memcpy(&n4->child_keys[0], &np->child_keys[0], 4);
+                copyHeader(reinterpret_cast<Node*>(n4), &header);
+                memcpy(&n4->child_keys[0], p + offsetof(Node4Persistent, child_keys), 4);
                 *node = reinterpret_cast<Node*>(n4);
                 *buf += sizeof(Node4Persistent);
                 return true;
@@ -1224,34 +2201,59 @@ bool AdaptiveRadixTree::deserializationNode(Node** node, char** buf)
             case NODE16:
             {
                 Node16* n16 = makeNode16();
-                Node16Persistent* np = reinterpret_cast<Node16Persistent*>(*buf);
-                memcpy(n16, header, sizeof(Node));
-                memcpy(&n16->child_keys[0], &np->child_keys[0], 16);
+                copyHeader(reinterpret_cast<Node*>(n16), &header);
+                memcpy(&n16->child_keys[0], p + offsetof(Node16Persistent, child_keys), 16);
                 *node = reinterpret_cast<Node*>(n16);
                 *buf += sizeof(Node16Persistent);
                 return true;
             }
             case NODE48:
             {
+                const char* indexs = p + offsetof(Node48Persistent, child_ptr_indexs);
+                if (_compressed_refs)
+                {
+                    Node48Ref* n48 = makeNode48Ref();
+                    copyHeader(reinterpret_cast<Node*>(n48), &header);
+                    n48->header.type = NODE48_REF;
+                    memcpy(&n48->child_ptr_indexs[0], indexs, 256);
+                    *node = reinterpret_cast<Node*>(n48);
+                    *buf += sizeof(Node48Persistent);
+                    return true;
+                }
                 Node48* n48 = makeNode48();
-                Node48Persistent* n = reinterpret_cast<Node48Persistent*>(*buf);
-                memcpy(n48, header, sizeof(Node));
-                memcpy(&n48->child_ptr_indexs[0], &n->child_ptr_indexs[0], 256);
+                copyHeader(reinterpret_cast<Node*>(n48), &header);
+                memcpy(&n48->child_ptr_indexs[0], indexs, 256);
                 *node = reinterpret_cast<Node*>(n48);
                 *buf += sizeof(Node48Persistent);
                 return true;
             }
             case NODE256:
             {
+                const unsigned char* bitmap = reinterpret_cast<const unsigned char*>(p + offsetof(Node256Persistent, child_bitmap));
+                if (_compressed_refs)
+                {
+                    // 有child的槽位先标记上，不需要临时的bitmap
+                    Node256Ref* n256 = makeNode256Ref();
+                    copyHeader(reinterpret_cast<Node*>(n256), &header);
+                    n256->header.type = NODE256_REF;
+                    for (int i = 0; i < 256; i++)
+                    {
+                        n256->child_refs[i] = bitmap[i] ? Node256Ref::kPendingRef : 0;
+                    }
+                    *node = reinterpret_cast<Node*>(n256);
+                    *buf += sizeof(Node256Persistent);
+                    return true;
+                }
                 Node256* n256 = makeNode256();
-                Node256Persistent* n = reinterpret_cast<Node256Persistent*>(*buf);
-                memcpy(n256, header, sizeof(Node));
+                copyHeader(reinterpret_cast<Node*>(n256), &header);
                 n256->child_bitmap = new Bitmap;
-                memcpy(&n256->child_bitmap->bitmap[0], &n->child_bitmap[0], 256);
+                memcpy(&n256->child_bitmap->bitmap[0], bitmap, 256);
                 *node = reinterpret_cast<Node*>(n256);
                 *buf += sizeof(Node256Persistent);
                 return true;
             }
+            default:
+                return false;
         }
     }
     return false;
@@ -1259,188 +2261,56 @@ bool AdaptiveRadixTree::deserializationNode(Node** node, char** buf)
 
 int AdaptiveRadixTree::Deserialization(const void* buf, const int bufSize)
 {
-    assert(_root == NULL);
     assert(bufSize > sizeof(Node));
-    char* pos = (char*)buf;
-
-    Node* n = NULL;
-    assert(deserializationNode(&n, &pos));
-
-    _root = n;
-
-    std::queue<Node*> q;
-    q.push(n);
-    
-    while (!q.empty())
-    {
-        int levelCount = q.size();
-        for (int i = 0; i < levelCount; i++)
-        {
-            Node* parent = q.front();
-            q.pop();
-            if (parent->is_leaf)
-            {
-                continue;
-            }
-            int node48Index = 0;
-            int node256Index = 0;
-
-            for (int j = 0; j < parent->child_count; j++)
-            {
-                Node* child;
-                assert(deserializationNode(&child, &pos));
-                
-                q.push(child);
-
-                switch (parent->type)
-                {
-                    case NODE4:
-                    {
-                        Node4* n4 = reinterpret_cast<Node4*>(parent);
-                        n4->child_ptrs[j] = child;
-                        break;
-                    }
-                    case NODE16:
-                    {
-                        Node16* n16 = reinterpret_cast<Node16*>(parent);
-                        n16->child_ptrs[j] = child;
-                        break;
-                    }
-                    case NODE48:
-                    {
-                        Node48* n48 = reinterpret_cast<Node48*>(parent);
-                        while (n48->child_ptr_indexs[node48Index] == 0) {
-                            node48Index++;
-                        }
-                        n48->child_ptrs[n48->child_ptr_indexs[node48Index] - 1] = child;
-                        node48Index++;
-                        break;
-                    }
-                    case NODE256:
-                    {
-                        Node256* n256 = reinterpret_cast<Node256*>(parent);
-                        while (n256->child_bitmap->bitmap[node256Index] == 0) {
-                            node256Index++;
-                        }
-                        n256->child_ptrs[node256Index] = child;
-                        node256Index++;
-                        break;
-                    }
-                }
-            }
-            if (parent->type == NODE256) {
-                Node256* n256 = reinterpret_cast<Node256*>(parent);
-                delete n256->child_bitmap;
-                n256->child_bitmap = NULL;
-            }
-        }
-    }
-
-    return 0;
+    const char* pos = reinterpret_cast<const char*>(buf);
+    const char* end = pos + bufSize;
+    return Deserialize([&pos, end](char* data, size_t size) -> int64_t {
+        size_t n = std::min<size_t>(size, end - pos);
+        memcpy(data, pos, n);
+        pos += n;
+        return n;
+    });
 }
 
-// 由于不确定需要多长的buffer，所以不应该由外部申请，传进来
-// 
+// 不确定需要多长的buffer，所以由内部申请，不够时换成两倍大小的buffer，保持4K对齐
 void AdaptiveRadixTree::Serialization(void** buf, int& size)
 {
-    char* pos = NULL;
-    int bufSize = 1 << 20;
-    posix_memalign((void**)&pos, 4096, bufSize);
-    *buf = pos;
-
-    std::queue<Node*> q;
-    q.push(_root);
-
-    while (!q.empty())
+    char* out = NULL;
+    size_t capacity = 1 << 20;
+    size_t used = 0;
+    *buf = NULL;
+    size = 0;
+    if (posix_memalign((void**)&out, 4096, capacity) != 0)
     {
-        int count = q.size();
-        for (uint k = 0; k < count; k++)
+        return;
+    }
+    int64_t ret = Serialize([&out, &capacity, &used](const char* data, size_t n) {
+        if (used + n > capacity)
         {
-            Node* n = q.front();
-            q.pop();
-            switch (n->type)
+            while (used + n > capacity)
             {
-                case NODE4:
-                {
-                    Node4* n4 = reinterpret_cast<Node4*>(n);
-                    if (!n->is_leaf)
-                    {
-                        for (uint i = 0; i < n->child_count; i++)
-                        {
-                            q.push(n4->child_ptrs[i]);
-                        }
-                    }
-                    break;
-                }
-                case NODE16:
-                {
-                    Node16* n16 = reinterpret_cast<Node16*>(n);
-                    if (!n->is_leaf)
-                    {
-                        for (uint i = 0; i < n->child_count; i++)
-                        {
-                            q.push(n16->child_ptrs[i]);
-                        }
-                    }
-                    break;
-                }
-                case NODE48:
-                {
-                    Node48* n48 = reinterpret_cast<Node48*>(n);
-                    if (!n->is_leaf)
-                    {
-                        for (uint i = 0; i < 256; i++)
-                        {
-                            if (n48->child_ptr_indexs[i] > 0)
-                            {
-                                assert(n48->child_ptrs[n48->child_ptr_indexs[i] - 1] != NULL);
-                                q.push(n48->child_ptrs[n48->child_ptr_indexs[i] - 1]);
-                            }
-                        }
-                    }
-                    break;
-                }
-                case NODE256:
-                {
-                    Node256* n256 = reinterpret_cast<Node256*>(n);
-                    int childCount = 0;
-                    if (!n->is_leaf)
-                    {
-                        for (uint i = 0; i < 256; i++)
-                        {
-                            if (n256->child_ptrs[i])
-                            {
-                                q.push(n256->child_ptrs[i]);
-                                childCount++;
-                            }
-                        }                   
-                        assert(childCount == n->child_count);
-                    }
-                    break;
-                }
-                default:
-                    assert(0);
+                capacity *= 2;
             }
-
-            if (bufSize - (pos - (char*)*buf) < _max_node_persistent_size)
+            char* bigger = NULL;
+            if (posix_memalign((void**)&bigger, 4096, capacity) != 0)
             {
-                bufSize *= 2;
-                char* newbuf = (char*)realloc(*buf, bufSize);
-                if (newbuf != *buf)
-                {
-                    pos = newbuf + (pos - (char*)*buf);
-                    *buf = newbuf;
-                }
+                return false;
             }
-
-            int nodeSize = 0;
-            assert(serializationNode(n, pos, nodeSize));
-            pos += nodeSize;
-            assert(pos - (char*)*buf < bufSize);
-        }
+            memcpy(bigger, out, used);
+            free(out);
+            out = bigger;
+        }
+        memcpy(out + used, data, n);
+        used += n;
+        return true;
+    });
+    if (ret < 0)
+    {
+        free(out);
+        return;
     }
-
-    size = (char*)pos - (char*)*buf;
+    *buf = out;
+    size = used;
 }
 
 void AdaptiveRadixTree::DumpNode(Node* node)
@@ -1449,9 +2319,9 @@ void AdaptiveRadixTree::DumpNode(Node* node)
     printf("Node: %p\t", node);
     printf("NodeType: %d\t", node->type);
     printf("ChildCount: %d\t", node->child_count);
-    printf("Leaf: %d\t", node->is_leaf);
+    printf("Leaf: %d\t", node->IsLeaf());
     printf("Childs: ");
-    if (node->is_leaf) {
+    if (node->IsLeaf()) {
         printf(" }\n");
         return;
     }
@@ -1501,6 +2371,34 @@ void AdaptiveRadixTree::DumpNode(Node* node)
             }
             break;
         }
+        case NODE48_REF:
+        {
+            Node48Ref* n48 = reinterpret_cast<Node48Ref*>(node);
+            int index = 0;
+            for (int i = 0; i < 256; i++)
+            {
+                if (n48->child_ptr_indexs[i] > 0)
+                {
+                    printf("[%d-%d-%p] ", index++, n48->child_ptr_indexs[i] - 1, decodeRef(n48->child_refs[n48->child_ptr_indexs[i] - 1]));
+                }
+            }
+            break;
+        }
+        case NODE256_REF:
+        {
+            Node256Ref* n256 = reinterpret_cast<Node256Ref*>(node);
+            int index = 0;
+            for (int i = 0; i < 256; i++)
+            {
+                if (n256->child_refs[i])
+                {
+                    printf("[%d-%d-%p] ", index++, i, decodeRef(n256->child_refs[i]));
+                }
+            }
+            break;
+        }
+        default:
+            break;
     }
     printf(" }\n");
 }
@@ -1508,7 +2406,7 @@ void AdaptiveRadixTree::DumpNode(Node* node)
 void AdaptiveRadixTree::DumpTree()
 {
     std::queue<Node*> q;
-    q.push(_root);
+    q.push(UntagNode(_root));
 
     int level = 0;
 
@@ -1524,7 +2422,7 @@ void AdaptiveRadixTree::DumpTree()
             Node* n = q.front();
             q.pop();
             DumpNode(n);
-            if (n->is_leaf)
+            if (n->IsLeaf())
             {
                 continue;
             }
@@ -1535,7 +2433,7 @@ void AdaptiveRadixTree::DumpTree()
                     for (int j = 0; j < n->child_count; j++)
                     {
                         Node4* n4 = reinterpret_cast<Node4*>(n);
-                        q.push(n4->child_ptrs[j]);
+                        q.push(UntagNode(n4->child_ptrs[j]));
                     }
                     break;
                 }
@@ -1544,7 +2442,7 @@ void AdaptiveRadixTree::DumpTree()
                     for (int j = 0; j < n->child_count; j++)
                     {
                         Node16* n16 = reinterpret_cast<Node16*>(n);
-                        q.push(n16->child_ptrs[j]);
+                        q.push(UntagNode(n16->child_ptrs[j]));
                     }
                     break;
                 }
@@ -1556,7 +2454,7 @@ void AdaptiveRadixTree::DumpTree()
                         if (n48->child_ptr_indexs[j] > 0)
                         {
                             assert(n48->child_ptrs[n48->child_ptr_indexs[j] - 1] != NULL);
-                            q.push(n48->child_ptrs[n48->child_ptr_indexs[j] - 1]);
+                            q.push(UntagNode(n48->child_ptrs[n48->child_ptr_indexs[j] - 1]));
                         }
                     }
                     break;
@@ -1568,11 +2466,24 @@ void AdaptiveRadixTree::DumpTree()
                     {
                         if (n256->child_ptrs[j])
                         {
-                            q.push(n256->child_ptrs[j]);
+                            q.push(UntagNode(n256->child_ptrs[j]));
                         }
                     }                   
                     break;
                 }
+                case NODE48_REF:
+                case NODE256_REF:
+                {
+                    Node* children[256];
+                    int count = collectChildren(n, children);
+                    for (int j = 0; j < count; j++)
+                    {
+                        q.push(children[j]);
+                    }
+                    break;
+                }
+                default:
+                    break;
             }
         }
     }
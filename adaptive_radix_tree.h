@@ -4,7 +4,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <vector>
+#include <map>
 #include <functional>
+#include <mutex>
+#include "assert.h"
+#include "art_stats.h"
+#include "epoch.h"
+#include "latency_histogram.h"
+#include "simd_search.h"
+#include "slab_allocator.h"
 
 namespace art
 {
@@ -14,7 +22,16 @@ enum NodeType
     NODE4 = 0,
     NODE16 = 1,
     NODE48 = 2,
-    NODE256 = 3
+    NODE256 = 3,
+    // 压缩引用模式下的内部节点，槽位里是32位的句柄
+    NODE48_REF = 4,
+    NODE256_REF = 5,
+    // 从NODE_EXTENT开始都是只用于叶节点的压缩格式，槽位里没有Node*
+    NODE_EXTENT = 6,
+    NODE_DICT = 7,
+    NODE_DELTA16 = 8,
+    NODE_DELTA32 = 9,
+    NODE_SINGLE = 10
 };
 
 struct Bitmap
@@ -22,15 +39,63 @@ struct Bitmap
     unsigned char bitmap[256];
 };
 
+// version的最高位，上次checkpoint之后自己或者子树被修改过，持久化时总是0
+static const uint32_t kDirtyBit = 1u << 31;
+// 节点创建之后不会变，和dirty一样放在version里，给type留出位置
+static const uint32_t kLeafBit = 1u << 30;
+
+// 前缀最长6个字节，根节点没有前缀，叶节点的前缀加上深度正好是7
 struct Node
 {
-    uint16_t        child_count;
-    uint8_t         prefix_length;
-    NodeType        type : 2;
-    bool            is_leaf : 1;
-    unsigned char   prefix[7];
+    uint32_t        version;            // 并发模式下的乐观锁，bit0 obsolete，bit1 locked，bit30 leaf，bit31 dirty
+    uint16_t        child_count : 9;
+    uint16_t        prefix_length : 3;
+    NodeType        type : 4;
+    unsigned char   prefix[6];
+
+    bool IsLeaf() const
+    {
+        return (version & kLeafBit) != 0;
+    }
+
+    void SetLeaf(bool leaf)
+    {
+        version = leaf ? (version | kLeafBit) : (version & ~kLeafBit);
+    }
 };
 
+// 节点从slab分配，至少16字节对齐，_root和内部节点槽位里的指针用低4位保存子节点的类型，
+// 下降时不用等子节点的节点头读进来就能选择查找方式
+// 内部节点和压缩格式叶节点的tag是type，普通叶节点是type + kLeafTag，叶节点的槽位里是value，不带tag
+static const uintptr_t kTagMask = 15;
+static const uintptr_t kLeafTag = 11;
+
+// node必须已经设置好type和leaf，tag由它们算出来，节点创建之后都不会变
+static inline Node* TagNode(Node* node)
+{
+    uintptr_t ptr = reinterpret_cast<uintptr_t>(node);
+    assert((ptr & kTagMask) == 0);
+    bool plainLeaf = node->IsLeaf() && node->type <= NODE256;
+    return reinterpret_cast<Node*>(ptr | (node->type + (plainLeaf ? kLeafTag : 0)));
+}
+
+// 不带tag的指针原样返回
+static inline Node* UntagNode(const Node* tagged)
+{
+    return reinterpret_cast<Node*>(reinterpret_cast<uintptr_t>(tagged) & ~kTagMask);
+}
+
+static inline bool TagIsLeaf(const Node* tagged)
+{
+    return (reinterpret_cast<uintptr_t>(tagged) & kTagMask) >= NODE_EXTENT;
+}
+
+static inline NodeType TagType(const Node* tagged)
+{
+    uintptr_t tag = reinterpret_cast<uintptr_t>(tagged) & kTagMask;
+    return static_cast<NodeType>(tag >= kLeafTag ? tag - kLeafTag : tag);
+}
+
 struct Node4
 {
     Node            header;
@@ -79,6 +144,179 @@ struct Node256
     }
 };
 
+// 压缩引用模式下的Node48/Node256，child_refs是带tag的child相对arena起点的偏移，0表示没有child
+// 只用于内部节点，叶节点的槽位里是64位的value
+struct Node48Ref
+{
+    Node            header;
+    unsigned char   child_ptr_indexs[256];
+    uint32_t        child_refs[48];
+    Node48Ref()
+    {
+        memset(this, 0, sizeof(*this));
+        header.type = NODE48_REF;
+    }
+};
+
+struct Node256Ref
+{
+    // 反序列化时标记有child的槽位，arena开头的一页不分配，不会和真正的句柄冲突
+    static const uint32_t kPendingRef = 1;
+
+    Node            header;
+    uint32_t        child_refs[256];
+    Node256Ref()
+    {
+        memset(this, 0, sizeof(*this));
+        header.type = NODE256_REF;
+    }
+};
+
+// key在[start, last]上的value是value + (key - start) * stride，stride为0时是同一个value
+struct ExtentRun
+{
+    uint64_t        value;
+    int32_t         stride;
+    unsigned char   start;
+    unsigned char   last;
+
+    void* ValueAt(int byte) const
+    {
+        return reinterpret_cast<void*>(value + (uint64_t)((int64_t)stride * (byte - start)));
+    }
+};
+
+// 按start排序、互不重叠的run，child_count是覆盖的key的个数，正好一个cache line
+// 连续写入的叶节点只需要几个run，run放不下时换回普通节点
+struct NodeExtent
+{
+    static const int kMaxRuns = 3;
+
+    Node            header;
+    unsigned char   run_count;
+    ExtentRun       runs[kMaxRuns];
+    NodeExtent()
+    {
+        memset(this, 0, sizeof(*this));
+        header.type = NODE_EXTENT;
+        header.SetLeaf(true);
+    }
+
+    void* Find(unsigned char byte) const
+    {
+        for (int i = 0; i < run_count && runs[i].start <= byte; i++)
+        {
+            if (byte <= runs[i].last)
+            {
+                return runs[i].ValueAt(byte);
+            }
+        }
+        return NULL;
+    }
+};
+
+// 不同的value放在values里，槽位只存1字节的下标，values[0]固定是0，下标0就是空槽位
+// 没有用到的value在放不下的时候重新编码时才清理
+struct NodeDict
+{
+    static const int kMaxValues = 15;
+
+    Node            header;
+    unsigned char   value_count;        // 包括values[0]
+    unsigned char   child_indexs[256];
+    uint64_t        values[kMaxValues + 1];
+    NodeDict()
+    {
+        memset(this, 0, sizeof(*this));
+        header.type = NODE_DICT;
+        header.SetLeaf(true);
+        value_count = 1;
+    }
+
+    void* Find(unsigned char byte) const
+    {
+        return reinterpret_cast<void*>(values[child_indexs[byte]]);
+    }
+};
+
+// 槽位存value - base + 1，0是空槽位，value的高位相同时只需要16位或者32位
+struct NodeDelta16
+{
+    static const uint64_t kMaxDelta = 0xFFFF;
+
+    Node            header;
+    uint64_t        base;
+    uint16_t        deltas[256];
+    NodeDelta16()
+    {
+        memset(this, 0, sizeof(*this));
+        header.type = NODE_DELTA16;
+        header.SetLeaf(true);
+    }
+
+    void* Find(unsigned char byte) const
+    {
+        return deltas[byte] == 0 ? NULL : reinterpret_cast<void*>(base + deltas[byte] - 1);
+    }
+};
+
+struct NodeDelta32
+{
+    static const uint64_t kMaxDelta = 0xFFFFFFFF;
+
+    Node            header;
+    uint64_t        base;
+    uint32_t        deltas[256];
+    NodeDelta32()
+    {
+        memset(this, 0, sizeof(*this));
+        header.type = NODE_DELTA32;
+        header.SetLeaf(true);
+    }
+
+    void* Find(unsigned char byte) const
+    {
+        return deltas[byte] == 0 ? NULL : reinterpret_cast<void*>(base + deltas[byte] - 1);
+    }
+};
+
+// 只有一个key的叶节点，前缀照常维护，另外按Search里的字节序保存key，查找时不用逐字节比较前缀
+// key只有节点覆盖的[7 - prefix_length, 8)这几个字节有效，比较时屏蔽掉上层节点负责的字节
+struct NodeSingle
+{
+    Node            header;
+    uint64_t        key;
+    void*           value;
+    NodeSingle()
+    {
+        memset(this, 0, sizeof(*this));
+        header.type = NODE_SINGLE;
+        header.SetLeaf(true);
+    }
+
+    unsigned char Byte() const
+    {
+        return reinterpret_cast<const unsigned char*>(&key)[7];
+    }
+
+    void* Find(unsigned char byte) const
+    {
+        return byte == Byte() ? value : NULL;
+    }
+
+    // data是字节反转之后的key，depth是节点所在的深度，不包括前缀
+    void* Match(uint64_t data, int depth) const
+    {
+        return ((data ^ key) & (~0ULL << (8 * depth))) == 0 ? value : NULL;
+    }
+
+    // 前缀变长之后把新的字节补到key里
+    void SyncKey()
+    {
+        memcpy(reinterpret_cast<unsigned char*>(&key) + 7 - header.prefix_length, header.prefix, header.prefix_length);
+    }
+};
+
 struct Node4Persistent
 {
     Node            header;
@@ -130,6 +368,152 @@ struct Node256LeafPersistent
     Node*           child_ptrs[256];
 };
 
+// WriteImage生成的镜像，节点按后序排列，child指针换成相对镜像开头的偏移，0表示没有child
+// 节点本身和内存中的结构完全一样，ReadOnlyArtView可以mmap之后直接在上面查找
+struct ArtImageHeader
+{
+    static const uint32_t kMagic = 0x49545241;     // "ARTI"
+    static const uint32_t kVersion = 2;
+
+    uint32_t        magic;
+    uint32_t        version;
+    uint64_t        root;           // 根节点的偏移
+    uint64_t        size;           // 整个镜像的字节数
+    uint64_t        node_count;
+    char            reserved[32];
+};
+
+// Serialize的输出，后面按层序排列节点，节点的格式是上面的Persistent结构
+// 最早的版本没有这个头，直接从根节点开始，读到这样的数据返回失败
+struct ArtStreamHeader
+{
+    static const uint32_t kMagic = 0x53545241;     // "ARTS"
+    static const uint32_t kVersion = 2;
+
+    uint32_t        magic;
+    uint32_t        version;
+};
+
+// SerializeDelta的输出，后面按先序排列，每个节点位置先写一个tag
+// kDeltaNode后面跟着节点本身和它的child，kBaseNode表示沿用上一个checkpoint里同一位置的子树
+struct ArtDeltaHeader
+{
+    static const uint32_t kMagic = 0x44545241;     // "ARTD"
+    static const uint32_t kVersion = 2;
+    static const unsigned char kDeltaNode = 1;
+    static const unsigned char kBaseNode = 2;
+
+    uint32_t        magic;
+    uint32_t        version;
+    uint64_t        sequence;       // 基准镜像之后的第几个delta，从1开始
+};
+
+// SerializeParallel的文件头，后面依次是子树目录、上层节点和各个子树
+// 上层节点是切分层以上的节点，子树是切分层上的节点，都和Serialize一样按层序排列，但是不带ArtStreamHeader
+// 开头的magic不是kMagic时按Serialize的输出读
+struct ArtParallelHeader
+{
+    static const uint32_t kMagic = 0x50545241;     // "ARTP"
+    static const uint32_t kVersion = 2;
+
+    uint32_t        magic;
+    uint32_t        version;
+    uint64_t        size;           // 整个文件的字节数
+    uint64_t        top_count;      // 上层节点的个数
+    uint64_t        top_size;
+    uint64_t        subtree_count;
+    char            reserved[24];
+};
+
+// 子树在文件中的位置
+struct ArtSubtreeEntry
+{
+    uint64_t        offset;
+    uint64_t        size;
+};
+
+// Init的选项，按位或组合
+enum ArtInitFlags
+{
+    // Insert/RangeInsert/Search/RangeQuery可以被多个线程同时调用，读不加锁，写只锁住修改的节点，
+    // 其他接口仍然需要调用者保证没有并发
+    ART_CONCURRENT = 1 << 0,
+    // value连续的叶节点按run存储
+    ART_EXTENT_LEAF = 1 << 1,
+    // key较多的叶节点用字典或者相对base的16/32位差值存储value
+    ART_PACKED_LEAF = 1 << 2,
+    // 只有一个key的叶节点只保存这个key和value，第二个key到来时再展开
+    ART_SINGLE_LEAF = 1 << 3,
+    // 节点从树自己的arena分配，内部的Node48/Node256用32位的句柄代替child指针，arena最大4G
+    ART_COMPRESSED_REFS = 1 << 4,
+};
+
+// ComputeStats里一种节点类型的统计
+struct ArtTypeStats
+{
+    uint64_t    count;
+    uint64_t    bytes;
+    uint64_t    children;       // 内部节点是child个数，叶节点是key个数
+    uint64_t    wasted_slots;   // 空着的槽位，压缩格式的叶节点按编码分配大小，不算
+    uint64_t    fill[10];       // child个数除以容量，按10%分桶，压缩格式的叶节点容量按256算
+};
+
+// 一段key区间上的节点
+struct ArtRangeStats
+{
+    uint64_t    nodes;
+    uint64_t    bytes;
+    uint64_t    keys;
+};
+
+// ComputeStats的结果，多次调用的结果会累加
+struct ArtTreeStats
+{
+    ArtTypeStats    inner[11];          // 按NodeType索引
+    ArtTypeStats    leaf[11];
+    uint64_t        levels[8];          // 每一层的节点个数，根节点在第0层
+    uint64_t        leaf_levels[8];     // 叶节点所在的层，查找一个key要访问层数加一个节点
+    uint64_t        prefix_lengths[7];
+    // 节点按key空间的下界(前缀后面补0) >> range_bits归到区间，上层节点算在它最左边的区间里
+    int             range_bits;
+    std::map<uint64_t, ArtRangeStats> ranges;
+
+    ArtTreeStats()
+    : range_bits(20)
+    {
+        memset(inner, 0, sizeof(inner));
+        memset(leaf, 0, sizeof(leaf));
+        memset(levels, 0, sizeof(levels));
+        memset(leaf_levels, 0, sizeof(leaf_levels));
+        memset(prefix_lengths, 0, sizeof(prefix_lengths));
+    }
+
+    void Merge(const ArtTreeStats& other);
+};
+
+// Compact的结果，多次调用的结果会累加
+struct ArtCompactStats
+{
+    uint64_t    nodes;              // 搬到新位置的节点
+    uint64_t    resized;            // 类型换了的节点
+    int64_t     used_reclaimed;     // MemoryUsage减少的字节
+    uint64_t    released;           // 空出来的slab还给系统的字节
+    uint64_t    passes;             // 完整遍历了几遍
+
+    ArtCompactStats()
+    {
+        memset(this, 0, sizeof(*this));
+    }
+};
+
+// [start, start + length)映射到同一个value
+struct Extent
+{
+    uint64_t        start;
+    uint32_t        length;
+    void*           val;
+};
+
 class AdaptiveRadixTree
 {
 
@@ -137,66 +521,380 @@ public:
     AdaptiveRadixTree()
     : _root(NULL),
       _used_memory(0),
-      _total_keys(0)
+      _total_keys(0),
+      _search_kernel(SSE2SearchKernel()),
+      _concurrent(false),
+      _extent_leaf(false),
+      _packed_leaf(false),
+      _single_leaf(false),
+      _compressed_refs(false),
+      _huge_pages(false),
+      _prefault_bytes(0),
+      _arena_base(NULL),
+      _parallel_build(false),
+      _checkpoint_seq(0),
+      _root_version(0),
+      _epoch(NULL),
+      _compacting(false),
+      _compact_cursor(0),
+      _stats(newStatsCollector()),
+      _latency(NULL)
     {
+        _slabs[NODE4].Init(sizeof(Node4));
+        _slabs[NODE16].Init(sizeof(Node16));
+        _slabs[NODE48].Init(sizeof(Node48));
+        _slabs[NODE256].Init(sizeof(Node256));
+        _slabs[NODE48_REF].Init(sizeof(Node48Ref));
+        _slabs[NODE256_REF].Init(sizeof(Node256Ref));
+        _slabs[NODE_EXTENT].Init(sizeof(NodeExtent));
+        _slabs[NODE_DICT].Init(sizeof(NodeDict));
+        _slabs[NODE_DELTA16].Init(sizeof(NodeDelta16));
+        _slabs[NODE_DELTA32].Init(sizeof(NodeDelta32));
+        _slabs[NODE_SINGLE].Init(sizeof(NodeSingle));
     }
 
-    void Init();
+    ~AdaptiveRadixTree()
+    {
+        Destroy();
+        delete _epoch;
+        delete _stats;
+        delete _latency;
+    }
+
+    // 根据CPU特性选择Node4/Node16的查找kernel，flags是ArtInitFlags的组合
+    // 几种压缩格式都不能和ART_CONCURRENT同时使用，这样的组合和不认识的位返回-1
+    // 调用过EnableHugePages时节点也从arena分配，arena用大页
+    // 成功返回0，ART_COMPRESSED_REFS时预留不到arena的地址空间返回-1，返回-1时树不能使用
+    // arena用完之后，ART_COMPRESSED_REFS时分配节点抛出bad_alloc，只用大页时退回普通内存
+    int Init(uint32_t flags = 0);
+
+    // 只能在第一次Init之前调用，节点内存按2M的大页提交，大页池不够时退回透明大页，
+    // 预留地址空间失败时和没有调用一样，每次Init时提前写入prefault_bytes字节，启动之后不再缺页
+    void EnableHugePages(uint64_t prefault_bytes = 0);
+
+    // 大页模式下用MAP_HUGETLB和透明大页提交的字节数
+    void HugePageBytes(uint64_t* hugetlb, uint64_t* transparent)
+    {
+        *hugetlb = _arena.HugeTlbBytes();
+        *transparent = _arena.TransparentBytes();
+    }
 
     // 插入不会失败
     void Insert(uint64_t key, void* val);
 
     void* Search(uint64_t key);
 
+    // 批量查找，out[i]对应keys[i]，多个查找交替前进，
+    // 每次访问节点之前先prefetch，让多个查找的cache miss同时进行
+    void MultiSearch(const uint64_t* keys, size_t n, void** out);
+
+    // 区间可以跨越多个叶节点，length为0时什么都不写
     void RangeInsert(uint64_t start, uint32_t length, void* val);
 
+    // vals会被重置成length个元素，不存在的key对应NULL
     void RangeQuery(uint64_t start, uint32_t length, std::vector<void*>* vals);
 
+    // 直接释放所有的slab，不需要遍历每个节点
     void Destroy();
 
-    // TODO delete
-    // void DeleteRange(uint64_t start, uint32_t length);
+    // 删除[start, start + length)，空的子树会被释放，节点按需缩小，不支持和其他接口并发
+    void DeleteRange(uint64_t start, uint32_t length);
 
+    // 存活节点占用的字节数
     uint64_t MemoryUsage()
     {
         return _used_memory;
     }
 
+    // slab向系统申请的字节数，包括free list上的空闲节点
+    uint64_t MemoryReserved()
+    {
+        return _slabs[NODE4].ReservedBytes() + _slabs[NODE16].ReservedBytes() +
+            _slabs[NODE48].ReservedBytes() + _slabs[NODE256].ReservedBytes() +
+            _slabs[NODE48_REF].ReservedBytes() + _slabs[NODE256_REF].ReservedBytes() +
+            _slabs[NODE_EXTENT].ReservedBytes() + _slabs[NODE_DICT].ReservedBytes() +
+            _slabs[NODE_DELTA16].ReservedBytes() + _slabs[NODE_DELTA32].ReservedBytes() +
+            _slabs[NODE_SINGLE].ReservedBytes();
+    }
+
     uint64_t Size()
     {
         return _total_keys;
     }
 
+    // 遍历树统计节点的结构，结果累加到stats上，不能和写操作并发
+    // 只统计key空间的下界(前缀后面补0)落在[lo, hi]里的节点，把key空间分成几段分别调用，结果加起来和一次统计整棵树相同
+    // threads大于1时把下面的子树分给多个线程
+    void ComputeStats(ArtTreeStats* stats, int threads = 1, uint64_t lo = 0, uint64_t hi = ~0ULL);
+
+    // 按key的顺序深度优先遍历，每个节点换成能放下的最小类型，复制到slab末尾新切出来的内存里，
+    // 同一种类型的节点按遍历顺序相邻，不能和其他接口并发调用
+    // budget_us为0时一次做完，否则时间用完就停在下一个叶节点之前，下次调用从这里继续
+    // 中间可以穿插其他操作，一遍做完时把空出来的slab还给系统并返回true，结果累加到stats上
+    bool Compact(ArtCompactStats* stats = NULL, uint64_t budget_us = 0);
+
+    // 所有线程计数器的和，编译时没有定义ART_ENABLE_STATS时全是0
+    ArtStats GetStats();
+
+    // 记录Search/RangeInsert/RangeQuery的耗时，每个线程每种操作每sample_every次记录一次，0表示关闭
+    // 不能和其他接口并发调用，重新打开时之前的数据清空
+    void EnableLatency(uint32_t sample_every);
+
+    // 所有线程的直方图合并之后加到out上，没有打开时不变
+    void GetLatency(LatencyOp op, LatencyHistogram* out);
+
+    // 一次性序列化到内存，buf按4K对齐，调用者用free释放，内存不够时buf为NULL、size为0
     void Serialization(void** buf, int& size);
 
     int Deserialization(const void* buf, const int bufSize);
 
+    // sink每次收到一段连续的数据，返回false时中止序列化
+    typedef std::function<bool(const char* data, size_t size)> SerializeSink;
+    // source最多读size个字节，返回读到的字节数，0表示结束，小于0表示出错
+    typedef std::function<int64_t(char* data, size_t size)> DeserializeSource;
+
+    // 和Serialization格式相同，通过固定大小的缓冲分段交给sink，不需要整个镜像的内存
+    // 成功返回写出的字节数，失败返回-1
+    int64_t Serialize(const SerializeSink& sink);
+
+    // fd可以是文件、管道或者socket，按顺序write
+    int64_t Serialize(int fd);
+
+    // 分段读取Serialize的输出，只能在空树上调用，数据不完整时释放已经恢复的节点并返回-1
+    int Deserialize(const DeserializeSource& source);
+
+    int Deserialize(int fd);
+
+    // 在第一个有足够多节点的层把树切成互不相交的子树，threads个线程分别编码，写到fd的各自位置
+    // fd需要支持pwrite，成功返回写出的字节数，也会开始一个新的checkpoint链
+    int64_t SerializeParallel(int fd, int threads);
+
+    // threads个线程分别解码各个子树再拼起来，fd需要支持pread，只能在空树上调用
+    // 文件是Serialize的输出时退回到单线程的Deserialize
+    int DeserializeParallel(int fd, int threads);
+
+    // Serialize和Deserialize都会开始一个新的checkpoint链，之后每次SerializeDelta只写出
+    // 上一个checkpoint之后修改过的节点，没有变化的子树只记一个tag，成功返回写出的字节数
+    int64_t SerializeDelta(const SerializeSink& sink);
+
+    // 按顺序应用基准镜像之后的delta，delta不完整或者顺序不对时返回-1，树保持不变
+    int ApplyDelta(const DeserializeSource& source);
+
+    // 把基准镜像和后面的delta合并成新的基准镜像，内存中只有一棵树
+    static int64_t CompactCheckpoints(const DeserializeSource& base, const std::vector<DeserializeSource>& deltas,
+        const SerializeSink& sink);
+
+    // 从按start排序、互不重叠的extent自底向上建树，每个节点一次分配成合适的类型，前缀直接算好
+    // 只能在Init之后的空树上调用，threads大于1时按key第一个不同的字节分区并行构建
+    void BulkLoad(const Extent* extents, size_t count, int threads = 1);
+
+    // 写出ReadOnlyArtView可以直接mmap的镜像，fd需要支持pwrite，成功返回0
+    int WriteImage(int fd);
+
     void DumpNode(Node* node);
 
     void DumpTree();
 
+    // 按key从小到大遍历value不为NULL的key，保存从根节点到叶节点的路径，Next/Prev均摊O(1)
+    // 树被修改之后迭代器失效，需要重新Seek，并发模式下也不能和写操作同时使用
+    class Iterator
+    {
+    public:
+        explicit Iterator(AdaptiveRadixTree* tree)
+        : _tree(tree)
+        {
+            memset(_key, 0, sizeof(_key));
+        }
+
+        bool Valid()
+        {
+            return !_stack.empty();
+        }
+
+        void SeekToFirst();
+
+        void SeekToLast();
+
+        // 定位到第一个>=key的位置
+        void Seek(uint64_t key);
+
+        // 定位到最后一个<=key的位置
+        void SeekForPrev(uint64_t key);
+
+        void Next();
+
+        void Prev();
+
+        uint64_t Key();
+
+        void* Value();
+
+    private:
+        // pos对Node4/Node16是数组下标，对Node48/Node256是key的字节
+        struct Frame
+        {
+            Node*   node;
+            int     depth;
+            int     pos;
+        };
+
+        // 槽位里的child，带tag
+        Node* childOf(Node* node, int pos);
+        void pushNode(Node* node, int depth, bool forward);
+        void pushChild(bool forward);
+        void forward();
+        void backward();
+
+        AdaptiveRadixTree*  _tree;
+        std::vector<Frame>  _stack;
+        unsigned char       _key[8];
+    };
+
 private:
+    class BulkBuilder;
+    class ImageWriter;
+    class StreamWriter;
+    class StreamReader;
+
+    uint64_t writeImageNode(const Node* node, ImageWriter* writer);
+
+    // MultiSearch里一个进行中的查找，stage表示下一步要读的内容已经prefetch过了
+    struct MultiSearchState
+    {
+        uint64_t        key;        // 字节序已经反转
+        size_t          index;
+        Node*           node;       // 带tag
+        Node**          slot;
+        int             depth;
+        int             stage;
+    };
+
+    void multiSearchStart(MultiSearchState* state, uint64_t key, size_t index);
+    bool multiSearchStep(MultiSearchState* state, void** out);
+
+    Node* makeFilledNode(int count, const unsigned char* keys, Node* const* ptrs);
+    static void fillNode(Node* node, int count, const unsigned char* keys, Node* const* ptrs);
+    Node* makeLeafNode(int count, const unsigned char* keys, Node* const* ptrs);
+    void bulkLoadRange(BulkBuilder* builder, const Extent* extents, size_t count, uint64_t lo, uint64_t hi);
+
     void insert(Node* node, Node** ref, unsigned char* key, uint32_t length, void* val, int depth);
+    Node* makeLeaf(unsigned char* key, uint32_t length, void* val, int depth);
+    void splitPrefix(Node* node, Node** ref, unsigned char* key, int p, uint32_t length, void* val, int depth);
+    void addNewChild(Node* node, Node** ref, Node** slot, unsigned char* key, uint32_t length, void* val, int depth);
+
+    void rangeInsert(Node** ref, uint64_t lo, uint64_t hi, void* val, int depth);
+    void rangeQuery(Node* node, uint64_t lo, uint64_t hi, int depth, void** vals);
+    void deleteRange(Node** ref, uint64_t lo, uint64_t hi, int depth);
+    void removeChild(Node* node, unsigned char start, uint32_t length);
+    void shrinkNode(Node* node, Node** ref);
+    void mergeChild(Node4* node4, Node** ref);
+
+    // 返回false表示读到了正在修改的节点，需要从根节点重试
+    void* searchOLC(unsigned char* key);
+    bool searchOLCOnce(unsigned char* key, void** result);
+    void rangeQueryOLC(unsigned char* key, uint32_t length, void** vals);
+    bool rangeQueryOLCOnce(unsigned char* key, uint32_t length, void** vals);
+    void insertOLC(unsigned char* key, uint32_t length, void* val);
+    bool insertOLCOnce(unsigned char* key, uint32_t length, void* val);
+    void retireNode(Node* node);
+    void releaseNode(Node* node);
+    static void reclaimNode(void* ctx, void* ptr);
 
     Node4* makeNode4();
     Node16* makeNode16();
     Node48* makeNode48();
     Node256* makeNode256();
+    Node48Ref* makeNode48Ref();
+    Node256Ref* makeNode256Ref();
+    NodeExtent* makeNodeExtent();
+    NodeDict* makeNodeDict();
+    NodeDelta16* makeNodeDelta16();
+    NodeDelta32* makeNodeDelta32();
+    NodeSingle* makeNodeSingle();
     Node* makeProperNode(uint32_t length);
+    static NodeType properType(uint32_t length);
+    // 内部节点的类型，压缩引用模式下Node48/Node256换成对应的Ref类型
+    NodeType innerType(uint32_t length);
 
     bool serializationNode(const Node* node, char* buf, int& nodeSize);
 
+    void writeStreamNode(const Node* node, StreamWriter* writer);
+    bool readStreamNode(StreamReader* reader, Node** node);
+    void serializeTree(Node* root, StreamWriter* writer);
+    bool deserializeTree(StreamReader* reader, Node** root);
+    uint64_t serializedSize(const Node* node);
+    void serializeDeltaNode(Node* node, StreamWriter* writer);
+    bool applyDeltaNode(StreamReader* reader, unsigned char* path, int depth, Node** out,
+        std::vector<Node*>* created, std::vector<Node*>* reused);
+    Node* findBaseNode(const unsigned char* path, int depth);
+    void releaseReplaced(Node* node, const std::vector<Node*>& reused);
+
+    struct StatsTask;
+    void statsNode(const StatsTask& task, uint64_t lo, uint64_t hi, ArtTreeStats* stats,
+        std::vector<StatsTask>* children);
+
+    struct CompactState;
+    // 时间用完时返回false，state->cursor是下一次开始的key
+    bool compactNode(Node** ref, int depth, uint64_t key, CompactState* state);
+    // 内容相同、类型合适的新节点替换node，返回不带tag的新节点
+    Node* relocateNode(Node* node, Node** ref);
+
     bool deserializationNode(Node** node, char** buf);
+    // 按序列化的顺序取出内部节点的child，不带tag，keys不为NULL时同时取出child对应的字节
+    int collectChildren(const Node* node, Node** children, unsigned char* keys = NULL);
+    // 把反序列化出来的第j个child挂到父节点上
+    bool attachChild(Node* parent, int j, int* cursor, Node* child);
+    // child全部挂上之后清理反序列化时的临时标记
+    void finishAttach(Node* parent);
 
     Node* makeNode(NodeType type);
 
+    void* allocNode(NodeType type);
+
     void freeNode(Node* node);
 
+    static uint32_t nodeSize(NodeType type);
+
     void addChild(Node* node, Node** ref, unsigned char byte, void* child);
     void addChild4(Node4* node, Node** ref, unsigned char byte, void* child);
     void addChild16(Node16* node, Node** ref, unsigned char byte, void* child);
     void addChild48(Node48* node, Node** ref, unsigned char byte, void* child);
     void addChild256(Node256* node, Node** ref, unsigned char byte, void* child);
+    void addChild48Ref(Node48Ref* node, Node** ref, unsigned char byte, void* child);
+    void addChild256Ref(Node256Ref* node, Node** ref, unsigned char byte, void* child);
+
+    // 压缩引用模式下带tag的指针和32位句柄互相转换，句柄0是NULL
+    Node* decodeRef(uint32_t handle) const
+    {
+        return handle == 0 ? NULL : reinterpret_cast<Node*>(_arena_base + handle);
+    }
+
+    uint32_t encodeRef(const Node* tagged) const
+    {
+        return tagged == NULL ? 0 : static_cast<uint32_t>(reinterpret_cast<const char*>(tagged) - _arena_base);
+    }
+
+    // Ref节点的槽位也当作Node**传递，最低位置1区分，只能通过childAt和storeChild访问
+    static Node** handleRef(uint32_t* slot)
+    {
+        return reinterpret_cast<Node**>(reinterpret_cast<uintptr_t>(slot) | 1);
+    }
+
+    // ref指向的槽位里带tag的child
+    Node* childAt(Node** ref) const
+    {
+        uintptr_t ptr = reinterpret_cast<uintptr_t>(ref);
+        if (ptr & 1)
+        {
+            return decodeRef(*reinterpret_cast<const uint32_t*>(ptr & ~(uintptr_t)1));
+        }
+        return *ref;
+    }
+
+    // ref是_root或者内部节点的槽位，child不带tag，写进去的时候加上
+    void storeChild(Node** ref, Node* child);
+    // Ref节点展开成内容相同的Node48/Node256写到buf，buf至少sizeof(Node256)
+    void expandRefNode(const Node* node, char* buf);
 
     Node* expandLeafChild(Node* node, uint32_t expected_size);
 
@@ -209,14 +907,46 @@ private:
     // 不需要考虑扩容
     void addLeafChildSafe(Node* node, Node** ref, unsigned char start, uint32_t length, void* val);
     Node** findChild(Node* node, unsigned char byte);
-
-    void findLeafChild(Node* node, unsigned char start, uint32_t length, std::vector<void*>* vals);
-    void findLeafChild4(Node4* node, unsigned char start, uint32_t length, std::vector<void*>* vals);
-    void findLeafChild16(Node16* node, unsigned char start, uint32_t length, std::vector<void*>* vals);
-    void findLeafChild48(Node48* node, unsigned char start, uint32_t length, std::vector<void*>* vals);
-    void findLeafChild256(Node256* node, unsigned char start, uint32_t length, std::vector<void*>* vals);
+    Node** findChild(Node* node, NodeType type, unsigned char byte);
+
+    // 放不下时返回NULL
+    Node* makeExtentLeaf(int count, const unsigned char* keys, Node* const* ptrs);
+    // val为NULL时删除，run放不下时把*ref换成普通节点
+    void setExtentRange(Node* node, Node** ref, unsigned char start, uint32_t length, void* val);
+    // 普通叶节点换成能放下的更小的压缩格式
+    void compactLeaf(Node* node, Node** ref);
+    static void findExtentChildren(const Node* node, unsigned char start, uint32_t length, void** vals);
+
+    // slots按key直接索引，空槽位是NULL，返回能放下这些value的最小的叶节点类型
+    static NodeType packedType(void* const* slots);
+    // 按packedType创建叶节点，前缀由调用者设置
+    Node* makePackedLeaf(void* const* slots);
+    // 原地修改，放不下时重新编码并替换*ref
+    void setPackedRange(Node* node, Node** ref, unsigned char start, uint32_t length, void* val);
+    void findPackedChildren(const Node* node, unsigned char start, uint32_t length, void** vals);
+
+    // header为NULL时没有前缀
+    Node* makeSingleLeaf(const Node* header, unsigned char byte, void* val);
+    // 写入其他key时展开成普通叶节点并替换*ref
+    void setSingleRange(Node* node, Node** ref, unsigned char start, uint32_t length, void* val);
+    static void findSingleChildren(const Node* node, unsigned char start, uint32_t length, void** vals);
+
+    // 压缩格式的叶节点里byte对应的value
+    static void* findCompactChild(const Node* node, unsigned char byte);
+    // 按key的顺序取出叶节点里的value，返回个数
+    static int collectLeaf(const Node* node, unsigned char* keys, Node** ptrs);
+    // 压缩格式的叶节点展开成内容相同的普通叶节点写到buf，buf至少sizeof(Node256)
+    static void expandCompactLeaf(const Node* node, char* buf);
+
+    void findLeafChild(Node* node, unsigned char start, uint32_t length, void** vals);
+    void findLeafChild4(Node4* node, unsigned char start, uint32_t length, void** vals);
+    void findLeafChild16(Node16* node, unsigned char start, uint32_t length, void** vals);
+    void findLeafChild48(Node48* node, unsigned char start, uint32_t length, void** vals);
+    void findLeafChild256(Node256* node, unsigned char start, uint32_t length, void** vals);
 
     int checkPrefix(Node* node, const unsigned char* key, int depth);
+    static StatsCollector* newStatsCollector();
+
     uint32_t maxCapacitySize(NodeType type);
 
     void destroyNode(Node* node, int depth);
@@ -227,6 +957,38 @@ private:
     uint64_t    _used_memory;
     uint64_t    _total_keys;
     uint64_t    _max_node_persistent_size;
+
+    const SearchKernel* _search_kernel;
+
+    // 按NodeType索引
+    SlabAllocator       _slabs[11];
+
+    bool                _concurrent;
+    bool                _extent_leaf;
+    bool                _packed_leaf;
+    bool                _single_leaf;
+    bool                _compressed_refs;
+    // 压缩引用模式和大页模式下所有节点的slab都从_arena分配
+    SlabArena           _arena;
+    bool                _huge_pages;
+    uint64_t            _prefault_bytes;
+    char*               _arena_base;
+    // BulkLoad多线程构建时分配节点需要加锁
+    bool                _parallel_build;
+    // 当前checkpoint链上最后一个delta的序号，基准镜像是0
+    uint64_t            _checkpoint_seq;
+    // _root指针的锁，替换根节点时相当于父节点
+    uint32_t            _root_version;
+    EpochManager*       _epoch;
+    std::mutex          _alloc_mutex;
+    // Compact搬动节点时不复用free list，新节点从slab末尾顺序分配
+    bool                _compacting;
+    // 没有做完的Compact下一次从这个key开始，0表示开始新的一遍
+    uint64_t            _compact_cursor;
+    // 没有定义ART_ENABLE_STATS时是NULL，所以头文件的布局和编译选项无关
+    StatsCollector*     _stats;
+    // 没有打开耗时记录时是NULL
+    LatencyRecorder*    _latency;
 };
 
 }
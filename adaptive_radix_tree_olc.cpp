@@ -0,0 +1,360 @@
+#include <emmintrin.h>
+#include "adaptive_radix_tree.h"
+#include "assert.h"
+
+// 乐观锁耦合(Optimistic Lock Coupling)
+// 读线程不加锁，读之前记下节点的版本号，读完之后校验版本号没有变化，否则从根节点重新开始
+// 写线程同样乐观地往下走，只在修改的时候把要修改的节点和被替换节点的父节点升级成写锁
+// 被替换掉的节点标记为obsolete，交给epoch回收
+
+namespace art
+{
+
+static const uint32_t kObsoleteBit = 1;
+static const uint32_t kLockedBit = 2;
+
+static inline uint32_t loadVersion(const uint32_t* word)
+{
+    return __atomic_load_n(word, __ATOMIC_ACQUIRE);
+}
+
+// 返回的是槽位里的原始内容，指向节点时带着tag
+static inline Node* loadChild(Node** ref)
+{
+    return __atomic_load_n(ref, __ATOMIC_ACQUIRE);
+}
+
+// 等待写锁释放，节点已经被替换时返回false
+static inline bool readLockOrRestart(const uint32_t* word, uint32_t* version)
+{
+    uint32_t v = loadVersion(word);
+    while (v & kLockedBit)
+    {
+        _mm_pause();
+        v = loadVersion(word);
+    }
+    *version = v;
+    return (v & kObsoleteBit) == 0;
+}
+
+// 读完节点的内容之后校验版本号
+static inline bool checkOrRestart(const uint32_t* word, uint32_t version)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return loadVersion(word) == version;
+}
+
+static inline bool upgradeToWriteLockOrRestart(uint32_t* word, uint32_t version)
+{
+    return __atomic_compare_exchange_n(word, &version, version | kLockedBit, false,
+            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+// 清掉locked位的同时版本号加一，obsolete位、leaf位和dirty位保留
+// 持有写锁时只有自己会修改version，计数溢出时不能进位到leaf位和dirty位
+static inline void writeUnlock(uint32_t* word)
+{
+    const uint32_t flags = kDirtyBit | kLeafBit;
+    uint32_t v = __atomic_load_n(word, __ATOMIC_RELAXED);
+    __atomic_store_n(word, ((v + kLockedBit) & ~flags) | (v & flags), __ATOMIC_RELEASE);
+}
+
+// 先锁父节点再锁子节点，任何一个失败都要放掉已经拿到的锁重新开始，所以不会死锁
+static inline bool lockPair(uint32_t* parent, uint32_t parent_version, uint32_t* node, uint32_t version)
+{
+    if (!upgradeToWriteLockOrRestart(parent, parent_version))
+    {
+        return false;
+    }
+    if (!upgradeToWriteLockOrRestart(node, version))
+    {
+        writeUnlock(parent);
+        return false;
+    }
+    return true;
+}
+
+void AdaptiveRadixTree::retireNode(Node* node)
+{
+    __atomic_fetch_or(&node->version, kObsoleteBit, __ATOMIC_RELEASE);
+    {
+        std::lock_guard<std::mutex> lock(_alloc_mutex);
+        _used_memory -= nodeSize(node->type);
+    }
+    _epoch->Retire(node);
+}
+
+void AdaptiveRadixTree::releaseNode(Node* node)
+{
+    std::lock_guard<std::mutex> lock(_alloc_mutex);
+    _slabs[node->type].Free(node);
+}
+
+void AdaptiveRadixTree::reclaimNode(void* ctx, void* ptr)
+{
+    reinterpret_cast<AdaptiveRadixTree*>(ctx)->releaseNode(reinterpret_cast<Node*>(ptr));
+}
+
+bool AdaptiveRadixTree::searchOLCOnce(unsigned char* key, void** result)
+{
+    uint32_t rv;
+    if (!readLockOrRestart(&_root_version, &rv))
+    {
+        return false;
+    }
+    Node* node = UntagNode(loadChild(&_root));
+    uint32_t v;
+    if (!readLockOrRestart(&node->version, &v) || !checkOrRestart(&_root_version, rv))
+    {
+        return false;
+    }
+
+    int depth = 0;
+    while (1)
+    {
+        ART_STAT_INC(descents);
+        if (node->prefix_length > 0)
+        {
+            int p = checkPrefix(node, key, depth);
+            if (p != node->prefix_length)
+            {
+                *result = NULL;
+                return checkOrRestart(&node->version, v);
+            }
+            depth += node->prefix_length;
+        }
+        if (depth > 7)
+        {
+            // 读到了不一致的前缀
+            return false;
+        }
+
+        Node** ref = findChild(node, key[depth]);
+        Node* next = (ref == NULL) ? NULL : loadChild(ref);
+        if (!checkOrRestart(&node->version, v))
+        {
+            return false;
+        }
+        // 叶节点的child就是value
+        if (depth == 7 || next == NULL)
+        {
+            *result = next;
+            return true;
+        }
+        next = UntagNode(next);
+
+        uint32_t nv;
+        if (!readLockOrRestart(&next->version, &nv) || !checkOrRestart(&node->version, v))
+        {
+            return false;
+        }
+        node = next;
+        v = nv;
+        depth++;
+    }
+}
+
+void* AdaptiveRadixTree::searchOLC(unsigned char* key)
+{
+    EpochGuard guard(_epoch);
+    void* result = NULL;
+    while (!searchOLCOnce(key, &result))
+    {
+    }
+    return result;
+}
+
+bool AdaptiveRadixTree::rangeQueryOLCOnce(unsigned char* key, uint32_t length, void** vals)
+{
+    uint32_t rv;
+    if (!readLockOrRestart(&_root_version, &rv))
+    {
+        return false;
+    }
+    Node* node = UntagNode(loadChild(&_root));
+    uint32_t v;
+    if (!readLockOrRestart(&node->version, &v) || !checkOrRestart(&_root_version, rv))
+    {
+        return false;
+    }
+
+    int depth = 0;
+    while (1)
+    {
+        ART_STAT_INC(descents);
+        if (node->prefix_length > 0)
+        {
+            int p = checkPrefix(node, key, depth);
+            if (p != node->prefix_length)
+            {
+                return checkOrRestart(&node->version, v);
+            }
+            depth += node->prefix_length;
+        }
+        if (depth > 7)
+        {
+            return false;
+        }
+
+        if (depth == 7)
+        {
+            findLeafChild(node, key[7], length, vals);
+            return checkOrRestart(&node->version, v);
+        }
+
+        Node** ref = findChild(node, key[depth]);
+        Node* next = (ref == NULL) ? NULL : UntagNode(loadChild(ref));
+        if (!checkOrRestart(&node->version, v))
+        {
+            return false;
+        }
+        if (next == NULL)
+        {
+            return true;
+        }
+
+        uint32_t nv;
+        if (!readLockOrRestart(&next->version, &nv) || !checkOrRestart(&node->version, v))
+        {
+            return false;
+        }
+        node = next;
+        v = nv;
+        depth++;
+    }
+}
+
+// vals调用前已经填成NULL，失败重试时要清掉上一次读到的值
+void AdaptiveRadixTree::rangeQueryOLC(unsigned char* key, uint32_t length, void** vals)
+{
+    EpochGuard guard(_epoch);
+    while (!rangeQueryOLCOnce(key, length, vals))
+    {
+        memset(vals, 0, length * sizeof(void*));
+    }
+}
+
+bool AdaptiveRadixTree::insertOLCOnce(unsigned char* key, uint32_t length, void* val)
+{
+    // 根节点的父节点是_root指针本身
+    uint32_t* parent_version = &_root_version;
+    uint32_t pv;
+    if (!readLockOrRestart(parent_version, &pv))
+    {
+        return false;
+    }
+    Node** ref = &_root;
+    Node* node = UntagNode(loadChild(ref));
+    uint32_t v;
+    if (!readLockOrRestart(&node->version, &v) || !checkOrRestart(parent_version, pv))
+    {
+        return false;
+    }
+
+    int depth = 0;
+    while (1)
+    {
+        ART_STAT_INC(descents);
+        // 路径上的节点都要标记成dirty，和其他写线程修改同一个节点头需要持有写锁
+        // 每个checkpoint周期里每个节点只会标记一次，标记完从根节点重新开始
+        if ((v & kDirtyBit) == 0)
+        {
+            if (upgradeToWriteLockOrRestart(&node->version, v))
+            {
+                __atomic_fetch_or(&node->version, kDirtyBit, __ATOMIC_RELAXED);
+                writeUnlock(&node->version);
+            }
+            return false;
+        }
+
+        if (node->prefix_length > 0 && depth < 7)
+        {
+            int p = checkPrefix(node, key, depth);
+            if (p != node->prefix_length)
+            {
+                // key不在树里，写入NULL不需要建叶节点
+                if (val == NULL)
+                {
+                    return checkOrRestart(&node->version, v);
+                }
+                // 分裂会修改node的前缀，并且替换父节点里的指针
+                if (!lockPair(parent_version, pv, &node->version, v))
+                {
+                    return false;
+                }
+                splitPrefix(node, ref, key, p, length, val, depth);
+                writeUnlock(&node->version);
+                writeUnlock(parent_version);
+                return true;
+            }
+            depth += node->prefix_length;
+        }
+        if (depth > 7)
+        {
+            return false;
+        }
+
+        if (depth == 7)
+        {
+            // 放不下时叶节点会被替换成更大的节点，需要同时锁住父节点
+            bool grow = node->type != NODE256 && node->child_count + length > maxCapacitySize(node->type);
+            if (grow ? !lockPair(parent_version, pv, &node->version, v) : !upgradeToWriteLockOrRestart(&node->version, v))
+            {
+                return false;
+            }
+            addLeafChild(node, ref, key[7], length, val);
+            writeUnlock(&node->version);
+            if (grow)
+            {
+                writeUnlock(parent_version);
+            }
+            return true;
+        }
+
+        Node** next = findChild(node, key[depth]);
+        Node* child = (next == NULL) ? NULL : UntagNode(loadChild(next));
+        if (child == NULL)
+        {
+            if (val == NULL)
+            {
+                return checkOrRestart(&node->version, v);
+            }
+            // 没有空位的时候addChild会把node换成更大的节点
+            bool grow = next == NULL && node->child_count >= maxCapacitySize(node->type);
+            if (grow ? !lockPair(parent_version, pv, &node->version, v) : !upgradeToWriteLockOrRestart(&node->version, v))
+            {
+                return false;
+            }
+            addNewChild(node, ref, next, key, length, val, depth);
+            writeUnlock(&node->version);
+            if (grow)
+            {
+                writeUnlock(parent_version);
+            }
+            return true;
+        }
+
+        uint32_t cv;
+        if (!checkOrRestart(&node->version, v) || !readLockOrRestart(&child->version, &cv) ||
+            !checkOrRestart(&node->version, v))
+        {
+            return false;
+        }
+        parent_version = &node->version;
+        pv = v;
+        ref = next;
+        node = child;
+        v = cv;
+        depth++;
+    }
+}
+
+void AdaptiveRadixTree::insertOLC(unsigned char* key, uint32_t length, void* val)
+{
+    EpochGuard guard(_epoch);
+    while (!insertOLCOnce(key, length, val))
+    {
+    }
+}
+
+}
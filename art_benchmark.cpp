@@ -0,0 +1,1112 @@
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <algorithm>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "benchmark/benchmark.h"
+// BM_SearchDispatch要和按节点头分派的下降对比，需要访问内部的查找函数
+#define private public
+#include "adaptive_radix_tree.h"
+#include "write_ahead_log.h"
+#undef private
+
+// bazel run --config=bench //:art_benchmark
+// 每次迭代是一个操作，Time列就是ns/op，Serialization/Deserialization按ms显示
+// keys/s按操作覆盖的key个数计算，bytes/key是MemoryUsage()除以树里的key个数
+
+using namespace art;
+
+namespace
+{
+
+// 1T的卷，一个LBA是4K
+static const uint64_t kVolumeLbas = 1ULL << 28;
+// 查询类的测试预先写入的key个数，写入时每个区间16个key
+static const uint64_t kPopulateKeys = 1 << 20;
+static const uint32_t kPopulateLength = 16;
+// RangeInsert写入的key超过这个数就换一棵空树，避免长时间运行之后内存无限增长
+static const uint64_t kMaxInsertKeys = 1 << 22;
+// 交错的顺序流之间的距离，4M
+static const uint64_t kStride = 1024;
+// 统计结构用的树，随机写入的64位key
+static const uint64_t kStatsKeys = 1 << 22;
+// 碎片化的树，先写入再删掉大部分区间，留下很多偏大的节点
+static const uint64_t kFragmentRanges = 1 << 18;
+// 大页对比用的树，随机写入，节点分散在将近200M的内存里，远超过dTLB能覆盖的范围
+static const uint64_t kTlbKeys = 1 << 23;
+// 跨8个叶节点的区间，对比一次下降和按叶节点拆开
+static const uint32_t kWideExtentLength = 2048;
+static const uint64_t kWideExtents = 1 << 11;
+// 顺序写满的树，对比Iterator和RangeQuery的扫描
+static const uint64_t kScanKeys = 1 << 24;
+// BulkLoad的输入，排好序的区间
+static const int kBulkExtents = 200000;
+// 每次迭代写入的记录数，按线程数均分
+static const int kWalInserts = 2000;
+// 按tag和按节点头分派的对比，以及压缩句柄的树，都远大于cache
+static const uint64_t kDispatchKeys = 1 << 23;
+static const uint64_t kRefKeys = 1 << 22;
+
+enum Distribution
+{
+    SEQUENTIAL = 0,
+    RANDOM = 1,
+    STRIDED = 2,
+    ZIPFIAN = 3
+};
+
+const char* distributionName(int dist)
+{
+    switch (dist)
+    {
+        case SEQUENTIAL:
+            return "sequential";
+        case RANDOM:
+            return "random";
+        case STRIDED:
+            return "strided";
+        case ZIPFIAN:
+            return "zipfian";
+    }
+    return "unknown";
+}
+
+// YCSB的zipfian生成器，返回[0, items)里的排名，0最热
+class ZipfianGenerator
+{
+public:
+    ZipfianGenerator(uint64_t items, double theta)
+    : _items(items),
+      _theta(theta)
+    {
+        double zeta2 = 1.0 + pow(0.5, theta);
+        _zetan = 0;
+        for (uint64_t i = 1; i <= items; i++)
+        {
+            _zetan += 1.0 / pow((double)i, theta);
+        }
+        _alpha = 1.0 / (1.0 - theta);
+        _eta = (1.0 - pow(2.0 / items, 1.0 - theta)) / (1.0 - zeta2 / _zetan);
+    }
+
+    uint64_t Next(std::mt19937_64* rng)
+    {
+        double u = std::uniform_real_distribution<double>(0.0, 1.0)(*rng);
+        double uz = u * _zetan;
+        if (uz < 1.0)
+        {
+            return 0;
+        }
+        if (uz < 1.0 + pow(0.5, _theta))
+        {
+            return 1;
+        }
+        uint64_t rank = (uint64_t)(_items * pow(_eta * u - _eta + 1.0, _alpha));
+        return std::min(rank, _items - 1);
+    }
+
+private:
+    uint64_t    _items;
+    double      _theta;
+    double      _zetan;
+    double      _alpha;
+    double      _eta;
+};
+
+// 按分布生成长度为length的区间的起始LBA
+class LbaGenerator
+{
+public:
+    LbaGenerator(int dist, uint32_t length, uint64_t seed)
+    : _dist(dist),
+      _length(length),
+      _cursor(0),
+      _rng(seed)
+    {
+    }
+
+    uint64_t Next()
+    {
+        uint64_t last = kVolumeLbas - _length;
+        switch (_dist)
+        {
+            case SEQUENTIAL:
+            {
+                uint64_t start = _cursor;
+                _cursor = _cursor + _length > last ? 0 : _cursor + _length;
+                return start;
+            }
+            case RANDOM:
+            {
+                return _rng() % last;
+            }
+            case STRIDED:
+            {
+                // 多个顺序流交错写，每个流之间隔kStride，到了卷的末尾从下一个位置开始新的一轮
+                uint64_t start = _cursor;
+                _cursor += std::max<uint64_t>(kStride, _length);
+                if (_cursor > last)
+                {
+                    _cursor = (start % kStride + _length) % kStride;
+                }
+                return start;
+            }
+            case ZIPFIAN:
+            {
+                // 热点按256个LBA的块分布，排名乘一个奇数打散到整个卷
+                static ZipfianGenerator zipf(kVolumeLbas / 256, 0.99);
+                uint64_t chunk = (zipf.Next(&_rng) * 0x9E3779B97F4A7C15ULL) % (kVolumeLbas / 256);
+                return std::min(chunk * 256 + _rng() % 256, last);
+            }
+        }
+        return 0;
+    }
+
+private:
+    int             _dist;
+    uint32_t        _length;
+    uint64_t        _cursor;
+    std::mt19937_64 _rng;
+};
+
+// 一个LBA对应一个8字节的位置
+void* locationOf(uint64_t lba)
+{
+    return reinterpret_cast<void*>((lba << 12) | 1);
+}
+
+uint64_t countKeys(AdaptiveRadixTree* art)
+{
+    uint64_t count = 0;
+    AdaptiveRadixTree::Iterator iter(art);
+    for (iter.SeekToFirst(); iter.Valid(); iter.Next())
+    {
+        count++;
+    }
+    return count;
+}
+
+// 预先写好的树，同一个分布的所有测试共用
+struct Populated
+{
+    AdaptiveRadixTree   art;
+    std::vector<uint64_t> starts;
+    uint64_t            keys;
+};
+
+Populated* populated(int dist)
+{
+    static Populated* trees[4] = {NULL, NULL, NULL, NULL};
+    if (trees[dist] == NULL)
+    {
+        Populated* p = new Populated;
+        p->art.Init();
+        LbaGenerator gen(dist, kPopulateLength, 1);
+        for (uint64_t i = 0; i < kPopulateKeys / kPopulateLength; i++)
+        {
+            uint64_t start = gen.Next();
+            p->art.RangeInsert(start, kPopulateLength, locationOf(start));
+            p->starts.push_back(start);
+        }
+        p->keys = countKeys(&p->art);
+        trees[dist] = p;
+    }
+    return trees[dist];
+}
+
+void setCounters(benchmark::State& state, uint64_t keys, uint64_t memory, uint64_t treeKeys)
+{
+    state.counters["keys/s"] = benchmark::Counter(keys, benchmark::Counter::kIsRate);
+    state.counters["bytes/key"] = treeKeys == 0 ? 0 : memory / (double)treeKeys;
+    state.SetLabel(distributionName(state.range(0)));
+}
+
+// 单个key的查找，key在预先写入的区间里
+void BM_Search(benchmark::State& state)
+{
+    Populated* p = populated(state.range(0));
+    size_t n = p->starts.size();
+    uint64_t i = 0;
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(p->art.Search(p->starts[i % n] + i % kPopulateLength));
+        i++;
+    }
+    setCounters(state, state.iterations(), p->art.MemoryUsage(), p->keys);
+}
+
+void BM_RangeQuery(benchmark::State& state)
+{
+    Populated* p = populated(state.range(0));
+    uint32_t length = state.range(1);
+    size_t n = p->starts.size();
+    std::vector<void*> vals;
+    uint64_t i = 0;
+    for (auto _ : state)
+    {
+        p->art.RangeQuery(p->starts[i % n], length, &vals);
+        benchmark::DoNotOptimize(vals.data());
+        i++;
+    }
+    setCounters(state, state.iterations() * length, p->art.MemoryUsage(), p->keys);
+}
+
+// 从空树开始写，写入的key太多时换一棵空树
+void BM_RangeInsert(benchmark::State& state)
+{
+    uint32_t length = state.range(1);
+    LbaGenerator gen(state.range(0), length, 2);
+    AdaptiveRadixTree* art = new AdaptiveRadixTree;
+    art->Init();
+    uint64_t inserted = 0;
+    for (auto _ : state)
+    {
+        uint64_t start = gen.Next();
+        art->RangeInsert(start, length, locationOf(start));
+        inserted += length;
+        if (inserted >= kMaxInsertKeys)
+        {
+            state.PauseTiming();
+            art->Destroy();
+            art->Init();
+            inserted = 0;
+            state.ResumeTiming();
+        }
+    }
+    setCounters(state, state.iterations() * length, art->MemoryUsage(), countKeys(art));
+    art->Destroy();
+    delete art;
+}
+
+// 只数当前线程用户态的事件，perf_event_paranoid不允许或者硬件不支持时Valid()是false
+class PerfCounter
+{
+public:
+    PerfCounter(uint32_t type, uint64_t config)
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        _fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+
+    ~PerfCounter()
+    {
+        if (_fd >= 0)
+        {
+            close(_fd);
+        }
+    }
+
+    bool Valid()
+    {
+        return _fd >= 0;
+    }
+
+    void Start()
+    {
+        ioctl(_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    uint64_t Stop()
+    {
+        ioctl(_fd, PERF_EVENT_IOC_DISABLE, 0);
+        uint64_t count = 0;
+        return read(_fd, &count, sizeof(count)) == sizeof(count) ? count : 0;
+    }
+
+private:
+    int _fd;
+};
+
+// pages为0时节点用posix_memalign分配的slab，1时用大页，2时大页并且Init时提前写入256M
+AdaptiveRadixTree* tlbTree(int pages)
+{
+    static AdaptiveRadixTree* trees[3] = {NULL, NULL, NULL};
+    if (trees[pages] == NULL)
+    {
+        AdaptiveRadixTree* art = new AdaptiveRadixTree;
+        if (pages > 0)
+        {
+            art->EnableHugePages(pages == 2 ? 256 << 20 : 0);
+        }
+        art->Init();
+        std::mt19937_64 rng(3);
+        for (uint64_t i = 0; i < kTlbKeys; i++)
+        {
+            uint64_t lba = rng() % kVolumeLbas;
+            art->Insert(lba, locationOf(lba));
+        }
+        trees[pages] = art;
+    }
+    return trees[pages];
+}
+
+// 随机的单key查找，每次都要从根节点走到一个不在cache里的叶节点，对比4K页和大页的dTLB miss
+void BM_SearchPages(benchmark::State& state)
+{
+    AdaptiveRadixTree* art = tlbTree(state.range(0));
+    std::mt19937_64 rng(4);
+    std::vector<uint64_t> keys(1 << 20);
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        keys[i] = rng() % kVolumeLbas;
+    }
+    PerfCounter loadMisses(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+        (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    if (loadMisses.Valid())
+    {
+        loadMisses.Start();
+    }
+    uint64_t i = 0;
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(art->Search(keys[i & (keys.size() - 1)]));
+        i++;
+    }
+    if (loadMisses.Valid())
+    {
+        state.counters["dtlb_misses/op"] = loadMisses.Stop() / (double)state.iterations();
+    }
+    uint64_t hugetlb = 0;
+    uint64_t transparent = 0;
+    art->HugePageBytes(&hugetlb, &transparent);
+    state.counters["hugetlb_MB"] = hugetlb >> 20;
+    state.counters["thp_MB"] = transparent >> 20;
+    state.counters["bytes/key"] = art->MemoryUsage() / (double)kTlbKeys;
+    const char* labels[] = {"4k", "huge", "huge_prefault"};
+    state.SetLabel(std::string(labels[state.range(0)]) + (loadMisses.Valid() ? "" : " no_perf_event"));
+}
+
+// 树远超过LLC，每次迭代查找64个已有的随机key，multi为1时整批交给MultiSearch，为0时逐个Search
+void BM_MultiSearch(benchmark::State& state)
+{
+    static const size_t kBatch = 64;
+    AdaptiveRadixTree* art = tlbTree(0);
+    // 和tlbTree用同一个种子，生成的是树里已有的key
+    std::mt19937_64 rng(3);
+    std::vector<uint64_t> keys(1 << 20);
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        keys[i] = rng() % kVolumeLbas;
+    }
+    std::shuffle(keys.begin(), keys.end(), std::mt19937(7));
+    std::vector<void*> out(kBatch);
+    uint64_t i = 0;
+    for (auto _ : state)
+    {
+        const uint64_t* batch = &keys[i & (keys.size() - 1)];
+        if (state.range(0))
+        {
+            art->MultiSearch(batch, kBatch, &out[0]);
+        }
+        else
+        {
+            for (size_t j = 0; j < kBatch; j++)
+            {
+                out[j] = art->Search(batch[j]);
+            }
+        }
+        benchmark::DoNotOptimize(out.data());
+        i += kBatch;
+    }
+    state.counters["keys/s"] = benchmark::Counter(state.iterations() * (double)kBatch, benchmark::Counter::kIsRate);
+    state.counters["bytes/key"] = art->MemoryUsage() / (double)kTlbKeys;
+}
+
+// 按叶节点把[start, start + length)拆开，每一块单独调用
+template <typename Fn>
+void forEachChunk(uint64_t start, uint32_t length, Fn fn)
+{
+    uint64_t end = start + length;
+    while (start < end)
+    {
+        uint32_t n = std::min<uint64_t>(end - start, 256 - start % 256);
+        fn(start, n);
+        start += n;
+    }
+}
+
+// 每次迭代写一个2048个key的区间，chunked为1时调用方按叶节点拆成多次RangeInsert
+void BM_WideExtentInsert(benchmark::State& state)
+{
+    std::mt19937_64 rng(8);
+    AdaptiveRadixTree* art = new AdaptiveRadixTree;
+    art->Init();
+    uint64_t inserted = 0;
+    for (auto _ : state)
+    {
+        uint64_t start = rng() % (kVolumeLbas - kWideExtentLength);
+        if (state.range(0))
+        {
+            forEachChunk(start, kWideExtentLength, [art, start](uint64_t cursor, uint32_t n) {
+                art->RangeInsert(cursor, n, locationOf(start));
+            });
+        }
+        else
+        {
+            art->RangeInsert(start, kWideExtentLength, locationOf(start));
+        }
+        inserted += kWideExtentLength;
+        if (inserted >= kMaxInsertKeys)
+        {
+            state.PauseTiming();
+            art->Destroy();
+            art->Init();
+            inserted = 0;
+            state.ResumeTiming();
+        }
+    }
+    state.counters["keys/s"] = benchmark::Counter(state.iterations() * (double)kWideExtentLength,
+        benchmark::Counter::kIsRate);
+    art->Destroy();
+    delete art;
+}
+
+void BM_WideExtentQuery(benchmark::State& state)
+{
+    static AdaptiveRadixTree* art = NULL;
+    static std::vector<uint64_t> starts;
+    if (art == NULL)
+    {
+        art = new AdaptiveRadixTree;
+        art->Init();
+        std::mt19937_64 rng(9);
+        for (uint64_t i = 0; i < kWideExtents; i++)
+        {
+            starts.push_back(rng() % (kVolumeLbas - kWideExtentLength));
+            art->RangeInsert(starts.back(), kWideExtentLength, locationOf(starts.back()));
+        }
+    }
+    std::vector<void*> vals;
+    std::vector<void*> chunk;
+    uint64_t i = 0;
+    for (auto _ : state)
+    {
+        uint64_t start = starts[i++ % kWideExtents];
+        if (state.range(0))
+        {
+            vals.clear();
+            forEachChunk(start, kWideExtentLength, [&](uint64_t cursor, uint32_t n) {
+                art->RangeQuery(cursor, n, &chunk);
+                vals.insert(vals.end(), chunk.begin(), chunk.end());
+            });
+        }
+        else
+        {
+            art->RangeQuery(start, kWideExtentLength, &vals);
+        }
+        benchmark::DoNotOptimize(vals.data());
+    }
+    state.counters["keys/s"] = benchmark::Counter(state.iterations() * (double)kWideExtentLength,
+        benchmark::Counter::kIsRate);
+}
+
+// 每次迭代扫一遍整棵树，iterator为1时用Iterator逐个key，为0时每次RangeQuery一个叶节点
+void BM_Scan(benchmark::State& state)
+{
+    static AdaptiveRadixTree* art = NULL;
+    if (art == NULL)
+    {
+        art = new AdaptiveRadixTree;
+        art->Init();
+        for (uint64_t start = 0; start < kScanKeys; start += 256)
+        {
+            art->RangeInsert(start, 256, locationOf(start));
+        }
+    }
+    std::vector<void*> vals;
+    uint64_t keys = 0;
+    for (auto _ : state)
+    {
+        keys = 0;
+        if (state.range(0))
+        {
+            AdaptiveRadixTree::Iterator iter(art);
+            for (iter.SeekToFirst(); iter.Valid(); iter.Next())
+            {
+                keys++;
+            }
+        }
+        else
+        {
+            for (uint64_t start = 0; start < kScanKeys; start += 256)
+            {
+                art->RangeQuery(start, 256, &vals);
+                keys += vals.size();
+            }
+        }
+    }
+    state.counters["keys/s"] = benchmark::Counter(state.iterations() * (double)keys, benchmark::Counter::kIsRate);
+}
+
+// 排好序的区间，spread控制区间之间的距离
+std::vector<Extent> sortedExtents(int count, uint64_t spread)
+{
+    std::mt19937_64 rng(10);
+    std::vector<Extent> extents;
+    uint64_t cursor = rng() % 1000;
+    for (int i = 0; i < count; i++)
+    {
+        Extent extent;
+        extent.start = cursor;
+        extent.length = 1 + rng() % (i % 16 == 0 ? 3000 : 64);
+        extent.val = locationOf(cursor);
+        extents.push_back(extent);
+        cursor += extent.length + (rng() % 4 == 0 ? 0 : rng() % spread);
+    }
+    return extents;
+}
+
+// 每次迭代建一棵新树，threads为0时逐个RangeInsert作为对照
+void BM_BulkLoad(benchmark::State& state)
+{
+    static std::vector<Extent> extents = sortedExtents(kBulkExtents, 1 << 12);
+    uint64_t keys = 0;
+    for (size_t i = 0; i < extents.size(); i++)
+    {
+        keys += extents[i].length;
+    }
+    uint64_t memory = 0;
+    for (auto _ : state)
+    {
+        AdaptiveRadixTree* art = new AdaptiveRadixTree;
+        art->Init();
+        if (state.range(0) == 0)
+        {
+            for (size_t i = 0; i < extents.size(); i++)
+            {
+                art->RangeInsert(extents[i].start, extents[i].length, extents[i].val);
+            }
+        }
+        else
+        {
+            art->BulkLoad(&extents[0], extents.size(), state.range(0));
+        }
+        state.PauseTiming();
+        memory = art->MemoryUsage();
+        art->Destroy();
+        delete art;
+        state.ResumeTiming();
+    }
+    state.counters["keys/s"] = benchmark::Counter(state.iterations() * (double)keys, benchmark::Counter::kIsRate);
+    state.counters["bytes/key"] = memory / (double)keys;
+}
+
+// 每次迭代提交一批batch个区间，一批一次fdatasync
+void BM_WalBatch(benchmark::State& state)
+{
+    const char* path = "./art_wal_bench";
+    unlink(path);
+    AdaptiveRadixTree* art = new AdaptiveRadixTree;
+    art->Init();
+    WriteAheadLog* wal = new WriteAheadLog(art);
+    if (wal->Open(path) != 0)
+    {
+        state.SkipWithError("open wal failed");
+        delete wal;
+        delete art;
+        return;
+    }
+    int batch = state.range(0);
+    std::vector<Extent> extents(batch);
+    uint64_t next = 0;
+    for (auto _ : state)
+    {
+        for (int j = 0; j < batch; j++)
+        {
+            extents[j].start = next * 64;
+            extents[j].length = 32;
+            extents[j].val = locationOf(next);
+            next++;
+        }
+        if (wal->RangeInsertBatch(&extents[0], batch) != 0)
+        {
+            state.SkipWithError("wal write failed");
+            break;
+        }
+    }
+    state.counters["inserts/s"] = benchmark::Counter(state.iterations() * (double)batch, benchmark::Counter::kIsRate);
+    state.counters["syncs/insert"] = wal->SyncCount() / std::max(1.0, (double)next);
+    delete wal;
+    art->Destroy();
+    delete art;
+    unlink(path);
+}
+
+// 单条写入，靠并发的线程自然形成批次，每次迭代所有线程一共写kWalInserts条
+void BM_WalThreads(benchmark::State& state)
+{
+    const char* path = "./art_wal_bench";
+    unlink(path);
+    AdaptiveRadixTree* art = new AdaptiveRadixTree;
+    art->Init();
+    WriteAheadLog* wal = new WriteAheadLog(art);
+    if (wal->Open(path) != 0)
+    {
+        state.SkipWithError("open wal failed");
+        delete wal;
+        delete art;
+        return;
+    }
+    int count = state.range(0);
+    int perThread = kWalInserts / count;
+    uint64_t round = 0;
+    for (auto _ : state)
+    {
+        std::vector<std::thread> threads;
+        for (int t = 0; t < count; t++)
+        {
+            threads.push_back(std::thread([wal, t, perThread, round]() {
+                for (int i = 0; i < perThread; i++)
+                {
+                    uint64_t key = round << 40 | (uint64_t)t << 32 | i;
+                    wal->Insert(key, locationOf(key));
+                }
+            }));
+        }
+        for (int t = 0; t < count; t++)
+        {
+            threads[t].join();
+        }
+        round++;
+    }
+    double inserts = state.iterations() * (double)perThread * count;
+    state.counters["inserts/s"] = benchmark::Counter(inserts, benchmark::Counter::kIsRate);
+    state.counters["syncs/insert"] = wal->SyncCount() / std::max(1.0, inserts);
+    delete wal;
+    art->Destroy();
+    delete art;
+    unlink(path);
+}
+
+// 每次迭代写出再读回整棵树，两边用同样的线程数
+void BM_SerializeParallel(benchmark::State& state)
+{
+    static AdaptiveRadixTree* art = NULL;
+    if (art == NULL)
+    {
+        std::vector<Extent> extents = sortedExtents(100000, 16);
+        art = new AdaptiveRadixTree;
+        art->Init();
+        art->BulkLoad(&extents[0], extents.size());
+    }
+    const char* path = "./art_parallel_bench";
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    int threads = state.range(0);
+    int64_t size = 0;
+    uint64_t serialize = 0;
+    uint64_t deserialize = 0;
+    for (auto _ : state)
+    {
+        uint64_t start = CycleClock::Now();
+        size = art->SerializeParallel(fd, threads);
+        uint64_t mid = CycleClock::Now();
+        AdaptiveRadixTree* loaded = new AdaptiveRadixTree;
+        int ret = loaded->DeserializeParallel(fd, threads);
+        uint64_t end = CycleClock::Now();
+        serialize += mid - start;
+        deserialize += end - mid;
+        state.PauseTiming();
+        loaded->Destroy();
+        delete loaded;
+        state.ResumeTiming();
+        if (size < 0 || ret != 0)
+        {
+            state.SkipWithError("serialize failed");
+            break;
+        }
+    }
+    close(fd);
+    unlink(path);
+    state.counters["serialize_ms"] = CycleClock::ToNanos(serialize) / 1e6 / std::max<int64_t>(state.iterations(), 1);
+    state.counters["deserialize_ms"] = CycleClock::ToNanos(deserialize) / 1e6 / std::max<int64_t>(state.iterations(), 1);
+    state.SetBytesProcessed(state.iterations() * size);
+}
+
+// 三种压缩叶节点各自针对的负载
+enum LeafWorkload
+{
+    EXTENT_WORKLOAD = 0,    // 顺序写入，value是连续的块地址
+    PACKED_WORKLOAD = 1,    // value的高位相同，一半顺序分配，一半在1GB的范围内随机
+    SINGLE_WORKLOAD = 2     // key互相离得很远，大部分叶节点只有一个key
+};
+
+struct LeafTree
+{
+    AdaptiveRadixTree       art;
+    // SINGLE_WORKLOAD写入的key，其他负载写满[0, keys.size())
+    std::vector<uint64_t>   keys;
+    uint64_t                count;
+};
+
+void buildLeafTree(LeafTree* tree, int workload, bool compact)
+{
+    const uint32_t flags[] = {ART_EXTENT_LEAF, ART_PACKED_LEAF, ART_SINGLE_LEAF};
+    tree->art.Init(compact ? flags[workload] : 0);
+    std::mt19937_64 rng(11);
+    if (workload == EXTENT_WORKLOAD)
+    {
+        const uint64_t count = 1 << 22;
+        for (uint64_t i = 0; i < count; i += 64)
+        {
+            tree->art.RangeInsert(i, 64, (void*)(0x100000 + (i / 1024) * 4096));
+        }
+        for (uint64_t i = count; i < 2 * count; i++)
+        {
+            tree->art.Insert(i, (void*)(0x100000 + i * 4096));
+        }
+        tree->count = 2 * count;
+    }
+    else if (workload == PACKED_WORKLOAD)
+    {
+        const uint64_t count = 1 << 22;
+        for (uint64_t i = 0; i < count; i++)
+        {
+            uint64_t block = i < count / 2 ? ((i * 13) & 0xFFFF) : rng() % (1 << 27);
+            tree->art.Insert(i, (void*)(0x7F0000000000UL + block * 8));
+        }
+        tree->count = count;
+    }
+    else
+    {
+        tree->keys.resize(1 << 20);
+        for (size_t i = 0; i < tree->keys.size(); i++)
+        {
+            tree->keys[i] = rng();
+            tree->art.Insert(tree->keys[i], (void*)(i + 1));
+        }
+        tree->count = tree->keys.size();
+    }
+}
+
+const char* kLeafLabels[] = {"extent", "packed", "single"};
+
+// 每次迭代按负载建一棵树，compact为1时打开对应的压缩叶节点
+void BM_LeafFormatBuild(benchmark::State& state)
+{
+    uint64_t memory = 0;
+    uint64_t count = 0;
+    for (auto _ : state)
+    {
+        LeafTree* tree = new LeafTree;
+        buildLeafTree(tree, state.range(0), state.range(1) != 0);
+        state.PauseTiming();
+        memory = tree->art.MemoryUsage();
+        count = tree->count;
+        tree->art.Destroy();
+        delete tree;
+        state.ResumeTiming();
+    }
+    state.counters["keys/s"] = benchmark::Counter(state.iterations() * (double)count, benchmark::Counter::kIsRate);
+    state.counters["bytes/key"] = memory / (double)count;
+    state.SetLabel(kLeafLabels[state.range(0)]);
+}
+
+// extent和packed每次迭代RangeQuery 4096个key，single每次Search一个存在或者相邻的key
+void BM_LeafFormatQuery(benchmark::State& state)
+{
+    static LeafTree* trees[3][2];
+    int workload = state.range(0);
+    int compact = state.range(1) != 0;
+    if (trees[workload][compact] == NULL)
+    {
+        trees[workload][compact] = new LeafTree;
+        buildLeafTree(trees[workload][compact], workload, compact);
+    }
+    LeafTree* tree = trees[workload][compact];
+    std::vector<void*> vals;
+    uint64_t i = 0;
+    uint64_t keys = 0;
+    for (auto _ : state)
+    {
+        if (workload == SINGLE_WORKLOAD)
+        {
+            benchmark::DoNotOptimize(tree->art.Search(tree->keys[i % tree->keys.size()] + (i & 1)));
+            keys++;
+        }
+        else
+        {
+            tree->art.RangeQuery(i * 4096 % tree->count, 4096, &vals);
+            benchmark::DoNotOptimize(vals.data());
+            keys += 4096;
+        }
+        i++;
+    }
+    state.counters["keys/s"] = benchmark::Counter(keys, benchmark::Counter::kIsRate);
+    state.counters["bytes/key"] = tree->art.MemoryUsage() / (double)tree->count;
+    state.SetLabel(kLeafLabels[workload]);
+}
+
+// 不用指针里的tag，每一层都要先读子节点的节点头才知道怎么查找
+void* headerSearch(AdaptiveRadixTree* art, uint64_t key)
+{
+    uint64_t reverse = __builtin_bswap64(key);
+    unsigned char* data = reinterpret_cast<unsigned char*>(&reverse);
+    Node* node = UntagNode(art->_root);
+    int depth = 0;
+    while (node && depth < 8)
+    {
+        if (node->prefix_length > 0)
+        {
+            if (art->checkPrefix(node, data, depth) != node->prefix_length)
+            {
+                return NULL;
+            }
+            depth += node->prefix_length;
+        }
+        Node** ref = art->findChild(node, data[depth]);
+        node = ref == NULL ? NULL : *ref;
+        // 叶节点的槽位里是value
+        if (depth < 7)
+        {
+            node = UntagNode(node);
+        }
+        depth++;
+    }
+    return node;
+}
+
+// 树远大于cache，打乱顺序查找，每一层都是cache miss，dense为1时key是连续的3的倍数
+void BM_SearchDispatch(benchmark::State& state)
+{
+    static AdaptiveRadixTree* trees[2] = {NULL, NULL};
+    static std::vector<uint64_t> keys[2];
+    int dense = state.range(0);
+    if (trees[dense] == NULL)
+    {
+        trees[dense] = new AdaptiveRadixTree;
+        trees[dense]->Init();
+        std::mt19937_64 rng(12);
+        keys[dense].resize(kDispatchKeys);
+        for (uint64_t i = 0; i < kDispatchKeys; i++)
+        {
+            keys[dense][i] = dense ? i * 3 : rng() % (1ULL << 47);
+            trees[dense]->Insert(keys[dense][i], (void*)(keys[dense][i] | 1));
+        }
+        std::shuffle(keys[dense].begin(), keys[dense].end(), rng);
+    }
+    AdaptiveRadixTree* art = trees[dense];
+    bool tagged = state.range(1) != 0;
+    uint64_t i = 0;
+    for (auto _ : state)
+    {
+        uint64_t key = keys[dense][i++ & (kDispatchKeys - 1)];
+        benchmark::DoNotOptimize(tagged ? art->Search(key) : headerSearch(art, key));
+    }
+    state.counters["bytes/key"] = art->MemoryUsage() / (double)kDispatchKeys;
+    state.SetLabel(tagged ? "tag" : "header");
+}
+
+// random为0时key的低16位随机，高位稀疏，为1时64位完全随机
+void BM_CompressedRefs(benchmark::State& state)
+{
+    static AdaptiveRadixTree* trees[2][2];
+    static std::vector<uint64_t> keys[2];
+    int random = state.range(0);
+    int compressed = state.range(1) != 0;
+    if (keys[random].empty())
+    {
+        std::mt19937_64 rng(13);
+        keys[random].resize(kRefKeys);
+        for (uint64_t i = 0; i < kRefKeys; i++)
+        {
+            keys[random][i] = random ? rng() : (rng() % (1ULL << 31)) << 16 | rng() % 65536;
+        }
+    }
+    if (trees[random][compressed] == NULL)
+    {
+        AdaptiveRadixTree* art = new AdaptiveRadixTree;
+        art->Init(compressed ? ART_COMPRESSED_REFS : 0);
+        for (uint64_t i = 0; i < kRefKeys; i++)
+        {
+            art->Insert(keys[random][i], (void*)(keys[random][i] | 1));
+        }
+        trees[random][compressed] = art;
+    }
+    AdaptiveRadixTree* art = trees[random][compressed];
+    uint64_t i = 0;
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(art->Search(keys[random][i++ & (kRefKeys - 1)]));
+    }
+    state.counters["bytes/key"] = art->MemoryUsage() / (double)kRefKeys;
+    state.SetLabel(random ? "random" : "sparse");
+}
+
+// 每次迭代统计一遍整棵树，对比不同的线程数
+void BM_ComputeStats(benchmark::State& state)
+{
+    static AdaptiveRadixTree* art = NULL;
+    if (art == NULL)
+    {
+        art = new AdaptiveRadixTree;
+        art->Init();
+        std::mt19937_64 rng(5);
+        for (uint64_t i = 0; i < kStatsKeys; i++)
+        {
+            art->Insert(rng(), (void*)1);
+        }
+    }
+    size_t ranges = 0;
+    for (auto _ : state)
+    {
+        ArtTreeStats stats;
+        art->ComputeStats(&stats, state.range(0));
+        ranges = stats.ranges.size();
+    }
+    state.counters["ranges"] = ranges;
+    state.counters["keys/s"] = benchmark::Counter(state.iterations() * (double)kStatsKeys,
+        benchmark::Counter::kIsRate);
+}
+
+AdaptiveRadixTree* fragmentedTree()
+{
+    AdaptiveRadixTree* art = new AdaptiveRadixTree;
+    art->Init();
+    std::mt19937_64 rng(6);
+    for (uint64_t i = 0; i < kFragmentRanges; i++)
+    {
+        uint64_t start = rng() % kVolumeLbas;
+        art->RangeInsert(start, 64, locationOf(start));
+    }
+    for (uint64_t i = 0; i < kFragmentRanges; i++)
+    {
+        art->DeleteRange(rng() % kVolumeLbas, 200);
+    }
+    return art;
+}
+
+// 按顺序扫一遍整个卷，compact为1时先做一遍Compact，对比节点的类型和位置整理前后的扫描速度
+void BM_ScanAfterCompact(benchmark::State& state)
+{
+    AdaptiveRadixTree* art = fragmentedTree();
+    ArtCompactStats stats;
+    if (state.range(0) != 0)
+    {
+        art->Compact(&stats);
+    }
+    std::vector<void*> vals;
+    uint64_t keys = 0;
+    for (auto _ : state)
+    {
+        keys = 0;
+        for (uint64_t lba = 0; lba < kVolumeLbas; lba += 4096)
+        {
+            art->RangeQuery(lba, 4096, &vals);
+            for (size_t i = 0; i < vals.size(); i++)
+            {
+                keys += vals[i] != NULL;
+            }
+        }
+    }
+    state.counters["keys/s"] = benchmark::Counter(state.iterations() * keys, benchmark::Counter::kIsRate);
+    state.counters["bytes/key"] = keys == 0 ? 0 : art->MemoryUsage() / (double)keys;
+    state.counters["reserved_MB"] = art->MemoryReserved() >> 20;
+    state.counters["resized"] = stats.resized;
+    art->Destroy();
+    delete art;
+}
+
+// 每次迭代整理一棵新的碎片化的树
+void BM_Compact(benchmark::State& state)
+{
+    ArtCompactStats stats;
+    for (auto _ : state)
+    {
+        state.PauseTiming();
+        AdaptiveRadixTree* art = fragmentedTree();
+        state.ResumeTiming();
+        art->Compact(&stats);
+        state.PauseTiming();
+        art->Destroy();
+        delete art;
+        state.ResumeTiming();
+    }
+    state.counters["nodes"] = stats.nodes / (double)state.iterations();
+    state.counters["reclaimed_MB"] = (stats.used_reclaimed >> 20) / (double)state.iterations();
+    state.counters["released_MB"] = (stats.released >> 20) / (double)state.iterations();
+}
+
+void BM_Serialization(benchmark::State& state)
+{
+    Populated* p = populated(state.range(0));
+    int size = 0;
+    for (auto _ : state)
+    {
+        void* buf = NULL;
+        p->art.Serialization(&buf, size);
+        free(buf);
+    }
+    setCounters(state, state.iterations() * p->keys, p->art.MemoryUsage(), p->keys);
+    state.counters["image_bytes/key"] = size / (double)p->keys;
+    state.SetBytesProcessed(state.iterations() * size);
+}
+
+void BM_Deserialization(benchmark::State& state)
+{
+    Populated* p = populated(state.range(0));
+    void* buf = NULL;
+    int size = 0;
+    p->art.Serialization(&buf, size);
+    uint64_t memory = 0;
+    for (auto _ : state)
+    {
+        AdaptiveRadixTree* art = new AdaptiveRadixTree;
+        art->Deserialization(buf, size);
+        memory = art->MemoryUsage();
+        state.PauseTiming();
+        art->Destroy();
+        delete art;
+        state.ResumeTiming();
+    }
+    free(buf);
+    setCounters(state, state.iterations() * p->keys, memory, p->keys);
+    state.SetBytesProcessed(state.iterations() * size);
+}
+
+}
+
+BENCHMARK(BM_Search)->ArgNames({"dist"})->DenseRange(SEQUENTIAL, ZIPFIAN);
+BENCHMARK(BM_SearchPages)->ArgNames({"pages"})->DenseRange(0, 2);
+BENCHMARK(BM_RangeQuery)->ArgNames({"dist", "length"})->ArgsProduct({
+    benchmark::CreateDenseRange(SEQUENTIAL, ZIPFIAN, 1), {1, 8, 64, 256, 1024, 4096}});
+BENCHMARK(BM_RangeInsert)->ArgNames({"dist", "length"})->ArgsProduct({
+    benchmark::CreateDenseRange(SEQUENTIAL, ZIPFIAN, 1), {1, 8, 64, 256, 1024, 4096}});
+BENCHMARK(BM_WideExtentInsert)->ArgNames({"chunked"})->DenseRange(0, 1);
+BENCHMARK(BM_WideExtentQuery)->ArgNames({"chunked"})->DenseRange(0, 1);
+BENCHMARK(BM_Scan)->ArgNames({"iterator"})->DenseRange(0, 1)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_SearchDispatch)->ArgNames({"dense", "tagged"})->ArgsProduct({{0, 1}, {0, 1}});
+BENCHMARK(BM_CompressedRefs)->ArgNames({"random", "compressed"})->ArgsProduct({{0, 1}, {0, 1}});
+BENCHMARK(BM_LeafFormatBuild)->ArgNames({"workload", "compact"})->ArgsProduct({
+    {EXTENT_WORKLOAD, PACKED_WORKLOAD, SINGLE_WORKLOAD}, {0, 1}})->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_LeafFormatQuery)->ArgNames({"workload", "compact"})->ArgsProduct({
+    {EXTENT_WORKLOAD, PACKED_WORKLOAD, SINGLE_WORKLOAD}, {0, 1}});
+BENCHMARK(BM_MultiSearch)->ArgNames({"multi"})->DenseRange(0, 1);
+BENCHMARK(BM_ComputeStats)->ArgNames({"threads"})->RangeMultiplier(2)->Range(1, 4)->UseRealTime()->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_ScanAfterCompact)->ArgNames({"compact"})->DenseRange(0, 1)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_Compact)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_Serialization)->ArgNames({"dist"})->DenseRange(SEQUENTIAL, ZIPFIAN)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_Deserialization)->ArgNames({"dist"})->DenseRange(SEQUENTIAL, ZIPFIAN)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_BulkLoad)->ArgNames({"threads"})->Arg(0)->RangeMultiplier(2)->Range(1, 8)->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_SerializeParallel)->ArgNames({"threads"})->RangeMultiplier(2)->Range(1, 8)->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_WalBatch)->ArgNames({"batch"})->RangeMultiplier(8)->Range(1, 512)->UseRealTime();
+BENCHMARK(BM_WalThreads)->ArgNames({"threads"})->Arg(1)->Arg(4)->Arg(16)->UseRealTime()->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
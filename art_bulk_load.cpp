@@ -0,0 +1,356 @@
+#include <algorithm>
+#include <thread>
+#include "adaptive_radix_tree.h"
+#include "assert.h"
+
+namespace art
+{
+
+// 按key的顺序接收叶节点，第level层缓存以key[level]为下标、还没有生成的内部节点的child
+// 下一个叶节点和当前路径在第m个字节分叉时，m之后的层都不会再有新的child，可以直接生成节点
+// 只有一个child的层不生成节点，把key[level]拼到child的前缀前面
+// 缓存的child都是节点，已经带上tag，生成节点时直接复制到槽位里
+class AdaptiveRadixTree::BulkBuilder
+{
+public:
+    // top及以上的层由调用者处理
+    BulkBuilder(AdaptiveRadixTree* tree, int top)
+    : _tree(tree),
+      _top(top),
+      _has_path(false)
+    {
+        memset(_path, 0, sizeof(_path));
+        memset(_count, 0, sizeof(_count));
+    }
+
+    // chunk是叶节点对应的key >> 8，必须递增
+    void AddLeaf(uint64_t chunk, Node* leaf)
+    {
+        uint64_t reverse = __builtin_bswap64(chunk << 8);
+        unsigned char* key = reinterpret_cast<unsigned char*>(&reverse);
+        if (_has_path)
+        {
+            int m = _top;
+            while (m < 7 && key[m] == _path[m])
+            {
+                m++;
+            }
+            assert(m < 7 && key[m] > _path[m]);
+            for (int level = 6; level > m; level--)
+            {
+                finishLevel(level);
+            }
+        }
+        SetPath(chunk << 8);
+        AddChild(6, key[6], TagNode(leaf));
+    }
+
+    void SetPath(uint64_t key)
+    {
+        uint64_t reverse = __builtin_bswap64(key);
+        memcpy(_path, &reverse, 7);
+        _has_path = true;
+    }
+
+    void AddChild(int level, unsigned char byte, Node* child)
+    {
+        assert(_count[level] < 256);
+        _keys[level][_count[level]] = byte;
+        _children[level][_count[level]] = child;
+        _count[level]++;
+    }
+
+    void Finish()
+    {
+        for (int level = 6; level > _top; level--)
+        {
+            finishLevel(level);
+        }
+    }
+
+    int Count(int level)
+    {
+        return _count[level];
+    }
+
+    const unsigned char* Keys(int level)
+    {
+        return _keys[level];
+    }
+
+    Node* const* Children(int level)
+    {
+        return _children[level];
+    }
+
+private:
+    void finishLevel(int level)
+    {
+        if (_count[level] == 0)
+        {
+            return;
+        }
+        Node* node;
+        if (_count[level] == 1)
+        {
+            node = UntagNode(_children[level][0]);
+            assert(node->prefix_length < 6);
+            memmove(&node->prefix[1], &node->prefix[0], node->prefix_length);
+            node->prefix[0] = _keys[level][0];
+            node->prefix_length++;
+            if (node->type == NODE_SINGLE)
+            {
+                reinterpret_cast<NodeSingle*>(node)->SyncKey();
+            }
+        }
+        else
+        {
+            node = _tree->makeFilledNode(_count[level], _keys[level], _children[level]);
+        }
+        _count[level] = 0;
+        AddChild(level - 1, _path[level - 1], TagNode(node));
+    }
+
+    AdaptiveRadixTree*  _tree;
+    int                 _top;
+    bool                _has_path;
+    unsigned char       _path[7];
+    int                 _count[7];
+    unsigned char       _keys[7][256];
+    Node*               _children[7][256];
+};
+
+// keys有序，按数量一次分配成合适的内部节点类型，Ref节点的槽位要编码成句柄
+Node* AdaptiveRadixTree::makeFilledNode(int count, const unsigned char* keys, Node* const* ptrs)
+{
+    Node* node = makeNode(innerType(count));
+    if (node->type == NODE48_REF)
+    {
+        Node48Ref* node48 = reinterpret_cast<Node48Ref*>(node);
+        for (int i = 0; i < count; i++)
+        {
+            node48->child_ptr_indexs[keys[i]] = i + 1;
+            node48->child_refs[i] = encodeRef(ptrs[i]);
+        }
+        node->child_count = count;
+    }
+    else if (node->type == NODE256_REF)
+    {
+        Node256Ref* node256 = reinterpret_cast<Node256Ref*>(node);
+        for (int i = 0; i < count; i++)
+        {
+            node256->child_refs[keys[i]] = encodeRef(ptrs[i]);
+        }
+        node->child_count = count;
+    }
+    else
+    {
+        fillNode(node, count, keys, ptrs);
+    }
+    return node;
+}
+
+// node的类型已经能放下count个child，槽位都是空的
+void AdaptiveRadixTree::fillNode(Node* node, int count, const unsigned char* keys, Node* const* ptrs)
+{
+    node->child_count = count;
+    switch (node->type)
+    {
+        case NODE4:
+        {
+            Node4* node4 = reinterpret_cast<Node4*>(node);
+            memcpy(node4->child_keys, keys, count);
+            memcpy(node4->child_ptrs, ptrs, count * sizeof(void*));
+            break;
+        }
+        case NODE16:
+        {
+            Node16* node16 = reinterpret_cast<Node16*>(node);
+            memcpy(node16->child_keys, keys, count);
+            memcpy(node16->child_ptrs, ptrs, count * sizeof(void*));
+            break;
+        }
+        case NODE48:
+        {
+            Node48* node48 = reinterpret_cast<Node48*>(node);
+            for (int i = 0; i < count; i++)
+            {
+                node48->child_ptr_indexs[keys[i]] = i + 1;
+                node48->child_ptrs[i] = ptrs[i];
+            }
+            break;
+        }
+        case NODE256:
+        {
+            Node256* node256 = reinterpret_cast<Node256*>(node);
+            for (int i = 0; i < count; i++)
+            {
+                node256->child_ptrs[keys[i]] = ptrs[i];
+            }
+            break;
+        }
+        default:
+            assert(0);
+            break;
+    }
+}
+
+// 连续的value优先放进extent叶节点，其次是字典或者差值编码
+Node* AdaptiveRadixTree::makeLeafNode(int count, const unsigned char* keys, Node* const* ptrs)
+{
+    if (_single_leaf && count == 1)
+    {
+        return makeSingleLeaf(NULL, keys[0], ptrs[0]);
+    }
+    Node* leaf = _extent_leaf && count > 4 ? makeExtentLeaf(count, keys, ptrs) : NULL;
+    if (leaf == NULL && _packed_leaf && count > 16)
+    {
+        void* slots[256];
+        memset(slots, 0, sizeof(slots));
+        for (int i = 0; i < count; i++)
+        {
+            slots[keys[i]] = ptrs[i];
+        }
+        leaf = makePackedLeaf(slots);
+    }
+    if (leaf == NULL)
+    {
+        leaf = makeProperNode(count);
+        fillNode(leaf, count, keys, ptrs);
+        leaf->SetLeaf(true);
+    }
+    return leaf;
+}
+
+// 把extents落在[lo, hi]的部分按叶节点切开交给builder
+void AdaptiveRadixTree::bulkLoadRange(BulkBuilder* builder, const Extent* extents, size_t count, uint64_t lo, uint64_t hi)
+{
+    unsigned char keys[256];
+    Node* vals[256];
+    int n = 0;
+    uint64_t chunk = 0;
+
+    // 第一个结束位置>=lo的extent
+    const Extent* first = std::partition_point(extents, extents + count, [lo](const Extent& e) {
+        return e.start + (std::max(e.length, 1U) - 1) < lo;
+    });
+    for (size_t i = first - extents; i < count && extents[i].start <= hi; i++)
+    {
+        const Extent& extent = extents[i];
+        if (extent.length == 0 || extent.val == NULL)
+        {
+            continue;
+        }
+        // 区间可以一直到~0ULL，先减1再加，不能算start + length
+        assert(extent.start + (extent.length - 1) >= extent.start);
+        uint64_t key = std::max(extent.start, lo);
+        uint64_t last = std::min<uint64_t>(extent.start + (extent.length - 1), hi);
+        while (1)
+        {
+            if (n > 0 && (key >> 8) != chunk)
+            {
+                builder->AddLeaf(chunk, makeLeafNode(n, keys, vals));
+                n = 0;
+            }
+            chunk = key >> 8;
+            uint64_t chunkLast = std::min<uint64_t>(last, key | 0xFF);
+            // extent有重叠或者没有排序
+            assert(n == 0 || keys[n - 1] < (key & 0xFF));
+            // chunkLast可能是~0ULL，按个数循环
+            for (uint32_t i = 0; i <= chunkLast - key; i++)
+            {
+                keys[n] = (key + i) & 0xFF;
+                vals[n] = reinterpret_cast<Node*>(extent.val);
+                n++;
+            }
+            if (chunkLast == last)
+            {
+                break;
+            }
+            key = chunkLast + 1;
+        }
+    }
+    if (n > 0)
+    {
+        builder->AddLeaf(chunk, makeLeafNode(n, keys, vals));
+    }
+}
+
+void AdaptiveRadixTree::BulkLoad(const Extent* extents, size_t count, int threads)
+{
+    assert(_root != NULL && UntagNode(_root)->child_count == 0);
+    if (count == 0)
+    {
+        return;
+    }
+
+    BulkBuilder* builder = new BulkBuilder(this, 0);
+    uint64_t first = extents[0].start;
+    uint64_t last = extents[count - 1].start + (std::max(extents[count - 1].length, 1U) - 1);
+    // 所有key第一个不同的字节，按这个字节分区，分区之间没有公共的内部节点
+    int split = first == last ? 8 : __builtin_clzll(first ^ last) / 8;
+    if (threads <= 1 || split >= 7 || count < (size_t)threads)
+    {
+        bulkLoadRange(builder, extents, count, 0, ~0ULL);
+        builder->Finish();
+    }
+    else
+    {
+        int shift = 56 - 8 * split;
+        uint64_t base = split == 0 ? 0 : first & (~0ULL << (64 - 8 * split));
+        // 按extent的个数均分，边界对齐到分区字节
+        std::vector<int> bounds;
+        for (int t = 0; t < threads; t++)
+        {
+            int byte = (extents[t * count / threads].start >> shift) & 0xFF;
+            if (t == 0)
+            {
+                byte = (first >> shift) & 0xFF;
+            }
+            if (bounds.empty() || byte > bounds.back())
+            {
+                bounds.push_back(byte);
+            }
+        }
+        bounds.push_back(256);
+
+        std::vector<BulkBuilder*> workers;
+        std::vector<std::thread> pool;
+        _parallel_build = true;
+        for (size_t i = 0; i + 1 < bounds.size(); i++)
+        {
+            uint64_t lo = base | ((uint64_t)bounds[i] << shift);
+            uint64_t hi = base | ((uint64_t)(bounds[i + 1] - 1) << shift) | ((1ULL << shift) - 1);
+            BulkBuilder* worker = new BulkBuilder(this, split);
+            workers.push_back(worker);
+            pool.push_back(std::thread([this, worker, extents, count, lo, hi]() {
+                bulkLoadRange(worker, extents, count, lo, hi);
+                worker->Finish();
+            }));
+        }
+        for (size_t i = 0; i < pool.size(); i++)
+        {
+            pool[i].join();
+        }
+        _parallel_build = false;
+
+        builder->SetPath(first);
+        for (size_t i = 0; i < workers.size(); i++)
+        {
+            for (int j = 0; j < workers[i]->Count(split); j++)
+            {
+                builder->AddChild(split, workers[i]->Keys(split)[j], workers[i]->Children(split)[j]);
+            }
+            delete workers[i];
+        }
+        builder->Finish();
+    }
+
+    // 根节点没有前缀，只有一个child也不合并
+    Node* root = makeFilledNode(builder->Count(0), builder->Keys(0), builder->Children(0));
+    delete builder;
+    freeNode(UntagNode(_root));
+    _root = TagNode(root);
+}
+
+}
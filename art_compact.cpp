@@ -0,0 +1,144 @@
+#include <time.h>
+#include "adaptive_radix_tree.h"
+#include "assert.h"
+
+namespace art
+{
+
+static uint64_t nowNanos()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct AdaptiveRadixTree::CompactState
+{
+    uint64_t            deadline;   // 0表示不限时间
+    uint64_t            cursor;     // key空间的下界不小于cursor的节点才搬动
+    ArtCompactStats*    stats;
+};
+
+Node* AdaptiveRadixTree::relocateNode(Node* node, Node** ref)
+{
+    unsigned char keys[256];
+    Node* ptrs[256];
+    Node* newNode;
+    if (node->IsLeaf())
+    {
+        // 和BulkLoad一样按key的个数重新选择叶节点的格式
+        int count = collectLeaf(node, keys, ptrs);
+        newNode = makeLeafNode(count, keys, ptrs);
+    }
+    else
+    {
+        int count = collectChildren(node, ptrs, keys);
+        for (int i = 0; i < count; i++)
+        {
+            ptrs[i] = TagNode(ptrs[i]);
+        }
+        newNode = makeFilledNode(count, keys, ptrs);
+    }
+    // 内容没有变，dirty保持原样，SerializeDelta仍然可以沿用上一个checkpoint
+    newNode->version = node->version & (kDirtyBit | kLeafBit);
+    newNode->prefix_length = node->prefix_length;
+    memcpy(newNode->prefix, node->prefix, sizeof(node->prefix));
+    if (newNode->type == NODE_SINGLE)
+    {
+        reinterpret_cast<NodeSingle*>(newNode)->SyncKey();
+    }
+    storeChild(ref, newNode);
+    freeNode(node);
+    return newNode;
+}
+
+// 先搬node再按key的顺序搬child，每种类型的节点在slab里按先序排列
+// 和ComputeStats一样按key空间的下界(前缀后面补0)决定节点属于哪一段，分几次做时每个节点正好搬一次
+bool AdaptiveRadixTree::compactNode(Node** ref, int depth, uint64_t key, CompactState* state)
+{
+    Node* node = UntagNode(childAt(ref));
+    for (int i = 0; i < node->prefix_length; i++)
+    {
+        key |= (uint64_t)node->prefix[i] << (56 - 8 * (depth + i));
+    }
+    depth += node->prefix_length;
+    assert(depth <= 7);
+    uint64_t last = key | (~0ULL >> (8 * depth));
+    if (last < state->cursor)
+    {
+        return true;
+    }
+
+    if (key >= state->cursor)
+    {
+        NodeType type = node->type;
+        int64_t size = nodeSize(type);
+        node = relocateNode(node, ref);
+        state->stats->nodes++;
+        state->stats->resized += node->type != type;
+        state->stats->used_reclaimed += size - nodeSize(node->type);
+    }
+
+    if (node->IsLeaf())
+    {
+        // 最后一个叶节点做完时整遍也做完了，不用再停下来
+        if (state->deadline != 0 && last != ~0ULL && nowNanos() >= state->deadline)
+        {
+            state->cursor = last + 1;
+            return false;
+        }
+        return true;
+    }
+
+    Node* children[256];
+    unsigned char bytes[256];
+    int count = collectChildren(node, children, bytes);
+    for (int i = 0; i < count; i++)
+    {
+        Node** slot = findChild(node, bytes[i]);
+        assert(slot != NULL);
+        if (!compactNode(slot, depth + 1, key | (uint64_t)bytes[i] << (56 - 8 * depth), state))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool AdaptiveRadixTree::Compact(ArtCompactStats* stats, uint64_t budget_us)
+{
+    ArtCompactStats local;
+    CompactState state;
+    state.deadline = budget_us == 0 ? 0 : nowNanos() + budget_us * 1000;
+    state.cursor = _compact_cursor;
+    state.stats = stats != NULL ? stats : &local;
+
+    bool done = true;
+    if (_root != NULL)
+    {
+        _compacting = true;
+        done = compactNode(&_root, 0, 0, &state);
+        _compacting = false;
+    }
+    _compact_cursor = done ? 0 : state.cursor;
+    // 统计空闲对象要走一遍free list，不适合每次限时的调用都做，一遍做完时再释放
+    if (!done)
+    {
+        return false;
+    }
+    state.stats->passes++;
+
+    // 并发模式下被替换的节点等epoch推进之后才回到free list，那时所在的slab才能释放
+    std::unique_lock<std::mutex> lock(_alloc_mutex, std::defer_lock);
+    if (_concurrent)
+    {
+        lock.lock();
+    }
+    for (int i = 0; i < 11; i++)
+    {
+        state.stats->released += _slabs[i].ReleaseEmptySlabs();
+    }
+    return true;
+}
+
+}
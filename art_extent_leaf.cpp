@@ -0,0 +1,335 @@
+#include <algorithm>
+#include "adaptive_radix_tree.h"
+#include "assert.h"
+
+namespace art
+{
+
+// 修改一个extent叶节点时最多多出两个run：新写入的区间和被切开的run的后半段
+static const int kMaxPendingRuns = NodeExtent::kMaxRuns + 2;
+
+// b紧跟在a后面，并且和a在同一条直线上时接到a上，只有一个key的run可以取任意的stride
+static bool mergeRun(ExtentRun* a, const ExtentRun& b)
+{
+    if (a->last + 1 != b.start)
+    {
+        return false;
+    }
+    int64_t stride;
+    if (a->start != a->last)
+    {
+        stride = a->stride;
+    }
+    else if (b.start != b.last)
+    {
+        stride = b.stride;
+    }
+    else
+    {
+        stride = (int64_t)(b.value - a->value);
+    }
+    if (stride != (int32_t)stride || (b.start != b.last && b.stride != stride) ||
+        b.value != a->value + (uint64_t)(stride * (b.start - a->start)))
+    {
+        return false;
+    }
+    a->stride = stride;
+    a->last = b.last;
+    return true;
+}
+
+static void appendRun(ExtentRun* runs, int* count, const ExtentRun& run)
+{
+    if (*count > 0 && mergeRun(&runs[*count - 1], run))
+    {
+        return;
+    }
+    runs[*count] = run;
+    // 只有一个key的run没有方向，stride清零方便和后面的run合并
+    if (run.start == run.last)
+    {
+        runs[*count].stride = 0;
+    }
+    (*count)++;
+}
+
+// keys有序，run放不下时返回-1
+static int encodeRuns(int count, const unsigned char* keys, Node* const* ptrs, ExtentRun* runs)
+{
+    int n = 0;
+    for (int i = 0; i < count; i++)
+    {
+        ExtentRun run;
+        run.value = reinterpret_cast<uint64_t>(ptrs[i]);
+        run.stride = 0;
+        run.start = keys[i];
+        run.last = keys[i];
+        appendRun(runs, &n, run);
+        if (n > NodeExtent::kMaxRuns)
+        {
+            return -1;
+        }
+    }
+    return n;
+}
+
+static int decodeRuns(const ExtentRun* runs, int count, unsigned char* keys, Node** ptrs)
+{
+    int n = 0;
+    for (int i = 0; i < count; i++)
+    {
+        for (int byte = runs[i].start; byte <= runs[i].last; byte++)
+        {
+            keys[n] = byte;
+            ptrs[n] = reinterpret_cast<Node*>(runs[i].ValueAt(byte));
+            n++;
+        }
+    }
+    return n;
+}
+
+int AdaptiveRadixTree::collectLeaf(const Node* node, unsigned char* keys, Node** ptrs)
+{
+    int n = 0;
+    switch (node->type)
+    {
+        case NODE4:
+        {
+            const Node4* node4 = reinterpret_cast<const Node4*>(node);
+            n = node->child_count;
+            memcpy(keys, node4->child_keys, n);
+            memcpy(ptrs, node4->child_ptrs, n * sizeof(void*));
+            break;
+        }
+        case NODE16:
+        {
+            const Node16* node16 = reinterpret_cast<const Node16*>(node);
+            n = node->child_count;
+            memcpy(keys, node16->child_keys, n);
+            memcpy(ptrs, node16->child_ptrs, n * sizeof(void*));
+            break;
+        }
+        case NODE48:
+        {
+            const Node48* node48 = reinterpret_cast<const Node48*>(node);
+            for (int i = 0; i < 256; i++)
+            {
+                if (node48->child_ptr_indexs[i] > 0)
+                {
+                    keys[n] = i;
+                    ptrs[n] = node48->child_ptrs[node48->child_ptr_indexs[i] - 1];
+                    n++;
+                }
+            }
+            break;
+        }
+        case NODE256:
+        {
+            const Node256* node256 = reinterpret_cast<const Node256*>(node);
+            for (int i = 0; i < 256; i++)
+            {
+                if (node256->child_ptrs[i] != NULL)
+                {
+                    keys[n] = i;
+                    ptrs[n] = node256->child_ptrs[i];
+                    n++;
+                }
+            }
+            break;
+        }
+        case NODE_EXTENT:
+        {
+            const NodeExtent* extent = reinterpret_cast<const NodeExtent*>(node);
+            n = decodeRuns(extent->runs, extent->run_count, keys, ptrs);
+            break;
+        }
+        case NODE_SINGLE:
+        {
+            const NodeSingle* single = reinterpret_cast<const NodeSingle*>(node);
+            if (node->child_count > 0)
+            {
+                keys[0] = single->Byte();
+                ptrs[0] = reinterpret_cast<Node*>(single->value);
+                n = 1;
+            }
+            break;
+        }
+        case NODE_DICT:
+        case NODE_DELTA16:
+        case NODE_DELTA32:
+        {
+            for (int i = 0; i < 256; i++)
+            {
+                void* val = findCompactChild(node, i);
+                if (val != NULL)
+                {
+                    keys[n] = i;
+                    ptrs[n] = reinterpret_cast<Node*>(val);
+                    n++;
+                }
+            }
+            break;
+        }
+        default:
+            assert(0);
+            break;
+    }
+    return n;
+}
+
+Node* AdaptiveRadixTree::makeExtentLeaf(int count, const unsigned char* keys, Node* const* ptrs)
+{
+    ExtentRun runs[NodeExtent::kMaxRuns + 1];
+    int n = encodeRuns(count, keys, ptrs, runs);
+    if (n < 0)
+    {
+        return NULL;
+    }
+    NodeExtent* extent = makeNodeExtent();
+    memcpy(extent->runs, runs, n * sizeof(ExtentRun));
+    extent->run_count = n;
+    extent->header.child_count = count;
+    return &extent->header;
+}
+
+// 先按run切开再合并，[start, start + length)之外的key不变
+void AdaptiveRadixTree::setExtentRange(Node* node, Node** ref, unsigned char start, uint32_t length, void* val)
+{
+    NodeExtent* extent = reinterpret_cast<NodeExtent*>(node);
+    int end = start + length - 1;
+    assert(end <= 255);
+    ExtentRun runs[kMaxPendingRuns];
+    int count = 0;
+    bool placed = val == NULL;
+    ExtentRun written;
+    written.value = reinterpret_cast<uint64_t>(val);
+    written.stride = 0;
+    written.start = start;
+    written.last = end;
+    for (int i = 0; i < extent->run_count; i++)
+    {
+        const ExtentRun& run = extent->runs[i];
+        if (run.start < start)
+        {
+            ExtentRun left = run;
+            left.last = std::min<int>(run.last, start - 1);
+            appendRun(runs, &count, left);
+        }
+        if (run.last > end)
+        {
+            if (!placed)
+            {
+                appendRun(runs, &count, written);
+                placed = true;
+            }
+            ExtentRun right = run;
+            right.start = std::max<int>(run.start, end + 1);
+            right.value = reinterpret_cast<uint64_t>(run.ValueAt(right.start));
+            appendRun(runs, &count, right);
+        }
+    }
+    if (!placed)
+    {
+        appendRun(runs, &count, written);
+    }
+
+    if (count <= NodeExtent::kMaxRuns)
+    {
+        int keys = 0;
+        for (int i = 0; i < count; i++)
+        {
+            keys += runs[i].last - runs[i].start + 1;
+        }
+        memcpy(extent->runs, runs, count * sizeof(ExtentRun));
+        extent->run_count = count;
+        node->child_count = keys;
+        return;
+    }
+
+    // 碎片太多，换回按key存储的节点
+    unsigned char keys[256];
+    Node* ptrs[256];
+    int n = decodeRuns(runs, count, keys, ptrs);
+    Node* newNode = makeProperNode(n);
+    NodeType type = newNode->type;
+    memcpy(newNode, node, sizeof(Node));
+    newNode->version = kDirtyBit | kLeafBit;
+    newNode->type = type;
+    fillNode(newNode, n, keys, ptrs);
+    storeChild(ref, newNode);
+    freeNode(node);
+}
+
+void AdaptiveRadixTree::compactLeaf(Node* node, Node** ref)
+{
+    assert(node->IsLeaf() && node->type <= NODE256);
+    bool single = _single_leaf && node->child_count == 1;
+    if (node->child_count <= 4 && !single)
+    {
+        return;
+    }
+    unsigned char keys[256];
+    Node* ptrs[256];
+    int n = collectLeaf(node, keys, ptrs);
+    Node* newNode = NULL;
+    if (single)
+    {
+        newNode = makeSingleLeaf(node, keys[0], ptrs[0]);
+    }
+    else if (_extent_leaf)
+    {
+        newNode = makeExtentLeaf(n, keys, ptrs);
+    }
+    if (newNode == NULL && _packed_leaf && n > 16)
+    {
+        void* slots[256];
+        memset(slots, 0, sizeof(slots));
+        for (int i = 0; i < n; i++)
+        {
+            slots[keys[i]] = ptrs[i];
+        }
+        if (packedType(slots) != node->type)
+        {
+            newNode = makePackedLeaf(slots);
+        }
+    }
+    if (newNode == NULL)
+    {
+        return;
+    }
+    // 刚反序列化出来的节点和checkpoint一致，不是dirty
+    newNode->version = (node->version & kDirtyBit) | kLeafBit;
+    memcpy(newNode->prefix, node->prefix, sizeof(node->prefix));
+    newNode->prefix_length = node->prefix_length;
+    storeChild(ref, newNode);
+    freeNode(node);
+}
+
+void AdaptiveRadixTree::findExtentChildren(const Node* node, unsigned char start, uint32_t length, void** vals)
+{
+    const NodeExtent* extent = reinterpret_cast<const NodeExtent*>(node);
+    memset(vals, 0, length * sizeof(void*));
+    int end = start + length - 1;
+    for (int i = 0; i < extent->run_count; i++)
+    {
+        const ExtentRun& run = extent->runs[i];
+        for (int byte = std::max<int>(start, run.start); byte <= std::min<int>(end, run.last); byte++)
+        {
+            vals[byte - start] = run.ValueAt(byte);
+        }
+    }
+}
+
+void AdaptiveRadixTree::expandCompactLeaf(const Node* node, char* buf)
+{
+    unsigned char keys[256];
+    Node* ptrs[256];
+    int n = collectLeaf(node, keys, ptrs);
+    memset(buf, 0, sizeof(Node256));
+    Node* out = reinterpret_cast<Node*>(buf);
+    memcpy(out, node, sizeof(Node));
+    out->type = properType(n);
+    fillNode(out, n, keys, ptrs);
+}
+
+}
@@ -0,0 +1,164 @@
+#include <unistd.h>
+#include <errno.h>
+#include "adaptive_radix_tree.h"
+#include "assert.h"
+#include "util.h"
+
+namespace art
+{
+
+static const uint32_t kImageBufferSize = 1 << 20;
+
+// 带缓冲的顺序写，节点的偏移就是它之前已经写出的字节数
+class AdaptiveRadixTree::ImageWriter
+{
+public:
+    explicit ImageWriter(int fd)
+    : _fd(fd),
+      _flushed(0),
+      _used(0),
+      _failed(false),
+      _node_count(0)
+    {
+        _buf = new char[kImageBufferSize];
+    }
+
+    ~ImageWriter()
+    {
+        delete[] _buf;
+    }
+
+    // 返回data在镜像中的偏移
+    uint64_t Append(const void* data, uint32_t size)
+    {
+        assert(size <= kImageBufferSize);
+        if (_used + size > kImageBufferSize)
+        {
+            Flush();
+        }
+        uint64_t offset = _flushed + _used;
+        memcpy(_buf + _used, data, size);
+        _used += size;
+        return offset;
+    }
+
+    bool Flush()
+    {
+        if (!_failed && _used > 0 && !PwriteFully(_fd, _buf, _used, _flushed))
+        {
+            _failed = true;
+        }
+        _flushed += _used;
+        _used = 0;
+        return !_failed;
+    }
+
+    uint64_t AppendNode(const Node* node, uint32_t size)
+    {
+        _node_count++;
+        return Append(node, size);
+    }
+
+    uint64_t Size()
+    {
+        return _flushed + _used;
+    }
+
+    uint64_t NodeCount()
+    {
+        return _node_count;
+    }
+
+    bool Failed()
+    {
+        return _failed;
+    }
+
+private:
+    int                 _fd;
+    uint64_t            _flushed;
+    uint32_t            _used;
+    bool                _failed;
+    uint64_t            _node_count;
+    char*               _buf;
+};
+
+// 后序写出，返回节点的偏移
+uint64_t AdaptiveRadixTree::writeImageNode(const Node* node, ImageWriter* writer)
+{
+    // 压缩格式的叶节点展开成普通叶节点，Ref节点展开成Node48/Node256，ReadOnlyArtView只需要认识四种节点
+    alignas(Node256) char copy[sizeof(Node256)];
+    if (node->type >= NODE_EXTENT)
+    {
+        expandCompactLeaf(node, copy);
+    }
+    else if (node->type == NODE48_REF || node->type == NODE256_REF)
+    {
+        expandRefNode(node, copy);
+    }
+    else
+    {
+        memcpy(copy, node, nodeSize(node->type));
+    }
+    Node* header = reinterpret_cast<Node*>(copy);
+    uint32_t size = nodeSize(header->type);
+    header->version &= kLeafBit;
+
+    Node** ptrs = NULL;
+    int slots = 0;
+    switch (header->type)
+    {
+        case NODE4:
+            ptrs = reinterpret_cast<Node4*>(copy)->child_ptrs;
+            slots = header->child_count;
+            break;
+        case NODE16:
+            ptrs = reinterpret_cast<Node16*>(copy)->child_ptrs;
+            slots = header->child_count;
+            break;
+        case NODE48:
+            ptrs = reinterpret_cast<Node48*>(copy)->child_ptrs;
+            slots = 48;
+            break;
+        case NODE256:
+            ptrs = reinterpret_cast<Node256*>(copy)->child_ptrs;
+            reinterpret_cast<Node256*>(copy)->child_bitmap = NULL;
+            slots = 256;
+            break;
+        default:
+            assert(0);
+            break;
+    }
+
+    // 叶节点的child是value，原样写出，内部节点的child换成偏移
+    if (!header->IsLeaf())
+    {
+        for (int i = 0; i < slots; i++)
+        {
+            uint64_t offset = ptrs[i] == NULL ? 0 : writeImageNode(UntagNode(ptrs[i]), writer);
+            ptrs[i] = reinterpret_cast<Node*>(offset);
+        }
+    }
+    return writer->AppendNode(header, size);
+}
+
+int AdaptiveRadixTree::WriteImage(int fd)
+{
+    assert(_root != NULL);
+    ImageWriter* writer = new ImageWriter(fd);
+    ArtImageHeader header;
+    memset(&header, 0, sizeof(header));
+    writer->Append(&header, sizeof(header));
+
+    header.magic = ArtImageHeader::kMagic;
+    header.version = ArtImageHeader::kVersion;
+    header.root = writeImageNode(UntagNode(_root), writer);
+    header.size = writer->Size();
+    header.node_count = writer->NodeCount();
+    // 头最后写，没写完的镜像打不开
+    bool ok = writer->Flush() && PwriteFully(fd, reinterpret_cast<const char*>(&header), sizeof(header), 0);
+    delete writer;
+    return ok ? 0 : -1;
+}
+
+}
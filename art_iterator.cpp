@@ -0,0 +1,610 @@
+#include <emmintrin.h>
+#include "adaptive_radix_tree.h"
+#include "assert.h"
+
+namespace art
+{
+
+// Node48里第一个>=pos的非空槽位，一次比较16个字节
+static int nextIndex48(const unsigned char* indexs, int pos)
+{
+    while (pos < 256 && (pos & 15) != 0)
+    {
+        if (indexs[pos])
+        {
+            return pos;
+        }
+        pos++;
+    }
+    const __m128i zero = _mm_setzero_si128();
+    for (; pos < 256; pos += 16)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&indexs[pos]));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) ^ 0xFFFF;
+        if (mask)
+        {
+            return pos + __builtin_ctz(mask);
+        }
+    }
+    return -1;
+}
+
+// Node48里最后一个<=pos的非空槽位
+static int prevIndex48(const unsigned char* indexs, int pos)
+{
+    while (pos >= 0 && (pos & 15) != 15)
+    {
+        if (indexs[pos])
+        {
+            return pos;
+        }
+        pos--;
+    }
+    const __m128i zero = _mm_setzero_si128();
+    for (; pos >= 0; pos -= 16)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&indexs[pos - 15]));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) ^ 0xFFFF;
+        if (mask)
+        {
+            return pos - 15 + 31 - __builtin_clz(mask);
+        }
+    }
+    return -1;
+}
+
+// 一次检查4个指针是否全为空
+static inline bool allNull4(Node* const* ptrs)
+{
+    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptrs));
+    __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptrs + 2));
+    return _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_or_si128(a, b), _mm_setzero_si128())) == 0xFFFF;
+}
+
+static int nextNonNull256(Node* const* ptrs, int pos)
+{
+    while (pos < 256 && (pos & 3) != 0)
+    {
+        if (ptrs[pos])
+        {
+            return pos;
+        }
+        pos++;
+    }
+    while (pos < 256 && allNull4(&ptrs[pos]))
+    {
+        pos += 4;
+    }
+    for (; pos < 256; pos++)
+    {
+        if (ptrs[pos])
+        {
+            return pos;
+        }
+    }
+    return -1;
+}
+
+static int prevNonNull256(Node* const* ptrs, int pos)
+{
+    while (pos >= 0 && (pos & 3) != 3)
+    {
+        if (ptrs[pos])
+        {
+            return pos;
+        }
+        pos--;
+    }
+    while (pos >= 0 && allNull4(&ptrs[pos - 3]))
+    {
+        pos -= 4;
+    }
+    for (; pos >= 0; pos--)
+    {
+        if (ptrs[pos])
+        {
+            return pos;
+        }
+    }
+    return -1;
+}
+
+// Node256Ref里第一个>=pos的非空槽位，一次比较4个句柄
+static int nextNonZero256(const uint32_t* refs, int pos)
+{
+    while (pos < 256 && (pos & 3) != 0)
+    {
+        if (refs[pos])
+        {
+            return pos;
+        }
+        pos++;
+    }
+    const __m128i zero = _mm_setzero_si128();
+    for (; pos < 256; pos += 4)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&refs[pos]));
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, zero))) ^ 0xF;
+        if (mask)
+        {
+            return pos + __builtin_ctz(mask);
+        }
+    }
+    return -1;
+}
+
+static int prevNonZero256(const uint32_t* refs, int pos)
+{
+    while (pos >= 0 && (pos & 3) != 3)
+    {
+        if (refs[pos])
+        {
+            return pos;
+        }
+        pos--;
+    }
+    const __m128i zero = _mm_setzero_si128();
+    for (; pos >= 0; pos -= 4)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&refs[pos - 3]));
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, zero))) ^ 0xF;
+        if (mask)
+        {
+            return pos - 3 + 31 - __builtin_clz(mask);
+        }
+    }
+    return -1;
+}
+
+// Ref节点的槽位是句柄，由Iterator::childOf处理
+static Node* slotChild(Node* node, int pos)
+{
+    switch (node->type)
+    {
+        case NODE4:
+            return reinterpret_cast<Node4*>(node)->child_ptrs[pos];
+        case NODE16:
+            return reinterpret_cast<Node16*>(node)->child_ptrs[pos];
+        case NODE48:
+        {
+            Node48* node48 = reinterpret_cast<Node48*>(node);
+            int index = node48->child_ptr_indexs[pos];
+            return index > 0 ? node48->child_ptrs[index - 1] : NULL;
+        }
+        case NODE256:
+            return reinterpret_cast<Node256*>(node)->child_ptrs[pos];
+        case NODE_EXTENT:
+            return reinterpret_cast<Node*>(reinterpret_cast<NodeExtent*>(node)->Find(pos));
+        case NODE_DICT:
+            return reinterpret_cast<Node*>(reinterpret_cast<NodeDict*>(node)->Find(pos));
+        case NODE_DELTA16:
+            return reinterpret_cast<Node*>(reinterpret_cast<NodeDelta16*>(node)->Find(pos));
+        case NODE_DELTA32:
+            return reinterpret_cast<Node*>(reinterpret_cast<NodeDelta32*>(node)->Find(pos));
+        case NODE_SINGLE:
+            return reinterpret_cast<Node*>(reinterpret_cast<NodeSingle*>(node)->Find(pos));
+        default:
+            assert(0);
+            return NULL;
+    }
+}
+
+static unsigned char slotKey(Node* node, int pos)
+{
+    switch (node->type)
+    {
+        case NODE4:
+            return reinterpret_cast<Node4*>(node)->child_keys[pos];
+        case NODE16:
+            return reinterpret_cast<Node16*>(node)->child_keys[pos];
+        default:
+            return pos;
+    }
+}
+
+static int lastPos(Node* node)
+{
+    return node->type == NODE4 || node->type == NODE16 ? node->child_count - 1 : 255;
+}
+
+// Node4/Node16的key是有序的，找第一个>=byte的下标
+static int lowerPos(Node* node, unsigned char byte)
+{
+    if (node->type != NODE4 && node->type != NODE16)
+    {
+        return byte;
+    }
+    int i = 0;
+    for (; i < node->child_count; i++)
+    {
+        if (slotKey(node, i) >= byte)
+        {
+            break;
+        }
+    }
+    return i;
+}
+
+// 最后一个<=byte的下标
+static int upperPos(Node* node, unsigned char byte)
+{
+    if (node->type != NODE4 && node->type != NODE16)
+    {
+        return byte;
+    }
+    int i = node->child_count - 1;
+    for (; i >= 0; i--)
+    {
+        if (slotKey(node, i) <= byte)
+        {
+            break;
+        }
+    }
+    return i;
+}
+
+// 从pos开始第一个child不为空的位置，没有返回-1
+static int nextSlot(Node* node, int pos)
+{
+    switch (node->type)
+    {
+        case NODE4:
+        case NODE16:
+        {
+            for (; pos < node->child_count; pos++)
+            {
+                if (slotChild(node, pos))
+                {
+                    return pos;
+                }
+            }
+            return -1;
+        }
+        case NODE48:
+        {
+            Node48* node48 = reinterpret_cast<Node48*>(node);
+            while (pos < 256)
+            {
+                pos = nextIndex48(node48->child_ptr_indexs, pos);
+                // 叶节点里可能存着NULL的value
+                if (pos < 0 || slotChild(node, pos))
+                {
+                    return pos;
+                }
+                pos++;
+            }
+            return -1;
+        }
+        case NODE256:
+        {
+            return pos < 256 ? nextNonNull256(reinterpret_cast<Node256*>(node)->child_ptrs, pos) : -1;
+        }
+        case NODE48_REF:
+        {
+            // 只有内部节点，有下标的槽位一定有child
+            return pos < 256 ? nextIndex48(reinterpret_cast<Node48Ref*>(node)->child_ptr_indexs, pos) : -1;
+        }
+        case NODE256_REF:
+        {
+            return pos < 256 ? nextNonZero256(reinterpret_cast<Node256Ref*>(node)->child_refs, pos) : -1;
+        }
+        case NODE_EXTENT:
+        {
+            // 第一个没有结束在pos之前的run
+            NodeExtent* extent = reinterpret_cast<NodeExtent*>(node);
+            for (int i = 0; i < extent->run_count; i++)
+            {
+                if (extent->runs[i].last >= pos)
+                {
+                    return std::max<int>(pos, extent->runs[i].start);
+                }
+            }
+            return -1;
+        }
+        case NODE_SINGLE:
+        {
+            int byte = reinterpret_cast<NodeSingle*>(node)->Byte();
+            return node->child_count > 0 && pos <= byte ? byte : -1;
+        }
+        case NODE_DICT:
+        case NODE_DELTA16:
+        case NODE_DELTA32:
+        {
+            for (; pos < 256; pos++)
+            {
+                if (slotChild(node, pos))
+                {
+                    return pos;
+                }
+            }
+            return -1;
+        }
+    }
+    assert(0);
+    return -1;
+}
+
+static int prevSlot(Node* node, int pos)
+{
+    switch (node->type)
+    {
+        case NODE4:
+        case NODE16:
+        {
+            for (pos = std::min<int>(pos, node->child_count - 1); pos >= 0; pos--)
+            {
+                if (slotChild(node, pos))
+                {
+                    return pos;
+                }
+            }
+            return -1;
+        }
+        case NODE48:
+        {
+            Node48* node48 = reinterpret_cast<Node48*>(node);
+            while (pos >= 0)
+            {
+                pos = prevIndex48(node48->child_ptr_indexs, pos);
+                if (pos < 0 || slotChild(node, pos))
+                {
+                    return pos;
+                }
+                pos--;
+            }
+            return -1;
+        }
+        case NODE256:
+        {
+            return pos >= 0 ? prevNonNull256(reinterpret_cast<Node256*>(node)->child_ptrs, pos) : -1;
+        }
+        case NODE48_REF:
+        {
+            return pos >= 0 ? prevIndex48(reinterpret_cast<Node48Ref*>(node)->child_ptr_indexs, pos) : -1;
+        }
+        case NODE256_REF:
+        {
+            return pos >= 0 ? prevNonZero256(reinterpret_cast<Node256Ref*>(node)->child_refs, pos) : -1;
+        }
+        case NODE_EXTENT:
+        {
+            NodeExtent* extent = reinterpret_cast<NodeExtent*>(node);
+            for (int i = extent->run_count - 1; i >= 0; i--)
+            {
+                if (extent->runs[i].start <= pos)
+                {
+                    return std::min<int>(pos, extent->runs[i].last);
+                }
+            }
+            return -1;
+        }
+        case NODE_SINGLE:
+        {
+            int byte = reinterpret_cast<NodeSingle*>(node)->Byte();
+            return node->child_count > 0 && pos >= byte ? byte : -1;
+        }
+        case NODE_DICT:
+        case NODE_DELTA16:
+        case NODE_DELTA32:
+        {
+            for (pos = std::min(pos, 255); pos >= 0; pos--)
+            {
+                if (slotChild(node, pos))
+                {
+                    return pos;
+                }
+            }
+            return -1;
+        }
+    }
+    assert(0);
+    return -1;
+}
+
+Node* AdaptiveRadixTree::Iterator::childOf(Node* node, int pos)
+{
+    if (node->type == NODE48_REF)
+    {
+        Node48Ref* node48 = reinterpret_cast<Node48Ref*>(node);
+        int index = node48->child_ptr_indexs[pos];
+        return index > 0 ? _tree->decodeRef(node48->child_refs[index - 1]) : NULL;
+    }
+    if (node->type == NODE256_REF)
+    {
+        return _tree->decodeRef(reinterpret_cast<Node256Ref*>(node)->child_refs[pos]);
+    }
+    return slotChild(node, pos);
+}
+
+void AdaptiveRadixTree::Iterator::pushNode(Node* node, int depth, bool forward)
+{
+    if (node->prefix_length > 0)
+    {
+        memcpy(&_key[depth], &node->prefix[0], node->prefix_length);
+    }
+    Frame frame;
+    frame.node = node;
+    frame.depth = depth + node->prefix_length;
+    frame.pos = forward ? 0 : lastPos(node);
+    _stack.push_back(frame);
+}
+
+void AdaptiveRadixTree::Iterator::pushChild(bool forward)
+{
+    Frame& top = _stack.back();
+    _key[top.depth] = slotKey(top.node, top.pos);
+    pushNode(UntagNode(childOf(top.node, top.pos)), top.depth + 1, forward);
+}
+
+// 从栈顶的pos开始往后找第一个value，当前节点找完了就回到父节点的下一个child
+void AdaptiveRadixTree::Iterator::forward()
+{
+    while (!_stack.empty())
+    {
+        Frame& top = _stack.back();
+        top.pos = nextSlot(top.node, top.pos);
+        if (top.pos < 0)
+        {
+            _stack.pop_back();
+            if (!_stack.empty())
+            {
+                _stack.back().pos++;
+            }
+            continue;
+        }
+        if (top.depth == 7)
+        {
+            return;
+        }
+        pushChild(true);
+    }
+}
+
+void AdaptiveRadixTree::Iterator::backward()
+{
+    while (!_stack.empty())
+    {
+        Frame& top = _stack.back();
+        top.pos = prevSlot(top.node, top.pos);
+        if (top.pos < 0)
+        {
+            _stack.pop_back();
+            if (!_stack.empty())
+            {
+                _stack.back().pos--;
+            }
+            continue;
+        }
+        if (top.depth == 7)
+        {
+            return;
+        }
+        pushChild(false);
+    }
+}
+
+void AdaptiveRadixTree::Iterator::SeekToFirst()
+{
+    _stack.clear();
+    pushNode(UntagNode(_tree->_root), 0, true);
+    forward();
+}
+
+void AdaptiveRadixTree::Iterator::SeekToLast()
+{
+    _stack.clear();
+    pushNode(UntagNode(_tree->_root), 0, false);
+    backward();
+}
+
+void AdaptiveRadixTree::Iterator::Seek(uint64_t key)
+{
+    _stack.clear();
+    uint64_t reverse = __builtin_bswap64(key);
+    unsigned char* data = reinterpret_cast<unsigned char*>(&reverse);
+    Node* node = UntagNode(_tree->_root);
+    int depth = 0;
+    while (1)
+    {
+        pushNode(node, depth, true);
+        Frame& top = _stack.back();
+        int cmp = memcmp(&node->prefix[0], &data[depth], node->prefix_length);
+        depth = top.depth;
+        if (cmp != 0)
+        {
+            // 前缀比key大时整个子树都满足条件，前缀比key小时整个子树都跳过
+            top.pos = cmp > 0 ? 0 : 256;
+            break;
+        }
+
+        top.pos = lowerPos(node, data[depth]);
+        if (depth == 7 || top.pos > lastPos(node))
+        {
+            break;
+        }
+        Node* child = childOf(node, top.pos);
+        if (slotKey(node, top.pos) != data[depth] || child == NULL)
+        {
+            break;
+        }
+        _key[depth] = data[depth];
+        node = UntagNode(child);
+        depth++;
+    }
+    forward();
+}
+
+void AdaptiveRadixTree::Iterator::SeekForPrev(uint64_t key)
+{
+    _stack.clear();
+    uint64_t reverse = __builtin_bswap64(key);
+    unsigned char* data = reinterpret_cast<unsigned char*>(&reverse);
+    Node* node = UntagNode(_tree->_root);
+    int depth = 0;
+    while (1)
+    {
+        pushNode(node, depth, false);
+        Frame& top = _stack.back();
+        int cmp = memcmp(&node->prefix[0], &data[depth], node->prefix_length);
+        depth = top.depth;
+        if (cmp != 0)
+        {
+            top.pos = cmp < 0 ? lastPos(node) : -1;
+            break;
+        }
+
+        top.pos = upperPos(node, data[depth]);
+        if (depth == 7 || top.pos < 0)
+        {
+            break;
+        }
+        Node* child = childOf(node, top.pos);
+        if (slotKey(node, top.pos) != data[depth] || child == NULL)
+        {
+            break;
+        }
+        _key[depth] = data[depth];
+        node = UntagNode(child);
+        depth++;
+    }
+    backward();
+}
+
+void AdaptiveRadixTree::Iterator::Next()
+{
+    assert(Valid());
+    Frame& top = _stack.back();
+    top.pos++;
+    // 同一个叶节点里连续的key不需要走通用的路径
+    if (top.node->type == NODE256 && top.pos < 256 && reinterpret_cast<Node256*>(top.node)->child_ptrs[top.pos] != NULL)
+    {
+        return;
+    }
+    forward();
+}
+
+void AdaptiveRadixTree::Iterator::Prev()
+{
+    assert(Valid());
+    _stack.back().pos--;
+    backward();
+}
+
+uint64_t AdaptiveRadixTree::Iterator::Key()
+{
+    assert(Valid());
+    Frame& top = _stack.back();
+    _key[7] = slotKey(top.node, top.pos);
+    uint64_t key;
+    memcpy(&key, _key, sizeof(key));
+    return __builtin_bswap64(key);
+}
+
+void* AdaptiveRadixTree::Iterator::Value()
+{
+    assert(Valid());
+    Frame& top = _stack.back();
+    return slotChild(top.node, top.pos);
+}
+
+}
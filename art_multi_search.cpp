@@ -0,0 +1,226 @@
+#include "adaptive_radix_tree.h"
+#include "assert.h"
+
+namespace art
+{
+
+// 同时进行的查找个数，太少掩盖不了内存延迟，太多会超出CPU能同时处理的cache miss个数
+static const int kMultiSearchGroup = 16;
+
+enum MultiSearchStage
+{
+    STAGE_IDLE = 0,
+    STAGE_HEADER = 1,       // 节点头
+    STAGE_INDEX48 = 2,      // Node48/Node48Ref的child_ptr_indexs[byte]
+    STAGE_SLOT = 3,         // 指向child的槽位
+};
+
+void AdaptiveRadixTree::multiSearchStart(MultiSearchState* state, uint64_t key, size_t index)
+{
+    state->key = __builtin_bswap64(key);
+    state->index = index;
+    state->node = _root;
+    state->slot = NULL;
+    state->depth = 0;
+    state->stage = STAGE_HEADER;
+    __builtin_prefetch(UntagNode(_root));
+}
+
+// 处理已经prefetch过的部分，然后prefetch下一步要访问的地址，返回true表示查找结束
+bool AdaptiveRadixTree::multiSearchStep(MultiSearchState* state, void** out)
+{
+    unsigned char* data = reinterpret_cast<unsigned char*>(&state->key);
+    // state->node带着tag，节点类型不用从节点头里读
+    Node* node = UntagNode(state->node);
+    NodeType type = TagType(state->node);
+    switch (state->stage)
+    {
+        case STAGE_HEADER:
+        {
+            ART_STAT_INC(descents);
+            if (type == NODE_SINGLE)
+            {
+                out[state->index] = reinterpret_cast<NodeSingle*>(node)->Match(state->key, state->depth);
+                return true;
+            }
+            if (node->prefix_length > 0)
+            {
+                int p = checkPrefix(node, data, state->depth);
+                if (p != node->prefix_length)
+                {
+                    out[state->index] = NULL;
+                    return true;
+                }
+                state->depth += node->prefix_length;
+            }
+            unsigned char byte = data[state->depth];
+            switch (type)
+            {
+                case NODE4:
+                case NODE16:
+                {
+                    // key和节点头在同一个cache line，只需要prefetch指针
+                    state->slot = findChild(node, type, byte);
+                    if (state->slot == NULL)
+                    {
+                        out[state->index] = NULL;
+                        return true;
+                    }
+                    __builtin_prefetch(state->slot);
+                    state->stage = STAGE_SLOT;
+                    return false;
+                }
+                case NODE48:
+                {
+                    __builtin_prefetch(&reinterpret_cast<Node48*>(node)->child_ptr_indexs[byte]);
+                    state->stage = STAGE_INDEX48;
+                    return false;
+                }
+                case NODE48_REF:
+                {
+                    __builtin_prefetch(&reinterpret_cast<Node48Ref*>(node)->child_ptr_indexs[byte]);
+                    state->stage = STAGE_INDEX48;
+                    return false;
+                }
+                case NODE256:
+                {
+                    state->slot = &reinterpret_cast<Node256*>(node)->child_ptrs[byte];
+                    __builtin_prefetch(state->slot);
+                    state->stage = STAGE_SLOT;
+                    return false;
+                }
+                case NODE256_REF:
+                {
+                    uint32_t* slot = &reinterpret_cast<Node256Ref*>(node)->child_refs[byte];
+                    state->slot = handleRef(slot);
+                    __builtin_prefetch(slot);
+                    state->stage = STAGE_SLOT;
+                    return false;
+                }
+                case NODE_EXTENT:
+                {
+                    // run和节点头在同一个cache line
+                    out[state->index] = reinterpret_cast<NodeExtent*>(node)->Find(byte);
+                    return true;
+                }
+                case NODE_DICT:
+                {
+                    out[state->index] = reinterpret_cast<NodeDict*>(node)->Find(byte);
+                    return true;
+                }
+                case NODE_DELTA16:
+                {
+                    out[state->index] = reinterpret_cast<NodeDelta16*>(node)->Find(byte);
+                    return true;
+                }
+                case NODE_DELTA32:
+                {
+                    out[state->index] = reinterpret_cast<NodeDelta32*>(node)->Find(byte);
+                    return true;
+                }
+                default:
+                    assert(0);
+                    return true;
+            }
+        }
+        case STAGE_INDEX48:
+        {
+            if (type == NODE48_REF)
+            {
+                Node48Ref* node48 = reinterpret_cast<Node48Ref*>(node);
+                int index = node48->child_ptr_indexs[data[state->depth]];
+                if (index == 0)
+                {
+                    out[state->index] = NULL;
+                    return true;
+                }
+                state->slot = handleRef(&node48->child_refs[index - 1]);
+                __builtin_prefetch(&node48->child_refs[index - 1]);
+                state->stage = STAGE_SLOT;
+                return false;
+            }
+            Node48* node48 = reinterpret_cast<Node48*>(node);
+            int index = node48->child_ptr_indexs[data[state->depth]];
+            if (index == 0)
+            {
+                out[state->index] = NULL;
+                return true;
+            }
+            state->slot = &node48->child_ptrs[index - 1];
+            __builtin_prefetch(state->slot);
+            state->stage = STAGE_SLOT;
+            return false;
+        }
+        case STAGE_SLOT:
+        {
+            Node* child = childAt(state->slot);
+            // 叶节点的child就是value
+            if (state->depth == 7 || child == NULL)
+            {
+                out[state->index] = child;
+                return true;
+            }
+            __builtin_prefetch(UntagNode(child));
+            state->node = child;
+            state->depth++;
+            state->stage = STAGE_HEADER;
+            return false;
+        }
+    }
+    assert(0);
+    return true;
+}
+
+// 一个查找结束之后马上在它的位置开始下一个key，始终保持kMultiSearchGroup个查找在进行
+void AdaptiveRadixTree::MultiSearch(const uint64_t* keys, size_t n, void** out)
+{
+    if (_concurrent)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            out[i] = Search(keys[i]);
+        }
+        return;
+    }
+
+    ART_STAT_ADD(search_ops, n);
+    MultiSearchState states[kMultiSearchGroup];
+    size_t next = 0;
+    int active = 0;
+    for (int i = 0; i < kMultiSearchGroup; i++)
+    {
+        if (next < n)
+        {
+            multiSearchStart(&states[i], keys[next], next);
+            next++;
+            active++;
+        }
+        else
+        {
+            states[i].stage = STAGE_IDLE;
+        }
+    }
+
+    while (active > 0)
+    {
+        for (int i = 0; i < kMultiSearchGroup; i++)
+        {
+            if (states[i].stage == STAGE_IDLE || !multiSearchStep(&states[i], out))
+            {
+                continue;
+            }
+            if (next < n)
+            {
+                multiSearchStart(&states[i], keys[next], next);
+                next++;
+            }
+            else
+            {
+                states[i].stage = STAGE_IDLE;
+                active--;
+            }
+        }
+    }
+}
+
+}
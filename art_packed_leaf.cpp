@@ -0,0 +1,288 @@
+#include <algorithm>
+#include "adaptive_radix_tree.h"
+#include "assert.h"
+
+namespace art
+{
+
+// packedType按节点大小从小到大尝试
+static_assert(sizeof(Node16) < sizeof(NodeDict) && sizeof(NodeDict) < sizeof(NodeDelta16) &&
+    sizeof(NodeDelta16) < sizeof(Node48) && sizeof(Node48) < sizeof(NodeDelta32) &&
+    sizeof(NodeDelta32) < sizeof(Node256), "leaf node size order");
+
+// 写入[start, start + length)并维护child_count，value为0表示删除
+template <typename T>
+static void setSlots(Node* node, T* slots, unsigned char start, uint32_t length, uint64_t value)
+{
+    for (uint32_t i = 0; i < length; i++)
+    {
+        T& slot = slots[start + i];
+        if (slot == 0 && value != 0)
+        {
+            node->child_count++;
+        }
+        else if (slot != 0 && value == 0)
+        {
+            node->child_count--;
+        }
+        slot = (T)value;
+    }
+}
+
+// 差值放不下时返回false
+template <typename Delta>
+static bool setDeltaRange(Delta* node, unsigned char start, uint32_t length, uint64_t v)
+{
+    uint64_t delta = 0;
+    if (v != 0)
+    {
+        if (v < node->base || v - node->base >= Delta::kMaxDelta)
+        {
+            return false;
+        }
+        delta = v - node->base + 1;
+    }
+    setSlots(&node->header, node->deltas, start, length, delta);
+    return true;
+}
+
+static uint64_t minValue(void* const* slots)
+{
+    uint64_t base = UINT64_MAX;
+    for (int i = 0; i < 256; i++)
+    {
+        if (slots[i] != NULL)
+        {
+            base = std::min(base, reinterpret_cast<uint64_t>(slots[i]));
+        }
+    }
+    return base;
+}
+
+NodeType AdaptiveRadixTree::packedType(void* const* slots)
+{
+    // 超过kMaxValues之后不再统计
+    uint64_t values[NodeDict::kMaxValues];
+    int distinct = 0;
+    int count = 0;
+    uint64_t lo = UINT64_MAX;
+    uint64_t hi = 0;
+    for (int i = 0; i < 256; i++)
+    {
+        uint64_t v = reinterpret_cast<uint64_t>(slots[i]);
+        if (v == 0)
+        {
+            continue;
+        }
+        count++;
+        lo = std::min(lo, v);
+        hi = std::max(hi, v);
+        if (distinct <= NodeDict::kMaxValues && std::find(values, values + distinct, v) == values + distinct)
+        {
+            if (distinct < NodeDict::kMaxValues)
+            {
+                values[distinct] = v;
+            }
+            distinct++;
+        }
+    }
+
+    if (count <= 16)
+    {
+        return properType(count);
+    }
+    if (distinct <= NodeDict::kMaxValues)
+    {
+        return NODE_DICT;
+    }
+    if (hi - lo < NodeDelta16::kMaxDelta)
+    {
+        return NODE_DELTA16;
+    }
+    if (count <= 48)
+    {
+        return NODE48;
+    }
+    if (hi - lo < NodeDelta32::kMaxDelta)
+    {
+        return NODE_DELTA32;
+    }
+    return NODE256;
+}
+
+Node* AdaptiveRadixTree::makePackedLeaf(void* const* slots)
+{
+    NodeType type = packedType(slots);
+    Node* node = makeNode(type);
+    node->SetLeaf(true);
+    switch (type)
+    {
+        case NODE_DICT:
+        {
+            NodeDict* dict = reinterpret_cast<NodeDict*>(node);
+            for (int i = 0; i < 256; i++)
+            {
+                uint64_t v = reinterpret_cast<uint64_t>(slots[i]);
+                if (v == 0)
+                {
+                    continue;
+                }
+                int index = std::find(&dict->values[1], &dict->values[dict->value_count], v) - &dict->values[0];
+                if (index == dict->value_count)
+                {
+                    dict->values[dict->value_count++] = v;
+                }
+                dict->child_indexs[i] = index;
+                node->child_count++;
+            }
+            break;
+        }
+        case NODE_DELTA16:
+        {
+            NodeDelta16* delta = reinterpret_cast<NodeDelta16*>(node);
+            delta->base = minValue(slots);
+            for (int i = 0; i < 256; i++)
+            {
+                setDeltaRange(delta, i, 1, reinterpret_cast<uint64_t>(slots[i]));
+            }
+            break;
+        }
+        case NODE_DELTA32:
+        {
+            NodeDelta32* delta = reinterpret_cast<NodeDelta32*>(node);
+            delta->base = minValue(slots);
+            for (int i = 0; i < 256; i++)
+            {
+                setDeltaRange(delta, i, 1, reinterpret_cast<uint64_t>(slots[i]));
+            }
+            break;
+        }
+        default:
+        {
+            unsigned char keys[256];
+            Node* ptrs[256];
+            int n = 0;
+            for (int i = 0; i < 256; i++)
+            {
+                if (slots[i] != NULL)
+                {
+                    keys[n] = i;
+                    ptrs[n] = reinterpret_cast<Node*>(slots[i]);
+                    n++;
+                }
+            }
+            fillNode(node, n, keys, ptrs);
+            break;
+        }
+    }
+    return node;
+}
+
+// 字典满了或者差值超出范围时按写入后的内容重新选择类型
+void AdaptiveRadixTree::setPackedRange(Node* node, Node** ref, unsigned char start, uint32_t length, void* val)
+{
+    assert(start + length <= 256);
+    uint64_t v = reinterpret_cast<uint64_t>(val);
+    switch (node->type)
+    {
+        case NODE_DICT:
+        {
+            NodeDict* dict = reinterpret_cast<NodeDict*>(node);
+            int index = 0;
+            if (v != 0)
+            {
+                index = std::find(&dict->values[1], &dict->values[dict->value_count], v) - &dict->values[0];
+                if (index == dict->value_count && dict->value_count <= NodeDict::kMaxValues)
+                {
+                    dict->values[dict->value_count++] = v;
+                }
+            }
+            if (index <= NodeDict::kMaxValues)
+            {
+                setSlots(node, dict->child_indexs, start, length, index);
+                return;
+            }
+            break;
+        }
+        case NODE_DELTA16:
+        {
+            if (setDeltaRange(reinterpret_cast<NodeDelta16*>(node), start, length, v))
+            {
+                return;
+            }
+            break;
+        }
+        case NODE_DELTA32:
+        {
+            if (setDeltaRange(reinterpret_cast<NodeDelta32*>(node), start, length, v))
+            {
+                return;
+            }
+            break;
+        }
+        default:
+            assert(0);
+    }
+
+    // 放不下说明val不是NULL，新节点不会是空的
+    void* slots[256];
+    findPackedChildren(node, 0, 256, slots);
+    for (uint32_t i = 0; i < length; i++)
+    {
+        slots[start + i] = val;
+    }
+    Node* newNode = makePackedLeaf(slots);
+    newNode->prefix_length = node->prefix_length;
+    memcpy(newNode->prefix, node->prefix, sizeof(node->prefix));
+    storeChild(ref, newNode);
+    freeNode(node);
+}
+
+void AdaptiveRadixTree::findPackedChildren(const Node* node, unsigned char start, uint32_t length, void** vals)
+{
+    switch (node->type)
+    {
+        case NODE_DICT:
+        {
+            const NodeDict* dict = reinterpret_cast<const NodeDict*>(node);
+            _search_kernel->decodeDict(&dict->child_indexs[start], dict->values, length, vals);
+            break;
+        }
+        case NODE_DELTA16:
+        {
+            const NodeDelta16* delta = reinterpret_cast<const NodeDelta16*>(node);
+            _search_kernel->decodeDelta16(&delta->deltas[start], delta->base, length, vals);
+            break;
+        }
+        case NODE_DELTA32:
+        {
+            const NodeDelta32* delta = reinterpret_cast<const NodeDelta32*>(node);
+            _search_kernel->decodeDelta32(&delta->deltas[start], delta->base, length, vals);
+            break;
+        }
+        default:
+            assert(0);
+    }
+}
+
+void* AdaptiveRadixTree::findCompactChild(const Node* node, unsigned char byte)
+{
+    switch (node->type)
+    {
+        case NODE_EXTENT:
+            return reinterpret_cast<const NodeExtent*>(node)->Find(byte);
+        case NODE_DICT:
+            return reinterpret_cast<const NodeDict*>(node)->Find(byte);
+        case NODE_DELTA16:
+            return reinterpret_cast<const NodeDelta16*>(node)->Find(byte);
+        case NODE_DELTA32:
+            return reinterpret_cast<const NodeDelta32*>(node)->Find(byte);
+        case NODE_SINGLE:
+            return reinterpret_cast<const NodeSingle*>(node)->Find(byte);
+        default:
+            assert(0);
+    }
+    return NULL;
+}
+
+}
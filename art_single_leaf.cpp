@@ -0,0 +1,64 @@
+#include "adaptive_radix_tree.h"
+#include "assert.h"
+
+namespace art
+{
+
+Node* AdaptiveRadixTree::makeSingleLeaf(const Node* header, unsigned char byte, void* val)
+{
+    NodeSingle* single = makeNodeSingle();
+    if (header != NULL)
+    {
+        single->header.prefix_length = header->prefix_length;
+        memcpy(single->header.prefix, header->prefix, sizeof(header->prefix));
+    }
+    reinterpret_cast<unsigned char*>(&single->key)[7] = byte;
+    single->SyncKey();
+    single->value = val;
+    single->header.child_count = 1;
+    return &single->header;
+}
+
+// 第二个key到来之前只修改value，之后换成能放下所有key的普通叶节点，再交给addLeafChild
+void AdaptiveRadixTree::setSingleRange(Node* node, Node** ref, unsigned char start, uint32_t length, void* val)
+{
+    NodeSingle* single = reinterpret_cast<NodeSingle*>(node);
+    unsigned char byte = single->Byte();
+    bool covered = byte >= start && (uint32_t)(byte - start) < length;
+    if (val == NULL || (covered && length == 1))
+    {
+        if (covered)
+        {
+            single->value = val;
+            node->child_count = val != NULL;
+        }
+        return;
+    }
+
+    Node* newNode = makeProperNode(covered ? length : length + 1);
+    NodeType type = newNode->type;
+    memcpy(newNode, node, sizeof(Node));
+    newNode->version = kDirtyBit | kLeafBit;
+    newNode->type = type;
+    newNode->child_count = 0;
+    storeChild(ref, newNode);
+    if (node->child_count > 0)
+    {
+        addLeafChild(newNode, ref, byte, 1, single->value);
+    }
+    freeNode(node);
+    addLeafChild(UntagNode(childAt(ref)), ref, start, length, val);
+}
+
+void AdaptiveRadixTree::findSingleChildren(const Node* node, unsigned char start, uint32_t length, void** vals)
+{
+    const NodeSingle* single = reinterpret_cast<const NodeSingle*>(node);
+    memset(vals, 0, length * sizeof(void*));
+    uint32_t offset = single->Byte() - start;
+    if (node->child_count > 0 && single->Byte() >= start && offset < length)
+    {
+        vals[offset] = single->value;
+    }
+}
+
+}
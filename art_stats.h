@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include "epoch.h"
+
+namespace art
+{
+
+// 树内部的计数器，编译时定义ART_ENABLE_STATS才会计数，否则GetStats()全是0
+struct ArtStats
+{
+    uint64_t    search_ops;         // Search和MultiSearch查找的key个数
+    uint64_t    insert_ops;         // Insert和RangeInsert
+    uint64_t    query_ops;          // RangeQuery
+    uint64_t    descents;           // 下降时访问的节点个数，并发模式下重试的部分也算
+    uint64_t    prefix_mismatches;  // checkPrefix没有完全匹配
+    uint64_t    splits;             // 插入时分裂前缀
+    uint64_t    grows[11];          // 节点换成更大的类型，按原来的NodeType索引
+    uint64_t    leaf_fill[9];       // 普通叶节点写入之后的child个数，第i个桶是[2^i, 2^(i+1))
+};
+
+// 写计数器的线程只有一个，不需要原子的加法，读的时候拿到的是近似值
+static inline void StatAdd(uint64_t* counter, uint64_t n)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static inline int LeafFillBucket(int count)
+{
+    return count <= 1 ? 0 : 31 - __builtin_clz(count);
+}
+
+// 每个线程一份计数器，按CurrentThreadIndex()索引，各自占满cache line
+// 线程退出之后编号被复用，新线程接着累加，总和不受影响
+class StatsCollector
+{
+public:
+    StatsCollector()
+    {
+        memset(_slots, 0, sizeof(_slots));
+    }
+
+    ArtStats* Local()
+    {
+        return &_slots[CurrentThreadIndex()].stats;
+    }
+
+    // 把所有线程的计数器加到out上
+    void Snapshot(ArtStats* out)
+    {
+        uint64_t* sum = reinterpret_cast<uint64_t*>(out);
+        for (int i = 0; i < EpochManager::kMaxThreads; i++)
+        {
+            uint64_t* counters = reinterpret_cast<uint64_t*>(&_slots[i].stats);
+            for (size_t j = 0; j < sizeof(ArtStats) / sizeof(uint64_t); j++)
+            {
+                sum[j] += __atomic_load_n(&counters[j], __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+private:
+    struct alignas(64) Slot
+    {
+        ArtStats    stats;
+    };
+
+    Slot    _slots[EpochManager::kMaxThreads];
+};
+
+}
+
+// 只能在AdaptiveRadixTree的成员函数里使用，关闭时参数不会被求值
+#ifdef ART_ENABLE_STATS
+#define ART_STAT_ADD(field, n) art::StatAdd(&_stats->Local()->field, (n))
+#else
+#define ART_STAT_ADD(field, n) ((void)0)
+#endif
+#define ART_STAT_INC(field) ART_STAT_ADD(field, 1)
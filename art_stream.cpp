@@ -0,0 +1,1155 @@
+#include <unistd.h>
+#include <errno.h>
+#include <queue>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include "adaptive_radix_tree.h"
+#include "assert.h"
+#include "util.h"
+
+namespace art
+{
+
+static const uint32_t kStreamBufferSize = 64 << 10;
+// 最大的节点是Node256的叶节点，缓冲剩余空间不够一个节点时先交给sink
+static const uint32_t kMaxPersistentSize = sizeof(Node256LeafPersistent);
+
+// 序列化格式里节点占用的字节数，由节点头决定
+static uint32_t persistentSize(const Node* header)
+{
+    if (header->IsLeaf())
+    {
+        switch (header->type)
+        {
+            case NODE4:
+                return sizeof(Node4LeafPersistent);
+            case NODE16:
+                return sizeof(Node16LeafPersistent);
+            case NODE48:
+                return sizeof(Node48LeafPersistent);
+            case NODE256:
+                return sizeof(Node256LeafPersistent);
+            default:
+                return 0;
+        }
+    }
+    else
+    {
+        switch (header->type)
+        {
+            case NODE4:
+                return sizeof(Node4Persistent);
+            case NODE16:
+                return sizeof(Node16Persistent);
+            case NODE48:
+                return sizeof(Node48Persistent);
+            case NODE256:
+                return sizeof(Node256Persistent);
+            default:
+                return 0;
+        }
+    }
+    return 0;
+}
+
+// Node48和Node256按key的顺序
+int AdaptiveRadixTree::collectChildren(const Node* node, Node** children, unsigned char* keys)
+{
+    int n = 0;
+    switch (node->type)
+    {
+        case NODE4:
+        {
+            const Node4* n4 = reinterpret_cast<const Node4*>(node);
+            for (; n < node->child_count; n++)
+            {
+                children[n] = UntagNode(n4->child_ptrs[n]);
+                if (keys != NULL)
+                {
+                    keys[n] = n4->child_keys[n];
+                }
+            }
+            break;
+        }
+        case NODE16:
+        {
+            const Node16* n16 = reinterpret_cast<const Node16*>(node);
+            for (; n < node->child_count; n++)
+            {
+                children[n] = UntagNode(n16->child_ptrs[n]);
+                if (keys != NULL)
+                {
+                    keys[n] = n16->child_keys[n];
+                }
+            }
+            break;
+        }
+        case NODE48:
+        {
+            const Node48* n48 = reinterpret_cast<const Node48*>(node);
+            for (int i = 0; i < 256; i++)
+            {
+                if (n48->child_ptr_indexs[i] > 0)
+                {
+                    children[n] = UntagNode(n48->child_ptrs[n48->child_ptr_indexs[i] - 1]);
+                    if (keys != NULL)
+                    {
+                        keys[n] = i;
+                    }
+                    n++;
+                }
+            }
+            break;
+        }
+        case NODE256:
+        {
+            const Node256* n256 = reinterpret_cast<const Node256*>(node);
+            for (int i = 0; i < 256; i++)
+            {
+                if (n256->child_ptrs[i])
+                {
+                    children[n] = UntagNode(n256->child_ptrs[i]);
+                    if (keys != NULL)
+                    {
+                        keys[n] = i;
+                    }
+                    n++;
+                }
+            }
+            break;
+        }
+        case NODE48_REF:
+        {
+            const Node48Ref* n48 = reinterpret_cast<const Node48Ref*>(node);
+            for (int i = 0; i < 256; i++)
+            {
+                if (n48->child_ptr_indexs[i] > 0)
+                {
+                    children[n] = UntagNode(decodeRef(n48->child_refs[n48->child_ptr_indexs[i] - 1]));
+                    if (keys != NULL)
+                    {
+                        keys[n] = i;
+                    }
+                    n++;
+                }
+            }
+            break;
+        }
+        case NODE256_REF:
+        {
+            const Node256Ref* n256 = reinterpret_cast<const Node256Ref*>(node);
+            for (int i = 0; i < 256; i++)
+            {
+                if (n256->child_refs[i])
+                {
+                    children[n] = UntagNode(decodeRef(n256->child_refs[i]));
+                    if (keys != NULL)
+                    {
+                        keys[n] = i;
+                    }
+                    n++;
+                }
+            }
+            break;
+        }
+        default:
+            assert(0);
+            break;
+    }
+    assert(n == node->child_count);
+    return n;
+}
+
+// cursor记录Node48/Node256扫描到的key
+bool AdaptiveRadixTree::attachChild(Node* parent, int j, int* cursor, Node* child)
+{
+    child = TagNode(child);
+    switch (parent->type)
+    {
+        case NODE4:
+            reinterpret_cast<Node4*>(parent)->child_ptrs[j] = child;
+            return true;
+        case NODE16:
+            reinterpret_cast<Node16*>(parent)->child_ptrs[j] = child;
+            return true;
+        case NODE48:
+        {
+            Node48* n48 = reinterpret_cast<Node48*>(parent);
+            while (*cursor < 256 && n48->child_ptr_indexs[*cursor] == 0)
+            {
+                (*cursor)++;
+            }
+            if (*cursor == 256 || n48->child_ptr_indexs[*cursor] > 48)
+            {
+                return false;
+            }
+            n48->child_ptrs[n48->child_ptr_indexs[*cursor] - 1] = child;
+            (*cursor)++;
+            return true;
+        }
+        case NODE256:
+        {
+            Node256* n256 = reinterpret_cast<Node256*>(parent);
+            while (*cursor < 256 && n256->child_bitmap->bitmap[*cursor] == 0)
+            {
+                (*cursor)++;
+            }
+            if (*cursor == 256)
+            {
+                return false;
+            }
+            n256->child_ptrs[*cursor] = child;
+            (*cursor)++;
+            return true;
+        }
+        case NODE48_REF:
+        {
+            Node48Ref* n48 = reinterpret_cast<Node48Ref*>(parent);
+            while (*cursor < 256 && n48->child_ptr_indexs[*cursor] == 0)
+            {
+                (*cursor)++;
+            }
+            if (*cursor == 256 || n48->child_ptr_indexs[*cursor] > 48)
+            {
+                return false;
+            }
+            n48->child_refs[n48->child_ptr_indexs[*cursor] - 1] = encodeRef(child);
+            (*cursor)++;
+            return true;
+        }
+        case NODE256_REF:
+        {
+            Node256Ref* n256 = reinterpret_cast<Node256Ref*>(parent);
+            while (*cursor < 256 && n256->child_refs[*cursor] != Node256Ref::kPendingRef)
+            {
+                (*cursor)++;
+            }
+            if (*cursor == 256)
+            {
+                return false;
+            }
+            n256->child_refs[*cursor] = encodeRef(child);
+            (*cursor)++;
+            return true;
+        }
+        default:
+            return false;
+    }
+    return false;
+}
+
+// Node256的bitmap只在挂child的时候用，Node256Ref里没有用到的标记清掉
+void AdaptiveRadixTree::finishAttach(Node* parent)
+{
+    if (parent->type == NODE256)
+    {
+        Node256* n256 = reinterpret_cast<Node256*>(parent);
+        delete n256->child_bitmap;
+        n256->child_bitmap = NULL;
+    }
+    else if (parent->type == NODE256_REF)
+    {
+        Node256Ref* n256 = reinterpret_cast<Node256Ref*>(parent);
+        for (int i = 0; i < 256; i++)
+        {
+            if (n256->child_refs[i] == Node256Ref::kPendingRef)
+            {
+                n256->child_refs[i] = 0;
+            }
+        }
+    }
+}
+
+static AdaptiveRadixTree::SerializeSink appendToString(std::string* out)
+{
+    return [out](const char* data, size_t size) {
+        out->append(data, size);
+        return true;
+    };
+}
+
+static bool writeFully(int fd, const char* data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t ret = write(fd, data, size);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        data += ret;
+        size -= ret;
+    }
+    return true;
+}
+
+// 固定大小的写缓冲，剩余空间不够一个节点时整段交给sink
+class AdaptiveRadixTree::StreamWriter
+{
+public:
+    explicit StreamWriter(const SerializeSink& sink)
+    : _sink(sink),
+      _used(0),
+      _total(0),
+      _ok(true)
+    {
+        _buf = new char[kStreamBufferSize];
+    }
+
+    ~StreamWriter()
+    {
+        delete[] _buf;
+    }
+
+    // 返回至少size个字节的连续空间，写完之后调用Commit
+    char* Reserve(uint32_t size)
+    {
+        assert(size <= kStreamBufferSize);
+        if (kStreamBufferSize - _used < size)
+        {
+            Flush();
+        }
+        return _buf + _used;
+    }
+
+    void Commit(uint32_t size)
+    {
+        _used += size;
+    }
+
+    void Append(const void* data, uint32_t size)
+    {
+        memcpy(Reserve(size), data, size);
+        Commit(size);
+    }
+
+    bool Flush()
+    {
+        if (_ok && _used > 0)
+        {
+            _ok = _sink(_buf, _used);
+            _total += _used;
+        }
+        _used = 0;
+        return _ok;
+    }
+
+    bool Ok()
+    {
+        return _ok;
+    }
+
+    uint64_t Total()
+    {
+        return _total;
+    }
+
+private:
+    SerializeSink           _sink;
+    char*                   _buf;
+    uint32_t                _used;
+    uint64_t                _total;
+    bool                    _ok;
+};
+
+// 固定大小的读缓冲，保证当前位置之后至少有一个完整的节点
+class AdaptiveRadixTree::StreamReader
+{
+public:
+    explicit StreamReader(const DeserializeSource& source)
+    : _source(source),
+      _begin(0),
+      _end(0),
+      _eof(false)
+    {
+        _buf = new char[kStreamBufferSize];
+    }
+
+    ~StreamReader()
+    {
+        delete[] _buf;
+    }
+
+    // 返回false表示数据不够或者source出错
+    bool Ensure(uint32_t size)
+    {
+        assert(size <= kStreamBufferSize);
+        if (_end - _begin >= size)
+        {
+            return true;
+        }
+        memmove(_buf, _buf + _begin, _end - _begin);
+        _end -= _begin;
+        _begin = 0;
+        while (_end < size && !_eof)
+        {
+            int64_t ret = _source(_buf + _end, kStreamBufferSize - _end);
+            if (ret < 0)
+            {
+                return false;
+            }
+            _eof = ret == 0;
+            _end += ret;
+        }
+        return _end >= size;
+    }
+
+    char* Data()
+    {
+        return _buf + _begin;
+    }
+
+    void Consume(uint32_t size)
+    {
+        assert(_begin + size <= _end);
+        _begin += size;
+    }
+
+    bool Read(void* data, uint32_t size)
+    {
+        if (!Ensure(size))
+        {
+            return false;
+        }
+        memcpy(data, Data(), size);
+        Consume(size);
+        return true;
+    }
+
+private:
+    DeserializeSource           _source;
+    char*                       _buf;
+    uint32_t                    _begin;
+    uint32_t                    _end;
+    bool                        _eof;
+};
+
+// 写出的节点头里dirty总是0，读回来的节点和checkpoint一致
+// 持久化结构里有对齐的空洞，先清零，同一棵树每次序列化的结果完全一样
+// 压缩格式的叶节点展开成普通叶节点写出，Ref节点写成Node48/Node256，格式里只有四种节点
+void AdaptiveRadixTree::writeStreamNode(const Node* node, StreamWriter* writer)
+{
+    alignas(Node256) char expanded[sizeof(Node256)];
+    if (node->type >= NODE_EXTENT)
+    {
+        expandCompactLeaf(node, expanded);
+        node = reinterpret_cast<const Node*>(expanded);
+    }
+    else if (node->type == NODE48_REF || node->type == NODE256_REF)
+    {
+        expandRefNode(node, expanded);
+        node = reinterpret_cast<const Node*>(expanded);
+    }
+    char* pos = writer->Reserve(kMaxPersistentSize);
+    memset(pos, 0, persistentSize(node));
+    int nodeSize = 0;
+    serializationNode(node, pos, nodeSize);
+    // pos不一定对齐，节点头拷出来改完再拷回去
+    Node header;
+    memcpy(&header, pos, sizeof(Node));
+    header.version &= kLeafBit;
+    memcpy(pos, &header, sizeof(Node));
+    writer->Commit(nodeSize);
+}
+
+bool AdaptiveRadixTree::readStreamNode(StreamReader* reader, Node** node)
+{
+    if (!reader->Ensure(sizeof(Node)))
+    {
+        return false;
+    }
+    // 记录按字节紧挨着，节点头不一定对齐
+    Node header;
+    memcpy(&header, reader->Data(), sizeof(Node));
+    uint32_t size = persistentSize(&header);
+    if (header.prefix_length > 6 || size == 0 || !reader->Ensure(size))
+    {
+        return false;
+    }
+    char* pos = reader->Data();
+    deserializationNode(node, &pos);
+    reader->Consume(pos - reader->Data());
+    // 还没有挂到父节点上，可以直接替换
+    if ((_extent_leaf || _packed_leaf || _single_leaf) && (*node)->IsLeaf())
+    {
+        compactLeaf(*node, node);
+        *node = UntagNode(*node);
+    }
+    return true;
+}
+
+// 按层序写出root下面的整棵子树
+void AdaptiveRadixTree::serializeTree(Node* root, StreamWriter* writer)
+{
+    Node* children[256];
+    std::queue<Node*> q;
+    q.push(root);
+    while (writer->Ok() && !q.empty())
+    {
+        Node* n = q.front();
+        q.pop();
+        if (!n->IsLeaf())
+        {
+            int count = collectChildren(n, children);
+            for (int i = 0; i < count; i++)
+            {
+                q.push(children[i]);
+            }
+        }
+        writeStreamNode(n, writer);
+        n->version &= ~kDirtyBit;
+    }
+}
+
+int64_t AdaptiveRadixTree::Serialize(const SerializeSink& sink)
+{
+    assert(_root != NULL);
+    StreamWriter* writer = new StreamWriter(sink);
+    ArtStreamHeader header;
+    header.magic = ArtStreamHeader::kMagic;
+    header.version = ArtStreamHeader::kVersion;
+    writer->Append(&header, sizeof(header));
+    serializeTree(UntagNode(_root), writer);
+    bool ok = writer->Flush();
+    int64_t total = writer->Total();
+    delete writer;
+    _checkpoint_seq = 0;
+    return ok ? total : -1;
+}
+
+int64_t AdaptiveRadixTree::Serialize(int fd)
+{
+    return Serialize([fd](const char* data, size_t size) {
+        return writeFully(fd, data, size);
+    });
+}
+
+// 读出一棵完整的子树，失败时只清理临时的bitmap，已经分配的节点由调用者统一释放
+bool AdaptiveRadixTree::deserializeTree(StreamReader* reader, Node** root)
+{
+    std::queue<Node*> q;
+    bool ok = true;
+    *root = NULL;
+
+    // 父节点先于child出现，按层恢复child指针
+    Node* parent = NULL;
+    int next = 0;
+    int cursor = 0;
+    while (1)
+    {
+        if (*root != NULL)
+        {
+            while (parent == NULL || next == parent->child_count)
+            {
+                if (parent != NULL)
+                {
+                    finishAttach(parent);
+                }
+                parent = NULL;
+                if (q.empty())
+                {
+                    break;
+                }
+                parent = q.front();
+                q.pop();
+                next = 0;
+                cursor = 0;
+                if (parent->IsLeaf())
+                {
+                    parent = NULL;
+                }
+            }
+            if (parent == NULL)
+            {
+                break;
+            }
+        }
+
+        Node* node = NULL;
+        if (!readStreamNode(reader, &node))
+        {
+            ok = false;
+            break;
+        }
+        q.push(node);
+        if (*root == NULL)
+        {
+            *root = node;
+        }
+        else if (!attachChild(parent, next++, &cursor, node))
+        {
+            ok = false;
+            break;
+        }
+    }
+
+    if (!ok)
+    {
+        // 还没处理的Node256内部节点上挂着临时的bitmap
+        if (parent != NULL)
+        {
+            q.push(parent);
+        }
+        while (!q.empty())
+        {
+            Node* n = q.front();
+            q.pop();
+            if (!n->IsLeaf() && n->type == NODE256)
+            {
+                delete reinterpret_cast<Node256*>(n)->child_bitmap;
+            }
+        }
+    }
+    return ok;
+}
+
+int AdaptiveRadixTree::Deserialize(const DeserializeSource& source)
+{
+    assert(_root == NULL);
+    StreamReader* reader = new StreamReader(source);
+    ArtStreamHeader header;
+    Node* root = NULL;
+    bool ok = reader->Read(&header, sizeof(header)) && header.magic == ArtStreamHeader::kMagic &&
+        header.version == ArtStreamHeader::kVersion && deserializeTree(reader, &root);
+    delete reader;
+    _root = root == NULL ? NULL : TagNode(root);
+    if (!ok)
+    {
+        Destroy();
+    }
+    _checkpoint_seq = 0;
+    return ok ? 0 : -1;
+}
+
+int AdaptiveRadixTree::Deserialize(int fd)
+{
+    return Deserialize([fd](char* data, size_t size) -> int64_t {
+        while (1)
+        {
+            ssize_t ret = read(fd, data, size);
+            if (ret >= 0 || errno != EINTR)
+            {
+                return ret;
+            }
+        }
+    });
+}
+
+// 切分层的节点数达到线程数的这么多倍就不再往下切，子树大小不均匀时靠动态分配平衡
+static const size_t kSubtreesPerThread = 8;
+
+// 从fd的[*offset, end)读取，读完返回0
+static int64_t preadRange(int fd, uint64_t* offset, uint64_t end, char* data, size_t size)
+{
+    size_t n = std::min<uint64_t>(size, end - *offset);
+    if (n == 0)
+    {
+        return 0;
+    }
+    while (1)
+    {
+        ssize_t ret = pread(fd, data, n, *offset);
+        if (ret < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (ret > 0)
+        {
+            *offset += ret;
+        }
+        return ret;
+    }
+}
+
+uint64_t AdaptiveRadixTree::serializedSize(const Node* node)
+{
+    Node header = *node;
+    if (node->type >= NODE_EXTENT)
+    {
+        header.type = properType(node->child_count);
+    }
+    else if (node->type == NODE48_REF || node->type == NODE256_REF)
+    {
+        header.type = node->type == NODE48_REF ? NODE48 : NODE256;
+    }
+    uint64_t size = persistentSize(&header);
+    if (!node->IsLeaf())
+    {
+        Node* children[256];
+        int count = collectChildren(node, children);
+        for (int i = 0; i < count; i++)
+        {
+            size += serializedSize(children[i]);
+        }
+    }
+    return size;
+}
+
+int64_t AdaptiveRadixTree::SerializeParallel(int fd, int threads)
+{
+    assert(_root != NULL);
+    // 按层往下找，直到某一层的节点足够多，这一层以上的节点单独写
+    std::vector<Node*> top;
+    std::vector<Node*> level(1, UntagNode(_root));
+    Node* children[256];
+    while (level.size() < kSubtreesPerThread * std::max(threads, 1))
+    {
+        std::vector<Node*> next;
+        for (size_t i = 0; i < level.size(); i++)
+        {
+            if (!level[i]->IsLeaf())
+            {
+                int count = collectChildren(level[i], children);
+                next.insert(next.end(), children, children + count);
+            }
+        }
+        if (next.empty())
+        {
+            break;
+        }
+        top.insert(top.end(), level.begin(), level.end());
+        level.swap(next);
+    }
+
+    std::string topData;
+    StreamWriter* writer = new StreamWriter(appendToString(&topData));
+    for (size_t i = 0; i < top.size(); i++)
+    {
+        writeStreamNode(top[i], writer);
+        top[i]->version &= ~kDirtyBit;
+    }
+    writer->Flush();
+    delete writer;
+
+    // 先算出每个子树的大小，各个线程直接写到自己的位置
+    std::vector<ArtSubtreeEntry> entries(level.size());
+    RunParallel(threads, level.size(), [this, &level, &entries](size_t i) {
+        entries[i].size = serializedSize(level[i]);
+    });
+    uint64_t offset = sizeof(ArtParallelHeader) + entries.size() * sizeof(ArtSubtreeEntry) + topData.size();
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        entries[i].offset = offset;
+        offset += entries[i].size;
+    }
+
+    std::atomic<bool> ok(true);
+    RunParallel(threads, level.size(), [this, fd, &level, &entries, &ok](size_t i) {
+        uint64_t pos = entries[i].offset;
+        StreamWriter* writer = new StreamWriter([fd, &pos](const char* data, size_t size) {
+            bool ret = PwriteFully(fd, data, size, pos);
+            pos += size;
+            return ret;
+        });
+        serializeTree(level[i], writer);
+        if (!writer->Flush() || writer->Total() != entries[i].size)
+        {
+            ok = false;
+        }
+        delete writer;
+    });
+
+    ArtParallelHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = ArtParallelHeader::kMagic;
+    header.version = ArtParallelHeader::kVersion;
+    header.size = offset;
+    header.top_count = top.size();
+    header.top_size = topData.size();
+    header.subtree_count = entries.size();
+    // 头最后写，没写完的文件读不出来
+    uint64_t directory = sizeof(header);
+    if (!ok || !PwriteFully(fd, reinterpret_cast<const char*>(&entries[0]), entries.size() * sizeof(ArtSubtreeEntry), directory) ||
+        !PwriteFully(fd, topData.data(), topData.size(), directory + entries.size() * sizeof(ArtSubtreeEntry)) ||
+        !PwriteFully(fd, reinterpret_cast<const char*>(&header), sizeof(header), 0))
+    {
+        return -1;
+    }
+    _checkpoint_seq = 0;
+    return offset;
+}
+
+int AdaptiveRadixTree::DeserializeParallel(int fd, int threads)
+{
+    assert(_root == NULL);
+    ArtParallelHeader header;
+    uint64_t offset = 0;
+    if (preadRange(fd, &offset, sizeof(header), reinterpret_cast<char*>(&header), sizeof(header)) != sizeof(header) ||
+        header.magic != ArtParallelHeader::kMagic)
+    {
+        // 单线程Serialize的输出
+        offset = 0;
+        return Deserialize([fd, &offset](char* data, size_t size) {
+            return preadRange(fd, &offset, ~0ULL, data, size);
+        });
+    }
+    uint64_t directorySize = header.subtree_count * sizeof(ArtSubtreeEntry);
+    if (header.version != ArtParallelHeader::kVersion || header.subtree_count == 0 ||
+        sizeof(header) + directorySize + header.top_size > header.size)
+    {
+        return -1;
+    }
+    std::vector<ArtSubtreeEntry> entries(header.subtree_count);
+    if (preadRange(fd, &offset, offset + directorySize, reinterpret_cast<char*>(&entries[0]), directorySize) != (int64_t)directorySize)
+    {
+        return -1;
+    }
+
+    std::vector<Node*> subtrees(entries.size(), NULL);
+    std::atomic<bool> ok(true);
+    _parallel_build = true;
+    RunParallel(threads, entries.size(), [this, fd, &entries, &subtrees, &ok](size_t i) {
+        uint64_t pos = entries[i].offset;
+        uint64_t end = entries[i].offset + entries[i].size;
+        StreamReader* reader = new StreamReader([fd, &pos, end](char* data, size_t size) {
+            return preadRange(fd, &pos, end, data, size);
+        });
+        if (!deserializeTree(reader, &subtrees[i]) || pos != end)
+        {
+            ok = false;
+        }
+        delete reader;
+    });
+    _parallel_build = false;
+
+    // 按层序把上层节点读出来，最后一层上层节点的child依次是各个子树
+    uint64_t topEnd = offset + header.top_size;
+    StreamReader* reader = new StreamReader([fd, &offset, topEnd](char* data, size_t size) {
+        return preadRange(fd, &offset, topEnd, data, size);
+    });
+    size_t used = 0;
+    uint64_t topRead = 0;
+    std::queue<Node*> q;
+    Node* parent = NULL;
+    auto nextNode = [&]() -> Node* {
+        Node* node = NULL;
+        if (topRead < header.top_count)
+        {
+            if (readStreamNode(reader, &node))
+            {
+                topRead++;
+                q.push(node);
+            }
+            return node;
+        }
+        return used < subtrees.size() ? subtrees[used++] : NULL;
+    };
+    Node* root = nextNode();
+    if (root == NULL)
+    {
+        ok = false;
+    }
+    else
+    {
+        _root = TagNode(root);
+    }
+    while (ok && !q.empty())
+    {
+        parent = q.front();
+        q.pop();
+        if (parent->IsLeaf())
+        {
+            parent = NULL;
+            continue;
+        }
+        int cursor = 0;
+        for (int j = 0; j < parent->child_count && ok; j++)
+        {
+            Node* child = nextNode();
+            if (child == NULL || !attachChild(parent, j, &cursor, child))
+            {
+                ok = false;
+            }
+        }
+        if (ok)
+        {
+            finishAttach(parent);
+        }
+        if (ok)
+        {
+            parent = NULL;
+        }
+    }
+    delete reader;
+    if (used != subtrees.size() || topRead != header.top_count)
+    {
+        ok = false;
+    }
+
+    if (!ok)
+    {
+        if (parent != NULL)
+        {
+            q.push(parent);
+        }
+        while (!q.empty())
+        {
+            Node* n = q.front();
+            q.pop();
+            if (!n->IsLeaf() && n->type == NODE256)
+            {
+                delete reinterpret_cast<Node256*>(n)->child_bitmap;
+            }
+        }
+        Destroy();
+        return -1;
+    }
+    _checkpoint_seq = 0;
+    return 0;
+}
+
+// 先序写出dirty的子树，写完的节点清掉dirty
+void AdaptiveRadixTree::serializeDeltaNode(Node* node, StreamWriter* writer)
+{
+    bool dirty = (node->version & kDirtyBit) != 0;
+    unsigned char tag = dirty ? ArtDeltaHeader::kDeltaNode : ArtDeltaHeader::kBaseNode;
+    writer->Append(&tag, 1);
+    if (!dirty)
+    {
+        return;
+    }
+    writeStreamNode(node, writer);
+    node->version &= ~kDirtyBit;
+    if (node->IsLeaf())
+    {
+        return;
+    }
+    Node* children[256];
+    int count = collectChildren(node, children);
+    for (int i = 0; i < count && writer->Ok(); i++)
+    {
+        serializeDeltaNode(children[i], writer);
+    }
+}
+
+int64_t AdaptiveRadixTree::SerializeDelta(const SerializeSink& sink)
+{
+    assert(_root != NULL);
+    StreamWriter* writer = new StreamWriter(sink);
+    ArtDeltaHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = ArtDeltaHeader::kMagic;
+    header.version = ArtDeltaHeader::kVersion;
+    header.sequence = _checkpoint_seq + 1;
+    writer->Append(&header, sizeof(header));
+    serializeDeltaNode(UntagNode(_root), writer);
+    bool ok = writer->Flush();
+    int64_t total = writer->Total();
+    delete writer;
+    // 写失败时dirty可能已经清掉了一部分，序号不前进，下一个delta也接不上，只能重新写基准镜像
+    if (!ok)
+    {
+        return -1;
+    }
+    _checkpoint_seq++;
+    return total;
+}
+
+// 上一个checkpoint里从path[0, depth)开始的节点
+Node* AdaptiveRadixTree::findBaseNode(const unsigned char* path, int depth)
+{
+    Node* node = UntagNode(_root);
+    int d = 0;
+    while (d < depth)
+    {
+        if (d + node->prefix_length >= depth || memcmp(&node->prefix[0], &path[d], node->prefix_length) != 0)
+        {
+            return NULL;
+        }
+        d += node->prefix_length;
+        if (node->IsLeaf())
+        {
+            return NULL;
+        }
+        Node** next = findChild(node, path[d]);
+        if (next == NULL || childAt(next) == NULL)
+        {
+            return NULL;
+        }
+        node = UntagNode(childAt(next));
+        d++;
+    }
+    return node;
+}
+
+// path[0, depth)是这个位置上面的key，新节点记在created里，沿用的旧节点记在reused里
+bool AdaptiveRadixTree::applyDeltaNode(StreamReader* reader, unsigned char* path, int depth, Node** out,
+    std::vector<Node*>* created, std::vector<Node*>* reused)
+{
+    unsigned char tag;
+    if (!reader->Read(&tag, 1))
+    {
+        return false;
+    }
+    if (tag == ArtDeltaHeader::kBaseNode)
+    {
+        *out = findBaseNode(path, depth);
+        if (*out == NULL)
+        {
+            return false;
+        }
+        reused->push_back(*out);
+        return true;
+    }
+    if (tag != ArtDeltaHeader::kDeltaNode)
+    {
+        return false;
+    }
+
+    Node* node = NULL;
+    if (!readStreamNode(reader, &node))
+    {
+        return false;
+    }
+    created->push_back(node);
+    *out = node;
+    int end = depth + node->prefix_length;
+    if (end > 7 || node->IsLeaf() != (end == 7))
+    {
+        return false;
+    }
+    if (node->IsLeaf())
+    {
+        return true;
+    }
+
+    // child的key，Node48和Node256按key的顺序
+    unsigned char keys[256];
+    int count = 0;
+    for (int i = 0; i < 256 && count <= node->child_count; i++)
+    {
+        switch (node->type)
+        {
+            case NODE4:
+            case NODE16:
+                if (i < node->child_count)
+                {
+                    keys[count++] = node->type == NODE4 ? reinterpret_cast<Node4*>(node)->child_keys[i] :
+                        reinterpret_cast<Node16*>(node)->child_keys[i];
+                }
+                break;
+            case NODE48:
+                if (reinterpret_cast<Node48*>(node)->child_ptr_indexs[i] > 0)
+                {
+                    keys[count++] = i;
+                }
+                break;
+            case NODE256:
+                if (reinterpret_cast<Node256*>(node)->child_bitmap->bitmap[i])
+                {
+                    keys[count++] = i;
+                }
+                break;
+            case NODE48_REF:
+                if (reinterpret_cast<Node48Ref*>(node)->child_ptr_indexs[i] > 0)
+                {
+                    keys[count++] = i;
+                }
+                break;
+            case NODE256_REF:
+                if (reinterpret_cast<Node256Ref*>(node)->child_refs[i] == Node256Ref::kPendingRef)
+                {
+                    keys[count++] = i;
+                }
+                break;
+            default:
+                return false;
+        }
+    }
+    if (count != node->child_count)
+    {
+        return false;
+    }
+
+    memcpy(&path[depth], &node->prefix[0], node->prefix_length);
+    int cursor = 0;
+    for (int j = 0; j < count; j++)
+    {
+        path[end] = keys[j];
+        Node* child = NULL;
+        if (!applyDeltaNode(reader, path, end + 1, &child, created, reused) || !attachChild(node, j, &cursor, child))
+        {
+            return false;
+        }
+    }
+    finishAttach(node);
+    return true;
+}
+
+// 释放被delta替换掉的旧节点，沿用的子树整个保留
+void AdaptiveRadixTree::releaseReplaced(Node* node, const std::vector<Node*>& reused)
+{
+    if (std::binary_search(reused.begin(), reused.end(), node))
+    {
+        return;
+    }
+    if (!node->IsLeaf())
+    {
+        Node* children[256];
+        int count = collectChildren(node, children);
+        for (int i = 0; i < count; i++)
+        {
+            releaseReplaced(children[i], reused);
+        }
+    }
+    freeNode(node);
+}
+
+int AdaptiveRadixTree::ApplyDelta(const DeserializeSource& source)
+{
+    assert(_root != NULL);
+    StreamReader* reader = new StreamReader(source);
+    ArtDeltaHeader header;
+    std::vector<Node*> created;
+    std::vector<Node*> reused;
+    unsigned char path[8];
+    Node* root = NULL;
+    bool ok = reader->Read(&header, sizeof(header)) && header.magic == ArtDeltaHeader::kMagic &&
+        header.version == ArtDeltaHeader::kVersion && header.sequence == _checkpoint_seq + 1 &&
+        applyDeltaNode(reader, path, 0, &root, &created, &reused);
+    delete reader;
+
+    if (!ok)
+    {
+        for (size_t i = 0; i < created.size(); i++)
+        {
+            Node* node = created[i];
+            if (!node->IsLeaf() && node->type == NODE256)
+            {
+                delete reinterpret_cast<Node256*>(node)->child_bitmap;
+            }
+            freeNode(node);
+        }
+        return -1;
+    }
+
+    std::sort(reused.begin(), reused.end());
+    releaseReplaced(UntagNode(_root), reused);
+    _root = TagNode(root);
+    _checkpoint_seq++;
+    return 0;
+}
+
+int64_t AdaptiveRadixTree::CompactCheckpoints(const DeserializeSource& base, const std::vector<DeserializeSource>& deltas,
+    const SerializeSink& sink)
+{
+    AdaptiveRadixTree* tree = new AdaptiveRadixTree;
+    int64_t ret = tree->Deserialize(base);
+    for (size_t i = 0; i < deltas.size() && ret == 0; i++)
+    {
+        ret = tree->ApplyDelta(deltas[i]);
+    }
+    if (ret == 0)
+    {
+        ret = tree->Serialize(sink);
+    }
+    delete tree;
+    return ret;
+}
+
+}
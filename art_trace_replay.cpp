@@ -0,0 +1,385 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <vector>
+#include "gflags/gflags.h"
+#include "adaptive_radix_tree.h"
+
+// 回放块设备的I/O trace，读对应RangeQuery，写对应RangeInsert
+// trace每行一个请求: timestamp op lba length，字段之间用空格、tab或者逗号分隔
+// op以R/r开头是读，W/w开头是写，其他的行和#开头的行跳过
+// bazel run --config=bench //:art_trace_replay -- --trace=/path/to/trace
+
+DEFINE_string(trace, "", "trace文件");
+DEFINE_uint64(bytes_per_lba, 0, "lba和length是字节数时按这个大小换算成LBA，0表示已经是LBA");
+DEFINE_uint64(report_interval, 1000000, "每回放多少个请求输出一次");
+DEFINE_uint64(max_ops, 0, "最多回放多少个请求，0表示不限制");
+DEFINE_bool(concurrent, false, "Init的concurrent参数");
+DEFINE_bool(extent_leaf, false, "Init的extent_leaf参数");
+DEFINE_bool(packed_leaf, false, "Init的packed_leaf参数");
+DEFINE_bool(single_leaf, false, "Init的single_leaf参数");
+DEFINE_bool(compressed_refs, false, "Init的compressed_refs参数");
+DEFINE_bool(huge_pages, false, "节点内存用大页");
+DEFINE_uint64(prefault_mb, 0, "大页模式下Init时提前写入多少M");
+
+using namespace art;
+
+namespace
+{
+
+enum OpType
+{
+    OP_READ = 0,
+    OP_WRITE = 1,
+    OP_COUNT = 2
+};
+
+const char* kOpNames[OP_COUNT] = {"read", "write"};
+
+uint64_t nowNanos()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct Request
+{
+    double      timestamp;
+    int         op;
+    uint64_t    lba;
+    uint64_t    length;
+};
+
+// 直接在mmap的文件上解析，不拷贝行，也不依赖结尾的'\0'
+class TraceParser
+{
+public:
+    TraceParser(const char* data, size_t size)
+    : _cur(data),
+      _end(data + size),
+      _line(0),
+      _skipped(0)
+    {
+    }
+
+    // 没有更多请求时返回false
+    bool Next(Request* req)
+    {
+        while (_cur < _end)
+        {
+            const char* eol = static_cast<const char*>(memchr(_cur, '\n', _end - _cur));
+            if (eol == NULL)
+            {
+                eol = _end;
+            }
+            const char* p = _cur;
+            _cur = eol + 1;
+            _line++;
+            if (parseLine(p, eol, req))
+            {
+                return true;
+            }
+            skipBlank(&p, eol);
+            if (p != eol && *p != '#')
+            {
+                _skipped++;
+            }
+        }
+        return false;
+    }
+
+    uint64_t Skipped()
+    {
+        return _skipped;
+    }
+
+private:
+    static bool isSeparator(char c)
+    {
+        return c == ' ' || c == '\t' || c == ',' || c == '\r';
+    }
+
+    static void skipBlank(const char** p, const char* end)
+    {
+        while (*p < end && isSeparator(**p))
+        {
+            (*p)++;
+        }
+    }
+
+    static bool parseUint(const char** p, const char* end, uint64_t* out)
+    {
+        skipBlank(p, end);
+        const char* begin = *p;
+        uint64_t v = 0;
+        while (*p < end && **p >= '0' && **p <= '9')
+        {
+            v = v * 10 + (**p - '0');
+            (*p)++;
+        }
+        *out = v;
+        return *p != begin;
+    }
+
+    static bool parseDouble(const char** p, const char* end, double* out)
+    {
+        uint64_t integer;
+        if (!parseUint(p, end, &integer))
+        {
+            return false;
+        }
+        double v = integer;
+        if (*p < end && **p == '.')
+        {
+            (*p)++;
+            double scale = 0.1;
+            while (*p < end && **p >= '0' && **p <= '9')
+            {
+                v += (**p - '0') * scale;
+                scale *= 0.1;
+                (*p)++;
+            }
+        }
+        *out = v;
+        return true;
+    }
+
+    static bool parseLine(const char* p, const char* end, Request* req)
+    {
+        if (!parseDouble(&p, end, &req->timestamp))
+        {
+            return false;
+        }
+        skipBlank(&p, end);
+        if (p == end)
+        {
+            return false;
+        }
+        if (*p == 'R' || *p == 'r')
+        {
+            req->op = OP_READ;
+        }
+        else if (*p == 'W' || *p == 'w')
+        {
+            req->op = OP_WRITE;
+        }
+        else
+        {
+            return false;
+        }
+        while (p < end && !isSeparator(*p))
+        {
+            p++;
+        }
+        return parseUint(&p, end, &req->lba) && parseUint(&p, end, &req->length);
+    }
+
+    const char* _cur;
+    const char* _end;
+    uint64_t    _line;
+    uint64_t    _skipped;
+};
+
+struct Stats
+{
+    LatencyHistogram    latency[OP_COUNT];
+    uint64_t            keys[OP_COUNT];
+    // 请求覆盖的256个key的块数，跨块的请求在树里要拆成多个叶节点处理
+    uint64_t            chunks[OP_COUNT];
+    uint64_t            split_ops[OP_COUNT];
+
+    Stats()
+    {
+        Reset();
+    }
+
+    void Reset()
+    {
+        for (int i = 0; i < OP_COUNT; i++)
+        {
+            latency[i].Reset();
+            keys[i] = 0;
+            chunks[i] = 0;
+            split_ops[i] = 0;
+        }
+    }
+
+    void Merge(const Stats& other)
+    {
+        for (int i = 0; i < OP_COUNT; i++)
+        {
+            latency[i].Merge(other.latency[i]);
+            keys[i] += other.keys[i];
+            chunks[i] += other.chunks[i];
+            split_ops[i] += other.split_ops[i];
+        }
+    }
+};
+
+void printLatency(const char* name, const Stats& stats, int op, double seconds)
+{
+    const LatencyHistogram& h = stats.latency[op];
+    if (h.Count() == 0)
+    {
+        return;
+    }
+    printf("  %-5s ops %llu (%.0f/s) keys %llu (%.0f/s) chunks/op %.2f split %.2f%% "
+        "avg %llu p50 %llu p90 %llu p99 %llu p999 %llu max %llu ns\n",
+        name, (unsigned long long)h.Count(), h.Count() / seconds,
+        (unsigned long long)stats.keys[op], stats.keys[op] / seconds,
+        (double)stats.chunks[op] / h.Count(), 100.0 * stats.split_ops[op] / h.Count(),
+        (unsigned long long)h.Average(), (unsigned long long)h.Percentile(50),
+        (unsigned long long)h.Percentile(90), (unsigned long long)h.Percentile(99),
+        (unsigned long long)h.Percentile(99.9), (unsigned long long)h.Max());
+}
+
+void printReport(const char* title, uint64_t ops, double traceTime, const Stats& stats, double seconds,
+    AdaptiveRadixTree* art, uint64_t lastMemory)
+{
+    uint64_t memory = art->MemoryUsage();
+    printf("%s ops %llu trace_time %.3f elapsed %.3fs memory %llu (%+lld) reserved %llu\n",
+        title, (unsigned long long)ops, traceTime, seconds, (unsigned long long)memory,
+        (long long)(memory - lastMemory), (unsigned long long)art->MemoryReserved());
+    for (int op = 0; op < OP_COUNT; op++)
+    {
+        printLatency(kOpNames[op], stats, op, seconds);
+    }
+    fflush(stdout);
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    gflags::SetUsageMessage("art_trace_replay --trace=<file>");
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+    if (FLAGS_trace.empty())
+    {
+        fprintf(stderr, "--trace is required\n");
+        return 1;
+    }
+
+    int fd = open(FLAGS_trace.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        perror("open trace");
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        perror("stat trace");
+        close(fd);
+        return 1;
+    }
+    const char* data = NULL;
+    if (st.st_size > 0)
+    {
+        void* addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED)
+        {
+            perror("mmap trace");
+            close(fd);
+            return 1;
+        }
+        madvise(addr, st.st_size, MADV_SEQUENTIAL);
+        data = static_cast<const char*>(addr);
+    }
+
+    AdaptiveRadixTree* art = new AdaptiveRadixTree;
+    if (FLAGS_huge_pages)
+    {
+        art->EnableHugePages(FLAGS_prefault_mb << 20);
+    }
+    uint32_t flags = (FLAGS_concurrent ? ART_CONCURRENT : 0) | (FLAGS_extent_leaf ? ART_EXTENT_LEAF : 0) |
+        (FLAGS_packed_leaf ? ART_PACKED_LEAF : 0) | (FLAGS_single_leaf ? ART_SINGLE_LEAF : 0) |
+        (FLAGS_compressed_refs ? ART_COMPRESSED_REFS : 0);
+    if (art->Init(flags) != 0)
+    {
+        fprintf(stderr, "init failed: --concurrent cannot be combined with the leaf or ref compression flags, "
+            "or the arena could not be reserved\n");
+        delete art;
+        close(fd);
+        return 1;
+    }
+
+    TraceParser parser(data, st.st_size);
+    Request req;
+    std::vector<void*> vals;
+    Stats total;
+    Stats interval;
+    uint64_t ops = 0;
+    uint64_t lastMemory = 0;
+    uint64_t start = nowNanos();
+    uint64_t intervalStart = start;
+    double firstTimestamp = -1;
+    double traceTime = 0;
+    while ((FLAGS_max_ops == 0 || ops < FLAGS_max_ops) && parser.Next(&req))
+    {
+        uint64_t lba = req.lba;
+        uint64_t length = req.length;
+        if (FLAGS_bytes_per_lba > 0)
+        {
+            lba = req.lba / FLAGS_bytes_per_lba;
+            length = (req.lba + req.length + FLAGS_bytes_per_lba - 1) / FLAGS_bytes_per_lba - lba;
+        }
+        if (length == 0 || length > UINT32_MAX || lba + length - 1 < lba)
+        {
+            continue;
+        }
+        if (firstTimestamp < 0)
+        {
+            firstTimestamp = req.timestamp;
+        }
+        traceTime = req.timestamp - firstTimestamp;
+
+        uint64_t begin = CycleClock::Now();
+        if (req.op == OP_READ)
+        {
+            art->RangeQuery(lba, length, &vals);
+        }
+        else
+        {
+            // 每次写入一个新的位置，和实际的块存储一样
+            art->RangeInsert(lba, length, reinterpret_cast<void*>(((ops + 1) << 12) | 1));
+        }
+        uint64_t latency = CycleClock::ToNanos(CycleClock::Now() - begin);
+
+        uint64_t chunks = ((lba + length - 1) >> 8) - (lba >> 8) + 1;
+        interval.latency[req.op].Add(latency);
+        interval.keys[req.op] += length;
+        interval.chunks[req.op] += chunks;
+        interval.split_ops[req.op] += chunks > 1;
+        ops++;
+
+        if (FLAGS_report_interval > 0 && ops % FLAGS_report_interval == 0)
+        {
+            uint64_t now = nowNanos();
+            printReport("[interval]", ops, traceTime, interval, (now - intervalStart) / 1e9, art, lastMemory);
+            lastMemory = art->MemoryUsage();
+            total.Merge(interval);
+            interval.Reset();
+            intervalStart = nowNanos();
+        }
+    }
+    total.Merge(interval);
+    printReport("[total]", ops, traceTime, total, (nowNanos() - start) / 1e9, art, 0);
+    if (parser.Skipped() > 0)
+    {
+        printf("skipped %llu malformed lines\n", (unsigned long long)parser.Skipped());
+    }
+
+    art->Destroy();
+    delete art;
+    if (data != NULL)
+    {
+        munmap(const_cast<char*>(data), st.st_size);
+    }
+    close(fd);
+    return 0;
+}
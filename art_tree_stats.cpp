@@ -0,0 +1,185 @@
+#include <algorithm>
+#include "adaptive_radix_tree.h"
+#include "assert.h"
+#include "util.h"
+
+namespace art
+{
+
+// 和SerializeParallel一样，子树个数达到线程数的这么多倍才分给多个线程
+static const size_t kStatsTasksPerThread = 8;
+
+struct AdaptiveRadixTree::StatsTask
+{
+    const Node* node;
+    int         depth;      // node的前缀开始的位置
+    int         level;
+    uint64_t    key;        // depth之前的字节，后面都是0
+};
+
+void ArtTreeStats::Merge(const ArtTreeStats& other)
+{
+    for (int t = 0; t < 11; t++)
+    {
+        ArtTypeStats* dst[2] = {&inner[t], &leaf[t]};
+        const ArtTypeStats* src[2] = {&other.inner[t], &other.leaf[t]};
+        for (int k = 0; k < 2; k++)
+        {
+            dst[k]->count += src[k]->count;
+            dst[k]->bytes += src[k]->bytes;
+            dst[k]->children += src[k]->children;
+            dst[k]->wasted_slots += src[k]->wasted_slots;
+            for (int i = 0; i < 10; i++)
+            {
+                dst[k]->fill[i] += src[k]->fill[i];
+            }
+        }
+    }
+    for (int i = 0; i < 8; i++)
+    {
+        levels[i] += other.levels[i];
+        leaf_levels[i] += other.leaf_levels[i];
+    }
+    for (int i = 0; i < 7; i++)
+    {
+        prefix_lengths[i] += other.prefix_lengths[i];
+    }
+    for (auto it = other.ranges.begin(); it != other.ranges.end(); it++)
+    {
+        ArtRangeStats& range = ranges[it->first];
+        range.nodes += it->second.nodes;
+        range.bytes += it->second.bytes;
+        range.keys += it->second.keys;
+    }
+}
+
+// 压缩格式的叶节点没有固定的槽位，按能放下的key个数算
+static uint32_t slotCapacity(NodeType type)
+{
+    switch (type)
+    {
+        case NODE4:
+            return 4;
+        case NODE16:
+            return 16;
+        case NODE48:
+        case NODE48_REF:
+            return 48;
+        default:
+            return 256;
+    }
+}
+
+// children为NULL时递归统计整棵子树，否则只统计node，把child放进children由调用者处理
+void AdaptiveRadixTree::statsNode(const StatsTask& task, uint64_t lo, uint64_t hi, ArtTreeStats* stats,
+    std::vector<StatsTask>* children)
+{
+    const Node* node = task.node;
+    uint64_t key = task.key;
+    for (int i = 0; i < node->prefix_length; i++)
+    {
+        key |= (uint64_t)node->prefix[i] << (56 - 8 * (task.depth + i));
+    }
+    int depth = task.depth + node->prefix_length;
+    assert(depth <= 7);
+    if ((key | (~0ULL >> (8 * depth))) < lo || key > hi)
+    {
+        return;
+    }
+
+    if (key >= lo)
+    {
+        bool leaf = node->IsLeaf();
+        ArtTypeStats* type = leaf ? &stats->leaf[node->type] : &stats->inner[node->type];
+        uint32_t bytes = nodeSize(node->type);
+        uint32_t capacity = slotCapacity(node->type);
+        type->count++;
+        type->bytes += bytes;
+        type->children += node->child_count;
+        if (node->type < NODE_EXTENT)
+        {
+            type->wasted_slots += capacity - node->child_count;
+        }
+        type->fill[std::min<uint32_t>(9, node->child_count * 10 / capacity)]++;
+        stats->levels[task.level]++;
+        if (leaf)
+        {
+            stats->leaf_levels[task.level]++;
+        }
+        stats->prefix_lengths[node->prefix_length]++;
+        uint64_t start = stats->range_bits >= 64 ? 0 : (key >> stats->range_bits) << stats->range_bits;
+        ArtRangeStats& range = stats->ranges[start];
+        range.nodes++;
+        range.bytes += bytes;
+        if (leaf)
+        {
+            range.keys += node->child_count;
+        }
+    }
+
+    if (node->IsLeaf())
+    {
+        return;
+    }
+    Node* nodes[256];
+    unsigned char bytes[256];
+    int count = collectChildren(node, nodes, bytes);
+    for (int i = 0; i < count; i++)
+    {
+        StatsTask child = {nodes[i], depth + 1, task.level + 1, key | (uint64_t)bytes[i] << (56 - 8 * depth)};
+        if (children != NULL)
+        {
+            children->push_back(child);
+        }
+        else
+        {
+            statsNode(child, lo, hi, stats, NULL);
+        }
+    }
+}
+
+void AdaptiveRadixTree::ComputeStats(ArtTreeStats* stats, int threads, uint64_t lo, uint64_t hi)
+{
+    if (_root == NULL || lo > hi)
+    {
+        return;
+    }
+    StatsTask root = {UntagNode(_root), 0, 0, 0};
+    if (threads <= 1)
+    {
+        statsNode(root, lo, hi, stats, NULL);
+        return;
+    }
+
+    // 按层往下展开，展开过的节点在当前线程统计，剩下的子树分给各个线程
+    std::vector<StatsTask> level(1, root);
+    bool expanded = true;
+    while (expanded && level.size() < kStatsTasksPerThread * threads)
+    {
+        std::vector<StatsTask> next;
+        expanded = false;
+        for (size_t i = 0; i < level.size(); i++)
+        {
+            if (level[i].node->IsLeaf())
+            {
+                next.push_back(level[i]);
+                continue;
+            }
+            statsNode(level[i], lo, hi, stats, &next);
+            expanded = true;
+        }
+        level.swap(next);
+    }
+
+    std::vector<ArtTreeStats> partial(level.size());
+    RunParallel(threads, level.size(), [this, &level, &partial, stats, lo, hi](size_t i) {
+        partial[i].range_bits = stats->range_bits;
+        statsNode(level[i], lo, hi, &partial[i], NULL);
+    });
+    for (size_t i = 0; i < partial.size(); i++)
+    {
+        stats->Merge(partial[i]);
+    }
+}
+
+}
@@ -1,12 +1,21 @@
 #define private public
 #include "adaptive_radix_tree.h"
+#include "read_only_art_view.h"
+#include "write_ahead_log.h"
 #define private private
 #include "gtest/gtest.h"
 #include "util.h"
 #include <map>
 #include <unordered_map>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <random>
+#include <algorithm>
+#include <memory>
 #include <emmintrin.h>
 #include <fcntl.h>
+#include <unistd.h>
 
 using namespace art;
 
@@ -262,8 +271,8 @@ static void ArtBench(BenchMode mode, uint64_t keycount)
     }
 
     uint64_t search_end = NowMicros();
-    printf("%s pattern memory size per key %.2fB memory %ldB keys %ld insert %.2f lookup %.2f\n",
-            mode == 0 ? "sparse" : "dense", art->MemoryUsage() / (float)keycount, art->MemoryUsage(), keycount,
+    printf("%s pattern memory size per key %.2fB memory %ldB reserved %ldB keys %ld insert %.2f lookup %.2f\n",
+            mode == 0 ? "sparse" : "dense", art->MemoryUsage() / (float)keycount, art->MemoryUsage(), art->MemoryReserved(), keycount,
             (insert_end - insert_start) / (float)keycount, (search_end - insert_end)/ (float)keycount);
     art->Destroy();
     delete art;
@@ -475,7 +484,7 @@ TEST(art, LeafNode_Expand_4_16)
     AdaptiveRadixTree* art = new AdaptiveRadixTree;
     art->Init();
 
-    Node4* node4 = new Node4;
+    Node4* node4 = art->makeNode4();
     art->addChild4(node4, NULL, 10, (void*)10);
     art->addChild4(node4, NULL, 34, (void*)34);
     art->addChild4(node4, NULL, 222, (void*)222);
@@ -484,7 +493,7 @@ TEST(art, LeafNode_Expand_4_16)
     EXPECT_EQ(*art->findChild(node, 10), (void*)10);
     EXPECT_EQ(*art->findChild(node, 34), (void*)34);
     EXPECT_EQ(*art->findChild(node, 222), (void*)222);
-    delete node;
+    art->freeNode(node);
 
     art->Destroy();
     delete art;
@@ -495,7 +504,7 @@ TEST(art, LeafNode_Expand_4_48)
     AdaptiveRadixTree* art = new AdaptiveRadixTree;
     art->Init();
 
-    Node4* node4 = new Node4;
+    Node4* node4 = art->makeNode4();
     art->addChild4(node4, NULL, 10, (void*)10);
     art->addChild4(node4, NULL, 34, (void*)34);
     art->addChild4(node4, NULL, 222, (void*)222);
@@ -504,7 +513,7 @@ TEST(art, LeafNode_Expand_4_48)
     EXPECT_EQ(*art->findChild(node, 10), (void*)10);
     EXPECT_EQ(*art->findChild(node, 34), (void*)34);
     EXPECT_EQ(*art->findChild(node, 222), (void*)222);
-    delete node;
+    art->freeNode(node);
 
     art->Destroy();
     delete art;
@@ -515,7 +524,7 @@ TEST(art, LeafNode_Expand_4_256)
     AdaptiveRadixTree* art = new AdaptiveRadixTree;
     art->Init();
 
-    Node4* node4 = new Node4;
+    Node4* node4 = art->makeNode4();
     art->addChild4(node4, NULL, 10, (void*)10);
     art->addChild4(node4, NULL, 34, (void*)34);
     art->addChild4(node4, NULL, 222, (void*)222);
@@ -524,7 +533,7 @@ TEST(art, LeafNode_Expand_4_256)
     EXPECT_EQ(*art->findChild(node, 10), (void*)10);
     EXPECT_EQ(*art->findChild(node, 34), (void*)34);
     EXPECT_EQ(*art->findChild(node, 222), (void*)222);
-    delete node;
+    art->freeNode(node);
 
     art->Destroy();
     delete art;
@@ -535,7 +544,7 @@ TEST(art, LeafNode_Expand_16_48)
     AdaptiveRadixTree* art = new AdaptiveRadixTree;
     art->Init();
 
-    Node16* node16 = new Node16;
+    Node16* node16 = art->makeNode16();
     art->addChild16(node16, NULL, 10, (void*)10);
     art->addChild16(node16, NULL, 34, (void*)34);
     art->addChild16(node16, NULL, 222, (void*)222);
@@ -544,7 +553,7 @@ TEST(art, LeafNode_Expand_16_48)
     EXPECT_EQ(*art->findChild(node, 10), (void*)10);
     EXPECT_EQ(*art->findChild(node, 34), (void*)34);
     EXPECT_EQ(*art->findChild(node, 222), (void*)222);
-    delete node;
+    art->freeNode(node);
 
     art->Destroy();
     delete art;
@@ -555,7 +564,7 @@ TEST(art, LeafNode_Expand_16_256)
     AdaptiveRadixTree* art = new AdaptiveRadixTree;
     art->Init();
 
-    Node16* node16 = new Node16;
+    Node16* node16 = art->makeNode16();
     art->addChild16(node16, NULL, 10, (void*)10);
     art->addChild16(node16, NULL, 34, (void*)34);
     art->addChild16(node16, NULL, 222, (void*)222);
@@ -568,7 +577,7 @@ TEST(art, LeafNode_Expand_16_256)
     EXPECT_EQ(*art->findChild(node, 222), (void*)222);
     EXPECT_EQ(*art->findChild(node, 230), (void*)230);
     EXPECT_EQ(*art->findChild(node, 254), (void*)254);
-    delete node;
+    art->freeNode(node);
 
     art->Destroy();
     delete art;
@@ -579,7 +588,7 @@ TEST(art, LeafNode_Expand_48_256)
     AdaptiveRadixTree* art = new AdaptiveRadixTree;
     art->Init();
 
-    Node48* node48 = new Node48;
+    Node48* node48 = art->makeNode48();
     art->addChild48(node48, NULL, 10, (void*)10);
     art->addChild48(node48, NULL, 34, (void*)34);
     art->addChild48(node48, NULL, 35, (void*)35);
@@ -596,13 +605,13 @@ TEST(art, LeafNode_Expand_48_256)
     EXPECT_EQ(*art->findChild(node, 200), (void*)200);
     EXPECT_EQ(*art->findChild(node, 254), (void*)254);
     EXPECT_EQ(*art->findChild(node, 255), (void*)255);
-    delete node;
+    art->freeNode(node);
 
     art->Destroy();
     delete art;
 }
 
-static bool checkChild(AdaptiveRadixTree* art, Node* node, uint8_t start, uint8_t length, void* expected)
+static void checkChild(AdaptiveRadixTree* art, Node* node, uint8_t start, uint8_t length, void* expected)
 {
     for (int i = 0; i < length; i++)
     {
@@ -699,13 +708,13 @@ TEST(art, DISABLED_LeafNode_Leaf16_Insert)
     delete art;
 }
 
-static bool checkValueRange(AdaptiveRadixTree* art, uint64_t start, uint8_t length, void* expect_val, std::vector<void*>* expect_vals = NULL)
+static void checkValueRange(AdaptiveRadixTree* art, uint64_t start, uint32_t length, void* expect_val, std::vector<void*>* expect_vals = NULL)
 {
     std::vector<void*> vals;
     art->RangeQuery(start, length, &vals);
     EXPECT_EQ(vals.size(), (size_t)length);
 
-    for (int i = 0; i < length; i++)
+    for (uint32_t i = 0; i < length; i++)
     {
         if (expect_vals != NULL)
         {
@@ -844,6 +853,631 @@ TEST(art, RangeInsert_Random)
     delete art;
 }
 
+TEST(art, DeleteRange_Shrink)
+{
+    AdaptiveRadixTree* art = new AdaptiveRadixTree;
+    art->Init();
+
+    uint64_t base = 0x123456789A00UL;
+    art->RangeInsert(base, 256, (void*)12345);
+    Node* leaf = UntagNode(*art->findChild(UntagNode(art->_root), 0));
+    EXPECT_EQ(leaf->type, NODE256);
+
+    // 48个还不会缩小，低于阈值才缩小
+    art->DeleteRange(base, 208);
+    leaf = UntagNode(*art->findChild(UntagNode(art->_root), 0));
+    EXPECT_EQ(leaf->type, NODE256);
+    art->DeleteRange(base + 208, 11);
+    leaf = UntagNode(*art->findChild(UntagNode(art->_root), 0));
+    EXPECT_EQ(leaf->type, NODE48);
+    EXPECT_EQ(leaf->child_count, 37);
+    checkValueRange(art, base, 219, NULL);
+    checkValueRange(art, base + 219, 37, (void*)12345);
+
+    art->DeleteRange(base + 219, 25);
+    leaf = UntagNode(*art->findChild(UntagNode(art->_root), 0));
+    EXPECT_EQ(leaf->type, NODE16);
+    art->DeleteRange(base + 244, 9);
+    leaf = UntagNode(*art->findChild(UntagNode(art->_root), 0));
+    EXPECT_EQ(leaf->type, NODE4);
+    checkValueRange(art, base + 253, 3, (void*)12345);
+
+    // 再插回去不会马上缩小
+    art->RangeInsert(base + 240, 13, (void*)22222);
+    leaf = UntagNode(*art->findChild(UntagNode(art->_root), 0));
+    EXPECT_EQ(leaf->type, NODE16);
+    art->DeleteRange(base + 240, 1);
+    leaf = UntagNode(*art->findChild(UntagNode(art->_root), 0));
+    EXPECT_EQ(leaf->type, NODE16);
+
+    art->DeleteRange(base, 256);
+    EXPECT_EQ(UntagNode(art->_root)->child_count, 0);
+    EXPECT_EQ(art->MemoryUsage(), sizeof(Node4));
+
+    art->Destroy();
+    delete art;
+}
+
+// 写入NULL等同于删除，不能留下空的叶节点
+TEST(art, Insert_Null)
+{
+    const uint32_t flags[] = {0, ART_CONCURRENT, ART_EXTENT_LEAF | ART_PACKED_LEAF | ART_SINGLE_LEAF};
+    for (size_t mode = 0; mode < sizeof(flags) / sizeof(flags[0]); mode++)
+    {
+        AdaptiveRadixTree* art = new AdaptiveRadixTree;
+        art->Init(flags[mode]);
+        uint64_t empty = art->MemoryUsage();
+
+        // 不存在的key
+        for (uint64_t i = 0; i < 1000; i++)
+        {
+            art->Insert(i * 0x10001, NULL);
+        }
+        art->RangeInsert(0x123456789A00UL, 1000, NULL);
+        EXPECT_EQ(art->MemoryUsage(), empty);
+        EXPECT_EQ(art->Search(0x10001), (void*)NULL);
+
+        // 已经存在的key
+        uint64_t base = 0x123456789A00UL;
+        art->RangeInsert(base, 600, (void*)12345);
+        for (uint64_t i = 0; i < 300; i++)
+        {
+            art->Insert(base + i, NULL);
+        }
+        checkValueRange(art, base, 300, NULL);
+        checkValueRange(art, base + 300, 300, (void*)12345);
+        art->RangeInsert(base + 300, 300, NULL);
+        checkValueRange(art, base, 600, NULL);
+        if (!(flags[mode] & ART_CONCURRENT))
+        {
+            EXPECT_EQ(art->MemoryUsage(), empty);
+        }
+
+        art->Destroy();
+        delete art;
+    }
+}
+
+TEST(art, DeleteRange_Merge)
+{
+    AdaptiveRadixTree* art = new AdaptiveRadixTree;
+    art->Init();
+
+    art->Insert(0x010000UL, (void*)1);
+    art->Insert(0x020000UL, (void*)2);
+    art->Insert(0x020001UL, (void*)3);
+    EXPECT_EQ(art->MemoryUsage(), 4 * sizeof(Node4));
+
+    art->DeleteRange(0x020000UL, 2);
+    EXPECT_EQ(art->MemoryUsage(), 2 * sizeof(Node4));
+    Node* leaf = UntagNode(*art->findChild(UntagNode(art->_root), 0));
+    EXPECT_TRUE(leaf->IsLeaf());
+    EXPECT_EQ(leaf->prefix_length, 6);
+    EXPECT_EQ(art->Search(0x010000UL), (void*)1);
+    EXPECT_EQ(art->Search(0x020000UL), (void*)NULL);
+    EXPECT_EQ(art->Search(0x010001UL), (void*)NULL);
+
+    // 合并之后的前缀仍然可以正常分裂
+    art->Insert(0x010100UL, (void*)4);
+    EXPECT_EQ(art->Search(0x010000UL), (void*)1);
+    EXPECT_EQ(art->Search(0x010100UL), (void*)4);
+
+    art->DeleteRange(0x010000UL, 1);
+    art->DeleteRange(0x010100UL, 1);
+    EXPECT_EQ(art->MemoryUsage(), sizeof(Node4));
+
+    art->Destroy();
+    delete art;
+}
+
+TEST(art, DeleteRange_Random)
+{
+    AdaptiveRadixTree* art = new AdaptiveRadixTree;
+    art->Init();
+
+    std::map<uint64_t, void*> verifyMap;
+    std::vector<uint64_t> starts;
+    for (int i = 0; i < 20000; i++)
+    {
+        uint64_t start = (uint64_t)(rand() % 64) << 24 | (uint64_t)(rand() % 64) << 8 | rand() % 256;
+        uint32_t length = std::max(1U, rand() % (256 - (uint32_t)(start % 256)));
+        void* ptr = (void*)(uint64_t)(rand() | 1);
+        art->RangeInsert(start, length, ptr);
+        for (uint32_t j = 0; j < length; j++)
+        {
+            verifyMap[start + j] = ptr;
+        }
+        starts.push_back(start);
+    }
+    uint64_t peak = art->MemoryUsage();
+
+    for (int i = 0; i < 20000; i++)
+    {
+        uint64_t start = starts[rand() % starts.size()];
+        uint32_t length = std::max(1U, rand() % (256 - (uint32_t)(start % 256)));
+        art->DeleteRange(start, length);
+        for (uint32_t j = 0; j < length; j++)
+        {
+            verifyMap.erase(start + j);
+        }
+    }
+    EXPECT_LT(art->MemoryUsage(), peak);
+
+    for (size_t i = 0; i < starts.size(); i++)
+    {
+        for (uint64_t key = starts[i]; key < starts[i] + 4; key++)
+        {
+            std::map<uint64_t, void*>::iterator iter = verifyMap.find(key);
+            EXPECT_EQ(art->Search(key), iter == verifyMap.end() ? NULL : iter->second);
+        }
+    }
+
+    for (size_t i = 0; i < starts.size(); i++)
+    {
+        art->DeleteRange(starts[i] & ~0xFFUL, 256);
+    }
+    EXPECT_EQ(UntagNode(art->_root)->child_count, 0);
+    EXPECT_EQ(art->MemoryUsage(), sizeof(Node4));
+
+    art->Destroy();
+    delete art;
+}
+
+TEST(art, RangeInsert_Unaligned)
+{
+    AdaptiveRadixTree* art = new AdaptiveRadixTree;
+    art->Init();
+
+    // 跨越多个叶节点，并且中间的叶节点还不存在
+    art->RangeInsert(0x10F0UL, 1000, (void*)11111);
+    checkValueRange(art, 0x10F0UL, 1000, (void*)11111);
+    checkValueRange(art, 0x10F0UL - 16, 16, NULL);
+    checkValueRange(art, 0x10F0UL + 1000, 16, NULL);
+
+    // 跨越前缀不同的子树，需要分裂前缀
+    art->RangeInsert(0x12345678FFF0UL, 100000, (void*)22222);
+    checkValueRange(art, 0x12345678FFF0UL, 100000, (void*)22222);
+    art->RangeInsert(0x12345678FFF0UL + 50000, 300, (void*)33333);
+    checkValueRange(art, 0x12345678FFF0UL + 50000, 300, (void*)33333);
+    checkValueRange(art, 0x12345678FFF0UL + 50300, 49700, (void*)22222);
+
+    art->DeleteRange(0x12345678FFF0UL + 10, 99980);
+    checkValueRange(art, 0x12345678FFF0UL, 10, (void*)22222);
+    checkValueRange(art, 0x12345678FFF0UL + 10, 99980, NULL);
+    checkValueRange(art, 0x12345678FFF0UL + 99990, 10, (void*)22222);
+    art->DeleteRange(0, 0xFFFFFFFFUL);
+    art->DeleteRange(0x12345678FFF0UL, 100000);
+    EXPECT_EQ(art->MemoryUsage(), sizeof(Node4));
+
+    art->Destroy();
+    delete art;
+
+    // 空区间什么都不写，和RangeQuery、DeleteRange一样
+    const uint32_t flags[] = {0, ART_CONCURRENT};
+    for (size_t mode = 0; mode < sizeof(flags) / sizeof(flags[0]); mode++)
+    {
+        art = new AdaptiveRadixTree;
+        art->Init(flags[mode]);
+        art->RangeInsert(0x10F0UL, 0, (void*)44444);
+        art->RangeInsert(UINT64_MAX, 0, (void*)44444);
+        EXPECT_EQ(art->MemoryUsage(), sizeof(Node4));
+        checkValueRange(art, 0x10F0UL, 1, NULL);
+        art->Destroy();
+        delete art;
+    }
+}
+
+TEST(art, RangeInsert_Unaligned_Random)
+{
+    AdaptiveRadixTree* art = new AdaptiveRadixTree;
+    art->Init();
+
+    std::map<uint64_t, void*> verifyMap;
+    for (int i = 0; i < 5000; i++)
+    {
+        uint64_t start = (uint64_t)(rand() % 16) << 32 | (uint64_t)(rand() % 1024) << 12 | rand() % 4096;
+        uint32_t length = 1 + rand() % 3000;
+        void* ptr = (void*)(uint64_t)(rand() | 1);
+        if (i % 4 == 3)
+        {
+            art->DeleteRange(start, length);
+            verifyMap.erase(verifyMap.lower_bound(start), verifyMap.lower_bound(start + length));
+        }
+        else
+        {
+            art->RangeInsert(start, length, ptr);
+            for (uint32_t j = 0; j < length; j++)
+            {
+                verifyMap[start + j] = ptr;
+            }
+        }
+
+        if (i % 100 == 0)
+        {
+            uint64_t queryStart = start + rand() % 1024 - 512;
+            uint32_t queryLength = 1 + rand() % 4000;
+            std::vector<void*> vals;
+            art->RangeQuery(queryStart, queryLength, &vals);
+            ASSERT_EQ(vals.size(), queryLength);
+            for (uint32_t j = 0; j < queryLength; j++)
+            {
+                std::map<uint64_t, void*>::iterator iter = verifyMap.find(queryStart + j);
+                ASSERT_EQ(vals[j], iter == verifyMap.end() ? NULL : iter->second) << "key " << queryStart + j;
+            }
+        }
+    }
+
+    for (std::map<uint64_t, void*>::iterator iter = verifyMap.begin(); iter != verifyMap.end(); iter++)
+    {
+        ASSERT_EQ(art->Search(iter->first), iter->second);
+    }
+    art->DeleteRange(0, 0xFFFFFFFFU);
+    for (uint64_t high = 1; high < 16; high++)
+    {
+        art->DeleteRange(high << 32, 0xFFFFFFFFU);
+        art->DeleteRange((high << 32) + 0xFFFFFFFFU, 1);
+    }
+    EXPECT_EQ(art->MemoryUsage(), sizeof(Node4));
+
+    art->Destroy();
+    delete art;
+}
+
+// 跨越多个叶节点的区间一次下降写入，和按叶节点拆开写入的结果一样，性能对比在BM_WideExtentInsert/BM_WideExtentQuery
+TEST(art, RangeInsert_Extent)
+{
+    const uint32_t kExtentKeys = 2048;
+    const int kExtents = 500;
+    AdaptiveRadixTree* single = new AdaptiveRadixTree;
+    single->Init();
+    AdaptiveRadixTree* chunked = new AdaptiveRadixTree;
+    chunked->Init();
+    std::vector<uint64_t> starts(kExtents);
+    for (int i = 0; i < kExtents; i++)
+    {
+        starts[i] = ((uint64_t)rand() << 16 | rand()) * 4096 + rand() % 4096;
+        void* ptr = (void*)(uint64_t)(i + 1);
+        single->RangeInsert(starts[i], kExtentKeys, ptr);
+        uint64_t cursor = starts[i];
+        uint64_t end = starts[i] + kExtentKeys;
+        while (cursor < end)
+        {
+            uint32_t length = std::min<uint64_t>(end - cursor, 256 - cursor % 256);
+            chunked->RangeInsert(cursor, length, ptr);
+            cursor += length;
+        }
+    }
+
+    std::vector<void*> expect;
+    std::vector<void*> actual;
+    for (int i = 0; i < kExtents; i++)
+    {
+        chunked->RangeQuery(starts[i] - 100, kExtentKeys + 200, &expect);
+        single->RangeQuery(starts[i] - 100, kExtentKeys + 200, &actual);
+        ASSERT_TRUE(expect == actual);
+    }
+    EXPECT_EQ(single->MemoryUsage(), chunked->MemoryUsage());
+
+    single->Destroy();
+    delete single;
+    chunked->Destroy();
+    delete chunked;
+}
+
+TEST(art, Iterator)
+{
+    AdaptiveRadixTree* art = new AdaptiveRadixTree;
+    art->Init();
+
+    AdaptiveRadixTree::Iterator iter(art);
+    iter.SeekToFirst();
+    EXPECT_FALSE(iter.Valid());
+    iter.SeekForPrev(~0UL);
+    EXPECT_FALSE(iter.Valid());
+
+    std::map<uint64_t, void*> verifyMap;
+    for (int i = 0; i < 3000; i++)
+    {
+        uint64_t start = (uint64_t)(rand() % 4) << 40 | (uint64_t)(rand() % 64) << 16 | rand() % 65536;
+        uint32_t length = 1 + rand() % (i % 10 == 0 ? 1000 : 50);
+        void* ptr = (void*)(uint64_t)(rand() | 1);
+        if (i % 5 == 4)
+        {
+            art->DeleteRange(start, length);
+            verifyMap.erase(verifyMap.lower_bound(start), verifyMap.lower_bound(start + length));
+        }
+        else if (i % 7 == 6)
+        {
+            // 写入NULL的key不会被遍历到
+            art->RangeInsert(start, length, NULL);
+            verifyMap.erase(verifyMap.lower_bound(start), verifyMap.lower_bound(start + length));
+        }
+        else
+        {
+            art->RangeInsert(start, length, ptr);
+            for (uint32_t j = 0; j < length; j++)
+            {
+                verifyMap[start + j] = ptr;
+            }
+        }
+    }
+
+    std::map<uint64_t, void*>::iterator expect = verifyMap.begin();
+    for (iter.SeekToFirst(); iter.Valid(); iter.Next(), expect++)
+    {
+        ASSERT_TRUE(expect != verifyMap.end());
+        ASSERT_EQ(iter.Key(), expect->first);
+        ASSERT_EQ(iter.Value(), expect->second);
+    }
+    EXPECT_TRUE(expect == verifyMap.end());
+
+    std::map<uint64_t, void*>::reverse_iterator rexpect = verifyMap.rbegin();
+    for (iter.SeekToLast(); iter.Valid(); iter.Prev(), rexpect++)
+    {
+        ASSERT_TRUE(rexpect != verifyMap.rend());
+        ASSERT_EQ(iter.Key(), rexpect->first);
+    }
+    EXPECT_TRUE(rexpect == verifyMap.rend());
+
+    for (int i = 0; i < 10000; i++)
+    {
+        uint64_t key = (uint64_t)(rand() % 5) << 40 | (uint64_t)(rand() % 65) << 16 | rand() % 65536;
+        expect = verifyMap.lower_bound(key);
+        iter.Seek(key);
+        ASSERT_EQ(iter.Valid(), expect != verifyMap.end());
+        if (iter.Valid())
+        {
+            ASSERT_EQ(iter.Key(), expect->first);
+            // 换个方向走一步
+            iter.Prev();
+            if (expect == verifyMap.begin())
+            {
+                ASSERT_FALSE(iter.Valid());
+            }
+            else
+            {
+                ASSERT_EQ(iter.Key(), (--expect)->first);
+            }
+        }
+
+        expect = verifyMap.upper_bound(key);
+        iter.SeekForPrev(key);
+        ASSERT_EQ(iter.Valid(), expect != verifyMap.begin());
+        if (iter.Valid())
+        {
+            expect--;
+            ASSERT_EQ(iter.Key(), expect->first);
+            iter.Next();
+            expect++;
+            ASSERT_EQ(iter.Valid(), expect != verifyMap.end());
+            if (iter.Valid())
+            {
+                ASSERT_EQ(iter.Key(), expect->first);
+            }
+        }
+    }
+
+    art->Destroy();
+    delete art;
+}
+
+// Iterator逐个key扫描和RangeQuery看到的key一样，性能对比在BM_Scan
+TEST(art, Iterator_Scan)
+{
+    AdaptiveRadixTree* art = new AdaptiveRadixTree;
+    art->Init();
+
+    const uint64_t kKeys = 1 << 20;
+    for (uint64_t start = 0; start < kKeys; start += 256)
+    {
+        art->RangeInsert(start, 256, (void*)(start | 1));
+    }
+
+    uint64_t count = 0;
+    AdaptiveRadixTree::Iterator iter(art);
+    for (iter.SeekToFirst(); iter.Valid(); iter.Next())
+    {
+        ASSERT_EQ(iter.Key(), count);
+        ASSERT_EQ(iter.Value(), (void*)((count & ~0xFFUL) | 1));
+        count++;
+    }
+    EXPECT_EQ(count, kKeys);
+
+    art->Destroy();
+    delete art;
+}
+
+static std::vector<Extent> makeSortedExtents(int count, uint64_t spread)
+{
+    std::vector<Extent> extents;
+    uint64_t cursor = rand() % 1000;
+    for (int i = 0; i < count; i++)
+    {
+        Extent extent;
+        extent.start = cursor;
+        extent.length = 1 + rand() % (i % 16 == 0 ? 3000 : 64);
+        extent.val = (void*)(uint64_t)(rand() | 1);
+        extents.push_back(extent);
+        cursor += extent.length + (rand() % 4 == 0 ? 0 : rand() % spread);
+    }
+    return extents;
+}
+
+static void checkSameTree(AdaptiveRadixTree* expect, AdaptiveRadixTree* actual)
+{
+    AdaptiveRadixTree::Iterator expectIter(expect);
+    AdaptiveRadixTree::Iterator actualIter(actual);
+    expectIter.SeekToFirst();
+    actualIter.SeekToFirst();
+    while (expectIter.Valid())
+    {
+        ASSERT_TRUE(actualIter.Valid());
+        ASSERT_EQ(actualIter.Key(), expectIter.Key());
+        ASSERT_EQ(actualIter.Value(), expectIter.Value());
+        expectIter.Next();
+        actualIter.Next();
+    }
+    EXPECT_FALSE(actualIter.Valid());
+}
+
+TEST(art, BulkLoad)
+{
+    for (int threads = 1; threads <= 4; threads += 3)
+    {
+        std::vector<Extent> spreads[3] = {
+            makeSortedExtents(20000, 16),
+            makeSortedExtents(20000, 1 << 20),
+            makeSortedExtents(20000, 1ULL << 50),
+        };
+        for (int s = 0; s < 3; s++)
+        {
+            std::vector<Extent>& extents = spreads[s];
+            AdaptiveRadixTree* expect = new AdaptiveRadixTree;
+            expect->Init();
+            for (size_t i = 0; i < extents.size(); i++)
+            {
+                expect->RangeInsert(extents[i].start, extents[i].length, extents[i].val);
+            }
+
+            AdaptiveRadixTree* art = new AdaptiveRadixTree;
+            art->Init();
+            art->BulkLoad(&extents[0], extents.size(), threads);
+            checkSameTree(expect, art);
+            EXPECT_EQ(UntagNode(art->_root)->prefix_length, 0);
+            EXPECT_FALSE(UntagNode(art->_root)->IsLeaf());
+            // 一次分配成合适的类型，不会比逐个插入占用更多
+            EXPECT_LE(art->MemoryUsage(), expect->MemoryUsage());
+
+            // 建好的树可以继续修改
+            for (int i = 0; i < 1000; i++)
+            {
+                const Extent& extent = extents[rand() % extents.size()];
+                uint64_t start = extent.start + rand() % 512;
+                uint32_t length = 1 + rand() % 512;
+                if (i % 2 == 0)
+                {
+                    art->DeleteRange(start, length);
+                    expect->DeleteRange(start, length);
+                }
+                else
+                {
+                    art->RangeInsert(start, length, (void*)(uint64_t)i);
+                    expect->RangeInsert(start, length, (void*)(uint64_t)i);
+                }
+            }
+            checkSameTree(expect, art);
+
+            art->Destroy();
+            delete art;
+            expect->Destroy();
+            delete expect;
+        }
+    }
+
+    // 只有一个key
+    AdaptiveRadixTree* art = new AdaptiveRadixTree;
+    art->Init();
+    Extent extent = {0x1234567890UL, 1, (void*)1};
+    art->BulkLoad(&extent, 1, 4);
+    EXPECT_EQ(art->Search(0x1234567890UL), (void*)1);
+    EXPECT_EQ(art->MemoryUsage(), 2 * sizeof(Node4));
+    art->Destroy();
+    delete art;
+
+    // extent一直到key空间的末尾，和RangeInsert的结果一样
+    for (int threads = 1; threads <= 4; threads += 3)
+    {
+        Extent tops[] = {
+            {0x1234567890UL, 10, (void*)1},
+            {0x8000000000000000UL, 5, (void*)4},
+            {~0ULL - 300, 20, (void*)2},
+            {~0ULL - 3, 4, (void*)3},
+        };
+        AdaptiveRadixTree* expect = new AdaptiveRadixTree;
+        expect->Init();
+        art = new AdaptiveRadixTree;
+        art->Init();
+        for (size_t i = 0; i < sizeof(tops) / sizeof(tops[0]); i++)
+        {
+            expect->RangeInsert(tops[i].start, tops[i].length, tops[i].val);
+        }
+        art->BulkLoad(tops, sizeof(tops) / sizeof(tops[0]), threads);
+        checkSameTree(expect, art);
+        EXPECT_EQ(art->Search(~0ULL), (void*)3);
+        art->Destroy();
+        delete art;
+        expect->Destroy();
+        delete expect;
+    }
+}
+
+TEST(art, MultiSearch)
+{
+    AdaptiveRadixTree* art = new AdaptiveRadixTree;
+    art->Init();
+
+    std::vector<uint64_t> keys;
+    for (int i = 0; i < 100000; i++)
+    {
+        // 混合稀疏和连续的key，覆盖4种节点类型
+        uint64_t key = i % 2 == 0 ? ((uint64_t)rand() << 20 | rand() % 1024) : (uint64_t)(i % 5000);
+        art->Insert(key, (void*)(key | 1));
+        keys.push_back(key);
+        // 不存在的key
+        keys.push_back(key + (1ULL << 40));
+    }
+    std::shuffle(keys.begin(), keys.end(), std::mt19937(rand()));
+
+    size_t sizes[] = {0, 1, 15, 16, 17, 64, keys.size()};
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        std::vector<void*> out(sizes[s] + 1, (void*)-1);
+        art->MultiSearch(&keys[0], sizes[s], &out[0]);
+        for (size_t i = 0; i < sizes[s]; i++)
+        {
+            ASSERT_EQ(out[i], art->Search(keys[i])) << "key " << keys[i];
+        }
+        EXPECT_EQ(out[sizes[s]], (void*)-1);
+    }
+
+    art->Destroy();
+    delete art;
+}
+
+// 稀疏的随机key，按64个一批查找，批内有重复和不存在的key，性能对比在art_benchmark的BM_MultiSearch
+TEST(art, MultiSearch_Batch)
+{
+    AdaptiveRadixTree* art = new AdaptiveRadixTree;
+    art->Init();
+
+    std::vector<uint64_t> keys;
+    for (int i = 0; i < 50000; i++)
+    {
+        uint64_t key = (uint64_t)rand() << 16 | rand() % 65536;
+        art->Insert(key, (void*)(key | 1));
+        keys.push_back(i % 4 == 0 ? key + 1 : key);
+        if (i % 7 == 0)
+        {
+            keys.push_back(key);
+        }
+    }
+    std::shuffle(keys.begin(), keys.end(), std::mt19937(rand()));
+
+    const size_t kBatch = 64;
+    std::vector<void*> out(kBatch);
+    for (size_t i = 0; i + kBatch <= keys.size(); i += kBatch)
+    {
+        art->MultiSearch(&keys[i], kBatch, &out[0]);
+        for (size_t j = 0; j < kBatch; j++)
+        {
+            ASSERT_EQ(out[j], art->Search(keys[i + j])) << "key " << keys[i + j];
+        }
+    }
+
+    art->Destroy();
+    delete art;
+}
+
 TEST(art, Serialization_Node4)
 {
     AdaptiveRadixTree* art = new AdaptiveRadixTree;
@@ -851,7 +1485,7 @@ TEST(art, Serialization_Node4)
     Node4* n4 = art->makeNode4();
 
     n4->header.child_count = 4;
-    n4->header.is_leaf = false;
+    n4->header.SetLeaf(false);
     n4->header.prefix[0] = 'a';
     n4->header.type = NODE4;
     n4->child_keys[0] = 0;
@@ -878,7 +1512,7 @@ TEST(art, Serialization_Node16)
     Node16* n16 = art->makeNode16();
 
     n16->header.child_count = 12;
-    n16->header.is_leaf = false;
+    n16->header.SetLeaf(false);
     n16->header.prefix[0] = 'a';
     n16->header.type = NODE16;
     n16->child_keys[0] = 0;
@@ -906,7 +1540,7 @@ TEST(art, Serialization_Node48)
     Node48* n48 = art->makeNode48();
 
     n48->header.child_count = 5;
-    n48->header.is_leaf = false;
+    n48->header.SetLeaf(false);
     n48->header.prefix[0] = 'a';
     n48->header.type = NODE48;
     n48->child_ptr_indexs[0] = 0;
@@ -935,7 +1569,7 @@ TEST(art, Serialization_Node256)
     Node256* n256 = art->makeNode256();
 
     n256->header.child_count = 5;
-    n256->header.is_leaf = false;
+    n256->header.SetLeaf(false);
     n256->header.prefix[0] = 'a';
     n256->header.type = NODE256;
     memset(&n256->child_ptrs[0], 0, sizeof(void*) * 256);
@@ -1068,14 +1702,1631 @@ TEST(art, Serialization_Tree_2_File)
     delete newArt;
 }
 
-TEST(art, SSE_lt)
+TEST(art, Serialize_Stream)
 {
-    int mask = (1 << 16) - 1;
-    signed char array[] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15};
+    AdaptiveRadixTree* art = new AdaptiveRadixTree;
+    art->Init();
 
+    std::map<uint64_t, void*> verifyMap;
+    for (int i = 0; i < 10000; i++)
     {
-        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(array));
-        __m128i cmp = _mm_cmplt_epi8(_mm_set1_epi8(0), b);
+        uint64_t start = i % 2 == 0 ? ((uint64_t)rand() << 20 | rand() % 4096) : (uint64_t)rand() % 1000000;
+        uint32_t length = 1 + rand() % (i % 10 == 0 ? 1000 : 40);
+        void* ptr = (void*)(uint64_t)(rand() | 1);
+        art->RangeInsert(start, length, ptr);
+        for (uint32_t j = 0; j < length; j++)
+        {
+            verifyMap[start + j] = ptr;
+        }
+    }
+
+    // 和一次性序列化的结果完全一样，每次交给sink的数据不超过固定大小的缓冲
+    void* buf = NULL;
+    int bufSize = 0;
+    art->Serialization(&buf, bufSize);
+    EXPECT_EQ((uint64_t)buf % 4096, 0);
+    std::string streamed;
+    size_t maxChunk = 0;
+    int64_t total = art->Serialize([&streamed, &maxChunk](const char* data, size_t size) {
+        streamed.append(data, size);
+        maxChunk = std::max(maxChunk, size);
+        return true;
+    });
+    ASSERT_EQ(total, bufSize);
+    ASSERT_EQ(memcmp(streamed.data(), buf, bufSize), 0);
+    EXPECT_LE(maxChunk, 64U << 10);
+    free(buf);
+
+    // sink失败时中止
+    int calls = 0;
+    EXPECT_EQ(art->Serialize([&calls](const char* data, size_t size) {
+        return ++calls < 2;
+    }), -1);
+    EXPECT_EQ(calls, 2);
+
+    const char* path = "./art_stream";
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(art->Serialize(fd), total);
+    close(fd);
+    art->Destroy();
+    delete art;
+
+    AdaptiveRadixTree* newArt = new AdaptiveRadixTree;
+    fd = open(path, O_RDONLY);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(newArt->Deserialize(fd), 0);
+    close(fd);
+    for (auto it = verifyMap.begin(); it != verifyMap.end(); it++)
+    {
+        ASSERT_EQ(newArt->Search(it->first), it->second);
+    }
+    newArt->Destroy();
+
+    // 每次只读到几个字节也能恢复，数据不完整时返回-1
+    size_t offset = 0;
+    auto slowSource = [&streamed, &offset](char* data, size_t size) -> int64_t {
+        size_t n = std::min<size_t>(std::min<size_t>(size, 7), streamed.size() - offset);
+        memcpy(data, streamed.data() + offset, n);
+        offset += n;
+        return n;
+    };
+    ASSERT_EQ(newArt->Deserialize(slowSource), 0);
+    EXPECT_EQ(newArt->Search(verifyMap.begin()->first), verifyMap.begin()->second);
+    newArt->Destroy();
+
+    // 没有头的老格式和版本不对的数据都不认
+    std::string full = streamed;
+    streamed = full.substr(sizeof(ArtStreamHeader));
+    offset = 0;
+    EXPECT_EQ(newArt->Deserialize(slowSource), -1);
+    EXPECT_TRUE(newArt->_root == NULL);
+    streamed = full;
+    reinterpret_cast<ArtStreamHeader*>(&streamed[0])->version++;
+    offset = 0;
+    EXPECT_EQ(newArt->Deserialize(slowSource), -1);
+    EXPECT_TRUE(newArt->_root == NULL);
+
+    streamed = full.substr(0, full.size() / 2);
+    offset = 0;
+    EXPECT_EQ(newArt->Deserialize(slowSource), -1);
+    EXPECT_TRUE(newArt->_root == NULL);
+    EXPECT_EQ(newArt->MemoryUsage(), 0);
+    unlink(path);
+    delete newArt;
+}
+
+static AdaptiveRadixTree::SerializeSink appendTo(std::string* out)
+{
+    return [out](const char* data, size_t size) {
+        out->append(data, size);
+        return true;
+    };
+}
+
+static AdaptiveRadixTree::DeserializeSource readFrom(const std::string* in)
+{
+    std::shared_ptr<size_t> offset(new size_t(0));
+    return [in, offset](char* data, size_t size) -> int64_t {
+        size_t n = std::min(size, in->size() - *offset);
+        memcpy(data, in->data() + *offset, n);
+        *offset += n;
+        return n;
+    };
+}
+
+TEST(art, Checkpoint_Delta)
+{
+    AdaptiveRadixTree* art = new AdaptiveRadixTree;
+    art->Init();
+    for (int i = 0; i < 20000; i++)
+    {
+        uint64_t start = i % 2 == 0 ? ((uint64_t)rand() << 20 | rand() % 4096) : (uint64_t)rand() % 1000000;
+        art->RangeInsert(start, 1 + rand() % 100, (void*)(uint64_t)(rand() | 1));
+    }
+    std::string base;
+    ASSERT_GT(art->Serialize(appendTo(&base)), 0);
+
+    // 没有修改时delta只有头和根节点的tag
+    std::string empty;
+    EXPECT_EQ(art->SerializeDelta(appendTo(&empty)), sizeof(ArtDeltaHeader) + 1);
+
+    // 少量修改，包括分裂前缀、扩容、删除和合并
+    std::vector<std::string> deltas(3);
+    for (int round = 0; round < 2; round++)
+    {
+        for (int i = 0; i < 200; i++)
+        {
+            uint64_t key = (uint64_t)rand() << 20 | rand() % 4096;
+            art->Insert(key, (void*)(uint64_t)(rand() | 1));
+            art->RangeInsert((uint64_t)rand() % 1000000, 1 + rand() % 300, (void*)(uint64_t)(rand() | 1));
+            art->DeleteRange((uint64_t)rand() % 1000000, rand() % 500);
+        }
+        ASSERT_GT(art->SerializeDelta(appendTo(&deltas[round + 1])), 0);
+    }
+    deltas[0] = empty;
+    printf("base %luB delta %luB %luB\n", base.size(), deltas[1].size(), deltas[2].size());
+    EXPECT_LT(deltas[1].size() * 4, base.size());
+
+    AdaptiveRadixTree* loaded = new AdaptiveRadixTree;
+    ASSERT_EQ(loaded->Deserialize(readFrom(&base)), 0);
+    // 顺序不对的delta不会被应用
+    EXPECT_EQ(loaded->ApplyDelta(readFrom(&deltas[1])), -1);
+    ASSERT_EQ(loaded->ApplyDelta(readFrom(&deltas[0])), 0);
+    ASSERT_EQ(loaded->ApplyDelta(readFrom(&deltas[1])), 0);
+    // 不完整的delta不改变树
+    uint64_t memory = loaded->MemoryUsage();
+    std::string truncated = deltas[2].substr(0, deltas[2].size() / 2);
+    EXPECT_EQ(loaded->ApplyDelta(readFrom(&truncated)), -1);
+    EXPECT_EQ(loaded->MemoryUsage(), memory);
+    ASSERT_EQ(loaded->ApplyDelta(readFrom(&deltas[2])), 0);
+    EXPECT_EQ(loaded->MemoryUsage(), art->MemoryUsage());
+
+    checkSameTree(art, loaded);
+
+    // 合并之后和直接序列化的结果完全一样
+    std::string compacted;
+    std::vector<AdaptiveRadixTree::DeserializeSource> chain;
+    for (size_t i = 0; i < deltas.size(); i++)
+    {
+        chain.push_back(readFrom(&deltas[i]));
+    }
+    ASSERT_GT(AdaptiveRadixTree::CompactCheckpoints(readFrom(&base), chain, appendTo(&compacted)), 0);
+    std::string full;
+    ASSERT_GT(art->Serialize(appendTo(&full)), 0);
+    EXPECT_TRUE(compacted == full);
+
+    art->Destroy();
+    delete art;
+    loaded->Destroy();
+    delete loaded;
+}
+
+TEST(art, WriteAheadLog)
+{
+    const char* path = "./art_wal";
+    unlink(path);
+    AdaptiveRadixTree* art = new AdaptiveRadixTree;
+    art->Init();
+    WriteAheadLog* wal = new WriteAheadLog(art);
+    ASSERT_EQ(wal->Open(path), 0);
+    ASSERT_EQ(wal->Replay(), 0);
+
+    // 多个线程同时写，返回的时候已经应用到树上，gtest的断言只在主线程里做
+    std::vector<std::thread> threads;
+    std::vector<int> failures(4, 0);
+    for (int t = 0; t < 4; t++)
+    {
+        threads.push_back(std::thread([wal, t, &failures]() {
+            for (int i = 0; i < 200; i++)
+            {
+                uint64_t start = (uint64_t)t << 32 | (uint64_t)i * 300;
+                failures[t] += wal->RangeInsert(start, 1 + i % 280, (void*)(uint64_t)(i + 1)) != 0;
+                failures[t] += wal->Insert(start + 299, (void*)(uint64_t)(i + 2)) != 0;
+                if (i % 10 == 0)
+                {
+                    failures[t] += wal->DeleteRange(start, 5) != 0;
+                }
+            }
+        }));
+    }
+    for (size_t i = 0; i < threads.size(); i++)
+    {
+        threads[i].join();
+        EXPECT_EQ(failures[i], 0);
+    }
+    printf("records %lu syncs %lu\n", wal->Size() / WriteAheadLog::kRecordSize, wal->SyncCount());
+    EXPECT_LE(wal->SyncCount(), wal->Size() / WriteAheadLog::kRecordSize);
+
+    // 在空树上回放得到同样的结果
+    uint64_t logSize = wal->Size();
+    delete wal;
+    AdaptiveRadixTree* recovered = new AdaptiveRadixTree;
+    recovered->Init();
+    wal = new WriteAheadLog(recovered);
+    ASSERT_EQ(wal->Open(path), 0);
+    ASSERT_EQ(wal->Replay(), logSize / WriteAheadLog::kRecordSize);
+    checkSameTree(art, recovered);
+    delete wal;
+    recovered->Destroy();
+    delete recovered;
+
+    // 崩溃时没写完的记录被丢掉，回放之前不能接着写
+    int fd = open(path, O_WRONLY | O_APPEND);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(write(fd, "torn", 4), 4);
+    close(fd);
+    recovered = new AdaptiveRadixTree;
+    recovered->Init();
+    wal = new WriteAheadLog(recovered);
+    ASSERT_EQ(wal->Open(path), 0);
+    EXPECT_EQ(wal->Size(), logSize + 4);
+    EXPECT_EQ(wal->Insert(1, (void*)1), -1);
+    ASSERT_EQ(wal->Replay(), logSize / WriteAheadLog::kRecordSize);
+    EXPECT_EQ(wal->Size(), logSize);
+    checkSameTree(art, recovered);
+
+    // checkpoint之后截断，重启时在checkpoint上回放之后的记录
+    std::string checkpoint;
+    ASSERT_GT(recovered->Serialize(appendTo(&checkpoint)), 0);
+    ASSERT_EQ(wal->Truncate(), 0);
+    EXPECT_EQ(wal->Size(), 0);
+    ASSERT_EQ(wal->RangeInsert(1ULL << 40, 1000, (void*)7), 0);
+    ASSERT_EQ(wal->DeleteRange(300, 10), 0);
+    delete wal;
+
+    AdaptiveRadixTree* restarted = new AdaptiveRadixTree;
+    ASSERT_EQ(restarted->Deserialize(readFrom(&checkpoint)), 0);
+    wal = new WriteAheadLog(restarted);
+    ASSERT_EQ(wal->Open(path), 0);
+    ASSERT_EQ(wal->Replay(), 2);
+    checkSameTree(recovered, restarted);
+    delete wal;
+
+    unlink(path);
+    art->Destroy();
+    delete art;
+    recovered->Destroy();
+    delete recovered;
+    restarted->Destroy();
+    delete restarted;
+}
+
+TEST(art, SerializeParallel)
+{
+    const char* path = "./art_parallel";
+    for (int round = 0; round < 3; round++)
+    {
+        AdaptiveRadixTree* art = new AdaptiveRadixTree;
+        art->Init();
+        // 空树、只有一个子树和正常的树
+        int ranges = round == 0 ? 0 : (round == 1 ? 1 : 20000);
+        for (int i = 0; i < ranges; i++)
+        {
+            uint64_t start = i % 2 == 0 ? ((uint64_t)rand() << 20 | rand() % 4096) : (uint64_t)rand() % 1000000;
+            art->RangeInsert(start, 1 + rand() % 100, (void*)(uint64_t)(rand() | 1));
+        }
+
+        int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        ASSERT_GE(fd, 0);
+        int64_t size = art->SerializeParallel(fd, 4);
+        ASSERT_GT(size, 0);
+        AdaptiveRadixTree* loaded = new AdaptiveRadixTree;
+        ASSERT_EQ(loaded->DeserializeParallel(fd, 4), 0);
+        checkSameTree(art, loaded);
+        EXPECT_EQ(loaded->MemoryUsage(), art->MemoryUsage());
+        loaded->Destroy();
+
+        // 不完整的文件
+        ASSERT_EQ(ftruncate(fd, size - 1), 0);
+        EXPECT_EQ(loaded->DeserializeParallel(fd, 4), -1);
+        EXPECT_EQ(loaded->MemoryUsage(), 0);
+
+        // 单线程Serialize的输出也能读
+        ASSERT_EQ(ftruncate(fd, 0), 0);
+        ASSERT_EQ(lseek(fd, 0, SEEK_SET), 0);
+        ASSERT_GT(art->Serialize(fd), 0);
+        ASSERT_EQ(loaded->DeserializeParallel(fd, 4), 0);
+        checkSameTree(art, loaded);
+        close(fd);
+
+        loaded->Destroy();
+        delete loaded;
+        art->Destroy();
+        delete art;
+    }
+    unlink(path);
+}
+
+// 不同的线程数写出的文件都能读回来，性能对比在BM_SerializeParallel
+TEST(art, SerializeParallel_Threads)
+{
+    const char* path = "./art_parallel";
+    std::vector<Extent> extents = makeSortedExtents(20000, 16);
+    AdaptiveRadixTree* art = new AdaptiveRadixTree;
+    art->Init();
+    art->BulkLoad(&extents[0], extents.size());
+
+    for (int threads = 1; threads <= 8; threads *= 2)
+    {
+        int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        ASSERT_GE(fd, 0);
+        ASSERT_GT(art->SerializeParallel(fd, threads), 0);
+        AdaptiveRadixTree* loaded = new AdaptiveRadixTree;
+        ASSERT_EQ(loaded->DeserializeParallel(fd, threads), 0);
+        close(fd);
+        checkSameTree(art, loaded);
+        loaded->Destroy();
+        delete loaded;
+    }
+    unlink(path);
+    art->Destroy();
+    delete art;
+}
+
+// key所在的叶节点
+static Node* leafOf(AdaptiveRadixTree* art, uint64_t key)
+{
+    uint64_t reverse = __builtin_bswap64(key);
+    unsigned char* data = reinterpret_cast<unsigned char*>(&reverse);
+    Node* node = UntagNode(art->_root);
+    int depth = node->prefix_length;
+    while (depth < 7)
+    {
+        node = UntagNode(art->childAt(art->findChild(node, data[depth])));
+        depth += 1 + node->prefix_length;
+    }
+    return node;
+}
+
+TEST(art, ExtentLeaf)
+{
+    AdaptiveRadixTree* expect = new AdaptiveRadixTree;
+    expect->Init();
+    AdaptiveRadixTree* art = new AdaptiveRadixTree;
+    art->Init(ART_EXTENT_LEAF);
+
+    // 整个叶节点是同一个value
+    uint64_t base = 0x123456789A00UL;
+    art->RangeInsert(base, 256, (void*)12345);
+    expect->RangeInsert(base, 256, (void*)12345);
+    Node* leaf = leafOf(art, base);
+    ASSERT_EQ(leaf->type, NODE_EXTENT);
+    EXPECT_EQ(reinterpret_cast<NodeExtent*>(leaf)->run_count, 1);
+    EXPECT_EQ(leaf->child_count, 256);
+    EXPECT_EQ(art->MemoryUsage(), sizeof(Node4) + sizeof(NodeExtent));
+
+    // 逐个写入的等差value合并成一个run
+    uint64_t linear = 0x5500UL;
+    for (int i = 0; i < 200; i++)
+    {
+        art->Insert(linear + i, (void*)(uint64_t)(0x10000 + i * 4096));
+        expect->Insert(linear + i, (void*)(uint64_t)(0x10000 + i * 4096));
+    }
+    leaf = leafOf(art, linear);
+    ASSERT_EQ(leaf->type, NODE_EXTENT);
+    EXPECT_EQ(reinterpret_cast<NodeExtent*>(leaf)->run_count, 1);
+    EXPECT_EQ(reinterpret_cast<NodeExtent*>(leaf)->runs[0].stride, 4096);
+    EXPECT_EQ(art->Search(linear + 199), (void*)(uint64_t)(0x10000 + 199 * 4096));
+    EXPECT_EQ(art->Search(linear + 200), (void*)NULL);
+    checkSameTree(expect, art);
+
+    // 覆盖和删除中间的一段，run被切开
+    art->RangeInsert(base + 10, 20, (void*)777);
+    expect->RangeInsert(base + 10, 20, (void*)777);
+    art->DeleteRange(linear + 50, 10);
+    expect->DeleteRange(linear + 50, 10);
+    EXPECT_EQ(leafOf(art, base)->type, NODE_EXTENT);
+    EXPECT_EQ(leafOf(art, linear)->type, NODE_EXTENT);
+    checkSameTree(expect, art);
+    AdaptiveRadixTree::Iterator iter(art);
+    iter.SeekForPrev(linear + 55);
+    ASSERT_TRUE(iter.Valid());
+    EXPECT_EQ(iter.Key(), linear + 49);
+    iter.Seek(linear + 55);
+    ASSERT_TRUE(iter.Valid());
+    EXPECT_EQ(iter.Key(), linear + 60);
+
+    // 碎片太多换回普通节点，之后的结果不变
+    for (int i = 0; i < 40; i++)
+    {
+        uint64_t key = base + rand() % 256;
+        art->Insert(key, (void*)(uint64_t)(rand() | 1));
+        expect->Insert(key, art->Search(key));
+    }
+    EXPECT_NE(leafOf(art, base)->type, NODE_EXTENT);
+    checkSameTree(expect, art);
+
+    // 随机读写和没有extent叶节点的树保持一致
+    for (int i = 0; i < 20000; i++)
+    {
+        uint64_t start = (uint64_t)rand() % 4000000;
+        uint32_t length = 1 + rand() % (i % 8 == 0 ? 1000 : 20);
+        if (i % 5 == 0)
+        {
+            art->DeleteRange(start, length);
+            expect->DeleteRange(start, length);
+        }
+        else
+        {
+            void* val = (void*)(uint64_t)(rand() | 1);
+            art->RangeInsert(start, length, val);
+            expect->RangeInsert(start, length, val);
+        }
+    }
+    checkSameTree(expect, art);
+    std::vector<void*> expectVals;
+    std::vector<void*> actualVals;
+    std::vector<uint64_t> keys;
+    for (int i = 0; i < 1000; i++)
+    {
+        uint64_t start = (uint64_t)rand() % 4000000;
+        expect->RangeQuery(start, 700, &expectVals);
+        art->RangeQuery(start, 700, &actualVals);
+        ASSERT_TRUE(expectVals == actualVals);
+        keys.push_back(start);
+    }
+    std::vector<void*> out(keys.size());
+    art->MultiSearch(&keys[0], keys.size(), &out[0]);
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        ASSERT_EQ(out[i], expect->Search(keys[i]));
+    }
+    printf("memory %ldB extent leaf memory %ldB\n", expect->MemoryUsage(), art->MemoryUsage());
+
+    // 持久化的格式里是普通节点，读回来重新编码，普通节点里连续的value也会被压缩
+    std::string data;
+    ASSERT_GT(art->Serialize(appendTo(&data)), 0);
+    AdaptiveRadixTree* loaded = new AdaptiveRadixTree;
+    loaded->Init(ART_EXTENT_LEAF);
+    loaded->Destroy();
+    ASSERT_EQ(loaded->Deserialize(readFrom(&data)), 0);
+    checkSameTree(expect, loaded);
+    EXPECT_LE(loaded->MemoryUsage(), art->MemoryUsage());
+
+    const char* path = "./art_extent_image";
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(art->WriteImage(fd), 0);
+    close(fd);
+    ReadOnlyArtView view;
+    ASSERT_EQ(view.Open(path), 0);
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        expect->RangeQuery(keys[i], 300, &expectVals);
+        view.RangeQuery(keys[i], 300, &actualVals);
+        ASSERT_TRUE(expectVals == actualVals);
+    }
+    view.Close();
+    unlink(path);
+
+    loaded->Destroy();
+    delete loaded;
+    art->Destroy();
+    delete art;
+    expect->Destroy();
+    delete expect;
+}
+
+// 顺序写入，value是连续的块地址，性能对比在BM_LeafFormatBuild/BM_LeafFormatQuery
+TEST(art, ExtentLeaf_Memory)
+{
+    const uint64_t count = 1 << 18;
+    uint64_t memory[2];
+    for (int extent = 0; extent < 2; extent++)
+    {
+        AdaptiveRadixTree* art = new AdaptiveRadixTree;
+        art->Init(extent == 1 ? ART_EXTENT_LEAF : 0);
+        for (uint64_t i = 0; i < count; i += 64)
+        {
+            art->RangeInsert(i, 64, (void*)(0x100000 + (i / 1024) * 4096));
+        }
+        for (uint64_t i = count; i < 2 * count; i++)
+        {
+            art->Insert(i, (void*)(0x100000 + i * 4096));
+        }
+        memory[extent] = art->MemoryUsage();
+        art->Destroy();
+        delete art;
+    }
+    EXPECT_GT(memory[0], memory[1] * 10);
+}
+
+// 块地址的高位相同，低位在windows以内
+static void* blockValue(uint64_t window)
+{
+    return (void*)(0x7F0000000000UL + (uint64_t)(rand() % window) * 8);
+}
+
+TEST(art, PackedLeaf)
+{
+    AdaptiveRadixTree* expect = new AdaptiveRadixTree;
+    expect->Init();
+    AdaptiveRadixTree* art = new AdaptiveRadixTree;
+    art->Init(ART_PACKED_LEAF);
+
+    // 重复的value放进字典
+    uint64_t dict = 0x10000UL;
+    for (int i = 0; i < 256; i++)
+    {
+        art->Insert(dict + i, (void*)(uint64_t)(1000 + i % 7));
+        expect->Insert(dict + i, (void*)(uint64_t)(1000 + i % 7));
+    }
+    Node* leaf = leafOf(art, dict);
+    ASSERT_EQ(leaf->type, NODE_DICT);
+    EXPECT_EQ(leaf->child_count, 256);
+    EXPECT_EQ(reinterpret_cast<NodeDict*>(leaf)->value_count, 8);
+
+    // 不重复但是离得很近的value用16位差值
+    uint64_t delta16 = 0x20000UL;
+    for (int i = 0; i < 200; i++)
+    {
+        art->Insert(delta16 + i, (void*)(0x7F0000000000UL + (uint64_t)(i * 37 % 200) * 8));
+        expect->Insert(delta16 + i, (void*)(0x7F0000000000UL + (uint64_t)(i * 37 % 200) * 8));
+    }
+    leaf = leafOf(art, delta16);
+    ASSERT_EQ(leaf->type, NODE_DELTA16);
+    EXPECT_EQ(reinterpret_cast<NodeDelta16*>(leaf)->base, 0x7F0000000000UL);
+    // 比base小的value重新编码
+    art->Insert(delta16 + 250, (void*)0x7EFFFFFFF000UL);
+    expect->Insert(delta16 + 250, (void*)0x7EFFFFFFF000UL);
+    EXPECT_EQ(leafOf(art, delta16)->type, NODE_DELTA16);
+    // 超出16位的差值换成32位
+    art->Insert(delta16 + 251, (void*)0x7F0000100000UL);
+    expect->Insert(delta16 + 251, (void*)0x7F0000100000UL);
+    EXPECT_EQ(leafOf(art, delta16)->type, NODE_DELTA32);
+    // 超出32位只能用Node256
+    art->Insert(delta16 + 252, (void*)0x100UL);
+    expect->Insert(delta16 + 252, (void*)0x100UL);
+    EXPECT_EQ(leafOf(art, delta16)->type, NODE256);
+    checkSameTree(expect, art);
+
+    // 删除到只剩几个key时换回Node16
+    art->DeleteRange(dict, 250);
+    expect->DeleteRange(dict, 250);
+    EXPECT_EQ(leafOf(art, dict)->type, NODE16);
+    AdaptiveRadixTree::Iterator iter(art);
+    iter.Seek(dict);
+    ASSERT_TRUE(iter.Valid());
+    EXPECT_EQ(iter.Key(), dict + 250);
+    iter.SeekForPrev(delta16 + 249);
+    ASSERT_TRUE(iter.Valid());
+    EXPECT_EQ(iter.Key(), delta16 + 199);
+    checkSameTree(expect, art);
+
+    // 随机读写和没有压缩的树保持一致
+    for (int i = 0; i < 20000; i++)
+    {
+        uint64_t start = (uint64_t)rand() % 4000000;
+        uint32_t length = 1 + rand() % (i % 8 == 0 ? 1000 : 20);
+        if (i % 5 == 0)
+        {
+            art->DeleteRange(start, length);
+            expect->DeleteRange(start, length);
+        }
+        else
+        {
+            void* val = blockValue(i % 3 == 0 ? 10 : (i % 3 == 1 ? 4096 : 1 << 28));
+            art->RangeInsert(start, length, val);
+            expect->RangeInsert(start, length, val);
+        }
+    }
+    checkSameTree(expect, art);
+    std::vector<void*> expectVals;
+    std::vector<void*> actualVals;
+    std::vector<uint64_t> keys;
+    for (int i = 0; i < 1000; i++)
+    {
+        uint64_t start = (uint64_t)rand() % 4000000;
+        expect->RangeQuery(start, 700, &expectVals);
+        art->RangeQuery(start, 700, &actualVals);
+        ASSERT_TRUE(expectVals == actualVals);
+        keys.push_back(start);
+    }
+    std::vector<void*> out(keys.size());
+    art->MultiSearch(&keys[0], keys.size(), &out[0]);
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        ASSERT_EQ(out[i], expect->Search(keys[i]));
+    }
+    printf("memory %ldB packed leaf memory %ldB\n", expect->MemoryUsage(), art->MemoryUsage());
+
+    // 持久化的格式里是普通节点，读回来重新编码
+    std::string data;
+    ASSERT_GT(art->Serialize(appendTo(&data)), 0);
+    AdaptiveRadixTree* loaded = new AdaptiveRadixTree;
+    loaded->Init(ART_PACKED_LEAF);
+    loaded->Destroy();
+    ASSERT_EQ(loaded->Deserialize(readFrom(&data)), 0);
+    checkSameTree(expect, loaded);
+    EXPECT_LE(loaded->MemoryUsage(), art->MemoryUsage());
+    loaded->Destroy();
+    delete loaded;
+
+    // BulkLoad直接建出压缩的叶节点
+    std::vector<Extent> extents;
+    for (uint64_t i = 0; i < 100000; i += 1 + rand() % 3)
+    {
+        Extent extent;
+        extent.start = i;
+        extent.length = 1;
+        extent.val = blockValue(4096);
+        extents.push_back(extent);
+    }
+    AdaptiveRadixTree* bulk = new AdaptiveRadixTree;
+    bulk->Init(ART_PACKED_LEAF);
+    bulk->BulkLoad(&extents[0], extents.size());
+    EXPECT_EQ(leafOf(bulk, extents[0].start)->type, NODE_DELTA16);
+    for (size_t i = 0; i < extents.size(); i++)
+    {
+        ASSERT_EQ(bulk->Search(extents[i].start), extents[i].val);
+    }
+    bulk->Destroy();
+    delete bulk;
+
+    art->Destroy();
+    delete art;
+    expect->Destroy();
+    delete expect;
+}
+
+// 每个key对应一个块地址，高位相同，一半是顺序分配，一半在1GB的范围内随机
+TEST(art, PackedLeaf_Memory)
+{
+    const uint64_t count = 1 << 18;
+    uint64_t memory[2];
+    for (int packed = 0; packed < 2; packed++)
+    {
+        srand(1);
+        AdaptiveRadixTree* art = new AdaptiveRadixTree;
+        art->Init(packed == 1 ? ART_PACKED_LEAF : 0);
+        for (uint64_t i = 0; i < count; i++)
+        {
+            void* val = i < count / 2 ? (void*)(0x7F0000000000UL + ((i * 13) & 0xFFFF) * 8) : blockValue(1 << 27);
+            art->Insert(i, val);
+        }
+        memory[packed] = art->MemoryUsage();
+        art->Destroy();
+        delete art;
+    }
+    EXPECT_GT(memory[0], memory[1] * 2);
+}
+
+static uint64_t rand64()
+{
+    return ((uint64_t)rand() << 33) ^ ((uint64_t)rand() << 11) ^ (uint64_t)rand();
+}
+
+TEST(art, SingleLeaf)
+{
+    AdaptiveRadixTree* expect = new AdaptiveRadixTree;
+    expect->Init();
+    AdaptiveRadixTree* art = new AdaptiveRadixTree;
+    art->Init(ART_SINGLE_LEAF);
+
+    uint64_t key = 0x0102030405060708UL;
+    art->Insert(key, (void*)100);
+    ASSERT_EQ(leafOf(art, key)->type, NODE_SINGLE);
+    EXPECT_EQ(art->MemoryUsage(), sizeof(Node4) + sizeof(NodeSingle));
+    EXPECT_EQ(art->Search(key), (void*)100);
+    EXPECT_EQ(art->Search(key ^ 1), (void*)NULL);
+    EXPECT_EQ(art->Search(key ^ 0x100), (void*)NULL);
+    EXPECT_EQ(art->Search(key ^ 0x0000010000000000UL), (void*)NULL);
+    art->Insert(key, (void*)101);
+    EXPECT_EQ(leafOf(art, key)->type, NODE_SINGLE);
+    EXPECT_EQ(art->Search(key), (void*)101);
+
+    // 同一个叶节点的第二个key到来时展开
+    art->Insert(key + 1, (void*)102);
+    EXPECT_EQ(leafOf(art, key)->type, NODE4);
+    EXPECT_EQ(leafOf(art, key)->child_count, 2);
+    // 前缀不同时分裂出两个单key叶节点
+    uint64_t other = key ^ 0x10000;
+    art->Insert(other, (void*)103);
+    EXPECT_EQ(leafOf(art, other)->type, NODE_SINGLE);
+    EXPECT_EQ(art->Search(other), (void*)103);
+    EXPECT_EQ(art->Search(key + 1), (void*)102);
+
+    // 删除到只剩一个key时换回单key叶节点
+    art->DeleteRange(key + 1, 1);
+    EXPECT_EQ(leafOf(art, key)->type, NODE_SINGLE);
+    EXPECT_EQ(art->Search(key), (void*)101);
+    EXPECT_EQ(art->Search(key + 1), (void*)NULL);
+    // 父节点被合并之后前缀变长，key里补上的字节也要参与比较
+    art->DeleteRange(other, 1);
+    EXPECT_EQ(UntagNode(art->_root)->child_count, 1);
+    EXPECT_EQ(art->Search(key), (void*)101);
+    EXPECT_EQ(art->Search(other), (void*)NULL);
+    AdaptiveRadixTree::Iterator iter(art);
+    iter.Seek(0);
+    ASSERT_TRUE(iter.Valid());
+    EXPECT_EQ(iter.Key(), key);
+    iter.Next();
+    EXPECT_FALSE(iter.Valid());
+    art->DeleteRange(key, 1);
+    expect->Insert(key, (void*)101);
+    expect->DeleteRange(key, 1);
+
+    // 稀疏的随机key和没有单key叶节点的树保持一致
+    std::vector<uint64_t> keys;
+    for (int i = 0; i < 50000; i++)
+    {
+        uint64_t start = i % 4 == 0 ? rand64() % 4000000 : rand64();
+        uint32_t length = i % 16 == 0 ? 1 + rand() % 300 : 1;
+        start = std::min(start, UINT64_MAX - length);
+        if (i % 5 == 0 && !keys.empty())
+        {
+            uint64_t victim = keys[rand() % keys.size()] - rand() % 2;
+            uint32_t count = 1 + rand() % 3;
+            art->DeleteRange(victim, count);
+            expect->DeleteRange(victim, count);
+        }
+        void* val = (void*)(uint64_t)(rand() | 1);
+        art->RangeInsert(start, length, val);
+        expect->RangeInsert(start, length, val);
+        keys.push_back(start);
+    }
+    printf("memory %ldB single leaf memory %ldB\n", expect->MemoryUsage(), art->MemoryUsage());
+    EXPECT_LT(art->MemoryUsage(), expect->MemoryUsage());
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        ASSERT_EQ(art->Search(keys[i]), expect->Search(keys[i]));
+        ASSERT_EQ(art->Search(keys[i] ^ 0x100), expect->Search(keys[i] ^ 0x100));
+    }
+    std::vector<void*> out(keys.size());
+    art->MultiSearch(&keys[0], keys.size(), &out[0]);
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        ASSERT_EQ(out[i], expect->Search(keys[i]));
+    }
+    std::vector<void*> expectVals;
+    std::vector<void*> actualVals;
+    for (int i = 0; i < 1000; i++)
+    {
+        expect->RangeQuery(keys[i] - 100, 300, &expectVals);
+        art->RangeQuery(keys[i] - 100, 300, &actualVals);
+        ASSERT_TRUE(expectVals == actualVals);
+    }
+
+    // 持久化的格式里是Node4，读回来重新换成单key叶节点
+    std::string data;
+    ASSERT_GT(art->Serialize(appendTo(&data)), 0);
+    AdaptiveRadixTree* loaded = new AdaptiveRadixTree;
+    loaded->Init(ART_SINGLE_LEAF);
+    loaded->Destroy();
+    ASSERT_EQ(loaded->Deserialize(readFrom(&data)), 0);
+    checkSameTree(expect, loaded);
+    EXPECT_EQ(loaded->MemoryUsage(), art->MemoryUsage());
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        ASSERT_EQ(loaded->Search(keys[i]), expect->Search(keys[i]));
+    }
+    loaded->Destroy();
+    delete loaded;
+
+    // BulkLoad时合并单child的层，前缀一层层补上
+    std::vector<Extent> extents;
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    AdaptiveRadixTree* bulkExpect = new AdaptiveRadixTree;
+    bulkExpect->Init();
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        Extent extent;
+        extent.start = keys[i];
+        extent.length = 1;
+        extent.val = (void*)(i * 2 + 1);
+        extents.push_back(extent);
+        bulkExpect->Insert(extent.start, extent.val);
+    }
+    AdaptiveRadixTree* bulk = new AdaptiveRadixTree;
+    bulk->Init(ART_SINGLE_LEAF);
+    bulk->BulkLoad(&extents[0], extents.size());
+    checkSameTree(bulkExpect, bulk);
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        ASSERT_EQ(bulk->Search(keys[i]), extents[i].val);
+        ASSERT_EQ(bulk->Search(keys[i] ^ 0x10000), bulkExpect->Search(keys[i] ^ 0x10000));
+    }
+    bulk->Destroy();
+    delete bulk;
+    bulkExpect->Destroy();
+    delete bulkExpect;
+
+    checkSameTree(expect, art);
+    art->Destroy();
+    delete art;
+    expect->Destroy();
+    delete expect;
+}
+
+// 元数据卷里大部分key互相离得很远
+TEST(art, SingleLeaf_Memory)
+{
+    const int count = 1 << 16;
+    std::vector<uint64_t> keys(count);
+    for (int i = 0; i < count; i++)
+    {
+        keys[i] = rand64();
+    }
+    uint64_t memory[2];
+    for (int single = 0; single < 2; single++)
+    {
+        AdaptiveRadixTree* art = new AdaptiveRadixTree;
+        art->Init(single == 1 ? ART_SINGLE_LEAF : 0);
+        for (int i = 0; i < count; i++)
+        {
+            art->Insert(keys[i], (void*)(uint64_t)(i + 1));
+        }
+        for (int i = 0; i < count; i++)
+        {
+            ASSERT_EQ(art->Search(keys[i]), (void*)(uint64_t)(i + 1));
+        }
+        memory[single] = art->MemoryUsage();
+        art->Destroy();
+        delete art;
+    }
+    EXPECT_GT(memory[0], memory[1] * 6 / 5);
+}
+
+// 检查tagged指向的子树里每个指针的tag和子节点的节点头一致
+static void checkTags(AdaptiveRadixTree* art, Node* tagged)
+{
+    Node* node = UntagNode(tagged);
+    ASSERT_EQ(TagType(tagged), node->type);
+    ASSERT_EQ(TagIsLeaf(tagged), node->IsLeaf());
+    if (node->IsLeaf())
+    {
+        return;
+    }
+    for (int byte = 0; byte < 256; byte++)
+    {
+        Node** ref = art->findChild(node, byte);
+        if (ref != NULL && art->childAt(ref) != NULL)
+        {
+            checkTags(art, art->childAt(ref));
+        }
+    }
+}
+
+TEST(art, TaggedPointer)
+{
+    // 普通叶节点和三种压缩叶节点，替换节点的路径各不相同
+    const uint32_t flags[] = {0, ART_EXTENT_LEAF, ART_PACKED_LEAF, ART_SINGLE_LEAF};
+    for (int mode = 0; mode < 4; mode++)
+    {
+        AdaptiveRadixTree* expect = new AdaptiveRadixTree;
+        expect->Init();
+        AdaptiveRadixTree* art = new AdaptiveRadixTree;
+        art->Init(flags[mode]);
+        for (int i = 0; i < 20000; i++)
+        {
+            uint64_t start = i % 2 == 0 ? rand64() : (uint64_t)rand() % 1000000;
+            uint32_t length = i % 8 == 0 ? 1 + rand() % 300 : 1;
+            start = std::min(start, UINT64_MAX - length);
+            void* val = (void*)(uint64_t)(i % 3 == 0 ? 5 : rand() | 1);
+            art->RangeInsert(start, length, val);
+            expect->RangeInsert(start, length, val);
+            if (i % 4 == 0)
+            {
+                uint64_t victim = rand() % 1000000;
+                uint32_t count = rand() % 200;
+                art->DeleteRange(victim, count);
+                expect->DeleteRange(victim, count);
+            }
+        }
+        checkTags(art, art->_root);
+        checkSameTree(expect, art);
+
+        // 反序列化和应用delta时重新挂上的子节点
+        std::string base;
+        ASSERT_GT(art->Serialize(appendTo(&base)), 0);
+        for (int i = 0; i < 200; i++)
+        {
+            art->Insert(rand64(), (void*)(uint64_t)(rand() | 1));
+            art->DeleteRange(rand() % 1000000, rand() % 300);
+        }
+        std::string delta;
+        ASSERT_GT(art->SerializeDelta(appendTo(&delta)), 0);
+        AdaptiveRadixTree* loaded = new AdaptiveRadixTree;
+        loaded->Init(flags[mode]);
+        loaded->Destroy();
+        ASSERT_EQ(loaded->Deserialize(readFrom(&base)), 0);
+        checkTags(loaded, loaded->_root);
+        ASSERT_EQ(loaded->ApplyDelta(readFrom(&delta)), 0);
+        checkTags(loaded, loaded->_root);
+        checkSameTree(art, loaded);
+        loaded->Destroy();
+        delete loaded;
+
+        // BulkLoad直接生成的节点
+        std::vector<Extent> extents;
+        uint64_t next = 0;
+        for (int i = 0; i < 5000; i++)
+        {
+            Extent extent;
+            extent.start = next + rand() % 100000;
+            extent.length = 1 + rand() % 300;
+            extent.val = (void*)(uint64_t)(i % 3 == 0 ? 5 : rand() | 1);
+            extents.push_back(extent);
+            next = extent.start + extent.length;
+        }
+        AdaptiveRadixTree* bulk = new AdaptiveRadixTree;
+        bulk->Init(flags[mode]);
+        bulk->BulkLoad(&extents[0], extents.size(), mode % 2 + 1);
+        checkTags(bulk, bulk->_root);
+        for (size_t i = 0; i < extents.size(); i++)
+        {
+            ASSERT_EQ(bulk->Search(extents[i].start + extents[i].length - 1), extents[i].val);
+        }
+        bulk->Destroy();
+        delete bulk;
+
+        art->Destroy();
+        delete art;
+        expect->Destroy();
+        delete expect;
+    }
+}
+
+// 和Search相同的查找，但是每一层从子节点的节点头里读type，用来对比tag的效果
+static void* headerSearch(AdaptiveRadixTree* art, uint64_t key)
+{
+    uint64_t reverse = __builtin_bswap64(key);
+    unsigned char* data = reinterpret_cast<unsigned char*>(&reverse);
+    Node* node = UntagNode(art->_root);
+    int depth = 0;
+    while (node && depth < 8)
+    {
+        if (node->prefix_length > 0)
+        {
+            if (art->checkPrefix(node, data, depth) != node->prefix_length)
+            {
+                return NULL;
+            }
+            depth += node->prefix_length;
+        }
+        Node** ref = art->findChild(node, data[depth]);
+        node = ref == NULL ? NULL : *ref;
+        // 叶节点的槽位里是value
+        if (depth < 7)
+        {
+            node = UntagNode(node);
+        }
+        depth++;
+    }
+    return node;
+}
+
+// 按tag分派和按节点头分派找到的value一样，性能对比在BM_SearchDispatch
+TEST(art, TaggedPointer_Dispatch)
+{
+    const int count = 1 << 16;
+    for (int mode = SPARSE; mode <= DENSE; mode++)
+    {
+        AdaptiveRadixTree* art = new AdaptiveRadixTree;
+        art->Init();
+        std::vector<uint64_t> keys(count);
+        for (int i = 0; i < count; i++)
+        {
+            keys[i] = mode == SPARSE ? ((uint64_t)rand() << 16 | rand() % 65536) : (uint64_t)i * 3;
+            art->Insert(keys[i], (void*)(keys[i] | 1));
+        }
+        for (int i = 0; i < count; i++)
+        {
+            ASSERT_EQ(headerSearch(art, keys[i]), art->Search(keys[i]));
+            ASSERT_EQ(headerSearch(art, keys[i] + 1), art->Search(keys[i] + 1));
+        }
+        art->Destroy();
+        delete art;
+    }
+}
+
+// 内部的Node48/Node256换成32位句柄，内容和持久化的格式都和普通的树一样
+TEST(art, CompressedRefs)
+{
+    for (int single = 0; single < 2; single++)
+    {
+        AdaptiveRadixTree* expect = new AdaptiveRadixTree;
+        expect->Init(single == 1 ? ART_SINGLE_LEAF : 0);
+        AdaptiveRadixTree* art = new AdaptiveRadixTree;
+        art->Init((single == 1 ? ART_SINGLE_LEAF : 0) | ART_COMPRESSED_REFS);
+        std::vector<uint64_t> keys;
+        for (int i = 0; i < 30000; i++)
+        {
+            uint64_t start = i % 2 == 0 ? rand64() : (uint64_t)rand() % 1000000;
+            uint32_t length = i % 8 == 0 ? 1 + rand() % 300 : 1;
+            start = std::min(start, UINT64_MAX - length);
+            void* val = (void*)(uint64_t)(rand() | 1);
+            art->RangeInsert(start, length, val);
+            expect->RangeInsert(start, length, val);
+            keys.push_back(start);
+            if (i % 4 == 0)
+            {
+                uint64_t victim = rand() % 1000000;
+                uint32_t count = rand() % 200;
+                art->DeleteRange(victim, count);
+                expect->DeleteRange(victim, count);
+            }
+        }
+        // 删掉一半随机key，上层的Node256Ref缩成Node48Ref
+        for (size_t i = 0; i < keys.size(); i += 4)
+        {
+            art->DeleteRange(keys[i], 1);
+            expect->DeleteRange(keys[i], 1);
+        }
+        checkTags(art, art->_root);
+        checkSameTree(expect, art);
+        EXPECT_GT(art->_slabs[NODE48_REF].UsedBytes(), 0u);
+        EXPECT_GT(art->_slabs[NODE256_REF].UsedBytes(), 0u);
+        EXPECT_LT(art->MemoryUsage(), expect->MemoryUsage());
+        printf("memory %luB compressed refs memory %luB\n", expect->MemoryUsage(), art->MemoryUsage());
+
+        std::vector<void*> out(keys.size());
+        art->MultiSearch(&keys[0], keys.size(), &out[0]);
+        std::vector<void*> expectVals;
+        std::vector<void*> actualVals;
+        AdaptiveRadixTree::Iterator expectIter(expect);
+        AdaptiveRadixTree::Iterator actualIter(art);
+        for (size_t i = 0; i < keys.size(); i++)
+        {
+            ASSERT_EQ(out[i], expect->Search(keys[i]));
+            ASSERT_EQ(art->Search(keys[i] + 1), expect->Search(keys[i] + 1));
+            expect->RangeQuery(keys[i], 300, &expectVals);
+            art->RangeQuery(keys[i], 300, &actualVals);
+            ASSERT_TRUE(expectVals == actualVals);
+            expectIter.SeekForPrev(keys[i] - 1);
+            actualIter.SeekForPrev(keys[i] - 1);
+            ASSERT_EQ(actualIter.Valid(), expectIter.Valid());
+            if (expectIter.Valid())
+            {
+                ASSERT_EQ(actualIter.Key(), expectIter.Key());
+                expectIter.Prev();
+                actualIter.Prev();
+                ASSERT_EQ(actualIter.Valid(), expectIter.Valid());
+            }
+        }
+
+        // 句柄按原来的顺序写成Node48/Node256，两边序列化的结果完全一样，可以互相读
+        std::string plain;
+        std::string compressed;
+        ASSERT_GT(expect->Serialize(appendTo(&plain)), 0);
+        ASSERT_GT(art->Serialize(appendTo(&compressed)), 0);
+        EXPECT_TRUE(plain == compressed);
+        AdaptiveRadixTree* loaded = new AdaptiveRadixTree;
+        loaded->Init((single == 1 ? ART_SINGLE_LEAF : 0) | ART_COMPRESSED_REFS);
+        loaded->Destroy();
+        ASSERT_EQ(loaded->Deserialize(readFrom(&plain)), 0);
+        checkTags(loaded, loaded->_root);
+        checkSameTree(expect, loaded);
+
+        for (int i = 0; i < 300; i++)
+        {
+            uint64_t key = rand64();
+            art->Insert(key, (void*)(key | 1));
+            expect->Insert(key, (void*)(key | 1));
+            art->DeleteRange(keys[rand() % keys.size()], rand() % 300);
+        }
+        std::string delta;
+        ASSERT_GT(art->SerializeDelta(appendTo(&delta)), 0);
+        ASSERT_EQ(loaded->ApplyDelta(readFrom(&delta)), 0);
+        checkTags(loaded, loaded->_root);
+        checkSameTree(art, loaded);
+        loaded->Destroy();
+        delete loaded;
+
+        const char* path = "./art_compressed_image";
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        ASSERT_GE(fd, 0);
+        ASSERT_EQ(art->WriteImage(fd), 0);
+        close(fd);
+        ReadOnlyArtView view;
+        ASSERT_EQ(view.Open(path), 0);
+        for (size_t i = 0; i < keys.size(); i++)
+        {
+            ASSERT_EQ(view.Search(keys[i]), art->Search(keys[i]));
+        }
+        view.Close();
+        unlink(path);
+
+        art->Destroy();
+        delete art;
+        expect->Destroy();
+        delete expect;
+    }
+
+    // BulkLoad直接生成Ref节点，多线程时arena的分配也要加锁
+    std::vector<Extent> extents = makeSortedExtents(20000, 1ULL << 50);
+    AdaptiveRadixTree* bulk = new AdaptiveRadixTree;
+    bulk->Init(ART_COMPRESSED_REFS);
+    bulk->BulkLoad(&extents[0], extents.size(), 4);
+    checkTags(bulk, bulk->_root);
+    for (size_t i = 0; i < extents.size(); i++)
+    {
+        ASSERT_EQ(bulk->Search(extents[i].start), extents[i].val);
+        ASSERT_EQ(bulk->Search(extents[i].start + extents[i].length - 1), extents[i].val);
+    }
+    bulk->Destroy();
+    delete bulk;
+}
+
+// 32位句柄让内部节点变小，性能对比在BM_CompressedRefs
+TEST(art, CompressedRefs_Memory)
+{
+    const int count = 1 << 18;
+    for (int mode = 0; mode < 2; mode++)
+    {
+        std::vector<uint64_t> keys(count);
+        for (int i = 0; i < count; i++)
+        {
+            keys[i] = mode == 0 ? ((uint64_t)rand() << 16 | rand() % 65536) : rand64();
+        }
+        uint64_t memory[2];
+        for (int compressed = 0; compressed < 2; compressed++)
+        {
+            AdaptiveRadixTree* art = new AdaptiveRadixTree;
+            art->Init(compressed == 1 ? ART_COMPRESSED_REFS : 0);
+            for (int i = 0; i < count; i++)
+            {
+                art->Insert(keys[i], (void*)(keys[i] | 1));
+            }
+            memory[compressed] = art->MemoryUsage();
+            art->Destroy();
+            delete art;
+        }
+        EXPECT_LT(memory[1], memory[0]);
+    }
+}
+
+TEST(art, Stats)
+{
+    AdaptiveRadixTree* art = new AdaptiveRadixTree;
+    art->Init();
+    // 同一个叶节点依次写入5个key，第5个把Node4扩成Node16
+    for (uint64_t key = 0x1000; key < 0x1005; key++)
+    {
+        art->Insert(key, (void*)(key | 1));
+    }
+    // 叶节点的前缀是6个字节，第二个key在前缀中间分叉
+    art->Insert(0x1122334455667788, (void*)1);
+    art->Insert(0x1122330000000000, (void*)1);
+    EXPECT_EQ(art->Search(0x1122999999999999), (void*)NULL);
+    std::vector<void*> vals;
+    art->RangeQuery(0x1000, 16, &vals);
+
+    const int kThreads = 4;
+    const int kSearches = 1000;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; t++)
+    {
+        threads.push_back(std::thread([art]() {
+            for (int i = 0; i < kSearches; i++)
+            {
+                EXPECT_EQ(art->Search(0x1000 + i % 5), (void*)((0x1000 + i % 5) | 1));
+            }
+        }));
+    }
+    for (int t = 0; t < kThreads; t++)
+    {
+        threads[t].join();
+    }
+
+    ArtStats stats = art->GetStats();
+#ifdef ART_ENABLE_STATS
+    EXPECT_EQ(stats.insert_ops, 7);
+    EXPECT_EQ(stats.query_ops, 1);
+    EXPECT_EQ(stats.search_ops, 1 + kThreads * kSearches);
+    EXPECT_GE(stats.descents, 2 * (1 + kThreads * kSearches));
+    EXPECT_GE(stats.prefix_mismatches, 2);
+    EXPECT_EQ(stats.splits, 1);
+    EXPECT_EQ(stats.grows[NODE4], 1);
+    EXPECT_EQ(stats.grows[NODE16], 0);
+    EXPECT_EQ(stats.leaf_fill[0], 3);
+    EXPECT_EQ(stats.leaf_fill[1], 2);
+    EXPECT_EQ(stats.leaf_fill[2], 2);
+#else
+    // 没有打开统计时什么都不计
+    ArtStats zero;
+    memset(&zero, 0, sizeof(zero));
+    EXPECT_EQ(memcmp(&stats, &zero, sizeof(stats)), 0);
+#endif
+    art->Destroy();
+    delete art;
+}
+
+static void expectSameStats(const ArtTreeStats& a, const ArtTreeStats& b)
+{
+    EXPECT_EQ(memcmp(a.inner, b.inner, sizeof(a.inner)), 0);
+    EXPECT_EQ(memcmp(a.leaf, b.leaf, sizeof(a.leaf)), 0);
+    EXPECT_EQ(memcmp(a.levels, b.levels, sizeof(a.levels)), 0);
+    EXPECT_EQ(memcmp(a.leaf_levels, b.leaf_levels, sizeof(a.leaf_levels)), 0);
+    EXPECT_EQ(memcmp(a.prefix_lengths, b.prefix_lengths, sizeof(a.prefix_lengths)), 0);
+    ASSERT_EQ(a.ranges.size(), b.ranges.size());
+    for (auto it = a.ranges.begin(), jt = b.ranges.begin(); it != a.ranges.end(); it++, jt++)
+    {
+        EXPECT_EQ(it->first, jt->first);
+        EXPECT_EQ(memcmp(&it->second, &jt->second, sizeof(ArtRangeStats)), 0);
+    }
+}
+
+TEST(art, ComputeStats)
+{
+    for (int mode = 0; mode < 3; mode++)
+    {
+        AdaptiveRadixTree* art = new AdaptiveRadixTree;
+        const uint32_t flags[] = {0, ART_EXTENT_LEAF | ART_PACKED_LEAF | ART_SINGLE_LEAF, ART_COMPRESSED_REFS};
+        art->Init(flags[mode]);
+        srand(mode + 1);
+        for (int i = 0; i < 20000; i++)
+        {
+            uint64_t start = rand() % (1 << 26);
+            art->RangeInsert(start, rand() % 300 + 1, (void*)(((uint64_t)i << 8) | 1));
+        }
+        for (int i = 0; i < 200; i++)
+        {
+            art->Insert(rand64(), (void*)1);
+        }
+        uint64_t keys = 0;
+        AdaptiveRadixTree::Iterator iter(art);
+        for (iter.SeekToFirst(); iter.Valid(); iter.Next())
+        {
+            keys++;
+        }
+
+        ArtTreeStats stats;
+        art->ComputeStats(&stats);
+        uint64_t bytes = 0;
+        uint64_t leafKeys = 0;
+        uint64_t nodes = 0;
+        for (int t = 0; t < 11; t++)
+        {
+            bytes += stats.inner[t].bytes + stats.leaf[t].bytes;
+            nodes += stats.inner[t].count + stats.leaf[t].count;
+            leafKeys += stats.leaf[t].children;
+            uint64_t filled = 0;
+            for (int i = 0; i < 10; i++)
+            {
+                filled += stats.inner[t].fill[i] + stats.leaf[t].fill[i];
+            }
+            EXPECT_EQ(filled, stats.inner[t].count + stats.leaf[t].count);
+        }
+        EXPECT_EQ(bytes, art->MemoryUsage());
+        EXPECT_EQ(leafKeys, keys);
+        EXPECT_EQ(stats.levels[0], 1);
+        uint64_t levelNodes = 0;
+        uint64_t prefixNodes = 0;
+        for (int i = 0; i < 8; i++)
+        {
+            levelNodes += stats.levels[i];
+        }
+        for (int i = 0; i < 7; i++)
+        {
+            prefixNodes += stats.prefix_lengths[i];
+        }
+        EXPECT_EQ(levelNodes, nodes);
+        EXPECT_EQ(prefixNodes, nodes);
+        uint64_t rangeBytes = 0;
+        for (auto it = stats.ranges.begin(); it != stats.ranges.end(); it++)
+        {
+            EXPECT_EQ(it->first & ((1ULL << stats.range_bits) - 1), 0);
+            rangeBytes += it->second.bytes;
+        }
+        EXPECT_EQ(rangeBytes, bytes);
+        if (mode == 0)
+        {
+            EXPECT_GT(stats.inner[NODE4].wasted_slots, 0);
+            EXPECT_GT(stats.leaf[NODE256].count, 0);
+        }
+
+        // 多线程和分段统计的结果都和一次统计相同
+        ArtTreeStats parallel;
+        art->ComputeStats(&parallel, 4);
+        expectSameStats(stats, parallel);
+        ArtTreeStats pieces;
+        uint64_t bounds[] = {0, 12345, 1 << 20, 1ULL << 40, ~0ULL};
+        for (int i = 0; i + 1 < 5; i++)
+        {
+            art->ComputeStats(&pieces, 1, i == 0 ? 0 : bounds[i] + 1, bounds[i + 1]);
+        }
+        expectSameStats(stats, pieces);
+
+        art->Destroy();
+        delete art;
+    }
+}
+
+static void collectAll(AdaptiveRadixTree* art, std::vector<std::pair<uint64_t, void*>>* out)
+{
+    out->clear();
+    AdaptiveRadixTree::Iterator iter(art);
+    for (iter.SeekToFirst(); iter.Valid(); iter.Next())
+    {
+        out->push_back(std::make_pair(iter.Key(), iter.Value()));
+    }
+}
+
+static uint64_t countNodes(AdaptiveRadixTree* art)
+{
+    ArtTreeStats stats;
+    art->ComputeStats(&stats);
+    uint64_t nodes = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        nodes += stats.levels[i];
+    }
+    return nodes;
+}
+
+TEST(art, Compact)
+{
+    for (int mode = 0; mode < 4; mode++)
+    {
+        AdaptiveRadixTree* art = new AdaptiveRadixTree;
+        const uint32_t flags[] = {0, ART_EXTENT_LEAF | ART_PACKED_LEAF | ART_SINGLE_LEAF, ART_COMPRESSED_REFS,
+            ART_CONCURRENT};
+        art->Init(flags[mode]);
+        srand(mode + 1);
+        for (int i = 0; i < 20000; i++)
+        {
+            uint64_t start = rand() % (1 << 26);
+            art->RangeInsert(start, rand() % 300 + 1, (void*)(((uint64_t)i << 8) | 1));
+        }
+        for (int i = 0; i < 2000; i++)
+        {
+            art->Insert(rand64(), (void*)1);
+        }
+        // 删掉大部分key，缩容有滞后，留下很多偏大的节点
+        for (int i = 0; i < 20000; i++)
+        {
+            art->DeleteRange(rand() % (1 << 26), rand() % 200 + 1);
+        }
+        std::vector<std::pair<uint64_t, void*>> expect;
+        std::vector<std::pair<uint64_t, void*>> actual;
+        collectAll(art, &expect);
+        uint64_t nodes = countNodes(art);
+        uint64_t used = art->MemoryUsage();
+
+        ArtCompactStats stats;
+        EXPECT_TRUE(art->Compact(&stats));
+        collectAll(art, &actual);
+        ASSERT_EQ(actual, expect);
+        EXPECT_EQ(stats.passes, 1);
+        EXPECT_EQ(stats.nodes, nodes);
+        EXPECT_GT(stats.resized, 0);
+        EXPECT_GT(stats.used_reclaimed, 0);
+        EXPECT_EQ(used - stats.used_reclaimed, art->MemoryUsage());
+        EXPECT_GT(stats.released, 0);
+        EXPECT_GE(art->MemoryReserved(), art->MemoryUsage());
+        for (size_t i = 0; i < expect.size(); i += 97)
+        {
+            ASSERT_EQ(art->Search(expect[i].first), expect[i].second);
+        }
+
+        // 节点已经是合适的类型，再做一遍只搬位置
+        ArtTreeStats before;
+        art->ComputeStats(&before);
+        ArtCompactStats again;
+        EXPECT_TRUE(art->Compact(&again));
+        EXPECT_EQ(again.nodes, nodes);
+        EXPECT_EQ(again.resized, 0);
+        EXPECT_EQ(again.used_reclaimed, 0);
+        ArtTreeStats after;
+        art->ComputeStats(&after);
+        expectSameStats(before, after);
+
+        // 分多次做，中间插入新的key，每个节点最多搬一次
+        ArtCompactStats pieces;
+        int calls = 0;
+        std::map<uint64_t, void*> inserted;
+        while (!art->Compact(&pieces, 1))
+        {
+            calls++;
+            uint64_t key = rand64();
+            art->Insert(key, (void*)3);
+            inserted[key] = (void*)3;
+        }
+        EXPECT_GT(calls, 1);
+        EXPECT_EQ(pieces.passes, 1);
+        EXPECT_LE(pieces.nodes, countNodes(art));
+        collectAll(art, &actual);
+        for (size_t i = 0; i < expect.size(); i++)
+        {
+            inserted.insert(expect[i]);
+        }
+        expect.assign(inserted.begin(), inserted.end());
+        ASSERT_EQ(actual, expect);
+
+        art->Destroy();
+        delete art;
+    }
+}
+
+TEST(art, LatencyHistogram)
+{
+    LatencyHistogram h;
+    for (uint64_t ns = 1; ns <= 100000; ns++)
+    {
+        h.Add(ns);
+    }
+    EXPECT_EQ(h.Count(), 100000);
+    EXPECT_EQ(h.Max(), 100000);
+    EXPECT_EQ(h.Average(), 50000);
+    // 桶的宽度不超过下界的1/16
+    double ps[] = {50, 90, 99, 99.9};
+    for (double p : ps)
+    {
+        uint64_t v = h.Percentile(p);
+        EXPECT_GE(v, p * 1000);
+        EXPECT_LE(v, p * 1000 * 17 / 16 + 1);
+    }
+
+    LatencyHistogram other;
+    other.Add(1000000);
+    h.Merge(other);
+    EXPECT_EQ(h.Count(), 100001);
+    EXPECT_EQ(h.Max(), 1000000);
+    EXPECT_EQ(h.Percentile(100), 1000000);
+
+    uint64_t start = CycleClock::Now();
+    usleep(10000);
+    uint64_t elapsed = CycleClock::ToNanos(CycleClock::Now() - start);
+    EXPECT_GE(elapsed, 10000000);
+    EXPECT_LT(elapsed, 1000000000);
+}
+
+TEST(art, Latency)
+{
+    AdaptiveRadixTree* art = new AdaptiveRadixTree;
+    art->Init();
+    LatencyHistogram h;
+    art->GetLatency(LATENCY_SEARCH, &h);
+    EXPECT_EQ(h.Count(), 0);
+
+    const int kThreads = 4;
+    const int kOps = 1000;
+    for (int sample = 1; sample <= 4; sample += 3)
+    {
+        art->EnableLatency(sample);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < kThreads; t++)
+        {
+            threads.push_back(std::thread([art, t]() {
+                std::vector<void*> vals;
+                for (int i = 0; i < kOps; i++)
+                {
+                    // 非并发模式下只读的接口也可以多个线程同时调用
+                    vals.clear();
+                    art->RangeQuery(t * 256 + i % 256, 8, &vals);
+                    art->Search(t * 256 + i % 256);
+                }
+            }));
+        }
+        for (int t = 0; t < kThreads; t++)
+        {
+            threads[t].join();
+        }
+        for (int i = 0; i < kOps; i++)
+        {
+            art->RangeInsert(i * 16, 16, (void*)1);
+        }
+
+        LatencyHistogram search, query, insert;
+        art->GetLatency(LATENCY_SEARCH, &search);
+        art->GetLatency(LATENCY_RANGE_QUERY, &query);
+        art->GetLatency(LATENCY_RANGE_INSERT, &insert);
+        // 每个线程的第一次操作就会被采样
+        EXPECT_EQ(search.Count(), kThreads * ((kOps - 1) / sample + 1));
+        EXPECT_EQ(query.Count(), kThreads * ((kOps - 1) / sample + 1));
+        EXPECT_EQ(insert.Count(), (kOps - 1) / sample + 1);
+        EXPECT_GT(insert.Max(), 0);
+        EXPECT_LE(insert.Percentile(50), insert.Percentile(99));
+        printf("sample 1/%d search p50 %lu p99 %lu insert p50 %lu p99 %lu query p50 %lu p99 %lu ns\n",
+            sample, search.Percentile(50), search.Percentile(99), insert.Percentile(50), insert.Percentile(99),
+            query.Percentile(50), query.Percentile(99));
+    }
+
+    art->EnableLatency(0);
+    art->Search(1);
+    LatencyHistogram off;
+    art->GetLatency(LATENCY_SEARCH, &off);
+    EXPECT_EQ(off.Count(), 0);
+    art->Destroy();
+    delete art;
+}
+
+TEST(art, ReadOnlyArtView)
+{
+    AdaptiveRadixTree* art = new AdaptiveRadixTree;
+    art->Init();
+
+    std::vector<uint64_t> starts;
+    for (int i = 0; i < 20000; i++)
+    {
+        uint64_t start = i % 2 == 0 ? ((uint64_t)rand() << 20 | rand() % 4096) : (uint64_t)rand() % 1000000;
+        uint32_t length = 1 + rand() % (i % 10 == 0 ? 2000 : 40);
+        art->RangeInsert(start, length, (void*)(uint64_t)(rand() | 1));
+        starts.push_back(start);
+    }
+    // 一直到key空间的末尾，start + length会溢出
+    art->RangeInsert(UINT64_MAX - 299, 300, (void*)77);
+
+    const char* path = "./art_image";
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(art->WriteImage(fd), 0);
+    close(fd);
+
+    ReadOnlyArtView view;
+    uint64_t open_start = NowMicros();
+    ASSERT_EQ(view.Open(path), 0);
+    uint64_t open_end = NowMicros();
+    printf("image size %ldB memory %ldB open %ldus\n", view.Size(), art->MemoryUsage(), open_end - open_start);
+
+    std::vector<void*> expect;
+    std::vector<void*> actual;
+    for (size_t i = 0; i < starts.size(); i++)
+    {
+        uint64_t key = starts[i] + rand() % 64;
+        ASSERT_EQ(view.Search(key), art->Search(key));
+        ASSERT_EQ(view.Search(key + (1ULL << 50)), (void*)NULL);
+
+        uint32_t length = 1 + rand() % 600;
+        uint64_t from = starts[i] > 8 ? starts[i] - 8 : 0;
+        art->RangeQuery(from, length, &expect);
+        view.RangeQuery(from, length, &actual);
+        ASSERT_TRUE(expect == actual);
+    }
+    view.RangeQuery(UINT64_MAX - 99, 100, &actual);
+    EXPECT_EQ(actual, std::vector<void*>(100, (void*)77));
+    uint64_t size = view.Size();
+    view.Close();
+
+    // child偏移指到文件外面的镜像，查找不会越界
+    std::string image(size, 0);
+    fd = open(path, O_RDWR);
+    ASSERT_EQ(pread(fd, &image[0], size, 0), (ssize_t)size);
+    const ArtImageHeader* header = reinterpret_cast<const ArtImageHeader*>(image.data());
+    Node* root = reinterpret_cast<Node*>(&image[header->root]);
+    ASSERT_FALSE(root->IsLeaf());
+    uint64_t* slots;
+    int slotCount;
+    switch (root->type)
+    {
+        case NODE4:
+            slots = reinterpret_cast<uint64_t*>(reinterpret_cast<Node4*>(root)->child_ptrs);
+            slotCount = root->child_count;
+            break;
+        case NODE16:
+            slots = reinterpret_cast<uint64_t*>(reinterpret_cast<Node16*>(root)->child_ptrs);
+            slotCount = root->child_count;
+            break;
+        case NODE48:
+            slots = reinterpret_cast<uint64_t*>(reinterpret_cast<Node48*>(root)->child_ptrs);
+            slotCount = 48;
+            break;
+        default:
+            slots = reinterpret_cast<uint64_t*>(reinterpret_cast<Node256*>(root)->child_ptrs);
+            slotCount = 256;
+            break;
+    }
+    for (int i = 0; i < slotCount; i++)
+    {
+        slots[i] = slots[i] == 0 ? 0 : size - 8 + i % 2 * (1ULL << 40);
+    }
+    ASSERT_EQ(pwrite(fd, image.data(), size, 0), (ssize_t)size);
+    ASSERT_EQ(view.Open(path), 0);
+    for (size_t i = 0; i < starts.size(); i += 100)
+    {
+        EXPECT_EQ(view.Search(starts[i]), (void*)NULL);
+        view.RangeQuery(starts[i], 300, &actual);
+        EXPECT_EQ(actual, std::vector<void*>(300, (void*)NULL));
+    }
+    view.Close();
+
+    // 根节点的类型不是四种普通节点
+    root->type = NODE_EXTENT;
+    ASSERT_EQ(pwrite(fd, image.data(), size, 0), (ssize_t)size);
+    close(fd);
+    EXPECT_EQ(view.Open(path), -1);
+
+    // 截断的镜像打不开
+    ASSERT_EQ(truncate(path, size / 2), 0);
+    EXPECT_EQ(view.Open(path), -1);
+    unlink(path);
+    EXPECT_EQ(view.Open(path), -1);
+
+    art->Destroy();
+    delete art;
+}
+
+TEST(art, SSE_lt)
+{
+    int mask = (1 << 16) - 1;
+    signed char array[] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15};
+
+    {
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(array));
+        __m128i cmp = _mm_cmplt_epi8(_mm_set1_epi8(0), b);
         int bitfieldend = _mm_movemask_epi8(cmp) & mask;
         int index = -1;
         if (bitfieldend)
@@ -1217,6 +3468,442 @@ TEST(art, SSE_gt)
     }
 }
 
+TEST(art, SlabAllocator)
+{
+    SlabAllocator slab;
+    slab.Init(sizeof(Node256));
+    EXPECT_EQ(slab.ObjectSize() % 16, 0);
+    EXPECT_EQ(slab.ReservedBytes(), 0);
+
+    std::vector<void*> objects;
+    for (int i = 0; i < 1000; i++)
+    {
+        void* ptr = slab.Alloc();
+        EXPECT_EQ((uint64_t)ptr % 16, 0);
+        memset(ptr, 0xff, sizeof(Node256));
+        objects.push_back(ptr);
+    }
+    EXPECT_EQ(slab.UsedBytes(), 1000ULL * slab.ObjectSize());
+    uint64_t reserved = slab.ReservedBytes();
+    EXPECT_GE(reserved, slab.UsedBytes());
+
+    // 释放的对象优先复用，不会申请新的slab
+    for (int i = 0; i < 500; i++)
+    {
+        slab.Free(objects[i]);
+    }
+    for (int i = 0; i < 500; i++)
+    {
+        slab.Alloc();
+    }
+    EXPECT_EQ(slab.ReservedBytes(), reserved);
+    EXPECT_EQ(slab.UsedBytes(), 1000ULL * slab.ObjectSize());
+    EXPECT_EQ(slab.ReleaseEmptySlabs(), 0);
+
+    // AllocFresh不复用free list，对象全部释放的slab可以还给系统
+    void* fresh = slab.AllocFresh();
+    void* next = slab.AllocFresh();
+    EXPECT_EQ((char*)next - (char*)fresh, slab.ObjectSize());
+    slab.Free(fresh);
+    slab.Free(next);
+    for (int i = 500; i < 1000; i++)
+    {
+        slab.Free(objects[i]);
+    }
+    EXPECT_GT(slab.ReleaseEmptySlabs(), 0);
+    EXPECT_LT(slab.ReservedBytes(), reserved);
+    EXPECT_EQ(slab.UsedBytes(), 500ULL * slab.ObjectSize());
+    for (int i = 0; i < 1000; i++)
+    {
+        memset(slab.Alloc(), 0xff, sizeof(Node256));
+    }
+
+    slab.Release();
+    EXPECT_EQ(slab.UsedBytes(), 0);
+    EXPECT_EQ(slab.ReservedBytes(), 0);
+
+    // arena用完之后，不允许回退时返回NULL，允许回退时从系统分配
+    SlabArena arena;
+    ASSERT_EQ(arena.Reserve(1 << 20), 0);
+    for (int fallback = 0; fallback < 2; fallback++)
+    {
+        SlabAllocator bounded;
+        bounded.Init(sizeof(Node256));
+        bounded.SetArena(&arena, fallback == 1);
+        std::vector<void*> ptrs;
+        void* ptr = NULL;
+        while (ptrs.size() < 10000 && (ptr = bounded.Alloc()) != NULL)
+        {
+            memset(ptr, 0xff, sizeof(Node256));
+            ptrs.push_back(ptr);
+        }
+        if (fallback == 0)
+        {
+            EXPECT_LT(ptrs.size(), 10000);
+            EXPECT_TRUE(bounded.AllocFresh() == NULL);
+        }
+        else
+        {
+            EXPECT_EQ(ptrs.size(), 10000);
+            EXPECT_GT(bounded.ReservedBytes(), 1 << 20);
+        }
+        EXPECT_EQ(bounded.UsedBytes(), ptrs.size() * bounded.ObjectSize());
+        for (size_t i = 0; i < ptrs.size(); i++)
+        {
+            bounded.Free(ptrs[i]);
+        }
+        EXPECT_GT(bounded.ReleaseEmptySlabs(), 0);
+        bounded.Release();
+        arena.Reset();
+    }
+
+    AdaptiveRadixTree* art = new AdaptiveRadixTree;
+    art->Init();
+    for (uint64_t i = 0; i < 100000; i++)
+    {
+        art->Insert((uint64_t)rand() << 32 | rand(), (void*)i);
+    }
+    EXPECT_GT(art->MemoryUsage(), 0);
+    EXPECT_GE(art->MemoryReserved(), art->MemoryUsage());
+
+    art->Destroy();
+    EXPECT_EQ(art->MemoryUsage(), 0);
+    EXPECT_EQ(art->MemoryReserved(), 0);
+    delete art;
+}
+
+TEST(art, HugePages)
+{
+    SlabArena arena;
+    ASSERT_EQ(arena.Reserve(64 << 20, true), 0);
+    EXPECT_EQ((uint64_t)arena.Base() % SlabArena::kHugePageSize, 0);
+    arena.Prefault(3 << 20);
+    EXPECT_EQ(arena.HugeTlbBytes() + arena.TransparentBytes(), 4 << 20);
+    // 切到没有提交的部分时按2M提交
+    for (int i = 0; i < 64; i++)
+    {
+        memset(arena.AllocSlab(64 << 10), 0xff, 64 << 10);
+    }
+    EXPECT_EQ(arena.HugeTlbBytes() + arena.TransparentBytes(), 6 << 20);
+    arena.Reset();
+    EXPECT_EQ(arena.HugeTlbBytes() + arena.TransparentBytes(), 0);
+    char* slab = arena.AllocSlab(64 << 10);
+    EXPECT_EQ(slab[0], 0);
+    printf("hugetlb %lu transparent %lu\n", arena.HugeTlbBytes(), arena.TransparentBytes());
+
+    for (int mode = 0; mode < 2; mode++)
+    {
+        AdaptiveRadixTree* expect = new AdaptiveRadixTree;
+        AdaptiveRadixTree* art = new AdaptiveRadixTree;
+        expect->Init(mode == 1 ? ART_COMPRESSED_REFS : 0);
+        art->EnableHugePages(16 << 20);
+        art->Init(mode == 1 ? ART_COMPRESSED_REFS : 0);
+        uint64_t hugetlb = 0;
+        uint64_t transparent = 0;
+        art->HugePageBytes(&hugetlb, &transparent);
+        EXPECT_GE(hugetlb + transparent, 16 << 20);
+        for (int round = 0; round < 2; round++)
+        {
+            srand(round + 1);
+            for (int i = 0; i < 100000; i++)
+            {
+                uint64_t start = rand64() % (1ULL << 40);
+                uint32_t length = rand() % 64 + 1;
+                void* val = (void*)(((uint64_t)i << 8) | 1);
+                expect->RangeInsert(start, length, val);
+                art->RangeInsert(start, length, val);
+            }
+            checkSameTree(expect, art);
+            EXPECT_EQ(art->MemoryUsage(), expect->MemoryUsage());
+            art->HugePageBytes(&hugetlb, &transparent);
+            EXPECT_GE(hugetlb + transparent, art->MemoryReserved());
+
+            // Destroy把大页还给系统，再次Init时重新预先提交
+            art->Destroy();
+            expect->Destroy();
+            art->Init(mode == 1 ? ART_COMPRESSED_REFS : 0);
+            expect->Init(mode == 1 ? ART_COMPRESSED_REFS : 0);
+        }
+        delete expect;
+        delete art;
+    }
+}
+
+TEST(art, SearchKernel)
+{
+    const SearchKernel* scalar = ScalarSearchKernel();
+    std::vector<const SearchKernel*> kernels;
+    kernels.push_back(SSE2SearchKernel());
+    if (AVX2SearchKernel() != NULL)
+    {
+        kernels.push_back(AVX2SearchKernel());
+    }
+    printf("selected kernel %s\n", SelectSearchKernel()->name);
+
+    for (int round = 0; round < 1000; round++)
+    {
+        // 有序不重复的key，包含0和255这样的边界值
+        unsigned char keys[16];
+        int count = rand() % 17;
+        std::map<unsigned char, bool> picked;
+        if (round % 2 == 0)
+        {
+            picked[0] = true;
+            picked[255] = true;
+        }
+        while (picked.size() < (size_t)count)
+        {
+            picked[rand() % 256] = true;
+        }
+        int n = 0;
+        for (auto it = picked.begin(); it != picked.end() && n < count; it++)
+        {
+            keys[n++] = it->first;
+        }
+        // 有效key之后填上垃圾数据，kernel不能读到
+        for (int i = n; i < 16; i++)
+        {
+            keys[i] = rand() % 256;
+        }
+
+        for (size_t k = 0; k < kernels.size(); k++)
+        {
+            for (int b = 0; b < 256; b++)
+            {
+                unsigned char byte = b;
+                EXPECT_EQ(kernels[k]->findKey16(keys, n, byte), scalar->findKey16(keys, n, byte)) << kernels[k]->name;
+                EXPECT_EQ(kernels[k]->insertPos16(keys, n, byte), scalar->insertPos16(keys, n, byte)) << kernels[k]->name;
+                if (n <= 4)
+                {
+                    EXPECT_EQ(kernels[k]->findKey4(keys, n, byte), scalar->findKey4(keys, n, byte)) << kernels[k]->name;
+                    EXPECT_EQ(kernels[k]->insertPos4(keys, n, byte), scalar->insertPos4(keys, n, byte)) << kernels[k]->name;
+                }
+            }
+        }
+    }
+    // 压缩叶节点的解码，长度覆盖kernel的尾部处理
+    unsigned char indexs[256];
+    uint64_t values[16];
+    uint16_t deltas16[256];
+    uint32_t deltas32[256];
+    for (int i = 0; i < 16; i++)
+    {
+        values[i] = i == 0 ? 0 : (uint64_t)rand() << 20;
+    }
+    for (int i = 0; i < 256; i++)
+    {
+        indexs[i] = rand() % 16;
+        deltas16[i] = i % 5 == 0 ? 0 : (i % 7 == 0 ? 0xFFFF : rand());
+        deltas32[i] = i % 5 == 0 ? 0 : (i % 7 == 0 ? 0xFFFFFFFF : rand());
+    }
+    uint64_t base = 0x7F0000000000UL;
+    for (int start = 0; start < 16; start++)
+    {
+        for (uint32_t length = 0; length + start <= 256; length += 1 + length / 8)
+        {
+            void* expect[256];
+            void* actual[256];
+            for (size_t k = 0; k < kernels.size(); k++)
+            {
+                scalar->decodeDict(&indexs[start], values, length, expect);
+                kernels[k]->decodeDict(&indexs[start], values, length, actual);
+                ASSERT_EQ(memcmp(expect, actual, length * sizeof(void*)), 0) << kernels[k]->name;
+                scalar->decodeDelta16(&deltas16[start], base, length, expect);
+                kernels[k]->decodeDelta16(&deltas16[start], base, length, actual);
+                ASSERT_EQ(memcmp(expect, actual, length * sizeof(void*)), 0) << kernels[k]->name;
+                scalar->decodeDelta32(&deltas32[start], base, length, expect);
+                kernels[k]->decodeDelta32(&deltas32[start], base, length, actual);
+                ASSERT_EQ(memcmp(expect, actual, length * sizeof(void*)), 0) << kernels[k]->name;
+            }
+        }
+    }
+}
+
+// 每次写入的value都不同，从value可以知道是哪个线程的第几次写入
+static void* writeValue(int thread, int op)
+{
+    return (void*)((((uint64_t)thread << 32) | (uint64_t)op) << 1 | 1);
+}
+
+struct StressOp
+{
+    uint64_t    start;
+    uint32_t    length;
+};
+
+TEST(art, Concurrent_Stress)
+{
+    AdaptiveRadixTree* art = new AdaptiveRadixTree;
+    // 并发模式不能和压缩格式一起用，不认识的位也拒绝
+    EXPECT_EQ(art->Init(ART_CONCURRENT | ART_EXTENT_LEAF), -1);
+    EXPECT_EQ(art->Init(ART_CONCURRENT | ART_COMPRESSED_REFS), -1);
+    EXPECT_EQ(art->Init(1 << 20), -1);
+    ASSERT_EQ(art->Init(ART_CONCURRENT), 0);
+
+    std::vector<uint64_t> insertedKeys;
+    std::mutex verifyMutex;
+    std::atomic<bool> stop(false);
+    std::atomic<uint64_t> readErrors(0);
+
+    const int kWriters = 4;
+    const int kReaders = 2;
+    const int kOpsPerWriter = 20000;
+
+    // 先生成所有的写入，读线程可以根据value查到是哪次写入
+    std::vector<std::vector<StressOp>> ops(kWriters, std::vector<StressOp>(kOpsPerWriter));
+    for (int t = 0; t < kWriters; t++)
+    {
+        unsigned int seed = t + 1;
+        for (int i = 0; i < kOpsPerWriter; i++)
+        {
+            // 高位取值范围小，让多个线程在相同的节点上分裂和扩容
+            uint64_t start = (uint64_t)(rand_r(&seed) % 16) << 40 | (uint64_t)(rand_r(&seed) % 4096) << 8 | rand_r(&seed) % 256;
+            ops[t][i].start = start;
+            ops[t][i].length = i % 2 == 0 ? 1 : std::max(1U, rand_r(&seed) % (256 - (uint32_t)(start % 256)));
+        }
+    }
+    auto writtenBy = [&ops](uint64_t key, void* val) {
+        uint64_t v = (uint64_t)val;
+        uint64_t t = v >> 33;
+        uint64_t i = (v >> 1) & 0xffffffff;
+        return (v & 1) && t < ops.size() && i < ops[t].size() && key >= ops[t][i].start &&
+            key < ops[t][i].start + ops[t][i].length;
+    };
+
+    std::vector<std::thread> writers;
+    for (int t = 0; t < kWriters; t++)
+    {
+        writers.push_back(std::thread([&, t]() {
+            for (int i = 0; i < kOpsPerWriter; i++)
+            {
+                const StressOp& op = ops[t][i];
+                if (i % 2 == 0)
+                {
+                    art->Insert(op.start, writeValue(t, i));
+                }
+                else
+                {
+                    art->RangeInsert(op.start, op.length, writeValue(t, i));
+                }
+                std::lock_guard<std::mutex> lock(verifyMutex);
+                insertedKeys.push_back(op.start + op.length - 1);
+            }
+        }));
+    }
+
+    std::vector<std::thread> readers;
+    for (int t = 0; t < kReaders; t++)
+    {
+        readers.push_back(std::thread([&, t]() {
+            unsigned int seed = t + 100;
+            std::vector<void*> vals;
+            while (!stop.load())
+            {
+                uint64_t key;
+                {
+                    std::lock_guard<std::mutex> lock(verifyMutex);
+                    if (insertedKeys.empty())
+                    {
+                        continue;
+                    }
+                    key = insertedKeys[rand_r(&seed) % insertedKeys.size()];
+                }
+                // 已经记录下来的key一定已经插入完成，之后可能被别的线程覆盖，但一定是某次覆盖了这个key的写入
+                if (!writtenBy(key, art->Search(key)))
+                {
+                    readErrors++;
+                }
+                vals.clear();
+                art->RangeQuery(key, 1, &vals);
+                if (vals.size() != 1 || !writtenBy(key, vals[0]))
+                {
+                    readErrors++;
+                }
+            }
+        }));
+    }
+
+    for (size_t i = 0; i < writers.size(); i++)
+    {
+        writers[i].join();
+    }
+    stop.store(true);
+    for (size_t i = 0; i < readers.size(); i++)
+    {
+        readers[i].join();
+    }
+
+    EXPECT_EQ(readErrors.load(), 0);
+    // 每个线程按自己的顺序写，最后留下的一定是某个线程对这个key的最后一次写入
+    std::map<uint64_t, std::vector<void*>> candidates;
+    for (int t = 0; t < kWriters; t++)
+    {
+        std::map<uint64_t, void*> last;
+        for (int i = 0; i < kOpsPerWriter; i++)
+        {
+            for (uint32_t j = 0; j < ops[t][i].length; j++)
+            {
+                last[ops[t][i].start + j] = writeValue(t, i);
+            }
+        }
+        for (auto it = last.begin(); it != last.end(); it++)
+        {
+            candidates[it->first].push_back(it->second);
+        }
+    }
+    for (auto it = candidates.begin(); it != candidates.end(); it++)
+    {
+        void* val = art->Search(it->first);
+        EXPECT_TRUE(std::find(it->second.begin(), it->second.end(), val) != it->second.end()) << it->first;
+    }
+
+    art->Destroy();
+    delete art;
+}
+
+// 线程退出之后编号可以给新线程用，同时存活的线程超过上限时直接退出
+TEST(art, ThreadIndex)
+{
+    int maxThreads = EpochManager::kMaxThreads;
+    for (int round = 0; round < 2 * maxThreads; round++)
+    {
+        int index = -1;
+        std::thread([&index]() {
+            index = CurrentThreadIndex();
+        }).join();
+        ASSERT_GE(index, 0);
+        ASSERT_LT(index, maxThreads);
+    }
+
+    testing::FLAGS_gtest_death_test_style = "threadsafe";
+    EXPECT_DEATH({
+        // 所有线程都拿到编号之后才放它们退出，否则编号会被复用
+        std::atomic<int> ready(0);
+        std::atomic<bool> release(false);
+        std::vector<std::thread> threads;
+        for (int i = 0; i <= maxThreads; i++)
+        {
+            threads.push_back(std::thread([&ready, &release]() {
+                CurrentThreadIndex();
+                ready++;
+                while (!release)
+                {
+                    usleep(1000);
+                }
+            }));
+        }
+        for (int i = 0; i < 10000 && ready <= maxThreads; i++)
+        {
+            usleep(1000);
+        }
+        release = true;
+        for (size_t i = 0; i < threads.size(); i++)
+        {
+            threads[i].join();
+        }
+    }, "no thread index left");
+}
+
 GTEST_API_ int main(int argc, char **argv) {
   testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
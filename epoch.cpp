@@ -0,0 +1,193 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <mutex>
+#include "epoch.h"
+#include "assert.h"
+
+namespace art
+{
+
+static const uint64_t kIdleEpoch = UINT64_MAX;
+// 每个线程攒够这么多待回收的指针之后尝试推进epoch
+static const size_t kReclaimBatch = 64;
+
+static std::mutex g_thread_index_mutex;
+static bool g_thread_index_used[EpochManager::kMaxThreads];
+
+class ThreadIndexHolder
+{
+public:
+    ThreadIndexHolder()
+    : _index(-1)
+    {
+        std::lock_guard<std::mutex> lock(g_thread_index_mutex);
+        for (int i = 0; i < EpochManager::kMaxThreads; i++)
+        {
+            if (!g_thread_index_used[i])
+            {
+                g_thread_index_used[i] = true;
+                _index = i;
+                break;
+            }
+        }
+        // 每个编号背后是EpochManager和统计的一个槽位，几个线程共用一个槽位时epoch和计数都不对，只能退出
+        if (_index < 0)
+        {
+            fprintf(stderr, "art: more than %d live threads, no thread index left\n", EpochManager::kMaxThreads);
+            abort();
+        }
+    }
+
+    ~ThreadIndexHolder()
+    {
+        std::lock_guard<std::mutex> lock(g_thread_index_mutex);
+        g_thread_index_used[_index] = false;
+    }
+
+    int Index()
+    {
+        return _index;
+    }
+
+private:
+    int _index;
+};
+
+__thread int g_current_thread_index = -1;
+
+int AssignThreadIndex()
+{
+    static thread_local ThreadIndexHolder holder;
+    g_current_thread_index = holder.Index();
+    return g_current_thread_index;
+}
+
+EpochManager::EpochManager(ReclaimFunc func, void* ctx)
+: _global_epoch(0),
+  _func(func),
+  _ctx(ctx)
+{
+    for (int i = 0; i < kMaxThreads; i++)
+    {
+        _slots[i].epoch.store(kIdleEpoch, std::memory_order_relaxed);
+        _slots[i].nesting = 0;
+    }
+}
+
+EpochManager::~EpochManager()
+{
+    ReclaimAll();
+}
+
+void EpochManager::Enter()
+{
+    ThreadSlot* slot = &_slots[CurrentThreadIndex()];
+    if (slot->nesting++ > 0)
+    {
+        return;
+    }
+    // 公布自己的epoch之后要再确认一次全局epoch没有变化，否则可能读到已经被回收的节点
+    uint64_t epoch = _global_epoch.load(std::memory_order_seq_cst);
+    do
+    {
+        slot->epoch.store(epoch, std::memory_order_seq_cst);
+        uint64_t current = _global_epoch.load(std::memory_order_seq_cst);
+        if (current == epoch)
+        {
+            break;
+        }
+        epoch = current;
+    } while (1);
+}
+
+void EpochManager::Exit()
+{
+    ThreadSlot* slot = &_slots[CurrentThreadIndex()];
+    assert(slot->nesting > 0);
+    if (--slot->nesting > 0)
+    {
+        return;
+    }
+    slot->epoch.store(kIdleEpoch, std::memory_order_release);
+}
+
+void EpochManager::Retire(void* ptr)
+{
+    ThreadSlot* slot = &_slots[CurrentThreadIndex()];
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    Retired r;
+    r.ptr = ptr;
+    r.epoch = _global_epoch.load(std::memory_order_seq_cst);
+    slot->retired.push_back(r);
+    if (slot->retired.size() >= kReclaimBatch)
+    {
+        tryAdvance();
+        reclaim(slot, _global_epoch.load(std::memory_order_acquire));
+    }
+}
+
+// 所有活跃的线程都已经进入当前epoch之后才能推进
+void EpochManager::tryAdvance()
+{
+    uint64_t epoch = _global_epoch.load(std::memory_order_seq_cst);
+    for (int i = 0; i < kMaxThreads; i++)
+    {
+        uint64_t e = _slots[i].epoch.load(std::memory_order_seq_cst);
+        if (e != kIdleEpoch && e != epoch)
+        {
+            return;
+        }
+    }
+    _global_epoch.compare_exchange_strong(epoch, epoch + 1, std::memory_order_seq_cst);
+}
+
+// epoch为e时摘掉的节点，全局epoch推进到e + 2之后就没有线程能访问了
+void EpochManager::reclaim(ThreadSlot* slot, uint64_t global_epoch)
+{
+    size_t kept = 0;
+    for (size_t i = 0; i < slot->retired.size(); i++)
+    {
+        if (slot->retired[i].epoch + 2 <= global_epoch)
+        {
+            _func(_ctx, slot->retired[i].ptr);
+        }
+        else
+        {
+            slot->retired[kept++] = slot->retired[i];
+        }
+    }
+    slot->retired.resize(kept);
+}
+
+void EpochManager::ReclaimAll()
+{
+    for (int i = 0; i < kMaxThreads; i++)
+    {
+        assert(_slots[i].nesting == 0);
+        for (size_t j = 0; j < _slots[i].retired.size(); j++)
+        {
+            _func(_ctx, _slots[i].retired[j].ptr);
+        }
+        _slots[i].retired.clear();
+    }
+}
+
+void EpochManager::DropAll()
+{
+    for (int i = 0; i < kMaxThreads; i++)
+    {
+        _slots[i].retired.clear();
+    }
+}
+
+uint64_t EpochManager::PendingCount()
+{
+    uint64_t count = 0;
+    for (int i = 0; i < kMaxThreads; i++)
+    {
+        count += _slots[i].retired.size();
+    }
+    return count;
+}
+
+}
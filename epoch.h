@@ -0,0 +1,94 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+
+namespace art
+{
+
+// 线程第一次调用CurrentThreadIndex()时分配编号
+int AssignThreadIndex();
+
+extern __thread int g_current_thread_index;
+
+// 当前线程的编号，线程退出后编号会被复用
+// 同时存活的线程里用过编号的超过EpochManager::kMaxThreads个时进程直接abort
+// 热路径上的统计计数也要用，分配过之后只读一个thread_local变量
+static inline int CurrentThreadIndex()
+{
+    int index = g_current_thread_index;
+    return index >= 0 ? index : AssignThreadIndex();
+}
+
+// 基于epoch的内存回收，被替换掉的节点要等所有可能还在读它的线程退出之后才能释放
+// 读写操作都要在Enter/Exit之间进行
+class EpochManager
+{
+public:
+    static const int kMaxThreads = 256;
+
+    typedef void (*ReclaimFunc)(void* ctx, void* ptr);
+
+    EpochManager(ReclaimFunc func, void* ctx);
+
+    ~EpochManager();
+
+    void Enter();
+
+    void Exit();
+
+    // ptr必须已经从树上摘掉
+    void Retire(void* ptr);
+
+    // 调用时不能有线程在Enter/Exit之间
+    void ReclaimAll();
+
+    // 丢弃所有待回收的指针，内存由调用者统一释放
+    void DropAll();
+
+    uint64_t PendingCount();
+
+private:
+    struct Retired
+    {
+        void*       ptr;
+        uint64_t    epoch;
+    };
+
+    struct alignas(64) ThreadSlot
+    {
+        std::atomic<uint64_t>   epoch;
+        uint32_t                nesting;
+        std::vector<Retired>    retired;
+    };
+
+    void tryAdvance();
+
+    void reclaim(ThreadSlot* slot, uint64_t safe_epoch);
+
+    std::atomic<uint64_t>   _global_epoch;
+    ReclaimFunc             _func;
+    void*                   _ctx;
+    ThreadSlot              _slots[kMaxThreads];
+};
+
+class EpochGuard
+{
+public:
+    explicit EpochGuard(EpochManager* epoch)
+    : _epoch(epoch)
+    {
+        _epoch->Enter();
+    }
+
+    ~EpochGuard()
+    {
+        _epoch->Exit();
+    }
+
+private:
+    EpochManager* _epoch;
+};
+
+}
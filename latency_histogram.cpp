@@ -0,0 +1,166 @@
+#include <time.h>
+#include <cpuid.h>
+#include "latency_histogram.h"
+#include "assert.h"
+
+namespace art
+{
+
+void LatencyHistogram::Reset()
+{
+    memset(_buckets, 0, sizeof(_buckets));
+    _count = 0;
+    _sum = 0;
+    _max = 0;
+}
+
+static inline void relaxedAdd(uint64_t* counter, uint64_t n)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+void LatencyHistogram::Add(uint64_t ns)
+{
+    relaxedAdd(&_buckets[bucketOf(ns)], 1);
+    relaxedAdd(&_count, 1);
+    relaxedAdd(&_sum, ns);
+    if (ns > _max)
+    {
+        __atomic_store_n(&_max, ns, __ATOMIC_RELAXED);
+    }
+}
+
+void LatencyHistogram::Merge(const LatencyHistogram& other)
+{
+    for (int i = 0; i < kBuckets; i++)
+    {
+        _buckets[i] += __atomic_load_n(&other._buckets[i], __ATOMIC_RELAXED);
+    }
+    _count += __atomic_load_n(&other._count, __ATOMIC_RELAXED);
+    _sum += __atomic_load_n(&other._sum, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&other._max, __ATOMIC_RELAXED);
+    _max = max > _max ? max : _max;
+}
+
+uint64_t LatencyHistogram::Percentile(double p) const
+{
+    // 合并时各个计数不是同一时刻读的，按桶里的实际个数算排名
+    uint64_t total = 0;
+    for (int i = 0; i < kBuckets; i++)
+    {
+        total += _buckets[i];
+    }
+    uint64_t rank = (uint64_t)(p / 100 * total);
+    uint64_t seen = 0;
+    for (int i = 0; i < kBuckets; i++)
+    {
+        seen += _buckets[i];
+        if (seen > rank)
+        {
+            uint64_t upper = bucketUpper(i);
+            return upper < _max ? upper : _max;
+        }
+    }
+    return _max;
+}
+
+int LatencyHistogram::bucketOf(uint64_t ns)
+{
+    if (ns < (1U << kSubBits))
+    {
+        return ns;
+    }
+    int exp = 63 - __builtin_clzll(ns);
+    int sub = (ns >> (exp - kSubBits)) & ((1 << kSubBits) - 1);
+    return ((exp - kSubBits + 1) << kSubBits) + sub;
+}
+
+uint64_t LatencyHistogram::bucketUpper(int index)
+{
+    if (index < (1 << kSubBits))
+    {
+        return index;
+    }
+    int exp = (index >> kSubBits) + kSubBits - 1;
+    uint64_t sub = index & ((1 << kSubBits) - 1);
+    return ((1ULL << kSubBits | sub) << (exp - kSubBits)) + (1ULL << (exp - kSubBits)) - 1;
+}
+
+uint64_t CycleClock::monotonicRawNanos()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// CPUID 0x80000007 EDX bit8: TSC的频率不随变频和C-state变化，各个核之间同步
+CycleClock::Calibration::Calibration()
+: use_tsc(false),
+  nanos_per_tick(1.0)
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) == 0 || (edx & (1 << 8)) == 0)
+    {
+        return;
+    }
+    // 对照10ms，误差在0.1%以内
+    uint64_t ns0 = monotonicRawNanos();
+    uint64_t tsc0 = __builtin_ia32_rdtsc();
+    uint64_t ns1 = ns0;
+    while (ns1 - ns0 < 10000000)
+    {
+        ns1 = monotonicRawNanos();
+    }
+    uint64_t tsc1 = __builtin_ia32_rdtsc();
+    if (tsc1 <= tsc0)
+    {
+        return;
+    }
+    use_tsc = true;
+    nanos_per_tick = (double)(ns1 - ns0) / (tsc1 - tsc0);
+}
+
+LatencyRecorder::LatencyRecorder(uint32_t sample_every)
+: _sample_every(sample_every)
+{
+    assert(sample_every > 0);
+    memset(_slots, 0, sizeof(_slots));
+    // 校准放在构造时做，不要落在第一次被采样的操作上
+    CycleClock::ToNanos(0);
+}
+
+LatencyRecorder::~LatencyRecorder()
+{
+    for (int i = 0; i < EpochManager::kMaxThreads; i++)
+    {
+        delete _slots[i];
+    }
+}
+
+LatencyRecorder::Slot* LatencyRecorder::allocSlot()
+{
+    Slot* slot = new Slot;
+    // 第一次操作就采样，短时间运行的线程也有数据
+    for (int i = 0; i < LATENCY_OP_COUNT; i++)
+    {
+        slot->countdown[i] = 1;
+    }
+    std::lock_guard<std::mutex> lock(_mutex);
+    __atomic_store_n(&_slots[CurrentThreadIndex()], slot, __ATOMIC_RELEASE);
+    return slot;
+}
+
+void LatencyRecorder::Merge(LatencyOp op, LatencyHistogram* out)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (int i = 0; i < EpochManager::kMaxThreads; i++)
+    {
+        Slot* slot = __atomic_load_n(&_slots[i], __ATOMIC_ACQUIRE);
+        if (slot != NULL)
+        {
+            out->Merge(slot->histograms[op]);
+        }
+    }
+}
+
+}
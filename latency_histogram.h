@@ -0,0 +1,185 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <mutex>
+#include "epoch.h"
+
+namespace art
+{
+
+// 对数分桶，每个2的幂再分16个桶，误差不超过1/16，桶的个数固定，合并就是逐个相加
+class LatencyHistogram
+{
+public:
+    LatencyHistogram()
+    {
+        Reset();
+    }
+
+    void Reset();
+
+    // 只有一个线程写，和读线程之间不加锁，读到的是近似值
+    void Add(uint64_t ns);
+
+    void Merge(const LatencyHistogram& other);
+
+    // p是0到100的百分位，返回所在桶的上界
+    uint64_t Percentile(double p) const;
+
+    uint64_t Count() const
+    {
+        return _count;
+    }
+
+    uint64_t Average() const
+    {
+        return _count == 0 ? 0 : _sum / _count;
+    }
+
+    uint64_t Max() const
+    {
+        return _max;
+    }
+
+private:
+    static const int kSubBits = 4;
+    static const int kBuckets = (64 - kSubBits + 1) << kSubBits;
+
+    static int bucketOf(uint64_t ns);
+    static uint64_t bucketUpper(int index);
+
+    uint64_t    _buckets[kBuckets];
+    uint64_t    _count;
+    uint64_t    _sum;
+    uint64_t    _max;
+};
+
+// 计时用的时钟，CPU有不变的TSC时用rdtsc，否则用CLOCK_MONOTONIC_RAW
+// TSC的频率在第一次使用时对照CLOCK_MONOTONIC_RAW校准
+class CycleClock
+{
+public:
+    static uint64_t Now()
+    {
+        return useTsc() ? __builtin_ia32_rdtsc() : monotonicRawNanos();
+    }
+
+    // Now()两次读数之差换算成纳秒
+    static uint64_t ToNanos(uint64_t ticks)
+    {
+        return useTsc() ? (uint64_t)(ticks * nanosPerTick()) : ticks;
+    }
+
+private:
+    struct Calibration
+    {
+        bool    use_tsc;
+        double  nanos_per_tick;
+
+        Calibration();
+    };
+
+    static const Calibration& calibration()
+    {
+        static Calibration c;
+        return c;
+    }
+
+    static bool useTsc()
+    {
+        return calibration().use_tsc;
+    }
+
+    static double nanosPerTick()
+    {
+        return calibration().nanos_per_tick;
+    }
+
+    static uint64_t monotonicRawNanos();
+};
+
+enum LatencyOp
+{
+    LATENCY_SEARCH = 0,
+    LATENCY_RANGE_INSERT = 1,
+    LATENCY_RANGE_QUERY = 2,
+    LATENCY_OP_COUNT = 3
+};
+
+// 每个线程每种操作一个直方图，读的时候合并
+// 每个线程每种操作每sample_every次记录一次，没有轮到的操作只有一次计数器减一
+class LatencyRecorder
+{
+public:
+    explicit LatencyRecorder(uint32_t sample_every);
+
+    ~LatencyRecorder();
+
+    // 轮到采样时返回true
+    bool Sample(LatencyOp op)
+    {
+        Slot* slot = local();
+        if (--slot->countdown[op] > 0)
+        {
+            return false;
+        }
+        slot->countdown[op] = _sample_every;
+        return true;
+    }
+
+    void Record(LatencyOp op, uint64_t ticks)
+    {
+        local()->histograms[op].Add(CycleClock::ToNanos(ticks));
+    }
+
+    // 合并所有线程的直方图，加到out上
+    void Merge(LatencyOp op, LatencyHistogram* out);
+
+private:
+    // 直方图比较大，线程第一次用到时才分配
+    struct alignas(64) Slot
+    {
+        uint32_t            countdown[LATENCY_OP_COUNT];
+        LatencyHistogram    histograms[LATENCY_OP_COUNT];
+    };
+
+    Slot* local()
+    {
+        Slot* slot = __atomic_load_n(&_slots[CurrentThreadIndex()], __ATOMIC_ACQUIRE);
+        return slot != NULL ? slot : allocSlot();
+    }
+
+    Slot* allocSlot();
+
+    uint32_t    _sample_every;
+    Slot*       _slots[EpochManager::kMaxThreads];
+    std::mutex  _mutex;
+};
+
+// 操作开始时构造，结束时记录，recorder为NULL时什么都不做
+class LatencyScope
+{
+public:
+    LatencyScope(LatencyRecorder* recorder, LatencyOp op)
+    : _recorder(recorder != NULL && recorder->Sample(op) ? recorder : NULL),
+      _op(op),
+      _start(_recorder != NULL ? CycleClock::Now() : 0)
+    {
+    }
+
+    ~LatencyScope()
+    {
+        if (_recorder != NULL)
+        {
+            _recorder->Record(_op, CycleClock::Now() - _start);
+        }
+    }
+
+private:
+    LatencyRecorder*    _recorder;
+    LatencyOp           _op;
+    uint64_t            _start;
+};
+
+}
@@ -0,0 +1,215 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "read_only_art_view.h"
+#include "assert.h"
+
+namespace art
+{
+
+int ReadOnlyArtView::Open(const char* path)
+{
+    assert(_base == NULL);
+    _fd = open(path, O_RDONLY);
+    if (_fd < 0)
+    {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(_fd, &st) != 0 || (uint64_t)st.st_size < sizeof(ArtImageHeader))
+    {
+        Close();
+        return -1;
+    }
+    void* addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, _fd, 0);
+    if (addr == MAP_FAILED)
+    {
+        Close();
+        return -1;
+    }
+    _base = reinterpret_cast<const char*>(addr);
+    _size = st.st_size;
+
+    const ArtImageHeader* header = reinterpret_cast<const ArtImageHeader*>(_base);
+    if (header->magic != ArtImageHeader::kMagic || header->version != ArtImageHeader::kVersion ||
+        header->size != _size || (_root = nodeAt(header->root)) == NULL)
+    {
+        Close();
+        return -1;
+    }
+    return 0;
+}
+
+void ReadOnlyArtView::Close()
+{
+    if (_base != NULL)
+    {
+        munmap(const_cast<char*>(_base), _size);
+        _base = NULL;
+    }
+    if (_fd >= 0)
+    {
+        close(_fd);
+        _fd = -1;
+    }
+    _size = 0;
+    _root = NULL;
+}
+
+const Node* ReadOnlyArtView::nodeAt(uint64_t offset)
+{
+    // 先确认节点头在文件里，再按类型检查整个节点
+    if (offset < sizeof(ArtImageHeader) || offset > _size || _size - offset < sizeof(Node))
+    {
+        return NULL;
+    }
+    const Node* node = reinterpret_cast<const Node*>(_base + offset);
+    uint64_t size;
+    uint32_t capacity;
+    switch (node->type)
+    {
+        case NODE4:
+            size = sizeof(Node4);
+            capacity = 4;
+            break;
+        case NODE16:
+            size = sizeof(Node16);
+            capacity = 16;
+            break;
+        case NODE48:
+            size = sizeof(Node48);
+            capacity = 48;
+            break;
+        case NODE256:
+            size = sizeof(Node256);
+            capacity = 256;
+            break;
+        default:
+            return NULL;
+    }
+    if (_size - offset < size || node->child_count > capacity)
+    {
+        return NULL;
+    }
+    return node;
+}
+
+const uint64_t* ReadOnlyArtView::findSlot(const Node* node, unsigned char byte)
+{
+    switch (node->type)
+    {
+        case NODE4:
+        {
+            const Node4* n = reinterpret_cast<const Node4*>(node);
+            int i = _search_kernel->findKey4(n->child_keys, node->child_count, byte);
+            return i < 0 ? NULL : reinterpret_cast<const uint64_t*>(&n->child_ptrs[i]);
+        }
+        case NODE16:
+        {
+            const Node16* n = reinterpret_cast<const Node16*>(node);
+            int i = _search_kernel->findKey16(n->child_keys, node->child_count, byte);
+            return i < 0 ? NULL : reinterpret_cast<const uint64_t*>(&n->child_ptrs[i]);
+        }
+        case NODE48:
+        {
+            const Node48* n = reinterpret_cast<const Node48*>(node);
+            int index = n->child_ptr_indexs[byte];
+            return (index == 0 || index > 48) ? NULL : reinterpret_cast<const uint64_t*>(&n->child_ptrs[index - 1]);
+        }
+        case NODE256:
+        {
+            const Node256* n = reinterpret_cast<const Node256*>(node);
+            return reinterpret_cast<const uint64_t*>(&n->child_ptrs[byte]);
+        }
+        default:
+            assert(0);
+            return NULL;
+    }
+}
+
+const Node* ReadOnlyArtView::findLeaf(const unsigned char* key)
+{
+    const Node* node = _root;
+    int depth = 0;
+    while (node != NULL)
+    {
+        if (depth + node->prefix_length > 7)
+        {
+            return NULL;
+        }
+        if (node->prefix_length > 0)
+        {
+            if (memcmp(&node->prefix[0], &key[depth], node->prefix_length) != 0)
+            {
+                return NULL;
+            }
+            depth += node->prefix_length;
+        }
+        if (depth == 7)
+        {
+            return node;
+        }
+        const uint64_t* slot = findSlot(node, key[depth]);
+        node = (slot == NULL || *slot == 0) ? NULL : nodeAt(*slot);
+        depth++;
+    }
+    return NULL;
+}
+
+void* ReadOnlyArtView::Search(uint64_t key)
+{
+    uint64_t reverse = __builtin_bswap64(key);
+    const unsigned char* data = reinterpret_cast<const unsigned char*>(&reverse);
+    const Node* leaf = findLeaf(data);
+    if (leaf == NULL)
+    {
+        return NULL;
+    }
+    const uint64_t* slot = findSlot(leaf, data[7]);
+    return slot == NULL ? NULL : reinterpret_cast<void*>(*slot);
+}
+
+// 每个叶节点下降一次，叶节点内按key直接定位
+void ReadOnlyArtView::RangeQuery(uint64_t start, uint32_t length, std::vector<void*>* vals)
+{
+    vals->assign(length, NULL);
+    if (length == 0)
+    {
+        return;
+    }
+    // start + length可能正好溢出到0，用最后一个key做边界
+    uint64_t last = start + length - 1;
+    assert(last >= start);
+    uint64_t cursor = start;
+    while (1)
+    {
+        uint32_t count = std::min<uint64_t>(last - cursor + 1, 256 - cursor % 256);
+        uint64_t reverse = __builtin_bswap64(cursor);
+        const unsigned char* data = reinterpret_cast<const unsigned char*>(&reverse);
+        const Node* leaf = findLeaf(data);
+        if (leaf != NULL)
+        {
+            void** out = &(*vals)[cursor - start];
+            if (leaf->type == NODE256)
+            {
+                memcpy(out, &reinterpret_cast<const Node256*>(leaf)->child_ptrs[data[7]], count * sizeof(void*));
+            }
+            else
+            {
+                for (uint32_t i = 0; i < count; i++)
+                {
+                    const uint64_t* slot = findSlot(leaf, data[7] + i);
+                    out[i] = slot == NULL ? NULL : reinterpret_cast<void*>(*slot);
+                }
+            }
+        }
+        if (cursor + count - 1 == last)
+        {
+            return;
+        }
+        cursor += count;
+    }
+}
+
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include "adaptive_radix_tree.h"
+
+namespace art
+{
+
+// mmap AdaptiveRadixTree::WriteImage生成的镜像，直接在映射的内存上查找，不分配节点
+// 多个进程打开同一个镜像共享page cache，打开的代价和镜像大小无关
+class ReadOnlyArtView
+{
+public:
+    ReadOnlyArtView()
+    : _fd(-1),
+      _base(NULL),
+      _size(0),
+      _root(NULL),
+      _search_kernel(SelectSearchKernel())
+    {
+    }
+
+    ~ReadOnlyArtView()
+    {
+        Close();
+    }
+
+    // 成功返回0，文件不是完整的镜像返回-1
+    int Open(const char* path);
+
+    void Close();
+
+    void* Search(uint64_t key);
+
+    // 和AdaptiveRadixTree::RangeQuery一样，vals会被重置成length个元素
+    void RangeQuery(uint64_t start, uint32_t length, std::vector<void*>* vals);
+
+    uint64_t Size()
+    {
+        return _size;
+    }
+
+private:
+    // 偏移越界、节点不完整或者不是四种普通节点时返回NULL
+    const Node* nodeAt(uint64_t offset);
+
+    // 返回key对应的槽位，内部节点里存的是偏移，叶节点里存的是value
+    const uint64_t* findSlot(const Node* node, unsigned char byte);
+
+    // 找到key所在的叶节点
+    const Node* findLeaf(const unsigned char* key);
+
+    int                 _fd;
+    const char*         _base;
+    uint64_t            _size;
+    const Node*         _root;
+    const SearchKernel* _search_kernel;
+};
+
+}
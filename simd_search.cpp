@@ -0,0 +1,331 @@
+#include <emmintrin.h>
+#include <immintrin.h>
+#include <string.h>
+#include "simd_search.h"
+
+namespace art
+{
+
+static inline int clampCount(int count, int capacity)
+{
+    return count > capacity ? capacity : count;
+}
+
+static int scalarFindKey(const unsigned char* keys, int count, unsigned char byte)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (keys[i] == byte)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int scalarInsertPos(const unsigned char* keys, int count, unsigned char byte)
+{
+    int slot;
+    for (slot = 0; slot < count; slot++)
+    {
+        if (byte < keys[slot])
+        {
+            break;
+        }
+    }
+    return slot;
+}
+
+static int scalarFindKey4(const unsigned char* keys, int count, unsigned char byte)
+{
+    return scalarFindKey(keys, clampCount(count, 4), byte);
+}
+
+static int scalarFindKey16(const unsigned char* keys, int count, unsigned char byte)
+{
+    return scalarFindKey(keys, clampCount(count, 16), byte);
+}
+
+static int scalarInsertPos4(const unsigned char* keys, int count, unsigned char byte)
+{
+    return scalarInsertPos(keys, clampCount(count, 4), byte);
+}
+
+static int scalarInsertPos16(const unsigned char* keys, int count, unsigned char byte)
+{
+    return scalarInsertPos(keys, clampCount(count, 16), byte);
+}
+
+// 4个key放在一个uint32里，异或之后找第一个为0的字节
+// haszero的误判只会出现在真正为0的字节的高位，取最低位的结果是准确的
+static int swarFindKey4(const unsigned char* keys, int count, unsigned char byte)
+{
+    count = clampCount(count, 4);
+    if (count == 0)
+    {
+        return -1;
+    }
+    uint32_t v;
+    memcpy(&v, keys, 4);
+    uint32_t x = v ^ (0x01010101u * byte);
+    uint32_t t = (x - 0x01010101u) & ~x & 0x80808080u;
+    if (count < 4)
+    {
+        t &= (1u << (count * 8)) - 1;
+    }
+    if (t == 0)
+    {
+        return -1;
+    }
+    return __builtin_ctz(t) >> 3;
+}
+
+static int sse2FindKey16(const unsigned char* keys, int count, unsigned char byte)
+{
+    count = clampCount(count, 16);
+    __m128i cmp = _mm_cmpeq_epi8(_mm_set1_epi8(byte), _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys)));
+    int bitfield = _mm_movemask_epi8(cmp) & ((1 << count) - 1);
+    if (bitfield == 0)
+    {
+        return -1;
+    }
+    return __builtin_ctz(bitfield);
+}
+
+// _mm_cmplt_epi8是有符号比较，这里用min_epu8做无符号的key <= byte
+static int sse2InsertPos16(const unsigned char* keys, int count, unsigned char byte)
+{
+    count = clampCount(count, 16);
+    __m128i k = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys));
+    __m128i le = _mm_cmpeq_epi8(_mm_min_epu8(k, _mm_set1_epi8(byte)), k);
+    int bitfield = _mm_movemask_epi8(le) & ((1 << count) - 1);
+    return __builtin_popcount(bitfield);
+}
+
+// Node4只有4个字节，不能直接load 16字节
+static int sse2InsertPos4(const unsigned char* keys, int count, unsigned char byte)
+{
+    count = clampCount(count, 4);
+    uint32_t v;
+    memcpy(&v, keys, 4);
+    __m128i k = _mm_cvtsi32_si128(v);
+    __m128i le = _mm_cmpeq_epi8(_mm_min_epu8(k, _mm_set1_epi8(byte)), k);
+    int bitfield = _mm_movemask_epi8(le) & ((1 << count) - 1);
+    return __builtin_popcount(bitfield);
+}
+
+// Node16的key一个xmm寄存器就装得下，256位比较没有好处，所以这几个还是128位的SSE指令，
+// 只是在avx2 target下编译成VEX编码，set1变成vpbroadcastb，popcnt/tzcnt用硬件指令
+__attribute__((target("avx2,popcnt,bmi")))
+static int vexFindKey16(const unsigned char* keys, int count, unsigned char byte)
+{
+    count = clampCount(count, 16);
+    __m128i cmp = _mm_cmpeq_epi8(_mm_set1_epi8(byte), _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys)));
+    unsigned bitfield = _mm_movemask_epi8(cmp) & ((1u << count) - 1);
+    if (bitfield == 0)
+    {
+        return -1;
+    }
+    return _tzcnt_u32(bitfield);
+}
+
+__attribute__((target("avx2,popcnt,bmi")))
+static int vexInsertPos16(const unsigned char* keys, int count, unsigned char byte)
+{
+    count = clampCount(count, 16);
+    __m128i k = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys));
+    __m128i le = _mm_cmpeq_epi8(_mm_min_epu8(k, _mm_set1_epi8(byte)), k);
+    unsigned bitfield = _mm_movemask_epi8(le) & ((1u << count) - 1);
+    return _mm_popcnt_u32(bitfield);
+}
+
+__attribute__((target("avx2,popcnt,bmi")))
+static int vexInsertPos4(const unsigned char* keys, int count, unsigned char byte)
+{
+    count = clampCount(count, 4);
+    uint32_t v;
+    memcpy(&v, keys, 4);
+    __m128i k = _mm_cvtsi32_si128(v);
+    __m128i le = _mm_cmpeq_epi8(_mm_min_epu8(k, _mm_set1_epi8(byte)), k);
+    unsigned bitfield = _mm_movemask_epi8(le) & ((1u << count) - 1);
+    return _mm_popcnt_u32(bitfield);
+}
+
+static void scalarDecodeDict(const unsigned char* indexs, const uint64_t* values, uint32_t length, void** vals)
+{
+    for (uint32_t i = 0; i < length; i++)
+    {
+        vals[i] = reinterpret_cast<void*>(values[indexs[i]]);
+    }
+}
+
+static void scalarDecodeDelta16(const uint16_t* deltas, uint64_t base, uint32_t length, void** vals)
+{
+    for (uint32_t i = 0; i < length; i++)
+    {
+        vals[i] = deltas[i] == 0 ? NULL : reinterpret_cast<void*>(base + deltas[i] - 1);
+    }
+}
+
+static void scalarDecodeDelta32(const uint32_t* deltas, uint64_t base, uint32_t length, void** vals)
+{
+    for (uint32_t i = 0; i < length; i++)
+    {
+        vals[i] = deltas[i] == 0 ? NULL : reinterpret_cast<void*>(base + deltas[i] - 1);
+    }
+}
+
+// 4个32位的差值扩展成64位加上base - 1，差值为0的位置清零
+static inline void sse2StoreDelta4(__m128i d, __m128i bias, void** vals)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i empty = _mm_cmpeq_epi32(d, zero);
+    __m128i lo = _mm_add_epi64(_mm_unpacklo_epi32(d, zero), bias);
+    __m128i hi = _mm_add_epi64(_mm_unpackhi_epi32(d, zero), bias);
+    lo = _mm_andnot_si128(_mm_unpacklo_epi32(empty, empty), lo);
+    hi = _mm_andnot_si128(_mm_unpackhi_epi32(empty, empty), hi);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(vals), lo);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(vals + 2), hi);
+}
+
+// 16位的差值先扩展成32位，每次处理8个
+static void sse2DecodeDelta16(const uint16_t* deltas, uint64_t base, uint32_t length, void** vals)
+{
+    const __m128i bias = _mm_set1_epi64x(base - 1);
+    const __m128i zero = _mm_setzero_si128();
+    uint32_t i = 0;
+    for (; i + 8 <= length; i += 8)
+    {
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&deltas[i]));
+        sse2StoreDelta4(_mm_unpacklo_epi16(d, zero), bias, &vals[i]);
+        sse2StoreDelta4(_mm_unpackhi_epi16(d, zero), bias, &vals[i + 4]);
+    }
+    scalarDecodeDelta16(&deltas[i], base, length - i, &vals[i]);
+}
+
+static void sse2DecodeDelta32(const uint32_t* deltas, uint64_t base, uint32_t length, void** vals)
+{
+    const __m128i bias = _mm_set1_epi64x(base - 1);
+    uint32_t i = 0;
+    for (; i + 4 <= length; i += 4)
+    {
+        sse2StoreDelta4(_mm_loadu_si128(reinterpret_cast<const __m128i*>(&deltas[i])), bias, &vals[i]);
+    }
+    scalarDecodeDelta32(&deltas[i], base, length - i, &vals[i]);
+}
+
+// 一次gather 4个value
+__attribute__((target("avx2,popcnt,bmi")))
+static void avx2DecodeDict(const unsigned char* indexs, const uint64_t* values, uint32_t length, void** vals)
+{
+    const long long* table = reinterpret_cast<const long long*>(values);
+    uint32_t i = 0;
+    for (; i + 4 <= length; i += 4)
+    {
+        uint32_t packed;
+        memcpy(&packed, &indexs[i], 4);
+        __m128i index = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(packed));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(&vals[i]), _mm256_i32gather_epi64(table, index, 8));
+    }
+    scalarDecodeDict(&indexs[i], values, length - i, &vals[i]);
+}
+
+__attribute__((target("avx2,popcnt,bmi")))
+static inline void avx2StoreDelta4(__m256i d, __m256i bias, void** vals)
+{
+    __m256i empty = _mm256_cmpeq_epi64(d, _mm256_setzero_si256());
+    __m256i v = _mm256_andnot_si256(empty, _mm256_add_epi64(d, bias));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(vals), v);
+}
+
+__attribute__((target("avx2,popcnt,bmi")))
+static void avx2DecodeDelta16(const uint16_t* deltas, uint64_t base, uint32_t length, void** vals)
+{
+    const __m256i bias = _mm256_set1_epi64x(base - 1);
+    uint32_t i = 0;
+    for (; i + 4 <= length; i += 4)
+    {
+        __m128i d = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(&deltas[i]));
+        avx2StoreDelta4(_mm256_cvtepu16_epi64(d), bias, &vals[i]);
+    }
+    scalarDecodeDelta16(&deltas[i], base, length - i, &vals[i]);
+}
+
+__attribute__((target("avx2,popcnt,bmi")))
+static void avx2DecodeDelta32(const uint32_t* deltas, uint64_t base, uint32_t length, void** vals)
+{
+    const __m256i bias = _mm256_set1_epi64x(base - 1);
+    uint32_t i = 0;
+    for (; i + 4 <= length; i += 4)
+    {
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&deltas[i]));
+        avx2StoreDelta4(_mm256_cvtepu32_epi64(d), bias, &vals[i]);
+    }
+    scalarDecodeDelta32(&deltas[i], base, length - i, &vals[i]);
+}
+
+static const SearchKernel kScalarKernel = {
+    "scalar",
+    scalarFindKey4,
+    scalarFindKey16,
+    scalarInsertPos4,
+    scalarInsertPos16,
+    scalarDecodeDict,
+    scalarDecodeDelta16,
+    scalarDecodeDelta32,
+};
+
+static const SearchKernel kSSE2Kernel = {
+    "sse2",
+    swarFindKey4,
+    sse2FindKey16,
+    sse2InsertPos4,
+    sse2InsertPos16,
+    // SSE2没有gather，字典查表本身没有分支，直接用标量
+    scalarDecodeDict,
+    sse2DecodeDelta16,
+    sse2DecodeDelta32,
+};
+
+static const SearchKernel kAVX2Kernel = {
+    "avx2",
+    swarFindKey4,
+    vexFindKey16,
+    vexInsertPos4,
+    vexInsertPos16,
+    avx2DecodeDict,
+    avx2DecodeDelta16,
+    avx2DecodeDelta32,
+};
+
+const SearchKernel* ScalarSearchKernel()
+{
+    return &kScalarKernel;
+}
+
+const SearchKernel* SSE2SearchKernel()
+{
+    return &kSSE2Kernel;
+}
+
+const SearchKernel* AVX2SearchKernel()
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt") && __builtin_cpu_supports("bmi"))
+    {
+        return &kAVX2Kernel;
+    }
+    return NULL;
+}
+
+const SearchKernel* SelectSearchKernel()
+{
+    const SearchKernel* kernel = AVX2SearchKernel();
+    if (kernel != NULL)
+    {
+        return kernel;
+    }
+    return SSE2SearchKernel();
+}
+
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+
+namespace art
+{
+
+// Node4/Node16 子节点查找和插入位置的kernel，以及压缩叶节点的批量解码
+// count是有效key的个数，keys按升序排列
+struct SearchKernel
+{
+    const char* name;
+    // 返回byte在keys中的下标，没有找到返回-1
+    int (*findKey4)(const unsigned char* keys, int count, unsigned char byte);
+    int (*findKey16)(const unsigned char* keys, int count, unsigned char byte);
+    // 返回第一个大于byte的key的下标，也就是有序插入的位置
+    int (*insertPos4)(const unsigned char* keys, int count, unsigned char byte);
+    int (*insertPos16)(const unsigned char* keys, int count, unsigned char byte);
+    // 解码length个槽位写到vals，字典的values[0]是0，差值为0的槽位写NULL，否则写base + delta - 1
+    void (*decodeDict)(const unsigned char* indexs, const uint64_t* values, uint32_t length, void** vals);
+    void (*decodeDelta16)(const uint16_t* deltas, uint64_t base, uint32_t length, void** vals);
+    void (*decodeDelta32)(const uint32_t* deltas, uint64_t base, uint32_t length, void** vals);
+};
+
+const SearchKernel* ScalarSearchKernel();
+
+// x86-64的基线，Node4使用SWAR
+const SearchKernel* SSE2SearchKernel();
+
+// 字典和差值解码用256位指令，Node16的查找仍然是128位，只是换成VEX编码
+// CPU不支持AVX2时返回NULL
+const SearchKernel* AVX2SearchKernel();
+
+// 根据CPU特性选择最快的kernel
+const SearchKernel* SelectSearchKernel();
+
+}
@@ -0,0 +1,350 @@
+#include <sys/mman.h>
+#include <algorithm>
+#include "slab_allocator.h"
+#include "assert.h"
+
+namespace art
+{
+
+static const uint32_t kSlabMinSize = 64 << 10;
+static const uint32_t kSlabMinObjects = 32;
+static const uint32_t kSlabAlign = 4096;
+// 对象按16字节对齐，AdaptiveRadixTree用指针的低4位做tag
+static const uint32_t kObjectAlign = 16;
+
+SlabArena::~SlabArena()
+{
+    if (_base != NULL)
+    {
+        munmap(_base, _capacity);
+    }
+}
+
+int SlabArena::Reserve(uint64_t capacity, bool huge_pages)
+{
+    assert(_base == NULL && (!huge_pages || capacity % kHugePageSize == 0));
+    // 大页模式多预留一个大页，把起点对齐到2M之后两头多出来的部分还回去
+    uint64_t size = huge_pages ? capacity + kHugePageSize : capacity;
+    void* base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED)
+    {
+        return -1;
+    }
+    _base = reinterpret_cast<char*>(base);
+    if (huge_pages)
+    {
+        char* aligned = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(_base) + kHugePageSize - 1) &
+            ~(kHugePageSize - 1));
+        if (aligned > _base)
+        {
+            munmap(_base, aligned - _base);
+        }
+        if (aligned + capacity < _base + size)
+        {
+            munmap(aligned + capacity, _base + size - aligned - capacity);
+        }
+        _base = aligned;
+    }
+    _capacity = capacity;
+    _cursor = kSlabAlign;
+    _huge_pages = huge_pages;
+    return 0;
+}
+
+int SlabArena::commit(uint64_t end, bool populate)
+{
+    end = std::min((end + kHugePageSize - 1) & ~(kHugePageSize - 1), _capacity);
+    for (; _committed < end; _committed += kHugePageSize)
+    {
+        char* chunk = _base + _committed;
+        if (!_hugetlb_failed)
+        {
+            // 不带MAP_NORESERVE，大页池不够时在这里失败，而不是以后缺页时SIGBUS
+            int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB | (populate ? MAP_POPULATE : 0);
+            if (mmap(chunk, kHugePageSize, PROT_READ | PROT_WRITE, flags, -1, 0) != MAP_FAILED)
+            {
+                _hugetlb_bytes += kHugePageSize;
+                continue;
+            }
+            _hugetlb_failed = true;
+        }
+        // MAP_FIXED失败时原来的映射不一定还在，重新映射一次普通的匿名内存
+        // 这里也失败时_committed停在这个2M上，下次分配到这里再重试
+        if (mmap(chunk, kHugePageSize, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0) == MAP_FAILED)
+        {
+            return -1;
+        }
+        madvise(chunk, kHugePageSize, MADV_HUGEPAGE);
+        _transparent_bytes += kHugePageSize;
+        if (!populate)
+        {
+            continue;
+        }
+#ifdef MADV_POPULATE_WRITE
+        if (madvise(chunk, kHugePageSize, MADV_POPULATE_WRITE) == 0)
+        {
+            continue;
+        }
+#endif
+        // 还没有slab切到这里，内容都是0，写0不会破坏数据
+        for (uint64_t i = 0; i < kHugePageSize; i += kSlabAlign)
+        {
+            reinterpret_cast<volatile char*>(chunk)[i] = 0;
+        }
+    }
+    return 0;
+}
+
+int SlabArena::Prefault(uint64_t bytes)
+{
+    if (_base != NULL && _huge_pages)
+    {
+        return commit(kSlabAlign + bytes, true);
+    }
+    return 0;
+}
+
+char* SlabArena::AllocSlab(uint32_t size)
+{
+    assert(_base != NULL && size % kSlabAlign == 0);
+    auto it = _free_slabs.find(size);
+    if (it != _free_slabs.end() && !it->second.empty())
+    {
+        char* slab = it->second.back();
+        it->second.pop_back();
+        return slab;
+    }
+    if (_cursor + size > _capacity)
+    {
+        return NULL;
+    }
+    if (_huge_pages && _cursor + size > _committed && commit(_cursor + size, false) != 0)
+    {
+        return NULL;
+    }
+    char* slab = _base + _cursor;
+    _cursor += size;
+    return slab;
+}
+
+void SlabArena::FreeSlab(char* slab, uint32_t size)
+{
+    assert(slab >= _base + kSlabAlign && slab + size <= _base + _cursor);
+    // 大页模式下不能只还一部分，留着给以后的slab用，否则透明大页会被拆成小页
+    if (!_huge_pages)
+    {
+        madvise(slab, size, MADV_DONTNEED);
+    }
+    _free_slabs[size].push_back(slab);
+}
+
+void SlabArena::Reset()
+{
+    if (_base != NULL && _huge_pages && _committed > 0)
+    {
+        // 换成新的普通映射，大页直接还给系统，下次用到时重新提交
+        void* ret = mmap(_base, _committed, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+        assert(ret == _base);
+        (void)ret;
+        _committed = 0;
+        _hugetlb_failed = false;
+        _hugetlb_bytes = 0;
+        _transparent_bytes = 0;
+    }
+    else if (_base != NULL && _cursor > kSlabAlign)
+    {
+        madvise(_base, _cursor, MADV_DONTNEED);
+    }
+    _cursor = kSlabAlign;
+    _free_slabs.clear();
+}
+
+void SlabAllocator::Init(uint32_t object_size)
+{
+    assert(_slabs.empty());
+    assert(object_size >= sizeof(FreeObject));
+    _object_size = (object_size + kObjectAlign - 1) & ~(kObjectAlign - 1);
+    _slab_size = kSlabMinSize;
+    while (_slab_size < _object_size * kSlabMinObjects)
+    {
+        _slab_size *= 2;
+    }
+}
+
+void SlabAllocator::SetArena(SlabArena* arena, bool fallback)
+{
+    assert(_slabs.empty());
+    _arena = arena;
+    _fallback = fallback;
+}
+
+char* SlabAllocator::allocSlab()
+{
+    if (_arena != NULL)
+    {
+        char* slab = _arena->AllocSlab(_slab_size);
+        if (slab != NULL)
+        {
+            _slabs.push_back(slab);
+            return slab;
+        }
+        if (!_fallback)
+        {
+            return NULL;
+        }
+    }
+    void* slab = NULL;
+    if (posix_memalign(&slab, kSlabAlign, _slab_size) != 0)
+    {
+        return NULL;
+    }
+    _slabs.push_back(reinterpret_cast<char*>(slab));
+    return reinterpret_cast<char*>(slab);
+}
+
+// arena模式下只有arena用完之后回退分配的slab要自己释放
+void SlabAllocator::freeSlab(char* slab)
+{
+    if (_arena != NULL && _arena->Contains(slab))
+    {
+        _arena->FreeSlab(slab, _slab_size);
+    }
+    else
+    {
+        free(slab);
+    }
+}
+
+void* SlabAllocator::allocFromSlab()
+{
+    if (_cursor == NULL || _cursor + _object_size > _end)
+    {
+        char* slab = allocSlab();
+        if (slab == NULL)
+        {
+            return NULL;
+        }
+        _cursor = slab;
+        _end = _cursor + _slab_size;
+    }
+    void* ptr = _cursor;
+    _cursor += _object_size;
+    return ptr;
+}
+
+void* SlabAllocator::Alloc()
+{
+    assert(_object_size > 0);
+    void* ptr;
+    if (_free_list != NULL)
+    {
+        ptr = _free_list;
+        _free_list = _free_list->next;
+    }
+    else
+    {
+        ptr = allocFromSlab();
+    }
+    _live_objects += ptr != NULL;
+    return ptr;
+}
+
+void* SlabAllocator::AllocFresh()
+{
+    assert(_object_size > 0);
+    void* ptr = allocFromSlab();
+    _live_objects += ptr != NULL;
+    return ptr;
+}
+
+void SlabAllocator::Free(void* ptr)
+{
+    assert(_live_objects > 0);
+    FreeObject* object = reinterpret_cast<FreeObject*>(ptr);
+    object->next = _free_list;
+    _free_list = object;
+    _live_objects--;
+}
+
+uint64_t SlabAllocator::ReleaseEmptySlabs()
+{
+    if (_slabs.empty())
+    {
+        return 0;
+    }
+    // 数一下每个slab里有多少个空闲对象，正在切分的slab只看已经切出去的部分
+    std::vector<char*> slabs(_slabs);
+    std::sort(slabs.begin(), slabs.end());
+    std::vector<uint32_t> frees(slabs.size(), 0);
+    for (FreeObject* object = _free_list; object != NULL; object = object->next)
+    {
+        char* ptr = reinterpret_cast<char*>(object);
+        frees[std::upper_bound(slabs.begin(), slabs.end(), ptr) - slabs.begin() - 1]++;
+    }
+    std::vector<bool> empty(slabs.size(), false);
+    bool found = false;
+    for (size_t i = 0; i < slabs.size(); i++)
+    {
+        bool current = _cursor > slabs[i] && _cursor <= slabs[i] + _slab_size;
+        uint32_t carved = current ? (_cursor - slabs[i]) / _object_size : _slab_size / _object_size;
+        empty[i] = frees[i] == carved;
+        found = found || empty[i];
+    }
+    if (!found)
+    {
+        return 0;
+    }
+
+    // 先从free list上摘掉要释放的slab里的对象，其他对象保持原来的顺序
+    FreeObject** tail = &_free_list;
+    for (FreeObject* object = _free_list; object != NULL; object = object->next)
+    {
+        char* ptr = reinterpret_cast<char*>(object);
+        if (!empty[std::upper_bound(slabs.begin(), slabs.end(), ptr) - slabs.begin() - 1])
+        {
+            *tail = object;
+            tail = &object->next;
+        }
+    }
+    *tail = NULL;
+
+    std::vector<char*> kept;
+    uint64_t released = 0;
+    for (size_t i = 0; i < slabs.size(); i++)
+    {
+        if (!empty[i])
+        {
+            kept.push_back(slabs[i]);
+            continue;
+        }
+        if (_cursor > slabs[i] && _cursor <= slabs[i] + _slab_size)
+        {
+            _cursor = NULL;
+            _end = NULL;
+        }
+        freeSlab(slabs[i]);
+        released += _slab_size;
+    }
+    _slabs.swap(kept);
+    return released;
+}
+
+void SlabAllocator::Release()
+{
+    for (size_t i = 0; i < _slabs.size(); i++)
+    {
+        if (_arena == NULL || !_arena->Contains(_slabs[i]))
+        {
+            free(_slabs[i]);
+        }
+    }
+    _slabs.clear();
+    _cursor = NULL;
+    _end = NULL;
+    _free_list = NULL;
+    _live_objects = 0;
+}
+
+}
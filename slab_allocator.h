@@ -0,0 +1,168 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <vector>
+#include <map>
+
+namespace art
+{
+
+// 预留一段连续的地址空间，slab从里面顺序切出来，物理内存在第一次写的时候才分配
+// 容量不超过kMaxCapacity时对象相对Base()的偏移不超过32位，可以代替64位指针保存，整段地址空间搬走之后偏移仍然有效
+// 大页模式下起点按2M对齐，切到哪个2M就提交哪个，先用MAP_HUGETLB，大页池不够时退回madvise(MADV_HUGEPAGE)
+class SlabArena
+{
+public:
+    // 偏移装进uint32_t，开头的一页不分配，偏移0可以表示NULL
+    static const uint64_t kMaxCapacity = 1ULL << 32;
+    static const uint64_t kHugePageSize = 2ULL << 20;
+
+    SlabArena()
+    : _base(NULL),
+      _capacity(0),
+      _cursor(0),
+      _huge_pages(false),
+      _hugetlb_failed(false),
+      _committed(0),
+      _hugetlb_bytes(0),
+      _transparent_bytes(0)
+    {
+    }
+
+    ~SlabArena();
+
+    // 只能调用一次，成功返回0，大页模式下capacity必须是2M的倍数
+    int Reserve(uint64_t capacity, bool huge_pages = false);
+
+    // 大页模式下提前提交并写入开头的bytes字节，之后分配slab不会再缺页，普通模式下什么都不做
+    // 提交失败返回-1，已经提交的部分保留
+    int Prefault(uint64_t bytes);
+
+    // 优先复用FreeSlab还回来的同样大小的slab，空间用完或者提交失败时返回NULL
+    char* AllocSlab(uint32_t size);
+
+    // slab的物理内存还给系统，地址留给以后同样大小的AllocSlab
+    void FreeSlab(char* slab, uint32_t size);
+
+    bool Contains(const char* ptr)
+    {
+        return ptr >= _base && ptr < _base + _capacity;
+    }
+
+    // 之前分配出去的slab全部失效，物理内存还给系统，地址空间保留
+    void Reset();
+
+    char* Base()
+    {
+        return _base;
+    }
+
+    // 用MAP_HUGETLB提交的字节数
+    uint64_t HugeTlbBytes()
+    {
+        return _hugetlb_bytes;
+    }
+
+    // 退回透明大页提交的字节数，是不是真的用上大页要看系统的THP配置
+    uint64_t TransparentBytes()
+    {
+        return _transparent_bytes;
+    }
+
+private:
+    // 把[_committed, end)按2M提交，populate为true时同时写入，映射失败返回-1
+    int commit(uint64_t end, bool populate);
+
+    char*       _base;
+    uint64_t    _capacity;
+    uint64_t    _cursor;
+    bool        _huge_pages;
+    // 大页池不够过一次之后不再尝试MAP_HUGETLB
+    bool        _hugetlb_failed;
+    uint64_t    _committed;
+    uint64_t    _hugetlb_bytes;
+    uint64_t    _transparent_bytes;
+    // 按slab大小索引
+    std::map<uint32_t, std::vector<char*>> _free_slabs;
+};
+
+// 固定大小对象的slab分配器，每种node类型一个
+// 对象从大块内存中切分，释放的对象挂在free list上复用，没有malloc头的开销
+class SlabAllocator
+{
+public:
+    SlabAllocator()
+    : _object_size(0),
+      _slab_size(0),
+      _cursor(NULL),
+      _end(NULL),
+      _free_list(NULL),
+      _live_objects(0),
+      _arena(NULL),
+      _fallback(false)
+    {
+    }
+
+    ~SlabAllocator()
+    {
+        Release();
+    }
+
+    void Init(uint32_t object_size);
+
+    // arena不为NULL时slab从arena分配，Release不归还，由arena统一回收，只能在没有slab时设置
+    // fallback为true时arena用完之后从系统分配slab，否则Alloc返回NULL
+    void SetArena(SlabArena* arena, bool fallback = false);
+
+    // 分配不到slab时返回NULL
+    void* Alloc();
+
+    // 不复用free list上的对象，从slab的末尾顺序切分，连续分配的对象地址相邻
+    void* AllocFresh();
+
+    void Free(void* ptr);
+
+    // 对象全部释放了的slab还给系统，arena模式下还给arena，返回释放的字节数
+    uint64_t ReleaseEmptySlabs();
+
+    // 释放所有的slab，之前分配出去的对象全部失效
+    void Release();
+
+    uint32_t ObjectSize()
+    {
+        return _object_size;
+    }
+
+    uint64_t UsedBytes()
+    {
+        return _live_objects * _object_size;
+    }
+
+    uint64_t ReservedBytes()
+    {
+        return (uint64_t)_slabs.size() * _slab_size;
+    }
+
+private:
+    struct FreeObject
+    {
+        FreeObject* next;
+    };
+
+    char* allocSlab();
+    void* allocFromSlab();
+    void freeSlab(char* slab);
+
+    uint32_t            _object_size;
+    uint32_t            _slab_size;
+    std::vector<char*>  _slabs;
+    char*               _cursor;
+    char*               _end;
+    FreeObject*         _free_list;
+    uint64_t            _live_objects;
+    SlabArena*          _arena;
+    bool                _fallback;
+};
+
+}
@@ -1,5 +1,10 @@
 #include "util.h"
 #include <sys/time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
 
 namespace art
 {
@@ -32,4 +37,43 @@ uint64_t NowMicros()
     return static_cast<uint64_t>(tv.tv_sec) * kUsecondsPerSecond + tv.tv_usec;
 }
 
+bool PwriteFully(int fd, const char* data, size_t size, uint64_t offset)
+{
+    while (size > 0)
+    {
+        ssize_t ret = pwrite(fd, data, size, offset);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        data += ret;
+        size -= ret;
+        offset += ret;
+    }
+    return true;
+}
+
+void RunParallel(int threads, size_t count, const std::function<void(size_t)>& func)
+{
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> pool;
+    for (int t = 0; t < std::max(threads, 1); t++)
+    {
+        pool.push_back(std::thread([&next, count, &func]() {
+            for (size_t i = next++; i < count; i = next++)
+            {
+                func(i);
+            }
+        }));
+    }
+    for (size_t t = 0; t < pool.size(); t++)
+    {
+        pool[t].join();
+    }
+}
+
 }
\ No newline at end of file
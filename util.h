@@ -1,5 +1,8 @@
+#include <stdint.h>
+#include <stddef.h>
 #include <vector>
 #include <string>
+#include <functional>
 
 namespace art
 {
@@ -8,4 +11,10 @@ std::vector<std::string> SplitString(std::string& str, const char* delim);
 
 uint64_t NowMicros();
 
+// 处理短写和EINTR，全部写完返回true
+bool PwriteFully(int fd, const char* data, size_t size, uint64_t offset);
+
+// threads个线程按编号顺序领取[0, count)里的任务
+void RunParallel(int threads, size_t count, const std::function<void(size_t)>& func);
+
 }
\ No newline at end of file
@@ -0,0 +1,283 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <algorithm>
+#include "write_ahead_log.h"
+#include "assert.h"
+#include "util.h"
+
+namespace art
+{
+
+static const unsigned char kWalInsert = 1;
+static const unsigned char kWalDelete = 2;
+// 整数条记录
+static const uint32_t kReplayBufferSize = (64 << 10) / WriteAheadLog::kRecordSize * WriteAheadLog::kRecordSize;
+
+// FNV-1a，只用来识别没写完的记录
+static uint32_t recordChecksum(const char* data, size_t size)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < size; i++)
+    {
+        h ^= (unsigned char)data[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void encodeRecord(char* buf, unsigned char type, uint64_t start, uint32_t length, void* val)
+{
+    uint64_t v = reinterpret_cast<uint64_t>(val);
+    buf[4] = type;
+    memcpy(buf + 5, &length, 4);
+    memcpy(buf + 9, &start, 8);
+    memcpy(buf + 17, &v, 8);
+    uint32_t checksum = recordChecksum(buf + 4, WriteAheadLog::kRecordSize - 4);
+    memcpy(buf, &checksum, 4);
+}
+
+// 校验失败返回false
+static bool decodeRecord(const char* buf, unsigned char* type, uint64_t* start, uint32_t* length, void** val)
+{
+    uint32_t checksum;
+    memcpy(&checksum, buf, 4);
+    if (checksum != recordChecksum(buf + 4, WriteAheadLog::kRecordSize - 4))
+    {
+        return false;
+    }
+    uint64_t v;
+    *type = buf[4];
+    memcpy(length, buf + 5, 4);
+    memcpy(start, buf + 9, 8);
+    memcpy(&v, buf + 17, 8);
+    *val = reinterpret_cast<void*>(v);
+    return (*type == kWalInsert && *length > 0) || *type == kWalDelete;
+}
+
+int WriteAheadLog::Open(const char* path)
+{
+    assert(_fd < 0);
+    _fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (_fd < 0)
+    {
+        return -1;
+    }
+    off_t size = lseek(_fd, 0, SEEK_END);
+    if (size < 0)
+    {
+        Close();
+        return -1;
+    }
+    _offset = size;
+    _failed = false;
+    _replayed = size == 0;
+    return 0;
+}
+
+void WriteAheadLog::Close()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (_syncing)
+    {
+        _cond.wait(lock);
+    }
+    if (_fd >= 0)
+    {
+        close(_fd);
+        _fd = -1;
+    }
+    _pending.clear();
+    _offset = 0;
+    _appended = _synced;
+}
+
+int64_t WriteAheadLog::Replay()
+{
+    assert(_fd >= 0 && _appended == _synced && _pending.empty());
+    char* buf = new char[kReplayBufferSize];
+    uint64_t offset = 0;
+    int64_t count = 0;
+    bool torn = false;
+    while (offset < _offset && !torn)
+    {
+        ssize_t ret = pread(_fd, buf, std::min<uint64_t>(kReplayBufferSize, _offset - offset), offset);
+        if (ret < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (ret <= 0)
+        {
+            delete[] buf;
+            return -1;
+        }
+        size_t pos = 0;
+        for (; pos + kRecordSize <= (size_t)ret; pos += kRecordSize)
+        {
+            unsigned char type;
+            uint64_t start;
+            uint32_t length;
+            void* val;
+            if (!decodeRecord(buf + pos, &type, &start, &length, &val))
+            {
+                torn = true;
+                break;
+            }
+            if (type == kWalInsert)
+            {
+                _tree->RangeInsert(start, length, val);
+            }
+            else
+            {
+                _tree->DeleteRange(start, length);
+            }
+            count++;
+        }
+        offset += pos;
+        // 文件末尾不足一条记录
+        if (pos == 0)
+        {
+            torn = true;
+        }
+    }
+    delete[] buf;
+
+    // 崩溃时没写完的记录从来没有返回成功，直接丢掉，后面的记录接着写在这里
+    if (offset < _offset)
+    {
+        if (ftruncate(_fd, offset) != 0 || fdatasync(_fd) != 0)
+        {
+            return -1;
+        }
+        _offset = offset;
+    }
+    _replayed = true;
+    return count;
+}
+
+// 第一个等不到落盘的线程成为leader，把积累的记录一起写出，
+// leader在写盘和修改树的时候不持有锁，后面的线程继续往_pending里追加，组成下一批
+int WriteAheadLog::commit(const char* records, size_t size)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (_failed || _fd < 0 || !_replayed)
+    {
+        return -1;
+    }
+    _pending.append(records, size);
+    _appended += size;
+    uint64_t lsn = _appended;
+    while (_synced < lsn && !_failed)
+    {
+        if (_syncing)
+        {
+            _cond.wait(lock);
+            continue;
+        }
+        _syncing = true;
+        std::string batch;
+        batch.swap(_pending);
+        uint64_t end = _appended;
+        uint64_t offset = _offset;
+        lock.unlock();
+
+        bool ok = PwriteFully(_fd, batch.data(), batch.size(), offset) && fdatasync(_fd) == 0;
+        if (ok)
+        {
+            apply(batch.data(), batch.size());
+        }
+
+        lock.lock();
+        _syncing = false;
+        if (ok)
+        {
+            _offset += batch.size();
+            _synced = end;
+            _sync_count++;
+        }
+        else
+        {
+            _failed = true;
+        }
+        _cond.notify_all();
+    }
+    return _synced >= lsn ? 0 : -1;
+}
+
+// 同一时间只有一个leader，记录按日志的顺序应用
+void WriteAheadLog::apply(const char* records, size_t size)
+{
+    for (size_t pos = 0; pos < size; pos += kRecordSize)
+    {
+        unsigned char type = records[pos + 4];
+        uint32_t length;
+        uint64_t start;
+        uint64_t v;
+        memcpy(&length, records + pos + 5, 4);
+        memcpy(&start, records + pos + 9, 8);
+        memcpy(&v, records + pos + 17, 8);
+        if (type == kWalInsert)
+        {
+            _tree->RangeInsert(start, length, reinterpret_cast<void*>(v));
+        }
+        else
+        {
+            _tree->DeleteRange(start, length);
+        }
+    }
+}
+
+int WriteAheadLog::Insert(uint64_t key, void* val)
+{
+    return RangeInsert(key, 1, val);
+}
+
+int WriteAheadLog::RangeInsert(uint64_t start, uint32_t length, void* val)
+{
+    assert(length > 0);
+    char record[kRecordSize];
+    encodeRecord(record, kWalInsert, start, length, val);
+    return commit(record, kRecordSize);
+}
+
+int WriteAheadLog::DeleteRange(uint64_t start, uint32_t length)
+{
+    char record[kRecordSize];
+    encodeRecord(record, kWalDelete, start, length, NULL);
+    return commit(record, kRecordSize);
+}
+
+int WriteAheadLog::RangeInsertBatch(const Extent* extents, size_t count)
+{
+    std::string records(count * kRecordSize, 0);
+    for (size_t i = 0; i < count; i++)
+    {
+        assert(extents[i].length > 0);
+        encodeRecord(&records[i * kRecordSize], kWalInsert, extents[i].start, extents[i].length, extents[i].val);
+    }
+    return commit(records.data(), records.size());
+}
+
+int WriteAheadLog::Truncate()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (_syncing)
+    {
+        _cond.wait(lock);
+    }
+    if (_failed || _fd < 0)
+    {
+        return -1;
+    }
+    // 还在_pending里的记录没有应用到树上，不在checkpoint里，留给下一批写在文件开头
+    if (ftruncate(_fd, 0) != 0 || fdatasync(_fd) != 0)
+    {
+        _failed = true;
+        return -1;
+    }
+    _offset = 0;
+    _replayed = true;
+    return 0;
+}
+
+}
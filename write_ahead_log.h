@@ -0,0 +1,97 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <mutex>
+#include <condition_variable>
+#include "adaptive_radix_tree.h"
+
+namespace art
+{
+
+// 修改先追加到日志文件，落盘之后再应用到树上，重启时在最近的checkpoint上回放日志
+// 多个线程同时写时合并成一批，一批只调用一次fdatasync，由拿到批次的线程按日志顺序修改树，
+// 所以树不需要开并发模式，但读树的线程仍然要和写日志的线程互斥，除非树是并发模式
+class WriteAheadLog
+{
+public:
+    // 记录定长25字节 | checksum 4 | type 1 | length 4 | start 8 | val 8 |
+    static const uint32_t kRecordSize = 25;
+
+    explicit WriteAheadLog(AdaptiveRadixTree* tree)
+    : _tree(tree),
+      _fd(-1),
+      _offset(0),
+      _appended(0),
+      _synced(0),
+      _syncing(false),
+      _failed(false),
+      _replayed(false),
+      _sync_count(0)
+    {
+    }
+
+    ~WriteAheadLog()
+    {
+        Close();
+    }
+
+    // 打开或者创建日志文件，成功返回0
+    int Open(const char* path);
+
+    // 把日志里的记录按顺序应用到树上，返回记录数
+    // 最后一条没写完的记录会被截掉，必须在Open之后、第一次写之前调用
+    int64_t Replay();
+
+    // 返回0时记录已经落盘并且应用到了树上，失败返回-1，之后的写也都会失败
+    // 文件不为空时要先Replay或者Truncate，否则新记录会接在没写完的记录后面，返回-1
+    int Insert(uint64_t key, void* val);
+
+    int RangeInsert(uint64_t start, uint32_t length, void* val);
+
+    int DeleteRange(uint64_t start, uint32_t length);
+
+    // 多个区间作为一批提交
+    int RangeInsertBatch(const Extent* extents, size_t count);
+
+    // checkpoint写完之后清空日志，checkpoint和Truncate之间不能有写操作
+    int Truncate();
+
+    void Close();
+
+    // 日志文件的字节数
+    uint64_t Size()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _offset;
+    }
+
+    uint64_t SyncCount()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _sync_count;
+    }
+
+private:
+    int commit(const char* records, size_t size);
+
+    void apply(const char* records, size_t size);
+
+    AdaptiveRadixTree*      _tree;
+    int                     _fd;
+    std::mutex              _mutex;
+    std::condition_variable _cond;
+    // 等待下一批写出的记录
+    std::string             _pending;
+    uint64_t                _offset;
+    // 按追加的字节数编号，_synced之前的记录都已经落盘
+    uint64_t                _appended;
+    uint64_t                _synced;
+    bool                    _syncing;
+    bool                    _failed;
+    // 文件末尾已经确认是完整的记录，可以接着写
+    bool                    _replayed;
+    uint64_t                _sync_count;
+};
+
+}